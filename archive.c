@@ -0,0 +1,743 @@
+/**
+ * @file    archive.c
+ * @brief   Compressed sample archive format
+ * @details Codes of the timestamp delta-of-delta, in microseconds:
+ * 
+ *              0                       same interval as before
+ *              10   + 7 bits           -63 to 64
+ *              110  + 9 bits           -255 to 256
+ *              1110 + 12 bits          -2047 to 2048
+ *              1111 + 64 bits          anything else
+ * 
+ *              Codes of the XOR of a channel with its previous value:
+ * 
+ *              0                       same value
+ *              10   + bits             inside the previous window of
+ *                                      meaningful bits
+ *              11   + 5 bits leading zeros, 5 bits length - 1, bits
+ * 
+ *              The relay and sample flags take one bit when unchanged and
+ *              nine otherwise. The first sample of a block is stored whole.
+ *              A steady reading costs 5 bits per sample against the 18
+ *              bytes of a binary record.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "archive.h"
+#include "arena.h"
+#include "timeutil.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define ARCHIVE_FLAG_RELAY 0x01     /* Relay was on */
+#define ARCHIVE_FLAG_DECIMATED 0x02 /* Taken at the adaptive base rate */
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static void archive_put(archive_bits *b, uint64_t value, unsigned int n);
+static void archive_put_flush(archive_bits *b);
+static uint64_t archive_get(archive_bits *b, unsigned int n);
+static void archive_put_dod(archive_bits *b, int64_t dod);
+static int64_t archive_get_dod(archive_bits *b);
+static void archive_put_xor(archive_bits *b, uint32_t x, uint8_t *lead, uint8_t *trail);
+static uint32_t archive_get_xor(archive_bits *b, uint8_t *lead, uint8_t *trail);
+static void archive_sample_values(const sample_record *rec, uint32_t values[ARCHIVE_CHANNELS], uint8_t *flags);
+static const void *archive_block_done(archive_writer *w, archive_encoder *enc, size_t *len);
+static archive_segment *archive_segment_done(archive_writer *w, size_t *len);
+static int archive_decode_block(const archive_header *hdr, const archive_block_header *bh,
+    const uint8_t *payload, FILE *out);
+static archive_index_entry *archive_read_index(FILE *fp, const archive_header *hdr, size_t *nblocks);
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Append bits to a stream
+ * 
+ * @param b Stream
+ * @param value Bits, in the low part
+ * @param n Number of bits, up to 32
+ */
+static void archive_put(archive_bits *b, uint64_t value, unsigned int n)
+{
+    b->acc = (b->acc << n) | (value & ((1ULL << n) - 1));
+    b->nacc += n;
+    while (b->nacc >= 8)
+    {
+        b->nacc -= 8;
+        b->buf[b->len++] = b->acc >> b->nacc;
+    }
+}
+
+/**
+ * @brief Pad the last byte of a stream with zeros
+ * 
+ * @param b Stream
+ */
+static void archive_put_flush(archive_bits *b)
+{
+    if (b->nacc > 0)
+    {
+        b->buf[b->len++] = b->acc << (8 - b->nacc);
+        b->nacc = 0;
+    }
+}
+
+/**
+ * @brief Take bits from a stream
+ * @details Reading past the end gives zeros.
+ * 
+ * @param b Stream
+ * @param n Number of bits, up to 32
+ * @return uint64_t Bits
+ */
+static uint64_t archive_get(archive_bits *b, unsigned int n)
+{
+    while (b->nacc < n)
+    {
+        b->acc = (b->acc << 8) | (b->pos < b->len ? b->buf[b->pos] : 0);
+        b->pos++;
+        b->nacc += 8;
+    }
+    b->nacc -= n;
+
+    return (b->acc >> b->nacc) & ((1ULL << n) - 1);
+}
+
+/**
+ * @brief Append a timestamp delta-of-delta
+ * 
+ * @param b Stream
+ * @param dod Delta-of-delta in microseconds
+ */
+static void archive_put_dod(archive_bits *b, int64_t dod)
+{
+    if (dod == 0)
+    {
+        archive_put(b, 0x0, 1);
+    }
+    else if (dod >= -63 && dod <= 64)
+    {
+        archive_put(b, 0x2, 2);
+        archive_put(b, dod + 63, 7);
+    }
+    else if (dod >= -255 && dod <= 256)
+    {
+        archive_put(b, 0x6, 3);
+        archive_put(b, dod + 255, 9);
+    }
+    else if (dod >= -2047 && dod <= 2048)
+    {
+        archive_put(b, 0xe, 4);
+        archive_put(b, dod + 2047, 12);
+    }
+    else
+    {
+        archive_put(b, 0xf, 4);
+        archive_put(b, (uint64_t)dod >> 32, 32);
+        archive_put(b, (uint64_t)dod, 32);
+    }
+}
+
+/**
+ * @brief Take a timestamp delta-of-delta
+ * 
+ * @param b Stream
+ * @return int64_t Delta-of-delta in microseconds
+ */
+static int64_t archive_get_dod(archive_bits *b)
+{
+    if (archive_get(b, 1) == 0)
+    {
+        return 0;
+    }
+    if (archive_get(b, 1) == 0)
+    {
+        return (int64_t)archive_get(b, 7) - 63;
+    }
+    if (archive_get(b, 1) == 0)
+    {
+        return (int64_t)archive_get(b, 9) - 255;
+    }
+    if (archive_get(b, 1) == 0)
+    {
+        return (int64_t)archive_get(b, 12) - 2047;
+    }
+
+    uint64_t high = archive_get(b, 32);
+    return (int64_t)(high << 32 | archive_get(b, 32));
+}
+
+/**
+ * @brief Append the XOR of a channel with its previous value
+ * 
+ * @param b Stream
+ * @param x XOR of the float bits
+ * @param lead Leading zeros of the current window, updated
+ * @param trail Trailing zeros of the current window, updated
+ */
+static void archive_put_xor(archive_bits *b, uint32_t x, uint8_t *lead, uint8_t *trail)
+{
+    if (x == 0)
+    {
+        archive_put(b, 0x0, 1);
+        return;
+    }
+
+    unsigned int l = __builtin_clz(x);
+    unsigned int t = __builtin_ctz(x);
+
+    if (l >= *lead && t >= *trail)
+    {
+        archive_put(b, 0x2, 2);
+        archive_put(b, x >> *trail, 32 - *lead - *trail);
+        return;
+    }
+
+    unsigned int bits = 32 - l - t;
+
+    archive_put(b, 0x3, 2);
+    archive_put(b, l, 5);
+    archive_put(b, bits - 1, 5);
+    archive_put(b, x >> t, bits);
+    *lead = l;
+    *trail = t;
+}
+
+/**
+ * @brief Take the XOR of a channel with its previous value
+ * 
+ * @param b Stream
+ * @param lead Leading zeros of the current window, updated
+ * @param trail Trailing zeros of the current window, updated
+ * @return uint32_t XOR of the float bits
+ */
+static uint32_t archive_get_xor(archive_bits *b, uint8_t *lead, uint8_t *trail)
+{
+    if (archive_get(b, 1) == 0)
+    {
+        return 0;
+    }
+    if (archive_get(b, 1) == 0)
+    {
+        return (uint32_t)archive_get(b, 32 - *lead - *trail) << *trail;
+    }
+
+    unsigned int l = archive_get(b, 5);
+    unsigned int bits = archive_get(b, 5) + 1;
+
+    *lead = l;
+    *trail = 32 - l - bits;
+
+    return (uint32_t)archive_get(b, bits) << *trail;
+}
+
+/**
+ * @brief Get the encoded fields of a sample
+ * 
+ * @param rec Sample
+ * @param values Float bits of the channels
+ * @param flags ARCHIVE_FLAG_*
+ */
+static void archive_sample_values(const sample_record *rec, uint32_t values[ARCHIVE_CHANNELS], uint8_t *flags)
+{
+    memcpy(&values[0], &rec->data.voltage, sizeof(uint32_t));
+    memcpy(&values[1], &rec->data.current, sizeof(uint32_t));
+    memcpy(&values[2], &rec->data.power, sizeof(uint32_t));
+    *flags = (rec->data.relay ? ARCHIVE_FLAG_RELAY : 0)
+        | (rec->flags & SAMPLE_FLAG_DECIMATED ? ARCHIVE_FLAG_DECIMATED : 0);
+}
+
+/**
+ * @brief Close a block and index it
+ * @details The index segment must have room for the entry, see
+ *              archive_segment_full().
+ * 
+ * @param w Writer
+ * @param enc Encoder of the block
+ * @param len Set to the length of the block
+ * @return const void* Block header and payload, valid until the next sample of the device
+ */
+static const void *archive_block_done(archive_writer *w, archive_encoder *enc, size_t *len)
+{
+    archive_put_flush(&enc->bits);
+    enc->hdr.size = enc->bits.len;
+    enc->finished = 1;
+
+    archive_index_entry *e = &w->index[w->nblocks++];
+
+    memset(e, 0, sizeof(*e));
+    e->offset = w->offset;
+    e->first_us = enc->hdr.first_us;
+    e->last_us = enc->last_us;
+    e->count = enc->hdr.count;
+    e->device = enc->hdr.device;
+
+    *len = sizeof(archive_block_header) + enc->hdr.size;
+    w->offset += *len;
+
+    return &enc->hdr;
+}
+
+/**
+ * @brief Close the open index segment and start the next one
+ * 
+ * @param w Writer
+ * @param len Set to the length of the segment
+ * @return archive_segment* Segment header and entries, valid until the next block is closed
+ */
+static archive_segment *archive_segment_done(archive_writer *w, size_t *len)
+{
+    memcpy(w->segment->magic, ARCHIVE_SEGMENT_MAGIC, sizeof(w->segment->magic));
+    w->segment->nentries = w->nblocks;
+    w->segment->prev_offset = w->last_segment;
+
+    *len = sizeof(archive_segment) + w->nblocks * sizeof(archive_index_entry);
+    w->last_segment = w->offset;
+    w->offset += *len;
+    w->indexed += w->nblocks;
+    w->nblocks = 0;
+
+    return w->segment;
+}
+
+/**
+ * @brief Write the samples of a block as CSV
+ * 
+ * @param hdr Archive header
+ * @param bh Block header
+ * @param payload Block payload
+ * @param out CSV output
+ * @return int 0 on success, -1 if the block is corrupt
+ */
+static int archive_decode_block(const archive_header *hdr, const archive_block_header *bh,
+    const uint8_t *payload, FILE *out)
+{
+    archive_bits b = { .buf = (uint8_t *)payload, .len = bh->size };
+    uint64_t start_us = hdr->start_ns / NSEC_PER_USEC;
+    uint64_t ts_us = bh->first_us;
+    int64_t delta = 0;
+    uint32_t values[ARCHIVE_CHANNELS];
+    uint8_t lead[ARCHIVE_CHANNELS] = {0};
+    uint8_t trail[ARCHIVE_CHANNELS] = {0};
+    uint8_t flags = 0;
+
+    for (unsigned int i = 0; i < bh->count; i++)
+    {
+        if (i == 0)
+        {
+            for (int c = 0; c < ARCHIVE_CHANNELS; c++)
+            {
+                values[c] = archive_get(&b, 32);
+                lead[c] = trail[c] = 32;
+            }
+            flags = archive_get(&b, 8);
+        }
+        else
+        {
+            delta += archive_get_dod(&b);
+            ts_us += delta;
+            for (int c = 0; c < ARCHIVE_CHANNELS; c++)
+            {
+                values[c] ^= archive_get_xor(&b, &lead[c], &trail[c]);
+            }
+            if (archive_get(&b, 1))
+            {
+                flags = archive_get(&b, 8);
+            }
+        }
+        if (b.pos > b.len)
+        {
+            return -1;
+        }
+
+        float v[ARCHIVE_CHANNELS];
+        memcpy(v, values, sizeof(v));
+
+        int64_t time_us = (int64_t)(ts_us - start_us);
+        int64_t wall_us = (int64_t)ts_us + hdr->realtime_offset_ns / (int64_t)NSEC_PER_USEC;
+        fprintf(out, "%.6f,%d,%.4f,%.6f,%.6f,%d,%d,%lld.%06lld\n",
+            (double)time_us / 1000000, bh->device, v[0], v[1], v[2],
+            flags & ARCHIVE_FLAG_RELAY ? 1 : 0, flags & ARCHIVE_FLAG_DECIMATED ? 1 : 0,
+            (long long)(wall_us / 1000000), (long long)(wall_us % 1000000));
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Read the index of an archive
+ * @details The segments are followed backwards from the trailer and their
+ *              entries put in file order. A version 1 archive has a single
+ *              index right before its trailer.
+ * 
+ * @param fp Archive
+ * @param hdr Archive header
+ * @param nblocks Set to the number of entries
+ * @return archive_index_entry* Entries to free, NULL if the archive has no usable index
+ */
+static archive_index_entry *archive_read_index(FILE *fp, const archive_header *hdr, size_t *nblocks)
+{
+    archive_trailer trailer;
+    archive_segment seg;
+    archive_index_entry *index;
+
+    if (fseek(fp, -(long)sizeof(trailer), SEEK_END) != 0 || fread(&trailer, sizeof(trailer), 1, fp) != 1
+        || memcmp(trailer.magic, ARCHIVE_INDEX_MAGIC, sizeof(trailer.magic)) != 0)
+    {
+        return NULL;
+    }
+
+    index = malloc(trailer.nblocks * sizeof(archive_index_entry) + 1);
+    if (index == NULL)
+    {
+        return NULL;
+    }
+
+    if (hdr->version == ARCHIVE_VERSION_FLAT)
+    {
+        if (fseek(fp, trailer.index_offset, SEEK_SET) != 0
+            || fread(index, sizeof(archive_index_entry), trailer.nblocks, fp) != trailer.nblocks)
+        {
+            free(index);
+            return NULL;
+        }
+        *nblocks = trailer.nblocks;
+        return index;
+    }
+
+    size_t remaining = trailer.nblocks;
+    uint64_t offset = trailer.index_offset;
+
+    while (remaining > 0)
+    {
+        if (fseek(fp, offset, SEEK_SET) != 0 || fread(&seg, sizeof(seg), 1, fp) != 1
+            || memcmp(seg.magic, ARCHIVE_SEGMENT_MAGIC, sizeof(seg.magic)) != 0 || seg.nentries > remaining
+            || fread(&index[remaining - seg.nentries], sizeof(archive_index_entry), seg.nentries, fp) != seg.nentries
+            || (seg.nentries == 0 && offset != trailer.index_offset))
+        {
+            free(index);
+            return NULL;
+        }
+        remaining -= seg.nentries;
+        offset = seg.prev_offset;
+        if ((remaining > 0) != (offset != 0))
+        {
+            free(index);
+            return NULL;
+        }
+    }
+
+    *nblocks = trailer.nblocks;
+    return index;
+}
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Fill an archive header
+ * 
+ * @param hdr Header
+ * @param sample_rate Nominal sampling rate in Hz
+ * @param start_ns CLOCK_MONOTONIC time base of the archive
+ */
+void archive_header_init(archive_header *hdr, double sample_rate, uint64_t start_ns)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, ARCHIVE_MAGIC, sizeof(hdr->magic));
+    hdr->version = ARCHIVE_VERSION;
+    hdr->block_samples = ARCHIVE_BLOCK_SAMPLES;
+    hdr->sample_rate = sample_rate;
+    hdr->start_ns = start_ns;
+    hdr->realtime_offset_ns = time_realtime_offset_ns();
+}
+
+/**
+ * @brief Initialize an archive writer
+ * @details The encoders of every device and the index segment are taken
+ *              from the arena, so adding samples never allocates.
+ * 
+ * @param w Writer
+ * @param header_len Bytes written before the first block
+ * @return int 0 on success, -1 if the arena is exhausted
+ */
+int archive_writer_init(archive_writer *w, size_t header_len)
+{
+    memset(w, 0, sizeof(*w));
+    w->offset = header_len;
+    w->segment = arena_alloc(sizeof(archive_segment) + ARCHIVE_SEGMENT_ENTRIES * sizeof(archive_index_entry)
+        + sizeof(archive_trailer));
+    if (w->segment == NULL)
+    {
+        return -1;
+    }
+    w->index = (archive_index_entry *)(w->segment + 1);
+    for (size_t d = 0; d < SPI_DEVICES_MAX; d++)
+    {
+        w->enc[d] = arena_alloc(sizeof(archive_encoder));
+        if (w->enc[d] == NULL)
+        {
+            return -1;
+        }
+        w->enc[d]->finished = 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Add a sample to the block of its device
+ * @details The block is handed out once it is full, and must be written
+ *              before the next sample of the device.
+ * 
+ * @param w Writer
+ * @param rec Sample
+ * @param len Set to the length of the completed block
+ * @return const void* Completed block, NULL while the block is open or on error
+ */
+const void *archive_add(archive_writer *w, const sample_record *rec, size_t *len)
+{
+    archive_encoder *enc;
+    uint32_t values[ARCHIVE_CHANNELS];
+    uint8_t flags;
+    uint64_t ts_us = rec->timestamp_ns / NSEC_PER_USEC;
+
+    if (rec->device >= SPI_DEVICES_MAX)
+    {
+        return NULL;
+    }
+    enc = w->enc[rec->device];
+
+    archive_sample_values(rec, values, &flags);
+
+    if (enc->finished)
+    {
+        memset(&enc->hdr, 0, sizeof(enc->hdr));
+        memcpy(enc->hdr.magic, ARCHIVE_BLOCK_MAGIC, sizeof(enc->hdr.magic));
+        enc->hdr.device = rec->device;
+        enc->hdr.first_us = ts_us;
+        enc->bits = (archive_bits){ .buf = enc->payload };
+        enc->finished = 0;
+
+        for (int c = 0; c < ARCHIVE_CHANNELS; c++)
+        {
+            archive_put(&enc->bits, values[c], 32);
+            enc->last[c] = values[c];
+            enc->lead[c] = enc->trail[c] = 32;
+        }
+        archive_put(&enc->bits, flags, 8);
+        enc->last_flags = flags;
+        enc->last_delta = 0;
+    }
+    else
+    {
+        int64_t delta = (int64_t)(ts_us - enc->last_us);
+
+        archive_put_dod(&enc->bits, delta - enc->last_delta);
+        enc->last_delta = delta;
+        for (int c = 0; c < ARCHIVE_CHANNELS; c++)
+        {
+            archive_put_xor(&enc->bits, values[c] ^ enc->last[c], &enc->lead[c], &enc->trail[c]);
+            enc->last[c] = values[c];
+        }
+        if (flags == enc->last_flags)
+        {
+            archive_put(&enc->bits, 0, 1);
+        }
+        else
+        {
+            archive_put(&enc->bits, 1, 1);
+            archive_put(&enc->bits, flags, 8);
+            enc->last_flags = flags;
+        }
+    }
+    enc->last_us = ts_us;
+    enc->hdr.count++;
+
+    if (enc->hdr.count < ARCHIVE_BLOCK_SAMPLES)
+    {
+        return NULL;
+    }
+
+    return archive_block_done(w, enc, len);
+}
+
+/**
+ * @brief Close the open block of a device
+ * 
+ * @param w Writer
+ * @param device Index of the device
+ * @param len Set to the length of the block
+ * @return const void* Block, NULL if the device has no open block
+ */
+const void *archive_finish_block(archive_writer *w, uint8_t device, size_t *len)
+{
+    archive_encoder *enc = device < SPI_DEVICES_MAX ? w->enc[device] : NULL;
+
+    if (enc == NULL || enc->finished)
+    {
+        return NULL;
+    }
+
+    return archive_block_done(w, enc, len);
+}
+
+/**
+ * @brief Hand out the index segment once it is full
+ * @details Called after each completed block is written, so a segment only
+ *              ever sits between two blocks.
+ * 
+ * @param w Writer
+ * @param len Set to the length of the segment
+ * @return const void* Segment, NULL while it has room for more blocks
+ */
+const void *archive_segment_full(archive_writer *w, size_t *len)
+{
+    if (w->nblocks < ARCHIVE_SEGMENT_ENTRIES)
+    {
+        return NULL;
+    }
+
+    return archive_segment_done(w, len);
+}
+
+/**
+ * @brief Get the last index segment and the trailer that end the archive
+ * @details The trailer is appended to the segment, so the writer must not
+ *              take blocks after this.
+ * 
+ * @param w Writer
+ * @param len Set to the length of the segment and trailer
+ * @return const void* Segment and trailer
+ */
+const void *archive_index(archive_writer *w, size_t *len)
+{
+    archive_segment *seg = archive_segment_done(w, len);
+    archive_trailer trailer = { .index_offset = w->last_segment, .nblocks = w->indexed };
+
+    memcpy(trailer.magic, ARCHIVE_INDEX_MAGIC, sizeof(trailer.magic));
+    memcpy((uint8_t *)seg + *len, &trailer, sizeof(trailer));
+    *len += sizeof(trailer);
+    w->offset += sizeof(trailer);
+
+    return seg;
+}
+
+/**
+ * @brief Tell whether a file is an archive
+ * 
+ * @param path File
+ * @return int 1 for an archive, 0 otherwise
+ */
+int archive_probe(const char *path)
+{
+    char magic[4];
+    FILE *fp = fopen(path, "rb");
+    int is_archive;
+
+    if (fp == NULL)
+    {
+        return 0;
+    }
+    is_archive = fread(magic, sizeof(magic), 1, fp) == 1 && memcmp(magic, ARCHIVE_MAGIC, sizeof(magic)) == 0;
+    fclose(fp);
+
+    return is_archive;
+}
+
+/**
+ * @brief Convert an archive to CSV
+ * @details Blocks are decoded in file order, so the samples of different
+ *              devices are grouped by block rather than merged. The index
+ *              locates the blocks when the archive has one; otherwise they
+ *              are walked from the header, stepping over the index segments.
+ * 
+ * @param path Archive file
+ * @param out CSV output
+ * @return int 0 on success, -1 on error
+ */
+int archive_decode_csv(const char *path, FILE *out)
+{
+    static uint8_t payload[ARCHIVE_BLOCK_BYTES];
+    archive_header hdr;
+    archive_block_header bh;
+    archive_segment seg;
+    archive_index_entry *index;
+    size_t nblocks = 0;
+    int ret = 0;
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        perror("Error opening archive");
+        return -1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, ARCHIVE_MAGIC, sizeof(hdr.magic)) != 0
+        || (hdr.version != ARCHIVE_VERSION && hdr.version != ARCHIVE_VERSION_FLAT)
+        || hdr.block_samples > ARCHIVE_BLOCK_SAMPLES)
+    {
+        fprintf(stderr, "%s: not a supported archive\n", path);
+        fclose(fp);
+        return -1;
+    }
+
+    index = archive_read_index(fp, &hdr, &nblocks);
+
+    fprintf(out, "time_s,device,voltage_v,current_a,power_w,relay,decimated,realtime_s\n");
+
+    fseek(fp, sizeof(hdr), SEEK_SET);
+    for (size_t i = 0; index == NULL || i < nblocks; i++)
+    {
+        if (index != NULL && fseek(fp, index[i].offset, SEEK_SET) != 0)
+        {
+            ret = -1;
+            break;
+        }
+        if (fread(&bh, sizeof(bh), 1, fp) == 1 && index == NULL
+            && memcmp(bh.magic, ARCHIVE_SEGMENT_MAGIC, sizeof(bh.magic)) == 0)
+        {
+            memcpy(&seg, &bh, sizeof(seg));
+            if (fseek(fp, (long)(sizeof(seg) + seg.nentries * sizeof(archive_index_entry)) - (long)sizeof(bh),
+                SEEK_CUR) != 0)
+            {
+                break;
+            }
+            continue;
+        }
+        if (feof(fp) || ferror(fp) || memcmp(bh.magic, ARCHIVE_BLOCK_MAGIC, sizeof(bh.magic)) != 0)
+        {
+            /* Without an index, the archive ends at the first incomplete block */
+            ret = index != NULL ? -1 : 0;
+            break;
+        }
+        if (bh.size > sizeof(payload) || bh.count > hdr.block_samples || fread(payload, bh.size, 1, fp) != 1
+            || archive_decode_block(&hdr, &bh, payload, out) < 0)
+        {
+            ret = index != NULL ? -1 : 0;
+            break;
+        }
+    }
+    if (ret < 0)
+    {
+        fprintf(stderr, "%s: corrupt block\n", path);
+    }
+
+    free(index);
+    fclose(fp);
+
+    return ret;
+}
@@ -0,0 +1,146 @@
+/**
+ * @file    archive.h
+ * @brief   Compressed sample archive format
+ * @details An archive is an archive_header followed by blocks of up to
+ *              ARCHIVE_BLOCK_SAMPLES samples of one device, and ends with an
+ *              index of the blocks and an archive_trailer, all in host
+ *              (little endian) byte order. Each block starts with an
+ *              archive_block_header and can be decoded on its own:
+ *              timestamps are stored as microsecond delta-of-deltas and the
+ *              channels as the XOR of consecutive floats, with the variable
+ *              length codes of Facebook's Gorilla. The index is written in
+ *              segments of up to ARCHIVE_SEGMENT_ENTRIES entries, each one
+ *              between the blocks as soon as it is full and the last one at
+ *              the end, chained backwards from the trailer, so the index of
+ *              an archive of any length costs a fixed amount of memory. An
+ *              archive cut short before its trailer is decoded by walking
+ *              the blocks, skipping the segments.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ring.h"
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define ARCHIVE_MAGIC "HOFZ"        /* Archive magic */
+#define ARCHIVE_VERSION 2           /* Archive format version */
+#define ARCHIVE_VERSION_FLAT 1      /* Version with a single index before the trailer */
+#define ARCHIVE_BLOCK_MAGIC "HOZB"  /* Block magic */
+#define ARCHIVE_INDEX_MAGIC "HOZI"  /* Trailer magic */
+#define ARCHIVE_SEGMENT_MAGIC "HOZS" /* Index segment magic */
+#define ARCHIVE_BLOCK_SAMPLES 1024  /* Samples per block */
+#define ARCHIVE_CHANNELS 3          /* Voltage, current and power */
+#define ARCHIVE_SEGMENT_ENTRIES 4096 /* Index entries per segment */
+
+/* Worst case block payload: a 68-bit timestamp code, three 45-bit channel codes and a 9-bit flags code */
+#define ARCHIVE_BLOCK_BYTES (ARCHIVE_BLOCK_SAMPLES * 28)
+
+/* *************************
+ * PUBLIC TYPES DEFINITION *
+ * *************************/
+
+/* Archive header */
+typedef struct archive_header{
+    char magic[4];                  /* ARCHIVE_MAGIC */
+    uint16_t version;               /* ARCHIVE_VERSION */
+    uint16_t block_samples;         /* ARCHIVE_BLOCK_SAMPLES */
+    float sample_rate;              /* Nominal sampling rate in Hz */
+    uint64_t start_ns;              /* CLOCK_MONOTONIC time base */
+    int64_t realtime_offset_ns;     /* CLOCK_REALTIME minus CLOCK_MONOTONIC */
+}__attribute__((__packed__)) archive_header;
+
+/* Header of a block, followed by its payload */
+typedef struct archive_block_header{
+    char magic[4];                  /* ARCHIVE_BLOCK_MAGIC */
+    uint32_t size;                  /* Payload bytes */
+    uint16_t count;                 /* Samples in the block */
+    uint8_t device;                 /* Index of the device in the device list */
+    uint8_t reserved;
+    uint64_t first_us;              /* CLOCK_MONOTONIC time of the first sample */
+}__attribute__((__packed__)) archive_block_header;
+
+/* Index entry of a block */
+typedef struct archive_index_entry{
+    uint64_t offset;                /* Offset of the block header in the file */
+    uint64_t first_us;
+    uint64_t last_us;
+    uint16_t count;
+    uint8_t device;
+    uint8_t reserved;
+}__attribute__((__packed__)) archive_index_entry;
+
+/* Header of an index segment, followed by its entries */
+typedef struct archive_segment{
+    char magic[4];                  /* ARCHIVE_SEGMENT_MAGIC */
+    uint32_t nentries;
+    uint64_t prev_offset;           /* Offset of the previous segment, 0 for the first one */
+}__attribute__((__packed__)) archive_segment;
+
+/* End of an archive */
+typedef struct archive_trailer{
+    uint64_t index_offset;          /* Offset of the last index segment (of the first entry in version 1) */
+    uint32_t nblocks;               /* Entries of all the segments */
+    char magic[4];                  /* ARCHIVE_INDEX_MAGIC */
+}__attribute__((__packed__)) archive_trailer;
+
+/* Bit stream */
+typedef struct archive_bits{
+    uint8_t *buf;
+    size_t len;                     /* Whole bytes written or available */
+    size_t pos;                     /* Next byte to read */
+    uint64_t acc;                   /* Pending bits */
+    unsigned int nacc;
+} archive_bits;
+
+/* Encoder of the open block of one device */
+typedef struct archive_encoder{
+    archive_block_header hdr;       /* Directly followed by the payload, so the block is contiguous */
+    uint8_t payload[ARCHIVE_BLOCK_BYTES];
+    archive_bits bits;
+    uint64_t last_us;
+    int64_t last_delta;
+    uint32_t last[ARCHIVE_CHANNELS];
+    uint8_t lead[ARCHIVE_CHANNELS];
+    uint8_t trail[ARCHIVE_CHANNELS];
+    uint8_t last_flags;
+    int finished;                   /* The block was handed out and is reset on the next sample */
+} archive_encoder;
+
+/* Archive writer */
+typedef struct archive_writer{
+    archive_encoder *enc[SPI_DEVICES_MAX];
+    archive_segment *segment;       /* Open segment, followed by its entries and room for the trailer */
+    archive_index_entry *index;     /* Entries of the open segment */
+    size_t nblocks;                 /* Entries in the open segment */
+    size_t indexed;                 /* Entries in the segments handed out */
+    uint64_t last_segment;          /* Offset of the last segment handed out, 0 if none */
+    uint64_t offset;                /* Bytes handed out so far */
+} archive_writer;
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+void archive_header_init(archive_header *hdr, double sample_rate, uint64_t start_ns);
+int archive_writer_init(archive_writer *w, size_t header_len);
+const void *archive_add(archive_writer *w, const sample_record *rec, size_t *len);
+const void *archive_finish_block(archive_writer *w, uint8_t device, size_t *len);
+const void *archive_segment_full(archive_writer *w, size_t *len);
+const void *archive_index(archive_writer *w, size_t *len);
+int archive_probe(const char *path);
+int archive_decode_csv(const char *path, FILE *out);
+
+#endif /* ARCHIVE_H */
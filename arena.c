@@ -0,0 +1,322 @@
+/**
+ * @file    arena.c
+ * @brief   Startup arena and fixed-size pools
+ * @details The arena is one anonymous mapping reserved without swap backing,
+ *              so an arena larger than needed only costs address space.
+ *              Allocations are zeroed as they are handed out, which faults
+ *              their pages in before sampling starts, and are never freed on
+ *              their own. Allocation is meant for the thread that opens the
+ *              sinks and is not locked.
+ * 
+ *              ARENA_GUARD builds are linked with --wrap for the allocator
+ *              entry points, so a malloc from a thread that armed the guard
+ *              prints a backtrace and aborts. Allocations made inside libc,
+ *              such as stdio buffers, are not seen.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef ARENA_GUARD
+#include <execinfo.h>
+#endif
+
+#include "arena.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define ARENA_BACKTRACE_FRAMES 32   /* Frames printed when the guard trips */
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static void arena_guard_check(const char *what, size_t size);
+
+#ifdef ARENA_GUARD
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+int __real_posix_memalign(void **ptr, size_t align, size_t size);
+void *__real_aligned_alloc(size_t align, size_t size);
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t n, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+int __wrap_posix_memalign(void **ptr, size_t align, size_t size);
+void *__wrap_aligned_alloc(size_t align, size_t size);
+#endif
+
+/* *************************************
+ * PRIVATE GLOBAL VARIABLES DEFINITION *
+ * *************************************/
+
+static uint8_t *gs_arena_base;      /* Reserved mapping, NULL when released */
+static size_t gs_arena_size;
+static size_t gs_arena_used;
+
+static __thread int gs_arena_hot;   /* The calling thread armed the guard */
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Fail loudly on an allocation from a guarded thread
+ * @details Only aborts in ARENA_GUARD builds. The report is written without
+ *              going through the allocator.
+ * 
+ * @param what Allocating function
+ * @param size Requested size
+ */
+static void arena_guard_check(const char *what, size_t size)
+{
+#ifdef ARENA_GUARD
+    if (gs_arena_hot)
+    {
+        void *frames[ARENA_BACKTRACE_FRAMES];
+        char msg[96];
+        int len = snprintf(msg, sizeof(msg), "%s(%zu) on a hot path after startup\n", what, size);
+
+        gs_arena_hot = 0;
+        if (write(STDERR_FILENO, msg, len) == len)
+        {
+            backtrace_symbols_fd(frames, backtrace(frames, ARENA_BACKTRACE_FRAMES), STDERR_FILENO);
+        }
+        abort();
+    }
+#else
+    (void)what;
+    (void)size;
+#endif
+}
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Reserve the arena
+ * 
+ * @param size Arena size in bytes
+ * @return int 0 on success, -1 on error
+ */
+int arena_init(size_t size)
+{
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (base == MAP_FAILED)
+    {
+        perror("Error reserving the arena");
+        return -1;
+    }
+
+    gs_arena_base = base;
+    gs_arena_size = size;
+    gs_arena_used = 0;
+
+    return 0;
+}
+
+/**
+ * @brief Allocate zeroed, cache-line aligned memory from the arena
+ * 
+ * @param size Size in bytes
+ * @return void* Memory, valid until arena_release(), or NULL if the arena is
+ *              exhausted
+ */
+void *arena_alloc(size_t size)
+{
+    size_t aligned = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    arena_guard_check("arena_alloc", size);
+    if (gs_arena_base == NULL || aligned > gs_arena_size - gs_arena_used)
+    {
+        fprintf(stderr, "Arena exhausted: %zu bytes requested, %zu of %zu used\n",
+            size, gs_arena_used, gs_arena_size);
+        return NULL;
+    }
+
+    void *p = gs_arena_base + gs_arena_used;
+    gs_arena_used += aligned;
+    memset(p, 0, aligned);
+
+    return p;
+}
+
+/**
+ * @brief Give back everything allocated from the arena
+ * @details Must only be called once no thread uses arena memory.
+ * 
+ */
+void arena_release()
+{
+    if (gs_arena_base != NULL)
+    {
+        munmap(gs_arena_base, gs_arena_size);
+        gs_arena_base = NULL;
+    }
+    gs_arena_size = 0;
+    gs_arena_used = 0;
+}
+
+/**
+ * @brief Get the arena usage
+ * 
+ * @return size_t Bytes allocated from the arena
+ */
+size_t arena_used()
+{
+    return gs_arena_used;
+}
+
+/**
+ * @brief Arm or disarm the allocation guard of the calling thread
+ * 
+ * @param on Non-zero once the thread is on its hot path
+ * @return int Previous state, to restore around a deliberate allocation
+ */
+int arena_guard(int on)
+{
+    int prev = gs_arena_hot;
+
+    gs_arena_hot = on != 0;
+
+    return prev;
+}
+
+/**
+ * @brief Carve a pool of objects out of the arena
+ * 
+ * @param p Pool
+ * @param size Object size
+ * @param count Number of objects
+ * @return int 0 on success, -1 if the arena is exhausted
+ */
+int arena_pool_init(arena_pool *p, size_t size, size_t count)
+{
+    size_t stride = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    uint8_t *objs = arena_alloc(stride * count);
+
+    p->free = NULL;
+    p->size = size;
+    if (objs == NULL)
+    {
+        return -1;
+    }
+
+    while (count-- > 0)
+    {
+        arena_pool_put(p, objs + count * stride);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Take an object from a pool
+ * 
+ * @param p Pool
+ * @return void* Object, or NULL if the pool is empty
+ */
+void *arena_pool_get(arena_pool *p)
+{
+    void **obj = p->free;
+
+    if (obj != NULL)
+    {
+        p->free = *obj;
+    }
+
+    return obj;
+}
+
+/**
+ * @brief Return an object to its pool
+ * 
+ * @param p Pool
+ * @param obj Object taken from the pool
+ */
+void arena_pool_put(arena_pool *p, void *obj)
+{
+    *(void **)obj = p->free;
+    p->free = obj;
+}
+
+#ifdef ARENA_GUARD
+
+/**
+ * @brief malloc() of guarded builds
+ * 
+ * @param size Size
+ * @return void* Memory
+ */
+void *__wrap_malloc(size_t size)
+{
+    arena_guard_check("malloc", size);
+    return __real_malloc(size);
+}
+
+/**
+ * @brief calloc() of guarded builds
+ * 
+ * @param n Number of elements
+ * @param size Element size
+ * @return void* Memory
+ */
+void *__wrap_calloc(size_t n, size_t size)
+{
+    arena_guard_check("calloc", n * size);
+    return __real_calloc(n, size);
+}
+
+/**
+ * @brief realloc() of guarded builds
+ * 
+ * @param ptr Memory to resize
+ * @param size New size
+ * @return void* Memory
+ */
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    arena_guard_check("realloc", size);
+    return __real_realloc(ptr, size);
+}
+
+/**
+ * @brief posix_memalign() of guarded builds
+ * 
+ * @param ptr Set to the memory
+ * @param align Alignment
+ * @param size Size
+ * @return int 0 on success, an error number otherwise
+ */
+int __wrap_posix_memalign(void **ptr, size_t align, size_t size)
+{
+    arena_guard_check("posix_memalign", size);
+    return __real_posix_memalign(ptr, align, size);
+}
+
+/**
+ * @brief aligned_alloc() of guarded builds
+ * 
+ * @param align Alignment
+ * @param size Size
+ * @return void* Memory
+ */
+void *__wrap_aligned_alloc(size_t align, size_t size)
+{
+    arena_guard_check("aligned_alloc", size);
+    return __real_aligned_alloc(align, size);
+}
+
+#endif
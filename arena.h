@@ -0,0 +1,50 @@
+/**
+ * @file    arena.h
+ * @brief   Startup arena and fixed-size pools
+ * @details Memory the sampling and sink threads use in the steady state is
+ *              taken from one arena while the sinks are opened and started,
+ *              and given back all at once when the run ends. Threads on the
+ *              hot path arm a guard, which in ARENA_GUARD builds aborts on any
+ *              malloc they make.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stddef.h>
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define ARENA_ALIGN 64              /* Allocation alignment, a cache line */
+
+/* *************************
+ * PUBLIC TYPES DEFINITION *
+ * *************************/
+
+/* Pool of fixed-size objects taken from the arena */
+typedef struct arena_pool{
+    void *free;                     /* Free list, linked through the objects */
+    size_t size;                    /* Object size */
+} arena_pool;
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+int arena_init(size_t size);
+void *arena_alloc(size_t size);
+void arena_release();
+size_t arena_used();
+int arena_guard(int on);
+int arena_pool_init(arena_pool *p, size_t size, size_t count);
+void *arena_pool_get(arena_pool *p);
+void arena_pool_put(arena_pool *p, void *obj);
+
+#endif /* ARENA_H */
@@ -0,0 +1,370 @@
+/**
+ * @file    bench.c
+ * @brief   SPI link benchmark
+ * @details For each speed of a table up to the configured maximum, every
+ *              read command and a range of CMD_READ_BATCH frame sizes is run
+ *              back to back after a short warm-up. Each request is timed on
+ *              CLOCK_MONOTONIC around the whole spi_query() path, ioctl and
+ *              frame checks included, so a regression anywhere between the
+ *              client and the device shows up in the numbers. Retries are
+ *              disabled while benchmarking so that every sample is a single
+ *              transfer; failed transfers are counted apart and left out of
+ *              the latency figures. Replies carrying samples are decoded the
+ *              way the sampler does, raw registers converted first. The raw
+ *              reads are only run on devices with a shunt configured. With
+ *              pipelining, those reads are run a second time through the SPI
+ *              worker, each timed cycle taking one reply, submitting the next
+ *              request and decoding the reply while the request is on the
+ *              wire, so the two rows compare the throughput of both paths.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "timeutil.h"
+#include "ina219.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define BENCH_WARMUP 10             /* Untimed transfers before each run */
+
+/* **************************
+ * PRIVATE TYPES DEFINITION *
+ * **************************/
+
+/* Request benchmarked */
+typedef struct bench_case{
+    uint8_t cmd;
+    uint8_t batch;                  /* Samples per batch read, 0 for other commands */
+} bench_case;
+
+/* Result of one run */
+typedef struct bench_result{
+    unsigned int ok;                /* Transfers with a valid reply */
+    unsigned int errors;
+    uint64_t elapsed_ns;            /* Duration of the timed transfers */
+} bench_result;
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static int bench_raw(uint8_t cmd);
+static int bench_decode(const spi_device *dev, uint8_t cmd, const uint8_t *samples, int count);
+static int bench_transfer(spi_device *dev, const bench_case *c);
+static int bench_transfer_pipelined(spi_device *dev, const bench_case *c);
+static void bench_case_run(spi_device *dev, const bench_case *c, int pipelined, unsigned int iterations,
+    uint64_t *latency_ns, bench_result *res);
+static int bench_compare(const void *a, const void *b);
+static double bench_percentile_us(const uint64_t *sorted_ns, unsigned int n, double q);
+
+/* *************************************
+ * PRIVATE GLOBAL VARIABLES DEFINITION *
+ * *************************************/
+
+/* Speeds tried, in increasing order */
+static const uint32_t gs_bench_speeds[] = {
+    100000, 500000, 1000000, 2000000, 4000000, 8000000, 16000000, 32000000,
+};
+
+/* Samples decoded out of the replies */
+static homeoffice_data gs_bench_decoded[SPI_BATCH_MAX];
+
+/* Packed samples converted from raw replies */
+static uint8_t gs_bench_packed[SPI_BATCH_MAX * SPI_SAMPLE_LEN];
+
+/* Requests run at each speed */
+static const bench_case gs_bench_cases[] = {
+    { CMD_READ_VOLTAGE, 0 },
+    { CMD_READ_CURRENT, 0 },
+    { CMD_READ_POWER, 0 },
+    { CMD_READ_RELAY, 0 },
+    { CMD_READ_ALL, 0 },
+    { CMD_READ_BATCH, 1 },
+    { CMD_READ_BATCH, 8 },
+    { CMD_READ_BATCH, 32 },
+    { CMD_READ_BATCH, SPI_BATCH_MAX },
+    { CMD_READ_RAW, 0 },
+    { CMD_READ_BATCH_RAW, 1 },
+    { CMD_READ_BATCH_RAW, 8 },
+    { CMD_READ_BATCH_RAW, 32 },
+    { CMD_READ_BATCH_RAW, SPI_BATCH_MAX },
+};
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Tell whether a command reads raw registers
+ * 
+ * @param cmd Command code
+ * @return int 1 for raw reads, 0 otherwise
+ */
+static int bench_raw(uint8_t cmd)
+{
+    return cmd == CMD_READ_RAW || cmd == CMD_READ_BATCH_RAW;
+}
+
+/**
+ * @brief Decode the samples of a reply
+ * 
+ * @param dev SPI device
+ * @param cmd Command of the reply
+ * @param samples Packed samples, or the payload of a raw reply
+ * @param count Number of samples, -1 if the read failed
+ * @return int Number of samples, -1 if the read failed or the reply is invalid
+ */
+static int bench_decode(const spi_device *dev, uint8_t cmd, const uint8_t *samples, int count)
+{
+    if (count >= 0 && bench_raw(cmd))
+    {
+        count = ina219_decode(dev->shunt_uohm, samples, count, gs_bench_packed);
+        samples = gs_bench_packed;
+    }
+
+    for (int k = 0; k < count; k++)
+    {
+        memcpy(&gs_bench_decoded[k], samples + k * SPI_SAMPLE_LEN, SPI_SAMPLE_LEN);
+    }
+
+    return count;
+}
+
+/**
+ * @brief Run one request
+ * 
+ * @param dev SPI device
+ * @param c Request
+ * @return int 0 on success, -1 on error
+ */
+static int bench_transfer(spi_device *dev, const bench_case *c)
+{
+    const uint8_t *samples;
+    int count;
+
+    if (c->batch > 0)
+    {
+        count = spi_read_batch(dev, c->cmd, c->batch, &samples);
+        return bench_decode(dev, c->cmd, samples, count) < 0 ? -1 : 0;
+    }
+
+    samples = spi_query(dev, c->cmd);
+    if (samples != NULL && (c->cmd == CMD_READ_ALL || c->cmd == CMD_READ_RAW))
+    {
+        return bench_decode(dev, c->cmd, samples, 1) < 0 ? -1 : 0;
+    }
+
+    return samples != NULL ? 0 : -1;
+}
+
+/**
+ * @brief Run one pipelined cycle: take a reply, submit the next request and
+ *              decode the reply
+ * 
+ * @param dev Pipelined SPI device
+ * @param c Request
+ * @return int 0 on success, -1 if the reply taken is invalid
+ */
+static int bench_transfer_pipelined(spi_device *dev, const bench_case *c)
+{
+    const spi_slot *slot = spi_complete(dev);
+    const uint8_t *samples;
+
+    spi_submit(dev, c->cmd, c->batch);
+    if (slot == NULL)
+    {
+        return 0;
+    }
+
+    int count = spi_slot_samples(slot, &samples);
+
+    return bench_decode(dev, slot->cmd, samples, count) < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Time a series of requests
+ * @details A pipelined series leaves no request in flight when done.
+ * 
+ * @param dev SPI device
+ * @param c Request
+ * @param pipelined Run the requests through the SPI worker of the device
+ * @param iterations Timed transfers
+ * @param latency_ns Filled with the latency of the successful transfers
+ * @param res Result
+ */
+static void bench_case_run(spi_device *dev, const bench_case *c, int pipelined, unsigned int iterations,
+    uint64_t *latency_ns, bench_result *res)
+{
+    int (*transfer)(spi_device *, const bench_case *) = pipelined ? bench_transfer_pipelined : bench_transfer;
+    uint64_t start_ns;
+
+    for (unsigned int i = 0; i < BENCH_WARMUP; i++)
+    {
+        transfer(dev, c);
+    }
+
+    res->ok = 0;
+    res->errors = 0;
+    start_ns = time_now_ns(CLOCK_MONOTONIC);
+
+    for (unsigned int i = 0; i < iterations; i++)
+    {
+        uint64_t t0_ns = time_now_ns(CLOCK_MONOTONIC);
+
+        if (transfer(dev, c) == 0)
+        {
+            latency_ns[res->ok++] = time_now_ns(CLOCK_MONOTONIC) - t0_ns;
+        }
+        else
+        {
+            res->errors++;
+        }
+    }
+
+    res->elapsed_ns = time_now_ns(CLOCK_MONOTONIC) - start_ns;
+    if (pipelined)
+    {
+        spi_complete(dev);
+    }
+}
+
+/**
+ * @brief Order two latencies for qsort()
+ * 
+ * @param a First latency
+ * @param b Second latency
+ * @return int Comparison result
+ */
+static int bench_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Get a percentile of sorted latencies, nearest rank
+ * 
+ * @param sorted_ns Latencies in increasing order
+ * @param n Number of latencies, at least 1
+ * @param q Quantile, from 0 to 1
+ * @return double Latency in microseconds
+ */
+static double bench_percentile_us(const uint64_t *sorted_ns, unsigned int n, double q)
+{
+    unsigned int rank = (unsigned int)(q * n + 0.999999);
+
+    return (double)sorted_ns[rank > 0 ? rank - 1 : 0] / NSEC_PER_USEC;
+}
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Benchmark the SPI link of a device
+ * @details Prints one CSV row per speed and request: the clocked bytes are
+ *              those of both SPI segments. Speeds the controller rejects end
+ *              the run. The speed and retries of the device are restored
+ *              afterwards. With the pipeline on, READ_ALL and batch requests
+ *              get a second row timed through the SPI worker.
+ * 
+ * @param dev SPI device
+ * @param cfg Benchmark configuration
+ * @param fp Output stream
+ * @param header Print the CSV header first
+ * @return int 0 on success, -1 on error
+ */
+int bench_run(spi_device *dev, const bench_config *cfg, FILE *fp, int header)
+{
+    unsigned int retries = dev->retries;
+    uint32_t speed_hz = dev->speed_hz;
+
+    uint64_t *latency_ns = malloc(cfg->iterations * sizeof(uint64_t));
+    if (latency_ns == NULL)
+    {
+        fprintf(stderr, "Error allocating benchmark buffer\n");
+        return -1;
+    }
+
+    if (cfg->pipeline && (errno = spi_pipeline_start(dev, NULL)) != 0)
+    {
+        perror("Error starting the SPI worker");
+        free(latency_ns);
+        return -1;
+    }
+
+    if (header)
+    {
+        fprintf(fp, "device,protocol,speed_hz,command,batch,pipelined,bytes,iterations,errors,"
+            "p50_us,p90_us,p99_us,max_us,transfers_per_s,bytes_per_s\n");
+    }
+
+    dev->retries = 0;
+
+    for (size_t s = 0; s < sizeof(gs_bench_speeds) / sizeof(gs_bench_speeds[0]); s++)
+    {
+        if (gs_bench_speeds[s] > cfg->max_hz || spi_set_speed(dev, gs_bench_speeds[s]) < 0)
+        {
+            break;
+        }
+
+        for (size_t i = 0; i < sizeof(gs_bench_cases) / sizeof(gs_bench_cases[0]); i++)
+        {
+            const bench_case *c = &gs_bench_cases[i];
+            size_t bytes = SPI_FRAME_LEN + spi_frame_len(dev, c->cmd, c->batch);
+            int modes = cfg->pipeline && (c->cmd == CMD_READ_ALL || c->cmd == CMD_READ_RAW || c->batch > 0) ? 2 : 1;
+
+            if (bench_raw(c->cmd) && dev->shunt_uohm == 0)
+            {
+                continue;
+            }
+
+            for (int pipelined = 0; pipelined < modes; pipelined++)
+            {
+                bench_result res;
+
+                bench_case_run(dev, c, pipelined, cfg->iterations, latency_ns, &res);
+                qsort(latency_ns, res.ok, sizeof(uint64_t), bench_compare);
+
+                double tps = res.elapsed_ns > 0 ? (double)res.ok * NSEC_PER_SEC / res.elapsed_ns : 0;
+
+                fprintf(fp, "%s,%d,%u,%s,%u,%d,%zu,%u,%u,", dev->path, dev->protocol, gs_bench_speeds[s],
+                    spi_cmd_str(c->cmd), c->batch, pipelined, bytes, cfg->iterations, res.errors);
+                if (res.ok > 0)
+                {
+                    fprintf(fp, "%.1f,%.1f,%.1f,%.1f,", bench_percentile_us(latency_ns, res.ok, 0.50),
+                        bench_percentile_us(latency_ns, res.ok, 0.90), bench_percentile_us(latency_ns, res.ok, 0.99),
+                        (double)latency_ns[res.ok - 1] / NSEC_PER_USEC);
+                }
+                else
+                {
+                    fprintf(fp, ",,,,");
+                }
+                fprintf(fp, "%.1f,%.0f\n", tps, tps * bytes);
+                fflush(fp);
+            }
+        }
+    }
+
+    if (cfg->pipeline)
+    {
+        spi_pipeline_stop(dev);
+    }
+    dev->retries = retries;
+    free(latency_ns);
+
+    return spi_set_speed(dev, speed_hz);
+}
@@ -0,0 +1,45 @@
+/**
+ * @file    bench.h
+ * @brief   SPI link benchmark
+ * @details Measures the latency and throughput of every read command at a
+ *              range of SPI clocks and reply frame sizes, and reports them as
+ *              CSV so runs can be compared across firmware and kernel updates.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "spi.h"
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define BENCH_MAX_HZ 32000000       /* Highest speed tried by default */
+
+/* *************************
+ * PUBLIC TYPES DEFINITION *
+ * *************************/
+
+/* Benchmark configuration */
+typedef struct bench_config{
+    unsigned int iterations;        /* Timed transfers per command and speed, 0 to disable */
+    uint32_t max_hz;                /* Highest speed to try */
+    int pipeline;                   /* Also run the sample reads pipelined, see spi_submit() */
+} bench_config;
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+int bench_run(spi_device *dev, const bench_config *cfg, FILE *fp, int header);
+
+#endif /* BENCH_H */
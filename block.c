@@ -0,0 +1,240 @@
+/**
+ * @file    block.c
+ * @brief   Structure-of-arrays sample blocks
+ * @details The NEON kernels handle four samples per iteration and leave the
+ *              remainder to the scalar loop, which is also the whole kernel on
+ *              targets without NEON. The conversion gives the same floats as
+ *              the scalar loop: the fixed-point products are exact in both,
+ *              and ARMv7 NEON has no double lanes, so the products are turned
+ *              into floats one by one. Reductions are taken relative to a
+ *              shift close to the data, usually its first value, so the float
+ *              sum of squares keeps its precision.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <math.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define BLOCK_NEON 1
+#endif
+
+#include "block.h"
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static void block_convert_one(const raw_block *raw, const ina219_scale *s, size_t i, sample_block *blk);
+#ifdef BLOCK_NEON
+static uint64x2_t block_mul_q16(uint32x2_t x, uint64_t q16);
+#endif
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Convert the raw registers of one sample
+ * @details A math overflow leaves the current and power registers invalid,
+ *              so the current is then taken from the shunt voltage and the
+ *              power from the current and the bus voltage.
+ * 
+ * @param raw Raw registers
+ * @param s Conversion factors of the calibration
+ * @param i Index of the sample
+ * @param blk Block the reading is stored in
+ */
+static void block_convert_one(const raw_block *raw, const ina219_scale *s, size_t i, sample_block *blk)
+{
+    int64_t bus_uv = (int64_t)(raw->bus[i] >> INA219_BUS_SHIFT) * INA219_BUS_LSB_UV;
+    int64_t current_na;
+    int64_t power_nw;
+
+    if (raw->bus[i] & INA219_BUS_OVF)
+    {
+        int64_t shunt_nv = (int64_t)raw->shunt[i] * INA219_SHUNT_LSB_NV;
+
+        current_na = shunt_nv * 1000000 / s->shunt_uohm;
+        power_nw = (current_na < 0 ? -current_na : current_na) * (bus_uv / 1000) / 1000;
+    }
+    else
+    {
+        current_na = (int64_t)raw->current[i] * (int64_t)s->current_q16 / INA219_Q16_ONE;
+        power_nw = (int64_t)(raw->power[i] * s->power_q16 / INA219_Q16_ONE);
+    }
+
+    blk->voltage[i] = (float)((double)bus_uv / 1e6);
+    blk->current[i] = (float)((double)current_na / 1e9);
+    blk->power[i] = (float)((double)power_nw / 1e9);
+    blk->relay[i] = raw->bus[i] & INA219_BUS_RELAY ? 1 : 0;
+}
+
+#ifdef BLOCK_NEON
+/**
+ * @brief Multiply two register magnitudes by a fixed-point factor
+ * @details NEON has no 64-bit multiply, so the factor is split in 32-bit
+ *              halves. The factors of ina219_scale_init() keep the products
+ *              below 2^63, so the sum of the partial products is exact.
+ * 
+ * @param x Register magnitudes
+ * @param q16 Factor in 2^-16 units
+ * @return uint64x2_t Products, rounded down to whole units
+ */
+static uint64x2_t block_mul_q16(uint32x2_t x, uint64_t q16)
+{
+    uint64x2_t lo = vmull_u32(x, vdup_n_u32((uint32_t)q16));
+    uint64x2_t hi = vmull_u32(x, vdup_n_u32((uint32_t)(q16 >> 32)));
+
+    return vshrq_n_u64(vaddq_u64(lo, vshlq_n_u64(hi, 32)), INA219_Q16_SHIFT);
+}
+#endif
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Append a sample to a block
+ * @details The caller starts a new block when this one is full or the
+ *              device changes.
+ * 
+ * @param blk Block
+ * @param rec Sample
+ */
+void block_append(sample_block *blk, const sample_record *rec)
+{
+    size_t i = blk->n++;
+
+    blk->device = rec->device;
+    blk->timestamp_ns[i] = rec->timestamp_ns;
+    blk->voltage[i] = rec->data.voltage;
+    blk->current[i] = rec->data.current;
+    blk->power[i] = rec->data.power;
+    blk->relay[i] = rec->data.relay;
+}
+
+/**
+ * @brief Convert raw INA219 registers into readings
+ * @details The bus voltage, current and power products are computed four
+ *              samples at a time, and the samples with a math overflow are
+ *              converted again one by one.
+ * 
+ * @param raw Raw registers, up to BLOCK_LEN samples
+ * @param s Conversion factors of the calibration the registers were read with
+ * @param blk Filled with the readings and relay states, without timestamps
+ */
+void block_convert(const raw_block *raw, const ina219_scale *s, sample_block *blk)
+{
+    size_t i = 0;
+
+#ifdef BLOCK_NEON
+    for (; i + 4 <= raw->n; i += 4)
+    {
+        int32x4_t c = vmovl_s16(vld1_s16(&raw->current[i]));
+        uint32x4_t mag = vreinterpretq_u32_s32(vabsq_s32(c));
+        uint32x4_t p = vmovl_u16(vld1_u16(&raw->power[i]));
+        uint32x4_t b = vshrq_n_u32(vmovl_u16(vld1_u16(&raw->bus[i])), INA219_BUS_SHIFT);
+        int32x4_t neg = vshrq_n_s32(c, 31);
+        int64x2_t neg_lo = vmovl_s32(vget_low_s32(neg));
+        int64x2_t neg_hi = vmovl_s32(vget_high_s32(neg));
+        int64x2_t c_lo = vreinterpretq_s64_u64(block_mul_q16(vget_low_u32(mag), s->current_q16));
+        int64x2_t c_hi = vreinterpretq_s64_u64(block_mul_q16(vget_high_u32(mag), s->current_q16));
+        int64_t current_na[4];
+        uint64_t power_nw[4];
+        uint32_t bus_uv[4];
+
+        /* Negated back as (x ^ -1) - -1, rounding toward zero like the division */
+        vst1q_s64(&current_na[0], vsubq_s64(veorq_s64(c_lo, neg_lo), neg_lo));
+        vst1q_s64(&current_na[2], vsubq_s64(veorq_s64(c_hi, neg_hi), neg_hi));
+        vst1q_u64(&power_nw[0], block_mul_q16(vget_low_u32(p), s->power_q16));
+        vst1q_u64(&power_nw[2], block_mul_q16(vget_high_u32(p), s->power_q16));
+        vst1q_u32(bus_uv, vmulq_n_u32(b, INA219_BUS_LSB_UV));
+
+        for (int l = 0; l < 4; l++)
+        {
+            if (raw->bus[i + l] & INA219_BUS_OVF)
+            {
+                block_convert_one(raw, s, i + l, blk);
+                continue;
+            }
+            blk->voltage[i + l] = (float)((double)bus_uv[l] / 1e6);
+            blk->current[i + l] = (float)((double)current_na[l] / 1e9);
+            blk->power[i + l] = (float)((double)(int64_t)power_nw[l] / 1e9);
+            blk->relay[i + l] = raw->bus[i + l] & INA219_BUS_RELAY ? 1 : 0;
+        }
+    }
+#endif
+    for (; i < raw->n; i++)
+    {
+        block_convert_one(raw, s, i, blk);
+    }
+
+    blk->n = raw->n;
+}
+
+/**
+ * @brief Reduce an array to its sum, sum of squares, min and max
+ * 
+ * @param x Array
+ * @param n Number of elements, at least one
+ * @param shift Value subtracted from every element before reducing
+ * @param out Reduction; min and max are absolute, sums are relative to shift
+ */
+void block_reduce(const float *x, size_t n, float shift, block_reduction *out)
+{
+    float sum = 0, sumsq = 0, min = INFINITY, max = -INFINITY;
+    size_t i = 0;
+
+#ifdef BLOCK_NEON
+    if (n >= 4)
+    {
+        float32x4_t vshift = vdupq_n_f32(shift);
+        float32x4_t vsum = vdupq_n_f32(0);
+        float32x4_t vsumsq = vdupq_n_f32(0);
+        float32x4_t vmin = vdupq_n_f32(INFINITY);
+        float32x4_t vmax = vdupq_n_f32(-INFINITY);
+        float lanes[4][4];
+
+        for (; i + 4 <= n; i += 4)
+        {
+            float32x4_t d = vsubq_f32(vld1q_f32(&x[i]), vshift);
+
+            vsum = vaddq_f32(vsum, d);
+            vsumsq = vmlaq_f32(vsumsq, d, d);
+            vmin = vminq_f32(vmin, d);
+            vmax = vmaxq_f32(vmax, d);
+        }
+
+        vst1q_f32(lanes[0], vsum);
+        vst1q_f32(lanes[1], vsumsq);
+        vst1q_f32(lanes[2], vmin);
+        vst1q_f32(lanes[3], vmax);
+        for (int l = 0; l < 4; l++)
+        {
+            sum += lanes[0][l];
+            sumsq += lanes[1][l];
+            min = fminf(min, lanes[2][l]);
+            max = fmaxf(max, lanes[3][l]);
+        }
+    }
+#endif
+    for (; i < n; i++)
+    {
+        float d = x[i] - shift;
+
+        sum += d;
+        sumsq += d * d;
+        min = fminf(min, d);
+        max = fmaxf(max, d);
+    }
+
+    out->sum = sum;
+    out->sumsq = sumsq;
+    out->min = min + shift;
+    out->max = max + shift;
+}
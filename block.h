@@ -0,0 +1,72 @@
+/**
+ * @file    block.h
+ * @brief   Structure-of-arrays sample blocks
+ * @details Blocks store the readings of consecutive samples of one device as
+ *              separate, 16-byte aligned arrays, so the kernels work on whole
+ *              vector registers: one converts the raw INA219 registers of a
+ *              reply into readings, the other reduces an array. The kernels
+ *              use NEON when the target has it and plain C otherwise.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef BLOCK_H
+#define BLOCK_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ring.h"
+#include "ina219.h"
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define BLOCK_LEN SPI_BATCH_MAX     /* Samples per block */
+#define BLOCK_ALIGN 16              /* Alignment of the block arrays */
+
+/* *************************
+ * PUBLIC TYPES DEFINITION *
+ * *************************/
+
+/* Consecutive samples of one device */
+typedef struct sample_block{
+    size_t n;
+    uint8_t device;
+    _Alignas(BLOCK_ALIGN) uint64_t timestamp_ns[BLOCK_LEN];
+    _Alignas(BLOCK_ALIGN) float voltage[BLOCK_LEN];
+    _Alignas(BLOCK_ALIGN) float current[BLOCK_LEN];
+    _Alignas(BLOCK_ALIGN) float power[BLOCK_LEN];
+    uint8_t relay[BLOCK_LEN];
+} sample_block;
+
+/* Raw INA219 registers of consecutive samples, see ina219_decode() */
+typedef struct raw_block{
+    size_t n;
+    _Alignas(BLOCK_ALIGN) int16_t shunt[BLOCK_LEN];
+    _Alignas(BLOCK_ALIGN) uint16_t bus[BLOCK_LEN];
+    _Alignas(BLOCK_ALIGN) int16_t current[BLOCK_LEN];
+    _Alignas(BLOCK_ALIGN) uint16_t power[BLOCK_LEN];
+} raw_block;
+
+/* Reduction of one array, relative to a shift */
+typedef struct block_reduction{
+    float sum;                      /* Sum of x - shift */
+    float sumsq;                    /* Sum of (x - shift)^2 */
+    float min;
+    float max;
+} block_reduction;
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+void block_append(sample_block *blk, const sample_record *rec);
+void block_convert(const raw_block *raw, const ina219_scale *s, sample_block *blk);
+void block_reduce(const float *x, size_t n, float shift, block_reduction *out);
+
+#endif /* BLOCK_H */
@@ -0,0 +1,122 @@
+/**
+ * @file    calibrate.c
+ * @brief   SPI clock calibration
+ * @details Steps the SPI clock upward through a table of speeds, checking a
+ *              series of CMD_READ_ALL replies at each step, and keeps the last
+ *              speed at which every reply was intact.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdio.h>
+#include <math.h>
+
+#include "calibrate.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define CALIBRATE_VOLTAGE_MAX 32.0f /* INA219 bus voltage range */
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static int calibrate_valid(const homeoffice_data *data);
+
+/* *************************************
+ * PRIVATE GLOBAL VARIABLES DEFINITION *
+ * *************************************/
+
+/* Speeds tried, in increasing order */
+static const uint32_t gs_calibrate_speeds[] = {
+    100000, 200000, 500000, 1000000, 2000000, 4000000,
+    8000000, 10000000, 16000000, 20000000, 32000000,
+};
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Check that a reading is physically plausible
+ * 
+ * @param data Reading
+ * @return int 1 if plausible, 0 otherwise
+ */
+static int calibrate_valid(const homeoffice_data *data)
+{
+    return isfinite(data->voltage) && isfinite(data->current) && isfinite(data->power)
+        && data->voltage >= 0 && data->voltage <= CALIBRATE_VOLTAGE_MAX
+        && data->relay <= 1;
+}
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Find and apply the highest error-free SPI clock of a device
+ * @details Retries are disabled while calibrating. A reply counts as an
+ *              error when it fails the frame checks of the SPI link (echoed
+ *              command byte, and the CRC when enabled) or its reading is not
+ *              plausible. Stepping stops at the first speed with an error,
+ *              since faster clocks only get worse.
+ * 
+ * @param dev SPI device
+ * @param max_hz Highest speed to try
+ * @param rounds Transfers checked at each speed
+ * @return int 0 on success, -1 if no speed was error-free
+ */
+int calibrate_speed(spi_device *dev, uint32_t max_hz, unsigned int rounds)
+{
+    unsigned int retries = dev->retries;
+    uint32_t best_hz = 0;
+    homeoffice_data data;
+
+    dev->retries = 0;
+
+    for (size_t i = 0; i < sizeof(gs_calibrate_speeds) / sizeof(gs_calibrate_speeds[0]); i++)
+    {
+        uint32_t speed_hz = gs_calibrate_speeds[i];
+        unsigned int errors = 0;
+
+        if (speed_hz > max_hz || spi_set_speed(dev, speed_hz) < 0)
+        {
+            break;
+        }
+
+        for (unsigned int n = 0; n < rounds; n++)
+        {
+            if (spi_command(dev, CMD_READ_ALL, &data, sizeof(data)) < 0 || !calibrate_valid(&data))
+            {
+                errors++;
+            }
+        }
+
+        printf("%s: %8u Hz: %u/%u errors\n", dev->path, speed_hz, errors, rounds);
+
+        if (errors > 0)
+        {
+            break;
+        }
+        best_hz = speed_hz;
+    }
+
+    dev->retries = retries;
+
+    if (best_hz == 0)
+    {
+        fprintf(stderr, "%s: no error-free SPI speed found\n", dev->path);
+        spi_set_speed(dev, SPI_SPEED_HZ);
+        return -1;
+    }
+
+    printf("%s: using %u Hz\n", dev->path, best_hz);
+
+    return spi_set_speed(dev, best_hz);
+}
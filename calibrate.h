@@ -0,0 +1,32 @@
+/**
+ * @file    calibrate.h
+ * @brief   SPI clock calibration
+ * @details Finds the highest SPI clock at which a device answers reliably.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef CALIBRATE_H
+#define CALIBRATE_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdint.h>
+
+#include "spi.h"
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define CALIBRATE_ROUNDS 200        /* Transfers checked at each speed */
+#define CALIBRATE_MAX_HZ 32000000   /* Highest speed tried by default */
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+int calibrate_speed(spi_device *dev, uint32_t max_hz, unsigned int rounds);
+
+#endif /* CALIBRATE_H */
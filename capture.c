@@ -0,0 +1,263 @@
+/**
+ * @file    capture.c
+ * @brief   Memory-mapped capture sink
+ * @details Each capture file is preallocated to its full size with fallocate()
+ *              and mapped shared, so appending a record is a plain store into
+ *              the mapping and never extends the file. Every time a chunk of
+ *              CAPTURE_CHUNK_SIZE bytes is completed it is queued for writeback
+ *              with msync(MS_ASYNC) and released with madvise(MADV_DONTNEED),
+ *              which keeps both the write latency and the resident set flat.
+ *              On rotation the file is truncated to the bytes actually used.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "capture.h"
+#include "record.h"
+#include "timeutil.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define CAPTURE_PATH_MAX 256        /* Capture file name length */
+
+/* **************************
+ * PRIVATE TYPES DEFINITION *
+ * **************************/
+
+/* Capture sink context */
+typedef struct capture_ctx{
+    capture_config cfg;
+    unsigned int seq;               /* Files opened so far */
+
+    /* Current file */
+    int fd;
+    uint8_t *map;
+    size_t size;                    /* Mapped (preallocated) size */
+    size_t used;                    /* Bytes written */
+    size_t flushed;                 /* Bytes already handed to msync */
+    uint32_t count;                 /* Records in the file */
+    uint64_t start_ns;              /* Time of the first record */
+    record_encoder enc;
+    size_t page_size;
+} capture_ctx;
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static int capture_file_open(capture_ctx *cap, uint64_t start_ns);
+static void capture_file_close(capture_ctx *cap);
+static void capture_write(void *ctx, const sample_record *recs, size_t n);
+static void capture_close(void *ctx);
+
+/* *************************************
+ * PRIVATE GLOBAL VARIABLES DEFINITION *
+ * *************************************/
+
+static const sink_ops gs_capture_ops = {
+    .write = capture_write,
+    .close = capture_close,
+};
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Create, preallocate and map the next capture file
+ * 
+ * @param cap Capture context
+ * @param start_ns Time of the first record of the file
+ * @return int 0 on success, -1 on error
+ */
+static int capture_file_open(capture_ctx *cap, uint64_t start_ns)
+{
+    char path[CAPTURE_PATH_MAX];
+    char stamp[32];
+    time_t now = time(NULL);
+    struct tm tm;
+
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime_r(&now, &tm));
+    snprintf(path, sizeof(path), "%s-%s-%03u.bin", cap->cfg.prefix, stamp, cap->seq++);
+
+    cap->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (cap->fd < 0)
+    {
+        perror("Error opening capture file");
+        return -1;
+    }
+
+    cap->size = cap->cfg.rotate_size;
+    if (fallocate(cap->fd, 0, 0, cap->size) < 0)
+    {
+        /* Filesystems without extents support still get a sized file */
+        if ((errno != EOPNOTSUPP && errno != ENOSYS) || ftruncate(cap->fd, cap->size) < 0)
+        {
+            perror("Error preallocating capture file");
+            close(cap->fd);
+            return -1;
+        }
+    }
+
+    cap->map = mmap(NULL, cap->size, PROT_READ | PROT_WRITE, MAP_SHARED, cap->fd, 0);
+    if (cap->map == MAP_FAILED)
+    {
+        perror("Error mapping capture file");
+        close(cap->fd);
+        cap->map = NULL;
+        return -1;
+    }
+    madvise(cap->map, cap->size, MADV_SEQUENTIAL);
+
+    record_header *hdr = (record_header *)cap->map;
+    record_header_init(hdr, cap->cfg.sample_rate, start_ns, &cap->enc);
+
+    cap->used = sizeof(record_header);
+    cap->flushed = 0;
+    cap->count = 0;
+    cap->start_ns = start_ns;
+
+    return 0;
+}
+
+/**
+ * @brief Finish the current capture file
+ * 
+ * @param cap Capture context
+ */
+static void capture_file_close(capture_ctx *cap)
+{
+    if (cap->map == NULL)
+    {
+        return;
+    }
+
+    ((record_header *)cap->map)->count = cap->count;
+
+    msync(cap->map, cap->size, MS_SYNC);
+    munmap(cap->map, cap->size);
+    cap->map = NULL;
+
+    if (ftruncate(cap->fd, cap->used) < 0)
+    {
+        perror("Error truncating capture file");
+    }
+    close(cap->fd);
+    cap->fd = -1;
+}
+
+/**
+ * @brief Store samples into the mapping
+ * 
+ * @param ctx Capture context
+ * @param recs Samples
+ * @param n Number of samples
+ */
+static void capture_write(void *ctx, const sample_record *recs, size_t n)
+{
+    capture_ctx *cap = ctx;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        const sample_record *rec = &recs[i];
+
+        if (cap->map != NULL
+            && (cap->used + sizeof(record_entry) > cap->size
+                || (cap->cfg.rotate_time_ns != 0
+                    && rec->timestamp_ns - cap->start_ns >= cap->cfg.rotate_time_ns)))
+        {
+            capture_file_close(cap);
+        }
+
+        if (cap->map == NULL && capture_file_open(cap, rec->timestamp_ns) < 0)
+        {
+            return;
+        }
+
+        record_encode(&cap->enc, rec, (record_entry *)(cap->map + cap->used));
+        cap->used += sizeof(record_entry);
+        cap->count++;
+
+        if (cap->used - cap->flushed >= CAPTURE_CHUNK_SIZE)
+        {
+            /* Header first, so a crash leaves a readable record count */
+            ((record_header *)cap->map)->count = cap->count;
+
+            size_t end = cap->used & ~((size_t)CAPTURE_CHUNK_SIZE - 1);
+            msync(cap->map + cap->flushed, end - cap->flushed, MS_ASYNC);
+
+            /* The header page is rewritten on every chunk, keep it mapped */
+            size_t start = cap->flushed < cap->page_size ? cap->page_size : cap->flushed;
+            madvise(cap->map + start, end - start, MADV_DONTNEED);
+            cap->flushed = end;
+        }
+    }
+}
+
+/**
+ * @brief Close the capture sink
+ * 
+ * @param ctx Capture context
+ */
+static void capture_close(void *ctx)
+{
+    capture_ctx *cap = ctx;
+
+    capture_file_close(cap);
+    free(cap);
+}
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Open a memory-mapped capture sink
+ * @details Files are named <prefix>-<date>-<time>-<seq>.bin and created when
+ *              the first sample arrives.
+ * 
+ * @param s Sink to set up
+ * @param cfg Capture configuration
+ * @return int 0 on success, -1 on error
+ */
+int capture_open(sink *s, const capture_config *cfg)
+{
+    if (cfg->rotate_size < sizeof(record_header) + CAPTURE_CHUNK_SIZE)
+    {
+        fprintf(stderr, "Capture size limit must be at least %d bytes\n",
+            (int)(sizeof(record_header) + CAPTURE_CHUNK_SIZE));
+        return -1;
+    }
+
+    capture_ctx *cap = calloc(1, sizeof(capture_ctx));
+    if (cap == NULL)
+    {
+        return -1;
+    }
+
+    cap->cfg = *cfg;
+    cap->fd = -1;
+    cap->page_size = sysconf(_SC_PAGESIZE);
+
+    s->name = "capture";
+    s->ops = &gs_capture_ops;
+    s->ctx = cap;
+
+    return 0;
+}
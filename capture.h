@@ -0,0 +1,46 @@
+/**
+ * @file    capture.h
+ * @brief   Memory-mapped capture sink
+ * @details Writes the sample stream as binary capture files (see record.h)
+ *              through a shared mapping of a preallocated file, rotating to a
+ *              new file when a size or time limit is reached.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdint.h>
+
+#include "sink.h"
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define CAPTURE_SIZE_DEFAULT (64 * 1024 * 1024) /* Default file size limit */
+#define CAPTURE_CHUNK_SIZE (1024 * 1024)        /* Flush granularity */
+
+/* *************************
+ * PUBLIC TYPES DEFINITION *
+ * *************************/
+
+/* Capture configuration */
+typedef struct capture_config{
+    const char *prefix;             /* File name prefix */
+    uint64_t rotate_size;           /* File size limit in bytes */
+    uint64_t rotate_time_ns;        /* File duration limit, 0 for none */
+    double sample_rate;             /* Nominal sampling rate, stored in the header */
+} capture_config;
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+int capture_open(sink *s, const capture_config *cfg);
+
+#endif /* CAPTURE_H */
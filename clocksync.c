@@ -0,0 +1,165 @@
+/**
+ * @file    clocksync.c
+ * @brief   Device clock correlation
+ * @details The device reads its tick counter somewhere inside the host time
+ *              bracket of the transfer, so every bracket is one noisy
+ *              observation of the mapping, with an error bounded by its width.
+ *              Brackets stretched by preemption or bus contention are the
+ *              least accurate, so the fit only uses those no wider than twice
+ *              the narrowest one in the window, as NTP does with its
+ *              minimum-delay filter. The remaining points are fitted by least
+ *              squares, which gives both the offset and the drift of the
+ *              device oscillator.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <string.h>
+#include <math.h>
+
+#include "clocksync.h"
+#include "timeutil.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define CLOCKSYNC_WIDTH_FACTOR 2    /* Widest bracket used, relative to the narrowest */
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static void clocksync_fit(clocksync *cs);
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Fit the model to the narrow brackets of the window
+ * @details The sums are taken relative to the newest point, so they stay
+ *              small enough for doubles to keep nanosecond resolution.
+ * 
+ * @param cs Correlation
+ */
+static void clocksync_fit(clocksync *cs)
+{
+    const clocksync_point *ref = &cs->points[(cs->next + CLOCKSYNC_POINTS - 1) % CLOCKSYNC_POINTS];
+    uint64_t min_width = UINT64_MAX;
+    double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+
+    for (size_t i = 0; i < cs->npoints; i++)
+    {
+        if (cs->points[i].width_ns < min_width)
+        {
+            min_width = cs->points[i].width_ns;
+        }
+    }
+
+    for (size_t i = 0; i < cs->npoints; i++)
+    {
+        const clocksync_point *p = &cs->points[i];
+
+        if (p->width_ns > min_width * CLOCKSYNC_WIDTH_FACTOR)
+        {
+            continue;
+        }
+        double x = (double)(int64_t)(p->tick - ref->tick);
+        double y = (double)(int64_t)(p->mid_ns - ref->mid_ns);
+
+        n++;
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+
+    double det = n * sxx - sx * sx;
+    double slope = det > 0 ? (n * sxy - sx * sy) / det : NSEC_PER_SEC / cs->tick_hz;
+    double intercept = (sy - slope * sx) / n;
+
+    cs->base_tick = ref->tick;
+    cs->base_ns = ref->mid_ns + (int64_t)llround(intercept);
+    cs->ns_per_tick = slope;
+    cs->fitted = n >= 2;
+}
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Initialize the correlation of a device clock
+ * 
+ * @param cs Correlation
+ * @param tick_hz Nominal tick rate
+ * @param tick_mask Largest counter value, one less than a power of two
+ */
+void clocksync_init(clocksync *cs, double tick_hz, uint32_t tick_mask)
+{
+    memset(cs, 0, sizeof(clocksync));
+    cs->tick_hz = tick_hz;
+    cs->tick_mask = tick_mask;
+    cs->ns_per_tick = NSEC_PER_SEC / tick_hz;
+}
+
+/**
+ * @brief Add the tick read in a transfer and refit the model
+ * @details The counter is unwrapped against the previous transfer, so the
+ *              device must be read at least once per wrap-around period.
+ * 
+ * @param cs Correlation
+ * @param raw_tick Counter value of the reply
+ * @param start_ns CLOCK_MONOTONIC time before the transfer
+ * @param end_ns CLOCK_MONOTONIC time after the transfer
+ * @return uint64_t Unwrapped tick
+ */
+uint64_t clocksync_add(clocksync *cs, uint32_t raw_tick, uint64_t start_ns, uint64_t end_ns)
+{
+    clocksync_point *p = &cs->points[cs->next];
+
+    cs->tick = cs->started ? cs->tick + ((raw_tick - cs->last_raw) & cs->tick_mask) : (raw_tick & cs->tick_mask);
+    cs->last_raw = raw_tick;
+    cs->started = 1;
+
+    p->tick = cs->tick;
+    p->mid_ns = start_ns + (end_ns - start_ns) / 2;
+    p->width_ns = end_ns - start_ns;
+    cs->next = (cs->next + 1) % CLOCKSYNC_POINTS;
+    if (cs->npoints < CLOCKSYNC_POINTS)
+    {
+        cs->npoints++;
+    }
+
+    if (cs->npoints >= CLOCKSYNC_MIN_POINTS)
+    {
+        clocksync_fit(cs);
+    }
+
+    return cs->tick;
+}
+
+/**
+ * @brief Map a device tick to host time
+ * @details Before the model is fitted, the middle of the last bracket is
+ *              used as the reference at the nominal rate.
+ * 
+ * @param cs Correlation
+ * @param tick Unwrapped tick
+ * @return uint64_t CLOCK_MONOTONIC time in nanoseconds
+ */
+uint64_t clocksync_host_ns(const clocksync *cs, uint64_t tick)
+{
+    if (!cs->fitted)
+    {
+        const clocksync_point *last = &cs->points[(cs->next + CLOCKSYNC_POINTS - 1) % CLOCKSYNC_POINTS];
+
+        return last->mid_ns + (int64_t)llround((double)(int64_t)(tick - last->tick) * NSEC_PER_SEC / cs->tick_hz);
+    }
+
+    return cs->base_ns + (int64_t)llround((double)(int64_t)(tick - cs->base_tick) * cs->ns_per_tick);
+}
@@ -0,0 +1,65 @@
+/**
+ * @file    clocksync.h
+ * @brief   Device clock correlation
+ * @details Maps the tick counter a device puts in its replies onto host
+ *              CLOCK_MONOTONIC time, with a linear model of offset and rate
+ *              fitted to the host time brackets of recent transfers.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef CLOCKSYNC_H
+#define CLOCKSYNC_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define CLOCKSYNC_POINTS 64         /* Transfers the model is fitted to */
+#define CLOCKSYNC_MIN_POINTS 8      /* Transfers needed before the model is used */
+
+/* *************************
+ * PUBLIC TYPES DEFINITION *
+ * *************************/
+
+/* Host time bracket of one transfer */
+typedef struct clocksync_point{
+    uint64_t tick;                  /* Unwrapped device tick */
+    uint64_t mid_ns;                /* Middle of the bracket */
+    uint64_t width_ns;              /* Bracket width */
+} clocksync_point;
+
+/* Correlation of one device clock */
+typedef struct clocksync{
+    double tick_hz;                 /* Nominal tick rate */
+    uint32_t tick_mask;             /* Wrap-around of the device counter */
+    uint32_t last_raw;
+    uint64_t tick;                  /* Unwrapped tick of the last transfer */
+    int started;
+
+    clocksync_point points[CLOCKSYNC_POINTS];
+    size_t npoints;
+    size_t next;
+
+    /* host_ns = base_ns + (tick - base_tick) * ns_per_tick */
+    uint64_t base_tick;
+    uint64_t base_ns;
+    double ns_per_tick;
+    int fitted;
+} clocksync;
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+void clocksync_init(clocksync *cs, double tick_hz, uint32_t tick_mask);
+uint64_t clocksync_add(clocksync *cs, uint32_t raw_tick, uint64_t start_ns, uint64_t end_ns);
+uint64_t clocksync_host_ns(const clocksync *cs, uint64_t tick);
+
+#endif /* CLOCKSYNC_H */
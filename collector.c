@@ -0,0 +1,806 @@
+/**
+ * @file    collector.c
+ * @brief   Multi-node collector
+ * @details Every node is a non-blocking TCP connection polled from a single
+ *              thread. Its records are timed on CLOCK_REALTIME with the wall
+ *              clock offset of its stream header and pushed into a bounded
+ *              reorder buffer, a min-heap, since the records of devices read
+ *              by different threads arrive slightly out of order. A second
+ *              heap holds the nodes by their oldest buffered record, so the
+ *              k-way merge takes the oldest record of the whole site in
+ *              O(log k). A record is merged once it is older than the newest
+ *              record of every live node minus the reorder window; a node
+ *              silent for COLLECTOR_STALL_NS longer than the window stops
+ *              holding the merge back, and a full reorder buffer forces the
+ *              merge ahead. Records older than the last merged one are
+ *              dropped and counted as late, so the output is always in time
+ *              order. The nodes' clocks are expected to be synchronized,
+ *              e.g. with NTP.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#include "collector.h"
+#include "record.h"
+#include "stats.h"
+#include "timeutil.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define COLLECTOR_REORDER_MAX 4096  /* Records buffered per node */
+#define COLLECTOR_READ_MAX 16384    /* Receive buffer of a node */
+#define COLLECTOR_POLL_MS 50        /* Longest wait for the nodes between merges */
+#define COLLECTOR_STALL_NS (2 * NSEC_PER_SEC) /* Silence beyond the reorder window after which a node is not waited for */
+#define COLLECTOR_BACKOFF_MIN_NS (500 * NSEC_PER_MSEC) /* First reconnection delay */
+#define COLLECTOR_BACKOFF_MAX_NS (30 * NSEC_PER_SEC) /* Longest reconnection delay */
+#define COLLECTOR_ADDR_MAX 256      /* Node address string length */
+#define COLLECTOR_NOT_QUEUED ((size_t)-1) /* Position of a node with no buffered record */
+
+#define COLLECTOR_NODE_DOWN 0       /* Waiting to reconnect */
+#define COLLECTOR_NODE_CONNECTING 1 /* Connection in progress */
+#define COLLECTOR_NODE_UP 2         /* Receiving the stream */
+
+/* **************************
+ * PRIVATE TYPES DEFINITION *
+ * **************************/
+
+/* Record of a node */
+typedef struct collector_sample{
+    uint64_t time_ns;               /* CLOCK_REALTIME time */
+    record_entry entry;
+} collector_sample;
+
+/* Node streaming its records */
+typedef struct collector_node{
+    const char *addr;
+    int fd;
+    int state;                      /* COLLECTOR_NODE_* */
+    uint64_t rx_ns;                 /* Last data received, CLOCK_MONOTONIC */
+    uint64_t retry_ns;              /* Next connection attempt, CLOCK_MONOTONIC */
+    uint64_t backoff_ns;            /* Delay before the one after */
+
+    /* Stream decoding */
+    uint8_t buf[COLLECTOR_READ_MAX]; /* Bytes received and not decoded yet */
+    size_t len;
+    int has_header;
+    record_header hdr;
+    int64_t time_us;                /* Time of the last record, on the node's CLOCK_MONOTONIC */
+
+    /* Reorder buffer */
+    collector_sample *reorder;      /* Min-heap of the records not merged yet */
+    size_t n;
+    size_t pos;                     /* Position in the merge heap, COLLECTOR_NOT_QUEUED when empty */
+    uint64_t newest_ns;             /* Newest record of the current connection */
+    int has_newest;
+
+    /* Rollup of the current interval, per device */
+    double power_sum[SPI_DEVICES_MAX];
+    unsigned long samples[SPI_DEVICES_MAX];
+    stats_energy energy[SPI_DEVICES_MAX];
+
+    /* Statistics */
+    uint64_t records;
+    uint64_t late;                  /* Records dropped behind the merge */
+    unsigned int connects;
+} collector_node;
+
+/* Collector state */
+typedef struct collector{
+    const collector_config *cfg;
+    FILE *out;
+    collector_node *nodes;
+    size_t nnodes;
+    collector_node *heap[COLLECTOR_NODES_MAX]; /* Nodes with buffered records, by their oldest */
+    size_t nheap;
+    unsigned long merged;           /* Records merged */
+    uint64_t merged_ns;             /* Time of the last merged record */
+    uint64_t forced;                /* Records merged early by a full reorder buffer */
+    uint64_t bucket_ns;             /* Start of the rollup interval */
+    int has_bucket;
+} collector;
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static void collector_reorder_push(collector_node *node, const collector_sample *s);
+static void collector_reorder_pop(collector_node *node, collector_sample *s);
+static int collector_heap_less(const collector *c, size_t i, size_t j);
+static void collector_heap_swap(collector *c, size_t i, size_t j);
+static void collector_heap_sift(collector *c, size_t i);
+static void collector_heap_update(collector *c, collector_node *node);
+static int collector_done(const collector *c);
+static void collector_rollup_write(collector *c);
+static void collector_emit(collector *c, collector_node *node, const collector_sample *s);
+static void collector_merge_one(collector *c);
+static void collector_merge(collector *c, uint64_t now_ns, int flush);
+static void collector_push(collector *c, collector_node *node, collector_sample *s);
+static int collector_parse(collector *c, collector_node *node);
+static void collector_drop(collector_node *node, uint64_t now_ns, const char *reason);
+static void collector_connect(collector_node *node, uint64_t now_ns);
+static void collector_connected(collector_node *node, uint64_t now_ns);
+static void collector_read(collector *c, collector_node *node, uint64_t now_ns);
+
+/* *************************************
+ * PRIVATE GLOBAL VARIABLES DEFINITION *
+ * *************************************/
+
+static atomic_int gs_collector_stop; /* Set to stop the collector */
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Add a record to the reorder buffer of a node
+ * 
+ * @param node Node, with room in its buffer
+ * @param s Record
+ */
+static void collector_reorder_push(collector_node *node, const collector_sample *s)
+{
+    collector_sample *heap = node->reorder;
+    size_t i = node->n++;
+
+    while (i > 0 && s->time_ns < heap[(i - 1) / 2].time_ns)
+    {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = *s;
+}
+
+/**
+ * @brief Take the oldest record out of the reorder buffer of a node
+ * 
+ * @param node Node, with at least one buffered record
+ * @param s Filled with the record
+ */
+static void collector_reorder_pop(collector_node *node, collector_sample *s)
+{
+    collector_sample *heap = node->reorder;
+    collector_sample last = heap[--node->n];
+    size_t i = 0;
+
+    *s = heap[0];
+    for (;;)
+    {
+        size_t child = 2 * i + 1;
+
+        if (child >= node->n)
+        {
+            break;
+        }
+        if (child + 1 < node->n && heap[child + 1].time_ns < heap[child].time_ns)
+        {
+            child++;
+        }
+        if (last.time_ns <= heap[child].time_ns)
+        {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+}
+
+/**
+ * @brief Compare two nodes of the merge heap by their oldest record
+ * @details Ties go to the node listed first, so equal times merge in a
+ *              stable order.
+ * 
+ * @param c Collector
+ * @param i Position of the first node
+ * @param j Position of the second node
+ * @return int 1 if the first node comes first, 0 otherwise
+ */
+static int collector_heap_less(const collector *c, size_t i, size_t j)
+{
+    const collector_node *a = c->heap[i];
+    const collector_node *b = c->heap[j];
+
+    if (a->reorder[0].time_ns != b->reorder[0].time_ns)
+    {
+        return a->reorder[0].time_ns < b->reorder[0].time_ns;
+    }
+
+    return a < b;
+}
+
+/**
+ * @brief Swap two nodes of the merge heap
+ * 
+ * @param c Collector
+ * @param i Position of the first node
+ * @param j Position of the second node
+ */
+static void collector_heap_swap(collector *c, size_t i, size_t j)
+{
+    collector_node *tmp = c->heap[i];
+
+    c->heap[i] = c->heap[j];
+    c->heap[j] = tmp;
+    c->heap[i]->pos = i;
+    c->heap[j]->pos = j;
+}
+
+/**
+ * @brief Restore the merge heap around a node whose oldest record changed
+ * 
+ * @param c Collector
+ * @param i Position of the node
+ */
+static void collector_heap_sift(collector *c, size_t i)
+{
+    while (i > 0 && collector_heap_less(c, i, (i - 1) / 2))
+    {
+        collector_heap_swap(c, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+
+    for (;;)
+    {
+        size_t child = 2 * i + 1;
+
+        if (child >= c->nheap)
+        {
+            break;
+        }
+        if (child + 1 < c->nheap && collector_heap_less(c, child + 1, child))
+        {
+            child++;
+        }
+        if (!collector_heap_less(c, child, i))
+        {
+            break;
+        }
+        collector_heap_swap(c, i, child);
+        i = child;
+    }
+}
+
+/**
+ * @brief Requeue a node in the merge heap after its reorder buffer changed
+ * 
+ * @param c Collector
+ * @param node Node
+ */
+static void collector_heap_update(collector *c, collector_node *node)
+{
+    if (node->n == 0)
+    {
+        if (node->pos != COLLECTOR_NOT_QUEUED)
+        {
+            size_t pos = node->pos;
+
+            collector_heap_swap(c, pos, --c->nheap);
+            node->pos = COLLECTOR_NOT_QUEUED;
+            if (pos < c->nheap)
+            {
+                collector_heap_sift(c, pos);
+            }
+        }
+        return;
+    }
+
+    if (node->pos == COLLECTOR_NOT_QUEUED)
+    {
+        node->pos = c->nheap;
+        c->heap[c->nheap++] = node;
+    }
+    collector_heap_sift(c, node->pos);
+}
+
+/**
+ * @brief Tell whether the requested number of records is merged
+ * 
+ * @param c Collector
+ * @return int 1 when done, 0 otherwise
+ */
+static int collector_done(const collector *c)
+{
+    return c->cfg->count > 0 && c->merged >= c->cfg->count;
+}
+
+/**
+ * @brief Write the rollup of the current interval and start the next one
+ * @details The site power is the sum of the mean power of every device that
+ *              reported in the interval; the energy is the total since
+ *              startup.
+ * 
+ * @param c Collector
+ */
+static void collector_rollup_write(collector *c)
+{
+    size_t nodes = 0;
+    size_t devices = 0;
+    unsigned long samples = 0;
+    double power = 0;
+    double energy_wh = 0;
+
+    for (size_t i = 0; i < c->nnodes; i++)
+    {
+        collector_node *node = &c->nodes[i];
+        size_t seen = devices;
+
+        for (size_t d = 0; d < SPI_DEVICES_MAX; d++)
+        {
+            energy_wh += stats_energy_wh(&node->energy[d]);
+            if (node->samples[d] == 0)
+            {
+                continue;
+            }
+            power += node->power_sum[d] / node->samples[d];
+            samples += node->samples[d];
+            devices++;
+            node->power_sum[d] = 0;
+            node->samples[d] = 0;
+        }
+        nodes += devices > seen;
+    }
+
+    fprintf(c->out, "%.3f,%zu,%zu,%lu,%.6f,%.6f\n", (double)c->bucket_ns / NSEC_PER_SEC,
+        nodes, devices, samples, power, energy_wh);
+}
+
+/**
+ * @brief Write a merged record, or add it to the rollup
+ * 
+ * @param c Collector
+ * @param node Node of the record
+ * @param s Record
+ */
+static void collector_emit(collector *c, collector_node *node, const collector_sample *s)
+{
+    const record_entry *e = &s->entry;
+
+    if (collector_done(c))
+    {
+        return;
+    }
+    c->merged++;
+    c->merged_ns = s->time_ns;
+
+    if (c->cfg->rollup_ns == 0)
+    {
+        fprintf(c->out, "%.6f,%s,%d,%.4f,%.6f,%.6f,%d\n", (double)s->time_ns / NSEC_PER_SEC, node->addr,
+            e->device, e->voltage, e->current, e->power, e->flags & RECORD_FLAG_RELAY ? 1 : 0);
+        return;
+    }
+
+    uint64_t bucket_ns = s->time_ns / c->cfg->rollup_ns * c->cfg->rollup_ns;
+    if (c->has_bucket && bucket_ns != c->bucket_ns)
+    {
+        collector_rollup_write(c);
+    }
+    c->bucket_ns = bucket_ns;
+    c->has_bucket = 1;
+
+    if (e->device < SPI_DEVICES_MAX)
+    {
+        stats_energy *energy = &node->energy[e->device];
+
+        /* Keep the energy of a device across an outage, but do not integrate the gap */
+        if (energy->started && s->time_ns - energy->last_ns > c->cfg->lateness_ns + COLLECTOR_STALL_NS)
+        {
+            energy->started = 0;
+        }
+        node->power_sum[e->device] += e->power;
+        node->samples[e->device]++;
+        stats_energy_update(energy, s->time_ns, e->power);
+    }
+}
+
+/**
+ * @brief Merge the oldest buffered record of the site
+ * 
+ * @param c Collector, with at least one buffered record
+ */
+static void collector_merge_one(collector *c)
+{
+    collector_node *node = c->heap[0];
+    collector_sample s;
+
+    collector_reorder_pop(node, &s);
+    collector_heap_update(c, node);
+    collector_emit(c, node, &s);
+}
+
+/**
+ * @brief Merge the records no live node can still precede
+ * 
+ * @param c Collector
+ * @param now_ns CLOCK_MONOTONIC time
+ * @param flush Merge every buffered record
+ */
+static void collector_merge(collector *c, uint64_t now_ns, int flush)
+{
+    uint64_t watermark_ns = UINT64_MAX;
+
+    for (size_t i = 0; i < c->nnodes && !flush; i++)
+    {
+        const collector_node *node = &c->nodes[i];
+
+        if (node->state == COLLECTOR_NODE_UP && node->has_newest
+            && now_ns - node->rx_ns < c->cfg->lateness_ns + COLLECTOR_STALL_NS)
+        {
+            uint64_t bound_ns = node->newest_ns > c->cfg->lateness_ns ? node->newest_ns - c->cfg->lateness_ns : 0;
+            watermark_ns = bound_ns < watermark_ns ? bound_ns : watermark_ns;
+        }
+    }
+
+    while (c->nheap > 0 && c->heap[0]->reorder[0].time_ns <= watermark_ns && !collector_done(c))
+    {
+        collector_merge_one(c);
+    }
+}
+
+/**
+ * @brief Buffer a record of a node
+ * 
+ * @param c Collector
+ * @param node Node
+ * @param s Record
+ */
+static void collector_push(collector *c, collector_node *node, collector_sample *s)
+{
+    node->records++;
+    if (c->merged > 0 && s->time_ns < c->merged_ns)
+    {
+        node->late++;
+        return;
+    }
+
+    if (!node->has_newest || s->time_ns > node->newest_ns)
+    {
+        node->newest_ns = s->time_ns;
+        node->has_newest = 1;
+    }
+
+    while (node->n == COLLECTOR_REORDER_MAX)
+    {
+        c->forced += !collector_done(c);
+        collector_merge_one(c);
+    }
+    collector_reorder_push(node, s);
+    collector_heap_update(c, node);
+}
+
+/**
+ * @brief Decode the received bytes of a node
+ * 
+ * @param c Collector
+ * @param node Node
+ * @return int 0 on success, -1 if the stream is not a record stream
+ */
+static int collector_parse(collector *c, collector_node *node)
+{
+    size_t off = 0;
+
+    if (!node->has_header)
+    {
+        if (node->len < sizeof(record_header))
+        {
+            return 0;
+        }
+
+        memcpy(&node->hdr, node->buf, sizeof(record_header));
+        if (memcmp(node->hdr.magic, RECORD_MAGIC, sizeof(node->hdr.magic)) != 0
+            || node->hdr.version != RECORD_VERSION || node->hdr.record_size != sizeof(record_entry))
+        {
+            return -1;
+        }
+
+        node->has_header = 1;
+        node->time_us = node->hdr.start_ns / NSEC_PER_USEC;
+        node->backoff_ns = COLLECTOR_BACKOFF_MIN_NS;
+        off = sizeof(record_header);
+        fprintf(stderr, "%s: connected\n", node->addr);
+    }
+
+    while (node->len - off >= sizeof(record_entry))
+    {
+        collector_sample s;
+
+        memcpy(&s.entry, node->buf + off, sizeof(record_entry));
+        off += sizeof(record_entry);
+        node->time_us += s.entry.delta_us;
+        s.time_ns = (uint64_t)(node->time_us * (int64_t)NSEC_PER_USEC + node->hdr.realtime_offset_ns);
+        collector_push(c, node, &s);
+    }
+
+    memmove(node->buf, node->buf + off, node->len - off);
+    node->len -= off;
+
+    return 0;
+}
+
+/**
+ * @brief Close the connection of a node and schedule the next attempt
+ * @details Only the first failure after a working stream is reported.
+ * 
+ * @param node Node
+ * @param now_ns CLOCK_MONOTONIC time
+ * @param reason Cause of the failure
+ */
+static void collector_drop(collector_node *node, uint64_t now_ns, const char *reason)
+{
+    if (node->backoff_ns == COLLECTOR_BACKOFF_MIN_NS)
+    {
+        fprintf(stderr, "%s: %s, reconnecting\n", node->addr, reason);
+    }
+    if (node->fd >= 0)
+    {
+        close(node->fd);
+        node->fd = -1;
+    }
+
+    node->state = COLLECTOR_NODE_DOWN;
+    node->has_header = 0;
+    node->has_newest = 0;
+    node->len = 0;
+    node->retry_ns = now_ns + node->backoff_ns;
+    node->backoff_ns = node->backoff_ns * 2 < COLLECTOR_BACKOFF_MAX_NS ? node->backoff_ns * 2 : COLLECTOR_BACKOFF_MAX_NS;
+}
+
+/**
+ * @brief Start connecting to a node
+ * 
+ * @param node Node, not connected
+ * @param now_ns CLOCK_MONOTONIC time
+ */
+static void collector_connect(collector_node *node, uint64_t now_ns)
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *ai;
+    char host[COLLECTOR_ADDR_MAX];
+    char *port;
+    int err;
+
+    snprintf(host, sizeof(host), "%s", node->addr);
+    port = strrchr(host, ':');
+    *port++ = '\0';
+
+    err = getaddrinfo(host, port, &hints, &ai);
+    if (err != 0)
+    {
+        collector_drop(node, now_ns, gai_strerror(err));
+        return;
+    }
+
+    node->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+    if (node->fd < 0 || (connect(node->fd, ai->ai_addr, ai->ai_addrlen) < 0 && errno != EINPROGRESS))
+    {
+        err = errno;
+        freeaddrinfo(ai);
+        collector_drop(node, now_ns, strerror(err));
+        return;
+    }
+    freeaddrinfo(ai);
+
+    node->state = COLLECTOR_NODE_CONNECTING;
+}
+
+/**
+ * @brief Complete the connection to a node
+ * 
+ * @param node Node, connecting
+ * @param now_ns CLOCK_MONOTONIC time
+ */
+static void collector_connected(collector_node *node, uint64_t now_ns)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(node->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+    {
+        err = errno;
+    }
+    if (err != 0)
+    {
+        collector_drop(node, now_ns, strerror(err));
+        return;
+    }
+
+    node->state = COLLECTOR_NODE_UP;
+    node->rx_ns = now_ns;
+    node->connects++;
+}
+
+/**
+ * @brief Receive and decode the stream of a node
+ * 
+ * @param c Collector
+ * @param node Node, connected
+ * @param now_ns CLOCK_MONOTONIC time
+ */
+static void collector_read(collector *c, collector_node *node, uint64_t now_ns)
+{
+    ssize_t n = recv(node->fd, node->buf + node->len, sizeof(node->buf) - node->len, 0);
+
+    if (n > 0)
+    {
+        node->len += n;
+        node->rx_ns = now_ns;
+        if (collector_parse(c, node) < 0)
+        {
+            collector_drop(node, now_ns, "not a record stream of this version");
+        }
+    }
+    else if (n == 0)
+    {
+        collector_drop(node, now_ns, "connection closed");
+    }
+    else if (errno != EAGAIN && errno != EINTR)
+    {
+        collector_drop(node, now_ns, strerror(errno));
+    }
+}
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Merge the record streams of the nodes until stopped
+ * @details The merged stream is written as CSV, one line per record with the
+ *              wall clock time and the node address; the rollup as one line
+ *              per interval with the site totals. Per-node statistics are
+ *              printed on stderr at the end.
+ * 
+ * @param cfg Configuration
+ * @param out Output
+ * @return int 0 on success, -1 on error
+ */
+int collector_run(const collector_config *cfg, FILE *out)
+{
+    collector c = { .cfg = cfg, .out = out, .nnodes = cfg->nnodes };
+    struct pollfd fds[COLLECTOR_NODES_MAX];
+    collector_node *polled[COLLECTOR_NODES_MAX];
+    int ret = 0;
+
+    for (size_t i = 0; i < cfg->nnodes; i++)
+    {
+        const char *port = strrchr(cfg->nodes[i], ':');
+
+        if (port == NULL || port == cfg->nodes[i] || port[1] == '\0' || strlen(cfg->nodes[i]) >= COLLECTOR_ADDR_MAX)
+        {
+            fprintf(stderr, "Invalid node address: %s\n", cfg->nodes[i]);
+            return -1;
+        }
+    }
+
+    c.nodes = calloc(cfg->nnodes, sizeof(collector_node));
+    if (c.nodes == NULL)
+    {
+        perror("Error allocating the nodes");
+        return -1;
+    }
+    for (size_t i = 0; i < cfg->nnodes; i++)
+    {
+        collector_node *node = &c.nodes[i];
+
+        node->addr = cfg->nodes[i];
+        node->fd = -1;
+        node->pos = COLLECTOR_NOT_QUEUED;
+        node->backoff_ns = COLLECTOR_BACKOFF_MIN_NS;
+        node->reorder = malloc(COLLECTOR_REORDER_MAX * sizeof(collector_sample));
+        if (node->reorder == NULL)
+        {
+            perror("Error allocating the reorder buffers");
+            ret = -1;
+            break;
+        }
+    }
+
+    if (cfg->rollup_ns == 0)
+    {
+        fprintf(out, "time_s,node,device,voltage_v,current_a,power_w,relay\n");
+    }
+    else
+    {
+        fprintf(out, "time_s,nodes,devices,samples,power_w,energy_wh\n");
+    }
+
+    atomic_store(&gs_collector_stop, 0);
+    while (ret == 0 && !atomic_load(&gs_collector_stop) && !collector_done(&c))
+    {
+        uint64_t now_ns = time_now_ns(CLOCK_MONOTONIC);
+        nfds_t nfds = 0;
+
+        for (size_t i = 0; i < c.nnodes; i++)
+        {
+            collector_node *node = &c.nodes[i];
+
+            if (node->state == COLLECTOR_NODE_DOWN && now_ns >= node->retry_ns)
+            {
+                collector_connect(node, now_ns);
+            }
+            if (node->state != COLLECTOR_NODE_DOWN)
+            {
+                fds[nfds].fd = node->fd;
+                fds[nfds].events = node->state == COLLECTOR_NODE_UP ? POLLIN : POLLOUT;
+                polled[nfds++] = node;
+            }
+        }
+
+        int n = poll(fds, nfds, COLLECTOR_POLL_MS);
+        if (n < 0 && errno != EINTR)
+        {
+            perror("Error polling the nodes");
+            ret = -1;
+            break;
+        }
+
+        now_ns = time_now_ns(CLOCK_MONOTONIC);
+        for (nfds_t i = 0; i < nfds && n > 0; i++)
+        {
+            if (fds[i].revents == 0)
+            {
+                continue;
+            }
+            if (polled[i]->state == COLLECTOR_NODE_CONNECTING)
+            {
+                collector_connected(polled[i], now_ns);
+            }
+            else
+            {
+                collector_read(&c, polled[i], now_ns);
+            }
+        }
+
+        collector_merge(&c, now_ns, 0);
+        fflush(out);
+    }
+
+    collector_merge(&c, time_now_ns(CLOCK_MONOTONIC), 1);
+    if (c.has_bucket)
+    {
+        collector_rollup_write(&c);
+    }
+    fflush(out);
+
+    for (size_t i = 0; i < c.nnodes; i++)
+    {
+        collector_node *node = &c.nodes[i];
+
+        fprintf(stderr, "%s: records %llu, late %llu, connections %u\n", node->addr,
+            (unsigned long long)node->records, (unsigned long long)node->late, node->connects);
+        if (node->fd >= 0)
+        {
+            close(node->fd);
+        }
+        free(node->reorder);
+    }
+    fprintf(stderr, "Merged: %lu, merged early by a full reorder buffer: %llu\n", c.merged,
+        (unsigned long long)c.forced);
+    free(c.nodes);
+
+    return ret;
+}
+
+/**
+ * @brief Ask the collector to stop (async-signal-safe)
+ * 
+ */
+void collector_stop()
+{
+    atomic_store(&gs_collector_stop, 1);
+}
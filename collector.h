@@ -0,0 +1,50 @@
+/**
+ * @file    collector.h
+ * @brief   Multi-node collector
+ * @details Collector mode connects to the TCP record streams (--listen) of
+ *              many nodes and merges them on CLOCK_REALTIME into one stream
+ *              in time order, or into a site-wide rollup of the power and
+ *              energy of every device of every node. Nodes are reconnected
+ *              with a backoff when their stream breaks.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef COLLECTOR_H
+#define COLLECTOR_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define COLLECTOR_NODES_MAX 64      /* Maximum nodes merged */
+#define COLLECTOR_LATENESS_DEFAULT_MS 250 /* Default reorder window */
+
+/* *************************
+ * PUBLIC TYPES DEFINITION *
+ * *************************/
+
+/* Collector configuration */
+typedef struct collector_config{
+    const char *nodes[COLLECTOR_NODES_MAX]; /* Record streams as "<host>:<port>" */
+    size_t nnodes;
+    uint64_t lateness_ns;           /* Reorder window: how far a node's records may arrive out of order */
+    uint64_t rollup_ns;             /* Rollup interval, 0 for the merged stream */
+    unsigned long count;            /* Merged samples after which to stop, 0 to run until stopped */
+} collector_config;
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+int collector_run(const collector_config *cfg, FILE *out);
+void collector_stop();
+
+#endif /* COLLECTOR_H */
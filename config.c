@@ -0,0 +1,144 @@
+/**
+ * @file    config.c
+ * @brief   Configuration file
+ * @details The file is read whole and split in place, so the values handed
+ *              to the setting handler point into the returned text and stay
+ *              valid until the caller frees it.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "config.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define CONFIG_SIZE_MAX (64 * 1024) /* Largest accepted configuration file */
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static char *config_trim(char *s);
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Strip leading and trailing blanks in place
+ * 
+ * @param s String
+ * @return char* Start of the stripped string
+ */
+static char *config_trim(char *s)
+{
+    char *end = s + strlen(s);
+
+    while (isspace((unsigned char)*s))
+    {
+        s++;
+    }
+    while (end > s && isspace((unsigned char)end[-1]))
+    {
+        *--end = '\0';
+    }
+
+    return s;
+}
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Read a configuration file
+ * 
+ * @param path Configuration file
+ * @param options Long options the setting names are looked up in
+ * @param apply Called with the option code and value of every setting
+ * @param ctx Handler context
+ * @param text Set to the file text the values point into, to be freed by the caller
+ * @return int 0 on success, -1 on error
+ */
+int config_read(const char *path, const struct option *options, config_apply_fn apply, void *ctx, char **text)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        perror("Error opening configuration file");
+        return -1;
+    }
+
+    char *buf = malloc(CONFIG_SIZE_MAX + 1);
+    if (buf == NULL)
+    {
+        fclose(fp);
+        return -1;
+    }
+    size_t len = fread(buf, 1, CONFIG_SIZE_MAX + 1, fp);
+    fclose(fp);
+    if (len > CONFIG_SIZE_MAX)
+    {
+        fprintf(stderr, "%s: configuration file too large\n", path);
+        free(buf);
+        return -1;
+    }
+    buf[len] = '\0';
+
+    int lineno = 0;
+    char *next = buf;
+    while (next != NULL)
+    {
+        char *line = next;
+
+        next = strchr(line, '\n');
+        if (next != NULL)
+        {
+            *next++ = '\0';
+        }
+        lineno++;
+
+        line = config_trim(line);
+        if (*line == '\0' || *line == '#')
+        {
+            continue;
+        }
+
+        char *value = strchr(line, '=');
+        if (value != NULL)
+        {
+            *value++ = '\0';
+            value = config_trim(value);
+        }
+        char *name = config_trim(line);
+
+        const struct option *opt;
+        for (opt = options; opt->name != NULL && strcmp(opt->name, name) != 0; opt++);
+
+        if (opt->name == NULL || (opt->has_arg == required_argument) != (value != NULL))
+        {
+            fprintf(stderr, "%s:%d: invalid setting \"%s\"\n", path, lineno, name);
+            free(buf);
+            return -1;
+        }
+        if (apply(ctx, opt->val, value) < 0)
+        {
+            fprintf(stderr, "%s:%d: in setting \"%s\"\n", path, lineno, name);
+            free(buf);
+            return -1;
+        }
+    }
+
+    *text = buf;
+    return 0;
+}
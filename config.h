@@ -0,0 +1,33 @@
+/**
+ * @file    config.h
+ * @brief   Configuration file
+ * @details The configuration file holds one "name = value" setting per line,
+ *              named after the long command line options, with blank lines and
+ *              lines starting with '#' ignored. Options without an argument
+ *              are given as a bare name.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <getopt.h>
+
+/* *************************
+ * PUBLIC TYPES DEFINITION *
+ * *************************/
+
+/* Setting handler, returns 0 if the setting was applied, -1 otherwise */
+typedef int (*config_apply_fn)(void *ctx, int opt, const char *arg);
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+int config_read(const char *path, const struct option *options, config_apply_fn apply, void *ctx, char **text);
+
+#endif /* CONFIG_H */
@@ -0,0 +1,1005 @@
+/**
+ * @file    control.c
+ * @brief   Local control socket
+ * @details The sink thread publishes the latest sample of every device under
+ *              a sequence lock; a control thread serves the clients from an
+ *              epoll set and reads those samples without ever waiting for the
+ *              sink. Requests are text lines answered with one "OK ..." or
+ *              "ERR ..." line each, so a client can pipeline them. A relay
+ *              command takes the device lock for one SPI request, between two
+ *              sampler reads. Relay changes seen in the sample stream are
+ *              queued by the sink thread and signalled on an eventfd in the
+ *              same epoll set, so watchers are told within one sink cycle
+ *              instead of polling GET RELAY.
+ * 
+ *              PING                        OK PONG
+ *              GET ALL [dev]               OK <voltage> <current> <power> <relay>
+ *              GET VOLTAGE|CURRENT|POWER|RELAY [dev]
+ *                                          OK <value>
+ *              SET RELAY ON|OFF [dev]      OK <relay>
+ *              SUBSCRIBE <rate>[hz] [dev]  OK, then at that rate
+ *                                          DATA <time> <dev> <voltage> <current> <power> <relay>
+ *              UNSUBSCRIBE                 OK
+ *              WATCH [dev]                 OK, then on every relay change
+ *                                          EVENT <time> <dev> RELAY <relay>
+ *                                          EVENT <time> <dev> OVERFLOW <n>
+ *              UNWATCH                     OK
+ *              TRACE ON|OFF                OK, switches the tracepoints (needs --trace)
+ *              QUIT                        OK, then the server hangs up
+ * 
+ *              A device is given by its index or its path, the first one by
+ *              default. DATA lines a client does not read in time are dropped;
+ *              EVENT lines are not, a watcher that falls behind is
+ *              disconnected instead. Relay changes that overflow the queue
+ *              of the control thread are reported in an OVERFLOW line with
+ *              their count, followed by a RELAY line with the latest state.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "control.h"
+#include "timeutil.h"
+#include "trace.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define CONTROL_INPUT_MAX 1024      /* Buffered request bytes per client */
+#define CONTROL_REPLY_MAX 4096      /* Reply bytes gathered before a send */
+#define CONTROL_LINE_MAX 160        /* Longest reply line */
+#define CONTROL_EPOLL_EVENTS 16     /* Events taken from the epoll set at once */
+#define CONTROL_POLL_MS 200         /* Stop flag check interval */
+#define CONTROL_RATE_MAX 1000.0     /* Highest subscription rate in Hz */
+#define CONTROL_LISTEN_BACKLOG 8    /* Pending connections */
+#define CONTROL_DEVICE_ALL -1       /* Subscription to every device */
+#define CONTROL_EVENTS_MAX 256      /* Relay changes queued for the control thread */
+
+/* **************************
+ * PRIVATE TYPES DEFINITION *
+ * **************************/
+
+/* Latest sample of a device */
+typedef struct control_latest{
+    atomic_uint seq;                /* Odd while being updated, 0 before the first sample */
+    uint64_t timestamp_ns;
+    homeoffice_data data;
+} control_latest;
+
+/* Connected client */
+typedef struct control_client{
+    int fd;
+    char input[CONTROL_INPUT_MAX];
+    size_t len;
+    char reply[CONTROL_REPLY_MAX];
+    size_t reply_len;
+    int quit;
+    uint64_t period_ns;             /* Subscription period, 0 if not subscribed */
+    uint64_t next_ns;
+    int device;                     /* Subscribed device or CONTROL_DEVICE_ALL */
+    int watching;                   /* Relay changes are sent to the client */
+    int watch_device;               /* Watched device or CONTROL_DEVICE_ALL */
+} control_client;
+
+/* Control sink context */
+typedef struct control_ctx{
+    control_config cfg;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    control_latest latest[SPI_DEVICES_MAX];
+
+    /* Relay changes, from the sink thread to the control thread */
+    int relay_known[SPI_DEVICES_MAX];
+    uint8_t relay[SPI_DEVICES_MAX]; /* Last relay state seen by the sink thread */
+    ring events;
+    _Atomic uint32_t overflows[SPI_DEVICES_MAX]; /* Changes dropped on a full queue, per device */
+    int event_fd;
+    unsigned long overflow_total;   /* Dropped changes reported by the control thread */
+
+    /* Control thread */
+    int listen_fd;
+    int epoll_fd;
+    control_client clients[CONTROL_CLIENTS_MAX];
+    size_t nclients;
+    pthread_t thread;
+    atomic_int stop;
+} control_ctx;
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static void control_publish(control_latest *l, const sample_record *rec);
+static int control_latest_get(control_latest *l, uint64_t *timestamp_ns, homeoffice_data *data);
+static void control_printf(control_client *c, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static int control_send(control_client *c, int droppable);
+static int control_device(control_ctx *ctl, const char *arg);
+static void control_get(control_ctx *ctl, control_client *c, const char *what, const char *arg);
+static void control_set(control_ctx *ctl, control_client *c, const char *what, const char *state, const char *arg);
+static void control_subscribe(control_ctx *ctl, control_client *c, const char *rate, const char *arg, uint64_t now_ns);
+static void control_watch(control_ctx *ctl, control_client *c, const char *arg);
+static void control_request(control_ctx *ctl, control_client *c, char *line, uint64_t now_ns);
+static void control_client_add(control_ctx *ctl, int fd);
+static void control_client_remove(control_ctx *ctl, size_t i);
+static int control_client_read(control_ctx *ctl, control_client *c);
+static int control_serve_data(control_ctx *ctl, uint64_t now_ns);
+static void control_serve_events(control_ctx *ctl);
+static void *control_thread(void *arg);
+static void control_write(void *ctx, const sample_record *recs, size_t n);
+static void control_flush(void *ctx);
+static void control_close(void *ctx);
+
+/* *************************************
+ * PRIVATE GLOBAL VARIABLES DEFINITION *
+ * *************************************/
+
+static const sink_ops gs_control_ops = {
+    .write = control_write,
+    .flush = control_flush,
+    .close = control_close,
+};
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Publish the latest sample of a device
+ * 
+ * @param l Latest sample slot, written by the sink thread only
+ * @param rec Sample
+ */
+static void control_publish(control_latest *l, const sample_record *rec)
+{
+    unsigned int seq = atomic_load_explicit(&l->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&l->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    l->timestamp_ns = rec->timestamp_ns;
+    l->data = rec->data;
+    atomic_store_explicit(&l->seq, seq + 2, memory_order_release);
+}
+
+/**
+ * @brief Read the latest sample of a device
+ * @details Retries while the sink thread is updating it.
+ * 
+ * @param l Latest sample slot
+ * @param timestamp_ns Sample time
+ * @param data Sample
+ * @return int 0 on success, -1 if no sample was taken yet
+ */
+static int control_latest_get(control_latest *l, uint64_t *timestamp_ns, homeoffice_data *data)
+{
+    unsigned int seq;
+
+    do
+    {
+        seq = atomic_load_explicit(&l->seq, memory_order_acquire);
+        if (seq == 0)
+        {
+            return -1;
+        }
+        *timestamp_ns = l->timestamp_ns;
+        *data = l->data;
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || atomic_load_explicit(&l->seq, memory_order_relaxed) != seq);
+
+    return 0;
+}
+
+/**
+ * @brief Append a reply line to the client output
+ * @details A line that does not fit is dropped.
+ * 
+ * @param c Client
+ * @param fmt printf format
+ */
+static void control_printf(control_client *c, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(c->reply + c->reply_len, CONTROL_REPLY_MAX - c->reply_len, fmt, ap);
+    va_end(ap);
+
+    if (n > 0 && (size_t)n < CONTROL_REPLY_MAX - c->reply_len)
+    {
+        c->reply_len += n;
+    }
+}
+
+/**
+ * @brief Send the client output
+ * @details Replies never wait for the client: one that can not take them
+ *              whole is disconnected. Subscription data is droppable and is
+ *              discarded instead when the socket buffer is full.
+ * 
+ * @param c Client
+ * @param droppable Whether the output may be dropped
+ * @return int 0 on success, -1 if the client must be disconnected
+ */
+static int control_send(control_client *c, int droppable)
+{
+    size_t len = c->reply_len;
+    ssize_t n;
+
+    c->reply_len = 0;
+    if (len == 0)
+    {
+        return 0;
+    }
+
+    do
+    {
+        n = send(c->fd, c->reply, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0 && droppable && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return 0;
+    }
+
+    return (size_t)n == len ? 0 : -1;
+}
+
+/**
+ * @brief Find the device named in a request
+ * 
+ * @param ctl Control context
+ * @param arg Device index or path, NULL for the first device
+ * @return int Device index, or -1 if there is no such device
+ */
+static int control_device(control_ctx *ctl, const char *arg)
+{
+    char *end;
+    long index;
+
+    if (arg == NULL)
+    {
+        return 0;
+    }
+
+    index = strtol(arg, &end, 10);
+    if (end != arg && *end == '\0')
+    {
+        return index >= 0 && (size_t)index < ctl->cfg.ndevices ? (int)index : -1;
+    }
+    for (size_t d = 0; d < ctl->cfg.ndevices; d++)
+    {
+        if (strcmp(ctl->cfg.devices[d].path, arg) == 0)
+        {
+            return d;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Answer a GET request from the latest sample
+ * 
+ * @param ctl Control context
+ * @param c Client
+ * @param what Quantity
+ * @param arg Device
+ */
+static void control_get(control_ctx *ctl, control_client *c, const char *what, const char *arg)
+{
+    int d = control_device(ctl, arg);
+    homeoffice_data data;
+    uint64_t timestamp_ns;
+
+    if (what == NULL)
+    {
+        control_printf(c, "ERR missing quantity\n");
+    }
+    else if (d < 0)
+    {
+        control_printf(c, "ERR no such device\n");
+    }
+    else if (control_latest_get(&ctl->latest[d], &timestamp_ns, &data) < 0)
+    {
+        control_printf(c, "ERR no sample yet\n");
+    }
+    else if (strcasecmp(what, "ALL") == 0)
+    {
+        control_printf(c, "OK %.6g %.6g %.6g %u\n", data.voltage, data.current, data.power, data.relay);
+    }
+    else if (strcasecmp(what, "VOLTAGE") == 0)
+    {
+        control_printf(c, "OK %.6g\n", data.voltage);
+    }
+    else if (strcasecmp(what, "CURRENT") == 0)
+    {
+        control_printf(c, "OK %.6g\n", data.current);
+    }
+    else if (strcasecmp(what, "POWER") == 0)
+    {
+        control_printf(c, "OK %.6g\n", data.power);
+    }
+    else if (strcasecmp(what, "RELAY") == 0)
+    {
+        control_printf(c, "OK %u\n", data.relay);
+    }
+    else
+    {
+        control_printf(c, "ERR unknown quantity\n");
+    }
+}
+
+/**
+ * @brief Answer a SET request
+ * 
+ * @param ctl Control context
+ * @param c Client
+ * @param what Setting, only RELAY
+ * @param state ON or OFF
+ * @param arg Device
+ */
+static void control_set(control_ctx *ctl, control_client *c, const char *what, const char *state, const char *arg)
+{
+    int d = control_device(ctl, arg);
+    uint8_t relay;
+    uint8_t cmd;
+
+    if (what == NULL || strcasecmp(what, "RELAY") != 0)
+    {
+        control_printf(c, "ERR unknown setting\n");
+        return;
+    }
+    if (state != NULL && strcasecmp(state, "ON") == 0)
+    {
+        cmd = CMD_SET_RELAY_ON;
+    }
+    else if (state != NULL && strcasecmp(state, "OFF") == 0)
+    {
+        cmd = CMD_SET_RELAY_OFF;
+    }
+    else
+    {
+        control_printf(c, "ERR expected ON or OFF\n");
+        return;
+    }
+    if (d < 0)
+    {
+        control_printf(c, "ERR no such device\n");
+        return;
+    }
+
+    if (spi_command(&ctl->cfg.devices[d], cmd, &relay, sizeof(relay)) < 0)
+    {
+        control_printf(c, "ERR SPI request failed\n");
+        return;
+    }
+    control_printf(c, "OK %u\n", relay);
+}
+
+/**
+ * @brief Answer a SUBSCRIBE request
+ * 
+ * @param ctl Control context
+ * @param c Client
+ * @param rate Rate in Hz, with an optional "hz" suffix
+ * @param arg Device, every device if NULL
+ * @param now_ns Current CLOCK_MONOTONIC time
+ */
+static void control_subscribe(control_ctx *ctl, control_client *c, const char *rate, const char *arg, uint64_t now_ns)
+{
+    int d = arg != NULL ? control_device(ctl, arg) : CONTROL_DEVICE_ALL;
+    char *end;
+    double hz = rate != NULL ? strtod(rate, &end) : 0;
+
+    if (rate == NULL || end == rate || (*end != '\0' && strcasecmp(end, "hz") != 0)
+        || !(hz > 0) || hz > CONTROL_RATE_MAX)
+    {
+        control_printf(c, "ERR rate must be between 0 and %g Hz\n", CONTROL_RATE_MAX);
+        return;
+    }
+    if (arg != NULL && d < 0)
+    {
+        control_printf(c, "ERR no such device\n");
+        return;
+    }
+
+    c->period_ns = NSEC_PER_SEC / hz;
+    c->next_ns = now_ns + c->period_ns;
+    c->device = d;
+    control_printf(c, "OK\n");
+}
+
+/**
+ * @brief Answer a WATCH request
+ * 
+ * @param ctl Control context
+ * @param c Client
+ * @param arg Device, every device if NULL
+ */
+static void control_watch(control_ctx *ctl, control_client *c, const char *arg)
+{
+    int d = arg != NULL ? control_device(ctl, arg) : CONTROL_DEVICE_ALL;
+
+    if (arg != NULL && d < 0)
+    {
+        control_printf(c, "ERR no such device\n");
+        return;
+    }
+
+    c->watching = 1;
+    c->watch_device = d;
+    control_printf(c, "OK\n");
+}
+
+/**
+ * @brief Answer one request line
+ * 
+ * @param ctl Control context
+ * @param c Client
+ * @param line Request, modified by the parsing
+ * @param now_ns Current CLOCK_MONOTONIC time
+ */
+static void control_request(control_ctx *ctl, control_client *c, char *line, uint64_t now_ns)
+{
+    char *save;
+    char *cmd = strtok_r(line, " \t\r", &save);
+    char *arg1 = strtok_r(NULL, " \t\r", &save);
+    char *arg2 = strtok_r(NULL, " \t\r", &save);
+    char *arg3 = strtok_r(NULL, " \t\r", &save);
+
+    if (cmd == NULL)
+    {
+        return;
+    }
+
+    if (strcasecmp(cmd, "PING") == 0)
+    {
+        control_printf(c, "OK PONG\n");
+    }
+    else if (strcasecmp(cmd, "GET") == 0)
+    {
+        control_get(ctl, c, arg1, arg2);
+    }
+    else if (strcasecmp(cmd, "SET") == 0)
+    {
+        control_set(ctl, c, arg1, arg2, arg3);
+    }
+    else if (strcasecmp(cmd, "SUBSCRIBE") == 0)
+    {
+        control_subscribe(ctl, c, arg1, arg2, now_ns);
+    }
+    else if (strcasecmp(cmd, "UNSUBSCRIBE") == 0)
+    {
+        c->period_ns = 0;
+        control_printf(c, "OK\n");
+    }
+    else if (strcasecmp(cmd, "WATCH") == 0)
+    {
+        control_watch(ctl, c, arg1);
+    }
+    else if (strcasecmp(cmd, "UNWATCH") == 0)
+    {
+        c->watching = 0;
+        control_printf(c, "OK\n");
+    }
+    else if (strcasecmp(cmd, "TRACE") == 0 && arg1 != NULL
+        && (strcasecmp(arg1, "ON") == 0 || strcasecmp(arg1, "OFF") == 0))
+    {
+        if (trace_set(strcasecmp(arg1, "ON") == 0) < 0)
+        {
+            control_printf(c, "ERR tracing needs --trace\n");
+        }
+        else
+        {
+            control_printf(c, "OK\n");
+        }
+    }
+    else if (strcasecmp(cmd, "QUIT") == 0)
+    {
+        c->quit = 1;
+        control_printf(c, "OK\n");
+    }
+    else
+    {
+        control_printf(c, "ERR unknown command\n");
+    }
+}
+
+/**
+ * @brief Add an accepted client
+ * 
+ * @param ctl Control context
+ * @param fd Client socket
+ */
+static void control_client_add(control_ctx *ctl, int fd)
+{
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.fd = fd };
+    control_client *c;
+
+    if (ctl->nclients == CONTROL_CLIENTS_MAX || epoll_ctl(ctl->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        close(fd);
+        return;
+    }
+
+    c = &ctl->clients[ctl->nclients++];
+    memset(c, 0, sizeof(control_client));
+    c->fd = fd;
+}
+
+/**
+ * @brief Disconnect a client
+ * 
+ * @param ctl Control context
+ * @param i Index of the client
+ */
+static void control_client_remove(control_ctx *ctl, size_t i)
+{
+    close(ctl->clients[i].fd);
+    ctl->clients[i] = ctl->clients[--ctl->nclients];
+}
+
+/**
+ * @brief Read the requests of a client and answer the complete lines
+ * 
+ * @param ctl Control context
+ * @param c Client
+ * @return int 0 on success, -1 if the client must be disconnected
+ */
+static int control_client_read(control_ctx *ctl, control_client *c)
+{
+    ssize_t n = recv(c->fd, c->input + c->len, CONTROL_INPUT_MAX - c->len, 0);
+    uint64_t now_ns = time_now_ns(CLOCK_MONOTONIC);
+    char *line = c->input;
+    char *end;
+
+    if (n <= 0)
+    {
+        return n < 0 && (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+    c->len += n;
+
+    while (!c->quit && (end = memchr(line, '\n', c->input + c->len - line)) != NULL)
+    {
+        *end = '\0';
+        control_request(ctl, c, line, now_ns);
+        line = end + 1;
+        if (c->reply_len > CONTROL_REPLY_MAX - CONTROL_LINE_MAX && control_send(c, 0) < 0)
+        {
+            return -1;
+        }
+    }
+
+    c->len -= line - c->input;
+    memmove(c->input, line, c->len);
+    if (c->len == CONTROL_INPUT_MAX)
+    {
+        c->len = 0;
+        control_printf(c, "ERR line too long\n");
+    }
+
+    return control_send(c, 0) < 0 || c->quit ? -1 : 0;
+}
+
+/**
+ * @brief Send the subscription data that is due
+ * 
+ * @param ctl Control context
+ * @param now_ns Current CLOCK_MONOTONIC time
+ * @return int Milliseconds until the next subscription is due, at most CONTROL_POLL_MS
+ */
+static int control_serve_data(control_ctx *ctl, uint64_t now_ns)
+{
+    uint64_t wait_ns = CONTROL_POLL_MS * NSEC_PER_MSEC;
+
+    for (size_t i = 0; i < ctl->nclients; )
+    {
+        control_client *c = &ctl->clients[i];
+
+        if (c->period_ns != 0 && now_ns >= c->next_ns)
+        {
+            for (size_t d = 0; d < ctl->cfg.ndevices; d++)
+            {
+                homeoffice_data data;
+                uint64_t timestamp_ns;
+
+                if ((c->device == CONTROL_DEVICE_ALL || (size_t)c->device == d)
+                    && control_latest_get(&ctl->latest[d], &timestamp_ns, &data) == 0)
+                {
+                    control_printf(c, "DATA %.6f %zu %.6g %.6g %.6g %u\n", (double)timestamp_ns / NSEC_PER_SEC,
+                        d, data.voltage, data.current, data.power, data.relay);
+                }
+            }
+
+            /* Periods missed while the client was busy are skipped */
+            c->next_ns += c->period_ns;
+            if (c->next_ns <= now_ns)
+            {
+                c->next_ns = now_ns + c->period_ns;
+            }
+            if (control_send(c, 1) < 0)
+            {
+                control_client_remove(ctl, i);
+                continue;
+            }
+        }
+        if (c->period_ns != 0)
+        {
+            uint64_t due_ns = c->next_ns > now_ns ? c->next_ns - now_ns : 0;
+
+            if (due_ns < wait_ns)
+            {
+                wait_ns = due_ns;
+            }
+        }
+        i++;
+    }
+
+    return (wait_ns + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+}
+
+/**
+ * @brief Send the queued relay changes to the watchers
+ * @details Changes dropped on a full queue are reported after the queued
+ *              ones, with the latest state of the device, so a watcher ends
+ *              up with the right relay state.
+ * 
+ * @param ctl Control context
+ */
+static void control_serve_events(control_ctx *ctl)
+{
+    sample_record events[CONTROL_EVENTS_MAX];
+    uint32_t lost[SPI_DEVICES_MAX];
+    uint64_t timestamp_ns[SPI_DEVICES_MAX];
+    homeoffice_data data[SPI_DEVICES_MAX];
+    int overflow = 0;
+    uint64_t signalled;
+    size_t n;
+
+    if (read(ctl->event_fd, &signalled, sizeof(signalled)) < 0 && errno != EAGAIN)
+    {
+        return;
+    }
+
+    while ((n = ring_pop(&ctl->events, events, CONTROL_EVENTS_MAX)) > 0)
+    {
+        for (size_t i = 0; i < ctl->nclients; )
+        {
+            control_client *c = &ctl->clients[i];
+
+            if (c->watching)
+            {
+                for (size_t k = 0; k < n; k++)
+                {
+                    if (c->watch_device == CONTROL_DEVICE_ALL || c->watch_device == events[k].device)
+                    {
+                        control_printf(c, "EVENT %.6f %u RELAY %u\n", (double)events[k].timestamp_ns / NSEC_PER_SEC,
+                            events[k].device, events[k].data.relay);
+                    }
+                }
+                if (control_send(c, 0) < 0)
+                {
+                    control_client_remove(ctl, i);
+                    continue;
+                }
+            }
+            i++;
+        }
+    }
+
+    for (size_t d = 0; d < SPI_DEVICES_MAX; d++)
+    {
+        lost[d] = atomic_exchange_explicit(&ctl->overflows[d], 0, memory_order_relaxed);
+        if (lost[d] > 0 && control_latest_get(&ctl->latest[d], &timestamp_ns[d], &data[d]) == 0)
+        {
+            ctl->overflow_total += lost[d];
+            overflow = 1;
+        }
+        else
+        {
+            lost[d] = 0;
+        }
+    }
+    if (!overflow)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < ctl->nclients; )
+    {
+        control_client *c = &ctl->clients[i];
+
+        if (c->watching)
+        {
+            for (size_t d = 0; d < SPI_DEVICES_MAX; d++)
+            {
+                if (lost[d] > 0 && (c->watch_device == CONTROL_DEVICE_ALL || c->watch_device == (int)d))
+                {
+                    control_printf(c, "EVENT %.6f %zu OVERFLOW %u\n", (double)timestamp_ns[d] / NSEC_PER_SEC, d, lost[d]);
+                    control_printf(c, "EVENT %.6f %zu RELAY %u\n", (double)timestamp_ns[d] / NSEC_PER_SEC, d, data[d].relay);
+                }
+            }
+            if (control_send(c, 0) < 0)
+            {
+                control_client_remove(ctl, i);
+                continue;
+            }
+        }
+        i++;
+    }
+}
+
+/**
+ * @brief Control server thread
+ * 
+ * @param arg Control context
+ * @return void* NULL
+ */
+static void *control_thread(void *arg)
+{
+    control_ctx *ctl = arg;
+    struct epoll_event events[CONTROL_EPOLL_EVENTS];
+    int timeout_ms = CONTROL_POLL_MS;
+
+    while (!atomic_load(&ctl->stop))
+    {
+        int n = epoll_wait(ctl->epoll_fd, events, CONTROL_EPOLL_EVENTS, timeout_ms);
+
+        for (int e = 0; e < n; e++)
+        {
+            int fd = events[e].data.fd;
+
+            if (fd == ctl->listen_fd)
+            {
+                int client;
+
+                while ((client = accept4(ctl->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                {
+                    control_client_add(ctl, client);
+                }
+                continue;
+            }
+            if (fd == ctl->event_fd)
+            {
+                control_serve_events(ctl);
+                continue;
+            }
+            for (size_t i = 0; i < ctl->nclients; i++)
+            {
+                if (ctl->clients[i].fd != fd)
+                {
+                    continue;
+                }
+                if (control_client_read(ctl, &ctl->clients[i]) < 0)
+                {
+                    control_client_remove(ctl, i);
+                }
+                break;
+            }
+        }
+
+        timeout_ms = control_serve_data(ctl, time_now_ns(CLOCK_MONOTONIC));
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Publish the last sample of every device in a batch and queue its relay changes
+ * @details The first sample of a device only sets the known state. The
+ *              control thread is woken once per batch with changes; a change
+ *              that does not fit in the queue is counted instead, see
+ *              control_serve_events().
+ * 
+ * @param ctx Control context
+ * @param recs Samples
+ * @param n Number of samples
+ */
+static void control_write(void *ctx, const sample_record *recs, size_t n)
+{
+    control_ctx *ctl = ctx;
+    const sample_record *last[SPI_DEVICES_MAX] = {0};
+    int changed = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        uint8_t d = recs[i].device;
+
+        if (d >= SPI_DEVICES_MAX)
+        {
+            continue;
+        }
+        last[d] = &recs[i];
+        if (ctl->relay_known[d] && ctl->relay[d] != recs[i].data.relay)
+        {
+            sample_record *ev = ring_reserve(&ctl->events);
+
+            if (ev != NULL)
+            {
+                *ev = recs[i];
+                ring_commit(&ctl->events);
+            }
+            else
+            {
+                atomic_fetch_add_explicit(&ctl->overflows[d], 1, memory_order_relaxed);
+            }
+            changed = 1;
+        }
+        ctl->relay[d] = recs[i].data.relay;
+        ctl->relay_known[d] = 1;
+    }
+    for (size_t d = 0; d < SPI_DEVICES_MAX; d++)
+    {
+        if (last[d] != NULL)
+        {
+            control_publish(&ctl->latest[d], last[d]);
+        }
+    }
+    if (changed)
+    {
+        uint64_t one = 1;
+
+        if (write(ctl->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        {
+            perror("Error signalling the control thread");
+        }
+    }
+}
+
+/**
+ * @brief Nothing to flush, clients are served by the control thread
+ * 
+ * @param ctx Control context
+ */
+static void control_flush(void *ctx)
+{
+    (void)ctx;
+}
+
+/**
+ * @brief Stop the control server and remove the socket
+ * 
+ * @param ctx Control context
+ */
+static void control_close(void *ctx)
+{
+    control_ctx *ctl = ctx;
+
+    atomic_store(&ctl->stop, 1);
+    pthread_join(ctl->thread, NULL);
+    if (ctl->overflow_total > 0)
+    {
+        fprintf(stderr, "Control: %lu relay changes dropped on a full event queue\n", ctl->overflow_total);
+    }
+    while (ctl->nclients > 0)
+    {
+        control_client_remove(ctl, 0);
+    }
+    ring_free(&ctl->events);
+    close(ctl->event_fd);
+    close(ctl->epoll_fd);
+    close(ctl->listen_fd);
+    unlink(ctl->path);
+    free(ctl);
+}
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Open a control socket sink
+ * @details A socket left at the path by an earlier run is replaced; any
+ *              other file there is an error. The socket is accessible to the
+ *              owner and the group only.
+ * 
+ * @param s Sink to set up
+ * @param cfg Configuration
+ * @return int 0 on success, -1 on error
+ */
+int control_open(sink *s, const control_config *cfg)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct epoll_event ev = { .events = EPOLLIN };
+    struct epoll_event event_ev = { .events = EPOLLIN };
+    struct stat st;
+
+    if (strlen(cfg->path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Control socket path too long: %s\n", cfg->path);
+        return -1;
+    }
+    if (lstat(cfg->path, &st) == 0 && !S_ISSOCK(st.st_mode))
+    {
+        fprintf(stderr, "Control socket path is not a socket: %s\n", cfg->path);
+        return -1;
+    }
+
+    control_ctx *ctl = calloc(1, sizeof(control_ctx));
+    if (ctl == NULL)
+    {
+        return -1;
+    }
+    ctl->cfg = *cfg;
+    strcpy(ctl->path, cfg->path);
+    strcpy(addr.sun_path, cfg->path);
+
+    ctl->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ctl->listen_fd < 0)
+    {
+        perror("Error opening control socket");
+        free(ctl);
+        return -1;
+    }
+    unlink(ctl->path);
+    if (bind(ctl->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || chmod(ctl->path, 0660) < 0
+        || listen(ctl->listen_fd, CONTROL_LISTEN_BACKLOG) < 0)
+    {
+        perror("Error listening on the control socket");
+        close(ctl->listen_fd);
+        free(ctl);
+        return -1;
+    }
+
+    ctl->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    ctl->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev.data.fd = ctl->listen_fd;
+    event_ev.data.fd = ctl->event_fd;
+    if (ctl->epoll_fd < 0 || ctl->event_fd < 0
+        || epoll_ctl(ctl->epoll_fd, EPOLL_CTL_ADD, ctl->listen_fd, &ev) < 0
+        || epoll_ctl(ctl->epoll_fd, EPOLL_CTL_ADD, ctl->event_fd, &event_ev) < 0)
+    {
+        perror("Error setting up epoll");
+        if (ctl->epoll_fd >= 0)
+        {
+            close(ctl->epoll_fd);
+        }
+        if (ctl->event_fd >= 0)
+        {
+            close(ctl->event_fd);
+        }
+        close(ctl->listen_fd);
+        unlink(ctl->path);
+        free(ctl);
+        return -1;
+    }
+
+    if (ring_init(&ctl->events, CONTROL_EVENTS_MAX) < 0
+        || pthread_create(&ctl->thread, NULL, control_thread, ctl) != 0)
+    {
+        fprintf(stderr, "Error starting control thread\n");
+        ring_free(&ctl->events);
+        close(ctl->event_fd);
+        close(ctl->epoll_fd);
+        close(ctl->listen_fd);
+        unlink(ctl->path);
+        free(ctl);
+        return -1;
+    }
+
+    s->name = "control";
+    s->ops = &gs_control_ops;
+    s->ctx = ctl;
+
+    return 0;
+}
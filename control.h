@@ -0,0 +1,46 @@
+/**
+ * @file    control.h
+ * @brief   Local control socket
+ * @details Line protocol on a Unix domain socket, so scripts read the devices
+ *              and switch the relay through the running process instead of
+ *              starting a new one per request. Reads are answered from the
+ *              latest sample, relay commands share the device with the
+ *              sampler.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include "sink.h"
+#include "spi.h"
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define CONTROL_PATH_DEFAULT "/var/run/homeoffice.sock" /* Default socket path */
+#define CONTROL_CLIENTS_MAX 32      /* Maximum connected clients */
+
+/* *************************
+ * PUBLIC TYPES DEFINITION *
+ * *************************/
+
+/* Control socket configuration */
+typedef struct control_config{
+    const char *path;               /* Socket path */
+    spi_device *devices;            /* Sampled devices, addressed by index */
+    size_t ndevices;
+} control_config;
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+int control_open(sink *s, const control_config *cfg);
+
+#endif /* CONTROL_H */
@@ -0,0 +1,142 @@
+/**
+ * @file    daemon.c
+ * @brief   Background service support
+ * @details The pidfile is locked before the devices are set up, so a running
+ *              instance is reported on the terminal before its bus is touched,
+ *              and rewritten with the final pid once detached. The lock is
+ *              held by the open descriptor until exit. The working directory
+ *              is kept, so relative paths given on the command line or in the
+ *              configuration file still resolve after detaching and on a
+ *              reload.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/file.h>
+
+#include "daemon.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define DAEMON_PID_MAX 16           /* Length of the pidfile contents */
+#define DAEMON_PATH_MAX 256         /* Pidfile path length */
+
+/* *************************************
+ * PRIVATE GLOBAL VARIABLES DEFINITION *
+ * *************************************/
+
+static int gs_daemon_pidfd = -1; /* Locked pidfile */
+static char gs_daemon_pidfile[DAEMON_PATH_MAX]; /* Pidfile path, removed on exit */
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Lock the pidfile, failing if another instance holds it
+ * 
+ * @param pidfile Pidfile path
+ * @return int 0 on success, -1 on error
+ */
+int daemon_lock(const char *pidfile)
+{
+    snprintf(gs_daemon_pidfile, sizeof(gs_daemon_pidfile), "%s", pidfile);
+    gs_daemon_pidfd = open(pidfile, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (gs_daemon_pidfd < 0)
+    {
+        perror("Error opening pidfile");
+        return -1;
+    }
+    if (flock(gs_daemon_pidfd, LOCK_EX | LOCK_NB) < 0)
+    {
+        if (errno == EWOULDBLOCK)
+        {
+            fprintf(stderr, "Already running, see %s\n", pidfile);
+        }
+        else
+        {
+            perror("Error locking pidfile");
+        }
+        close(gs_daemon_pidfd);
+        gs_daemon_pidfd = -1;
+        return -1;
+    }
+
+    /* Also remove it when setting up fails with exit() */
+    atexit(daemon_stop);
+
+    return 0;
+}
+
+/**
+ * @brief Detach from the terminal and write the pidfile locked by daemon_lock()
+ * 
+ * @param logfile File receiving stdout and stderr, NULL to discard them
+ * @return int 0 on success, -1 on error
+ */
+int daemon_detach(const char *logfile)
+{
+    char pid[DAEMON_PID_MAX];
+
+    int out = open(logfile != NULL ? logfile : "/dev/null", O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (out < 0)
+    {
+        perror("Error opening log file");
+        return -1;
+    }
+
+    /* The lock is inherited by the child through the shared descriptor */
+    if (daemon(1, 1) < 0)
+    {
+        perror("Error detaching");
+        close(out);
+        return -1;
+    }
+
+    int in = open("/dev/null", O_RDONLY);
+    if (in >= 0)
+    {
+        dup2(in, STDIN_FILENO);
+        close(in);
+    }
+    dup2(out, STDOUT_FILENO);
+    dup2(out, STDERR_FILENO);
+    close(out);
+    setvbuf(stderr, NULL, _IOLBF, 0);
+
+    int len = snprintf(pid, sizeof(pid), "%ld\n", (long)getpid());
+    if (ftruncate(gs_daemon_pidfd, 0) < 0 || pwrite(gs_daemon_pidfd, pid, len, 0) != len)
+    {
+        perror("Error writing pidfile");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Remove the pidfile locked by daemon_lock()
+ * 
+ */
+void daemon_stop()
+{
+    if (gs_daemon_pidfd >= 0)
+    {
+        unlink(gs_daemon_pidfile);
+        close(gs_daemon_pidfd);
+        gs_daemon_pidfd = -1;
+    }
+}
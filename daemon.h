@@ -0,0 +1,26 @@
+/**
+ * @file    daemon.h
+ * @brief   Background service support
+ * @details Detaches the process from its terminal and keeps a locked pidfile
+ *              for the init script, so a second instance refuses to start.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define DAEMON_PIDFILE_DEFAULT "/var/run/homeoffice.pid" /* Default pidfile */
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+int daemon_lock(const char *pidfile);
+int daemon_detach(const char *logfile);
+void daemon_stop();
+
+#endif /* DAEMON_H */
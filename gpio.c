@@ -0,0 +1,153 @@
+/**
+ * @file    gpio.c
+ * @brief   GPIO interrupt lines
+ * @details Lines are requested with the v2 uAPI as inputs with edge
+ *              detection. The kernel queues the edges on the returned file
+ *              descriptor, which becomes readable for poll() and epoll, so a
+ *              thread can wait for a line and a deadline at once.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+#include "gpio.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define GPIO_EVENTS_READ 16         /* Edge events taken from the line at once */
+#define GPIO_DEV_PREFIX "/dev/"     /* Directory of chips given by name */
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Request a GPIO line as an interrupt input
+ * @details The line is given as "<chip>:<line>[:rising|falling|both]",
+ *              where the chip is a path or a name under /dev such as
+ *              gpiochip0 and the line its offset in the chip. Both edges are
+ *              detected by default.
+ * 
+ * @param spec Line
+ * @return int Non-blocking line file descriptor, -1 on error
+ */
+int gpio_irq_open(const char *spec)
+{
+    struct gpio_v2_line_request req;
+    char path[PATH_MAX];
+    char buf[PATH_MAX];
+    char *colon, *end;
+    uint64_t edges = GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    unsigned long line;
+    int chip;
+
+    if (strlen(spec) >= sizeof(buf))
+    {
+        fprintf(stderr, "Invalid GPIO line: %s\n", spec);
+        return -1;
+    }
+    strcpy(buf, spec);
+
+    colon = strrchr(buf, ':');
+    if (colon != NULL && isalpha((unsigned char)colon[1]))
+    {
+        if (strcmp(colon + 1, "rising") == 0)
+        {
+            edges = GPIO_V2_LINE_FLAG_EDGE_RISING;
+        }
+        else if (strcmp(colon + 1, "falling") == 0)
+        {
+            edges = GPIO_V2_LINE_FLAG_EDGE_FALLING;
+        }
+        else if (strcmp(colon + 1, "both") != 0)
+        {
+            fprintf(stderr, "Invalid GPIO edge: %s\n", spec);
+            return -1;
+        }
+        *colon = '\0';
+        colon = strrchr(buf, ':');
+    }
+    if (colon == NULL || colon == buf)
+    {
+        fprintf(stderr, "Invalid GPIO line: %s\n", spec);
+        return -1;
+    }
+    *colon = '\0';
+    line = strtoul(colon + 1, &end, 10);
+    if (end == colon + 1 || *end != '\0')
+    {
+        fprintf(stderr, "Invalid GPIO line: %s\n", spec);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s%s", strchr(buf, '/') != NULL ? "" : GPIO_DEV_PREFIX, buf);
+
+    chip = open(path, O_RDONLY | O_CLOEXEC);
+    if (chip < 0)
+    {
+        perror("Error opening GPIO chip");
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.offsets[0] = line;
+    req.num_lines = 1;
+    req.config.flags = GPIO_V2_LINE_FLAG_INPUT | edges;
+    strncpy(req.consumer, GPIO_CONSUMER, sizeof(req.consumer) - 1);
+
+    if (ioctl(chip, GPIO_V2_GET_LINE_IOCTL, &req) < 0)
+    {
+        perror("Error requesting GPIO line");
+        close(chip);
+        return -1;
+    }
+    close(chip);
+
+    if (fcntl(req.fd, F_SETFL, O_NONBLOCK) < 0 || fcntl(req.fd, F_SETFD, FD_CLOEXEC) < 0)
+    {
+        perror("Error setting up GPIO line");
+        close(req.fd);
+        return -1;
+    }
+
+    return req.fd;
+}
+
+/**
+ * @brief Consume the pending edge events of a line
+ * 
+ * @param fd Line file descriptor
+ * @return int Number of edges, -1 on error
+ */
+int gpio_irq_drain(int fd)
+{
+    struct gpio_v2_line_event events[GPIO_EVENTS_READ];
+    int count = 0;
+    ssize_t n;
+
+    while ((n = read(fd, events, sizeof(events))) > 0)
+    {
+        count += n / sizeof(events[0]);
+    }
+    if (n < 0 && errno != EAGAIN && errno != EINTR)
+    {
+        return -1;
+    }
+
+    return count;
+}
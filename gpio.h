@@ -0,0 +1,26 @@
+/**
+ * @file    gpio.h
+ * @brief   GPIO interrupt lines
+ * @details Edge events of a line requested through the gpiochip character
+ *              device, for devices that signal a change of state on an
+ *              interrupt pin.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef GPIO_H
+#define GPIO_H
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define GPIO_CONSUMER "homeoffice"  /* Consumer label of the requested lines */
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+int gpio_irq_open(const char *spec);
+int gpio_irq_drain(int fd);
+
+#endif /* GPIO_H */
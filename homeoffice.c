@@ -1,9 +1,10 @@
 /**
  * @file    homeoffice.c
  * @brief   Homeoffice device communication
- * @details This file contains the SPI communication with the homeoffice device.
+ * @details This file contains the user interface of the homeoffice client.
  *              It is possible to read the voltage, current and power, as well as
- *              the relay status. It is also possible to set the relay on or off.
+ *              the relay status. It is also possible to set the relay on or off,
+ *              or to sample all readings continuously.
  * @author  Klaus Becker (doklauss@gmail.com)
 */
 
@@ -14,303 +15,404 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/ioctl.h>
-#include <linux/spi/spidev.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "spi.h"
+#include "sink.h"
+#include "output.h"
+#include "record.h"
+#include "archive.h"
+#include "capture.h"
+#include "summary.h"
+#include "net.h"
+#include "metrics.h"
+#include "control.h"
+#include "rules.h"
+#include "daemon.h"
+#include "config.h"
+#include "calibrate.h"
+#include "bench.h"
+#include "sampler.h"
+#include "timeutil.h"
+#include "trace.h"
+#include "arena.h"
+#include "collector.h"
 
 /* *****************
  * PRIVATE DEFINES *
  * *****************/
 
-#ifdef __DEBUG__
-	#define printd(fmt, args...) { printf("%s:%d::%s: " fmt "\n", __FILE__, __LINE__, __FUNCTION__, ##args); fflush(stdout); }
-#else
-	#define printd(args...)
-#endif
-
-#define SPI_DEVICE "/dev/spidev0.0" /* SPI device path */
-#define SPI_MODE SPI_MODE_0         /* SPI communication mode */
-#define SPI_BITS_PER_WORD 8         /* SPI bits per word */
-#define SPI_SPEED_HZ 100000           /* SPI speed in Hz */
-
-#define CMD_READ_VOLTAGE 0x01       /* SPI Read Voltage command */
-#define CMD_READ_CURRENT 0x02       /* SPI Read Current command */
-#define CMD_READ_POWER 0x03         /* SPI Read Power command */
-#define CMD_READ_RELAY 0x04         /* SPI Read Relay command */
-#define CMD_READ_ALL 0x05           /* SPI Read All command */
-#define CMD_SET_RELAY_ON 0x06       /* SPI Set Relay On command */
-#define CMD_SET_RELAY_OFF 0x07      /* SPI Set Relay Off command */
+#define SINKS_MAX 7                 /* Sinks of one sampling run */
+#define ARENA_FIXED_SIZE (16 * 1024 * 1024) /* Arena room for all but the sink rings */
+#define OPTION_INTEGER_MAX 9007199254740992.0 /* 2^53, the largest integer option a double holds exactly */
+#define OPTION_RING_MAX (1 << 24)   /* Largest ring capacity, in records */
+#define OPTION_SECONDS_MAX 1e9      /* Longest time option, about 31 years, well within nanoseconds in 64 bits */
 
 /* **************************
  * PRIVATE TYPES DEFINITION *
  * **************************/
 
-/* Homeoffice device struct data */
-typedef struct homeoffice_data{
-    float voltage;
-    float current;
-    float power;
-    uint8_t relay;
-}__attribute__((__packed__)) __attribute__((aligned(4))) homeoffice_data;
+/* Settings from the command line and the configuration file */
+typedef struct app_options{
+    /* Devices */
+    const char *device_paths[SPI_DEVICES_MAX];
+    size_t ndevice_paths;
+    int devices_given;              /* Devices set by the current source */
+    int irqs_given;                 /* Interrupt lines set by the current source */
+    int protocol;
+    uint32_t speed_hz;
+    int calibrate;
+    bench_config bench;
+    int crc;
+    int retries;
+    uint64_t wait_ns;               /* Wait for the device nodes to appear */
+    uint32_t tick_hz;
+    uint32_t shunt_uohm;
+
+    /* Sampling and consumers */
+    sampler_config sampler;
+    size_t ring_capacity;
+    const char *output_path;
+    int output_format;
+    capture_config capture;
+    const char *summary_path;
+    uint64_t summary_interval_ns;
+    net_config net;
+    int metrics_port;
+    const char *control_path;
+    rule rules[RULES_MAX];
+    size_t nrules;
+    int rules_given;                /* Rules set by the current source */
+    const char *trace_path;
+
+    /* Collector */
+    collector_config collector;
+    int nodes_given;                /* Nodes set by the current source */
+
+    /* Service */
+    int daemon;
+    const char *pidfile;
+    const char *logfile;
+    const char *config;
+} app_options;
 
 /* *********************************
  * PROTOTYPES OF PRIVATE FUNCTIONS *
  * *********************************/
 
-static char *get_cmd_str(uint8_t cmd);
-static void spi_init();
-static void spi_transfer(void *tx_buf, void *rx_buf, size_t len);
-static void spi_write(uint8_t cmd);
-static void spi_read(void *rx_buf, size_t len);
 static void spi_read_voltage();
 static void spi_read_current();
 static void spi_read_power();
 static void spi_read_all();
 static void spi_read_relay();
 static void spi_set_relay(uint8_t state);
+static void signal_handler(int sig);
+static void signals_setup();
+static int sample_run(const sampler_config *cfg, sink *sinks, size_t nsinks, size_t ring_capacity);
+static int collect_run(app_options *o);
+static void menu_run();
+static void print_usage(char *prog);
+static void options_init(app_options *o);
+static int options_cpus(sampler_config *cfg, const char *arg);
+static int option_number(const char *arg, double min, double max, int integer, double *value);
+static int option_apply(void *ctx, int opt, const char *arg);
+static int options_parse(app_options *o, int argc, char **argv);
+static int options_check(const app_options *o);
+static int options_load(app_options *o, int argc, char **argv, char **config_text);
+static void sinks_discard(sink *sinks, size_t nsinks);
+static int sinks_open(app_options *o, sink *sinks);
+static size_t arena_size(const app_options *o);
+static int devices_setup(const app_options *o, const app_options *prev);
+static int options_revert(app_options *o, const app_options *prev);
 
 /* *************************************
  * PRIVATE GLOBAL VARIABLES DEFINITION *
  * *************************************/
 
-static int gs_spi_fd = -1; /* SPI file descriptor */
-
 static homeoffice_data gs_homeoffice_data; /* Homeoffice data */
 
+static spi_device gs_device_sets[2][SPI_DEVICES_MAX]; /* The running devices and the ones a reload opens */
+static spi_device *gs_devices = gs_device_sets[0]; /* Polled devices */
+static size_t gs_ndevices; /* Number of polled devices */
+
+static spi_device *gs_menu_device = gs_device_sets[0]; /* Device used by the interactive menu */
+
+static volatile sig_atomic_t gs_reload; /* Set by SIGHUP to reload the configuration */
+
+static const struct option gs_long_options[] = {
+    {"device", required_argument, NULL, 'D'},
+    {"protocol", required_argument, NULL, 'p'},
+    {"speed", required_argument, NULL, 'F'},
+    {"calibrate", no_argument, NULL, 'C'},
+    {"bench", required_argument, NULL, 'N'},
+    {"crc", no_argument, NULL, 'K'},
+    {"retries", required_argument, NULL, 'R'},
+    {"wait", required_argument, NULL, 'H'},
+    {"tick", required_argument, NULL, 'k'},
+    {"raw", required_argument, NULL, 'W'},
+    {"sample", required_argument, NULL, 's'},
+    {"count", required_argument, NULL, 'n'},
+    {"ring", required_argument, NULL, 'r'},
+    {"output", required_argument, NULL, 'o'},
+    {"format", required_argument, NULL, 'f'},
+    {"decode", required_argument, NULL, 'd'},
+    {"batch", required_argument, NULL, 'b'},
+    {"pipeline", no_argument, NULL, 'e'},
+    {"adaptive", required_argument, NULL, 'j'},
+    {"deadband", required_argument, NULL, 'z'},
+    {"rt-priority", required_argument, NULL, 'Y'},
+    {"cpu", required_argument, NULL, 'a'},
+    {"mlock", no_argument, NULL, 'm'},
+    {"irq", required_argument, NULL, 'i'},
+    {"capture", required_argument, NULL, 'c'},
+    {"rotate-size", required_argument, NULL, 'S'},
+    {"rotate-time", required_argument, NULL, 'T'},
+    {"stats", required_argument, NULL, 'A'},
+    {"stats-interval", required_argument, NULL, 'I'},
+    {"udp", required_argument, NULL, 'U'},
+    {"listen", required_argument, NULL, 'L'},
+    {"metrics", required_argument, NULL, 'M'},
+    {"control", required_argument, NULL, 'Q'},
+    {"rule", required_argument, NULL, 'u'},
+    {"trace", required_argument, NULL, 't'},
+    {"collect", required_argument, NULL, 'O'},
+    {"rollup", required_argument, NULL, 'w'},
+    {"lateness", required_argument, NULL, 'l'},
+    {"daemon", no_argument, NULL, 'B'},
+    {"pidfile", required_argument, NULL, 'P'},
+    {"log", required_argument, NULL, 'G'},
+    {"config", required_argument, NULL, 'E'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+};
+
+static const char gs_short_options[] = "D:p:F:CN:KR:H:k:W:s:n:b:ej:z:Y:a:mi:r:o:f:d:c:S:T:A:I:U:L:M:Q:u:t:O:w:l:BP:G:E:h";
+
 /* *********************************
  * DEFINITION OF PRIVATE FUNCTIONS *
  * *********************************/
 
 /**
- * @brief Get the SPI command string
+ * @brief SPI read voltage data
  * 
- * @param cmd SPI Command
- * @return char* 
  */
-static char *get_cmd_str(uint8_t cmd)
-{
-    switch (cmd)
-    {
-    case CMD_READ_POWER:
-        return "READ POWER";
-    case CMD_READ_CURRENT:
-        return "READ CURRENT";
-    case CMD_READ_VOLTAGE:
-        return "READ VOLTAGE";
-    case CMD_READ_RELAY:
-        return "READ RELAY";
-    case CMD_READ_ALL:
-        return "READ ALL";
-    case CMD_SET_RELAY_ON:
-        return "SET RELAY ON";
-    case CMD_SET_RELAY_OFF:
-        return "SET RELAY OFF";
-    default:
-        return "UNKNOWN";
+static void spi_read_voltage()
+{   
+    if (spi_command(gs_menu_device, CMD_READ_VOLTAGE, &gs_homeoffice_data.voltage, sizeof(float)) < 0)
+    {
+        printf("Error reading the device\n");
+        return;
     }
+    printf("Voltage: %05.2f V\n", gs_homeoffice_data.voltage);
 }
 
 /**
- * @brief Initialize SPI communication
+ * @brief SPI read current data
  * 
  */
-static void spi_init()
+static void spi_read_current()
 {
-    gs_spi_fd = open(SPI_DEVICE, O_RDWR);
-    if (gs_spi_fd < 0)
-    {
-        perror("Error opening SPI device");
-        exit(1);
-    }
-
-    uint8_t mode = SPI_MODE;
-    if (ioctl(gs_spi_fd, SPI_IOC_WR_MODE, &mode) < 0)
+    if (spi_command(gs_menu_device, CMD_READ_CURRENT, &gs_homeoffice_data.current, sizeof(float)) < 0)
     {
-        perror("Error setting SPI mode");
-        exit(1);
-    }
-
-    uint8_t bits_per_word = SPI_BITS_PER_WORD;
-    if (ioctl(gs_spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits_per_word) < 0)
-    {
-        perror("Error setting SPI bits per word");
-        exit(1);
-    }
-
-    uint32_t speed_hz = SPI_SPEED_HZ;
-    if (ioctl(gs_spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz) < 0)
-    {
-        perror("Error setting SPI speed");
-        exit(1);
+        printf("Error reading the device\n");
+        return;
     }
+    printf("Current: %05.2f mA\n", gs_homeoffice_data.current * 1000);
 }
 
 /**
- * @brief SPI transfer data
+ * @brief SPI read power data
  * 
- * @param tx_buf Transmit buffer
- * @param rx_buf Receive buffer
- * @param len Length of the buffer
  */
-static void spi_transfer(void *tx_buf, void *rx_buf, size_t len)
-{
-    uint8_t sendbuf[20] = {0};
-    uint8_t recvbuf[20] = {0};
-
-    memset(sendbuf, 0, sizeof(sendbuf));
-    memset(recvbuf, 0, sizeof(recvbuf));
-
-
-    uint8_t data;
 
-    if (tx_buf != NULL){
-        memcpy(sendbuf, tx_buf, len);
-        data = sendbuf[0];
-
-        printd("==== SENDING ====\n");
-        printd(" CMD: %s (%d)\n", get_cmd_str(data), data);
-        for(int i = 1; i < len; i++)
-        {   
-            data = sendbuf[i];
-            if(data != 0){
-                printd(" %02d: %d\n", i, data);
-            }
-        }
-    }
-
-    struct spi_ioc_transfer transfer = {
-        .tx_buf = (unsigned long)sendbuf,
-        .rx_buf = (unsigned long)recvbuf,
-        .len = 20,
-        .speed_hz = SPI_SPEED_HZ,
-        .bits_per_word = SPI_BITS_PER_WORD,
-    };
-
-    if (ioctl(gs_spi_fd, SPI_IOC_MESSAGE(1), &transfer) < 0)
-    {
-        perror("Error transferring SPI data");
-        exit(1);
-    }
-
-    if (rx_buf != NULL)
+static void spi_read_power()
+{
+    if (spi_command(gs_menu_device, CMD_READ_POWER, &gs_homeoffice_data.power, sizeof(float)) < 0)
     {
-        data = recvbuf[2];
-        printd("=== RECEIVING ===\n");
-        printd(" CMD: %s (%d)\n", get_cmd_str(data), data);
-        for(int i = 3; i < 20; i++)
-        {   
-            data = recvbuf[i];
-            if(data != 0){
-                printd(" %02d: %d\n", i, data);
-            }
-        }
-        printd("=================\n");
-
-        memcpy(rx_buf,&recvbuf[3], len);
+        printf("Error reading the device\n");
+        return;
     }
+    printf("Power: %05.2f mW\n", gs_homeoffice_data.power * 1000);
 }
 
 /**
- * @brief SPI write data
+ * @brief SPI read all data
  * 
- * @param cmd SPI Command
  */
-static void spi_write(uint8_t cmd)
+static void spi_read_all()
 {
-    spi_transfer(&cmd, NULL, 1);
+    if (spi_command(gs_menu_device, CMD_READ_ALL, &gs_homeoffice_data, sizeof(homeoffice_data)) < 0)
+    {
+        printf("Error reading the device\n");
+        return;
+    }
+    printf("Voltage: %05.2f V\n", gs_homeoffice_data.voltage);
+    printf("Current: %05.2f mA\n", gs_homeoffice_data.current *1000);
+    printf("Power: %05.2f mW\n", gs_homeoffice_data.power * 1000);
+    printf("Relay: %s\n", gs_homeoffice_data.relay ? "ON" : "OFF");
 }
 
 /**
- * @brief SPI read data
+ * @brief SPI read relay data
  * 
- * @param rx_buf Receive buffer
- * @param len Length of the buffer
  */
-static void spi_read(void *rx_buf, size_t len)
+static void spi_read_relay()
 {
-    spi_transfer(NULL, rx_buf, len);
+    if (spi_command(gs_menu_device, CMD_READ_RELAY, &gs_homeoffice_data.relay, sizeof(uint8_t)) < 0)
+    {
+        printf("Error reading the device\n");
+        return;
+    }
+    printf("Relay: %s\n", gs_homeoffice_data.relay ? "ON" : "OFF");
 }
 
 /**
- * @brief SPI read voltage data
+ * @brief SPI set relay state
  * 
  */
-static void spi_read_voltage()
-{   
-    spi_write(CMD_READ_VOLTAGE);
-    spi_read(&gs_homeoffice_data.voltage, sizeof(float));
-    printf("Voltage: %05.2f V\n", gs_homeoffice_data.voltage);
+static void spi_set_relay(uint8_t state)
+{
+    if (spi_command(gs_menu_device, state ? CMD_SET_RELAY_ON : CMD_SET_RELAY_OFF, &gs_homeoffice_data.relay, sizeof(uint8_t)) < 0)
+    {
+        printf("Error reading the device\n");
+        return;
+    }
+    printf("Relay: %s\n", gs_homeoffice_data.relay ? "ON" : "OFF");
 }
 
 /**
- * @brief SPI read current data
+ * @brief Stop sampling on SIGINT/SIGTERM, and also ask for a reload on SIGHUP;
+ *        toggle tracing on SIGUSR1 when a trace file is set
  * 
+ * @param sig Signal number
  */
-static void spi_read_current()
+static void signal_handler(int sig)
 {
-    spi_write(CMD_READ_CURRENT);
-    spi_read(&gs_homeoffice_data.current, sizeof(float));
-    printf("Current: %05.2f mA\n", gs_homeoffice_data.current * 1000);
+    if (sig == SIGUSR1)
+    {
+        trace_set(!atomic_load_explicit(&g_trace_enabled, memory_order_relaxed));
+        return;
+    }
+    if (sig == SIGHUP)
+    {
+        gs_reload = 1;
+    }
+    sampler_stop();
+    collector_stop();
 }
 
 /**
- * @brief SPI read power data
+ * @brief Install the signal handlers of sampling and collector mode
  * 
  */
-
-static void spi_read_power()
+static void signals_setup()
 {
-    spi_write(CMD_READ_POWER);
-    spi_read(&gs_homeoffice_data.power, sizeof(float));
-    printf("Power: %05.2f mW\n", gs_homeoffice_data.power * 1000);
+    struct sigaction sa = { .sa_handler = signal_handler };
+
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
 }
 
 /**
- * @brief SPI read all data
+ * @brief Continuously sample all readings and feed them to the sinks
  * 
+ * @param cfg Sampler configuration
+ * @param sinks Opened sinks
+ * @param nsinks Number of sinks
+ * @param ring_capacity Capacity of each sink ring in records
+ * @return int 0 on success, -1 on error
  */
-static void spi_read_all()
+static int sample_run(const sampler_config *cfg, sink *sinks, size_t nsinks, size_t ring_capacity)
 {
-    spi_write(CMD_READ_ALL);
-    spi_read(&gs_homeoffice_data, sizeof(homeoffice_data));
-    printf("Voltage: %05.2f V\n", gs_homeoffice_data.voltage);
-    printf("Current: %05.2f mA\n", gs_homeoffice_data.current *1000);
-    printf("Power: %05.2f mW\n", gs_homeoffice_data.power * 1000);
-    printf("Relay: %s\n", gs_homeoffice_data.relay ? "ON" : "OFF");
+    sampler_stats stats;
+    size_t started;
+    int ret = 0;
+
+    signals_setup();
+
+    for (started = 0; started < nsinks; started++)
+    {
+        if (sink_start(&sinks[started], ring_capacity, sampler_threads(gs_devices, gs_ndevices)) < 0)
+        {
+            /* The sinks from this one on were opened but never started */
+            sinks_discard(&sinks[started], nsinks - started);
+            ret = -1;
+            break;
+        }
+    }
+
+    if (ret == 0)
+    {
+        ret = sampler_run(cfg, gs_devices, gs_ndevices, sinks, nsinks, &stats);
+    }
+
+    if (ret == 0)
+    {
+        sampler_print_stats(&stats, stderr);
+        fprintf(stderr, "Arena: %zu KiB\n", arena_used() / 1024);
+        for (size_t i = 0; i < gs_ndevices; i++)
+        {
+            spi_print_stats(&gs_devices[i], stderr);
+        }
+    }
+
+    for (size_t i = 0; i < started; i++)
+    {
+        if (ret == 0)
+        {
+            fprintf(stderr, "Sink %s: dropped %llu\n",
+                sinks[i].name, (unsigned long long)sink_drops(&sinks[i]));
+        }
+        sink_stop(&sinks[i]);
+    }
+
+    return ret;
 }
 
 /**
- * @brief SPI read relay data
+ * @brief Merge the streams of the nodes into the output until stopped
  * 
+ * @param o Options
+ * @return int 0 on success, -1 on error
  */
-static void spi_read_relay()
+static int collect_run(app_options *o)
 {
-    spi_write(CMD_READ_RELAY);
-    spi_read(&gs_homeoffice_data.relay, sizeof(uint8_t));
-    printf("Relay: %s\n", gs_homeoffice_data.relay ? "ON" : "OFF");
+    int to_stdout = o->output_path == NULL || strcmp(o->output_path, "-") == 0;
+    FILE *out = to_stdout ? stdout : fopen(o->output_path, "w");
+    int ret;
+
+    if (out == NULL)
+    {
+        perror("Error opening output file");
+        return -1;
+    }
+
+    signals_setup();
+    o->collector.count = o->sampler.count;
+    ret = collector_run(&o->collector, out);
+    if (!to_stdout)
+    {
+        fclose(out);
+    }
+
+    return ret;
 }
 
 /**
- * @brief SPI set relay state
+ * @brief Interactive menu loop
  * 
  */
-static void spi_set_relay(uint8_t state)
-{
-    spi_write(state ? CMD_SET_RELAY_ON : CMD_SET_RELAY_OFF);
-    spi_read(&gs_homeoffice_data.relay, sizeof(uint8_t));
-    printf("Relay: %s\n", gs_homeoffice_data.relay ? "ON" : "OFF");
-}
-
-/* ********************************
- * DEFINITION OF PUBLIC FUNCTIONS *
- * ********************************/
-
-int main(int argc, char **argv)
+static void menu_run()
 {
-    spi_init();
-
     int choice = 0, c;
     while (choice != 8)
     {
@@ -370,8 +472,996 @@ int main(int argc, char **argv)
         c = getchar();
 
     }
+}
+
+/**
+ * @brief Print the command line usage
+ * 
+ * @param prog Program name
+ */
+static void print_usage(char *prog)
+{
+    printf("Usage: %s [options]\n", prog);
+    printf(" -D, --device <path>   SPI device, may be repeated to poll several\n");
+    printf("                        devices (default: %s)\n", SPI_DEVICE);
+    printf("                        sim:[<options>] and replay:<capture>[,<options>]\n");
+    printf("                        are emulated devices, see the README\n");
+    printf(" -p, --protocol <1|2>  SPI protocol version (default: %d)\n", SPI_PROTOCOL_DEFAULT);
+    printf("                        1: command and reply as two SPI transfers\n");
+    printf("                        2: command and reply in a single SPI message\n");
+    printf(" -F, --speed <hz>      SPI clock in Hz (default: %d)\n", SPI_SPEED_HZ);
+    printf(" -C, --calibrate       Step the SPI clock up to the highest speed with\n");
+    printf("                        error-free replies, up to --speed if given\n");
+    printf(" -N, --bench <n>       Time <n> transfers of every read command and\n");
+    printf("                        batch size at SPI clocks up to --speed, or %d,\n", BENCH_MAX_HZ);
+    printf("                        and print the latency percentiles and throughput\n");
+    printf("                        as CSV\n");
+    printf(" -K, --crc             Check the CRC-8 trailer of every reply frame\n");
+    printf(" -R, --retries <n>     Retries of a failed or invalid request (default: %d)\n", SPI_RETRIES_DEFAULT);
+    printf(" -H, --wait <s>        Wait up to <s> seconds for the device nodes to\n");
+    printf("                        appear at startup (default: %d, 0: fail at once)\n", SPI_WAIT_DEFAULT_S);
+    printf(" -k, --tick <hz>       The devices send a tick counter running at <hz>\n");
+    printf("                        in batch replies, used to timestamp the samples\n");
+    printf(" -W, --raw <mohm>      Read raw INA219 registers, converted for a <mohm>\n");
+    printf("                        shunt\n");
+    printf(" -s, --sample <hz>     Sample all readings continuously at <hz> and\n");
+    printf("                        write them to the output\n");
+    printf(" -n, --count <n>       Stop sampling after <n> samples\n");
+    printf(" -b, --batch <n>       Read <n> samples buffered by the device per\n");
+    printf("                        transfer, up to %d (default: 1)\n", SPI_BATCH_MAX);
+    printf(" -e, --pipeline        Overlap each SPI transfer with decoding the\n");
+    printf("                        previous reply in a worker thread per device,\n");
+    printf("                        samples arrive one read later\n");
+    printf(" -j, --adaptive <hz>   Drop to <hz> while the readings stay within the\n");
+    printf("                        deadband, back to --sample on a step or a relay\n");
+    printf("                        toggle\n");
+    printf(" -z, --deadband <%%>    Relative change that counts as a step (default: %g)\n",
+        SAMPLER_DEADBAND_DEFAULT * 100);
+    printf(" -Y, --rt-priority <n> Run the acquisition threads under SCHED_FIFO at\n");
+    printf("                        priority <n>, 1 to 99\n");
+    printf(" -a, --cpu <n>[,<n>...] Pin the acquisition threads to these CPUs, one\n");
+    printf("                        each in turn\n");
+    printf(" -m, --mlock           Lock the process memory while sampling\n");
+    printf(" -i, --irq <line>      Read the device at once on an edge of the GPIO\n");
+    printf("                        line <chip>:<offset>[:rising|falling|both],\n");
+    printf("                        repeated for each device in order\n");
+    printf(" -r, --ring <n>        Sample ring capacity in records (default: %d)\n", SINK_RING_DEFAULT);
+    printf(" -o, --output <file>   Write the samples to <file> (default: stdout)\n");
+    printf(" -f, --format <fmt>    Sample output format: csv, binary or archive\n");
+    printf("                       (default: csv)\n");
+    printf(" -d, --decode <file>   Convert a binary capture or archive to CSV\n");
+    printf(" -c, --capture <prefix> Record binary captures to memory-mapped files\n");
+    printf("                        named <prefix>-<date>-<time>-<seq>.bin\n");
+    printf(" -S, --rotate-size <MiB> Start a new capture file after <MiB> (default: %d)\n", CAPTURE_SIZE_DEFAULT / (1024 * 1024));
+    printf(" -T, --rotate-time <s>  Start a new capture file every <s> seconds\n");
+    printf(" -A, --stats <file>    Write rolling 1s/1min/15min statistics and the\n");
+    printf("                        energy of each device to <file> (\"-\": stdout)\n");
+    printf(" -I, --stats-interval <s> Statistics report interval (default: 1)\n");
+    printf(" -U, --udp <addr:port> Send the samples as batched binary records over\n");
+    printf("                        UDP, e.g. to a multicast group\n");
+    printf(" -L, --listen <port>   Serve the samples as a binary record stream to\n");
+    printf("                        TCP clients, up to %d\n", NET_CLIENTS_MAX);
+    printf(" -M, --metrics <port>  Serve Prometheus metrics on http://<host>:<port>/metrics\n");
+    printf(" -Q, --control <path>  Accept commands on the Unix socket <path>, e.g.\n");
+    printf("                        GET ALL, SET RELAY ON, SUBSCRIBE 100hz\n");
+    printf(" -u, --rule <rule>     Switch the relay of a device when a reading holds a\n");
+    printf("                        limit, e.g. \"power > 5W for 200ms -> relay off\",\n");
+    printf("                        up to %d rules\n", RULES_MAX);
+    printf(" -t, --trace <file>    Record hot-path tracepoints, toggled by SIGUSR1\n");
+    printf("                        or TRACE ON|OFF only when this is given,\n");
+    printf("                        and write them to <file> as a Chrome trace when\n");
+    printf("                        sampling stops\n");
+    printf(" -O, --collect <host:port> Collector mode: merge the --listen streams of\n");
+    printf("                        the nodes in time order, repeated for each node,\n");
+    printf("                        up to %d, and write them to the output as CSV\n", COLLECTOR_NODES_MAX);
+    printf(" -w, --rollup <s>      In collector mode, write the site power and energy\n");
+    printf("                        every <s> seconds instead of the merged samples\n");
+    printf(" -l, --lateness <ms>   In collector mode, how late the samples of a node\n");
+    printf("                        may arrive out of order (default: %d)\n", COLLECTOR_LATENESS_DEFAULT_MS);
+    printf(" -B, --daemon          Run in the background as a service, reloading the\n");
+    printf("                        configuration on SIGHUP\n");
+    printf(" -P, --pidfile <file>  Daemon pidfile (default: %s)\n", DAEMON_PIDFILE_DEFAULT);
+    printf(" -G, --log <file>      Daemon log file (default: discarded)\n");
+    printf(" -E, --config <file>   Read settings from <file>, one \"option = value\"\n");
+    printf("                        per line; the command line takes precedence\n");
+    printf(" -h, --help            Show this help\n");
+}
+
+/**
+ * @brief Set the default options
+ * 
+ * @param o Options
+ */
+static void options_init(app_options *o)
+{
+    memset(o, 0, sizeof(*o));
+    o->protocol = SPI_PROTOCOL_DEFAULT;
+    o->retries = SPI_RETRIES_DEFAULT;
+    o->wait_ns = SPI_WAIT_DEFAULT_S * NSEC_PER_SEC;
+    o->sampler.deadband = SAMPLER_DEADBAND_DEFAULT;
+    o->ring_capacity = SINK_RING_DEFAULT;
+    o->output_format = OUTPUT_FORMAT_CSV;
+    o->capture.rotate_size = CAPTURE_SIZE_DEFAULT;
+    o->summary_interval_ns = SUMMARY_INTERVAL_DEFAULT;
+    o->net.udp_ttl = NET_UDP_TTL_DEFAULT;
+    o->collector.lateness_ns = COLLECTOR_LATENESS_DEFAULT_MS * NSEC_PER_MSEC;
+    o->pidfile = DAEMON_PIDFILE_DEFAULT;
+}
+
+/**
+ * @brief Parse the CPUs of the acquisition threads
+ * 
+ * @param cfg Sampler configuration
+ * @param arg Comma-separated CPU numbers
+ * @return int 0 on success, -1 on an invalid list
+ */
+static int options_cpus(sampler_config *cfg, const char *arg)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+    const char *p = arg;
+
+    cfg->ncpus = 0;
+    do
+    {
+        char *end;
+        long cpu = strtol(p, &end, 10);
+
+        if (end == p || cpu < 0 || cpu >= ncpus || (*end != ',' && *end != '\0')
+            || cfg->ncpus == SPI_DEVICES_MAX)
+        {
+            return -1;
+        }
+        cfg->cpus[cfg->ncpus++] = cpu;
+        p = *end == ',' ? end + 1 : end;
+    } while (*p != '\0');
+
+    return 0;
+}
+
+/**
+ * @brief Parse a numeric option argument
+ * @details The whole argument must be a finite number within the bounds,
+ *              in decimal, or in hexadecimal with a 0x prefix, so a typo is
+ *              rejected instead of being read as 0.
+ * 
+ * @param arg Option argument
+ * @param min Smallest value
+ * @param max Largest value
+ * @param integer Whether the value must be a whole number
+ * @param value Set to the value
+ * @return int 0 on success, -1 on an invalid argument
+ */
+static int option_number(const char *arg, double min, double max, int integer, double *value)
+{
+    char *end;
+    double v;
+
+    errno = 0;
+    v = strtod(arg, &end);
+    if (end == arg || *end != '\0' || errno == ERANGE || !isfinite(v) || v < min || v > max
+        || (integer && v != floor(v)))
+    {
+        return -1;
+    }
+
+    *value = v;
+    return 0;
+}
+
+/**
+ * @brief Apply one option
+ * @details Shared by the command line and the configuration file. Devices
+ *              given by a source replace the ones from the sources before it.
+ * 
+ * @param ctx Options
+ * @param opt Short option code
+ * @param arg Option argument
+ * @return int 0 on success, -1 if the option or its argument is invalid
+ */
+static int option_apply(void *ctx, int opt, const char *arg)
+{
+    app_options *o = ctx;
+    double v;
+
+    switch (opt)
+    {
+        case 'D':
+            if (!o->devices_given)
+            {
+                o->ndevice_paths = 0;
+                o->devices_given = 1;
+            }
+            if (o->ndevice_paths == SPI_DEVICES_MAX)
+            {
+                fprintf(stderr, "At most %d devices are supported\n", SPI_DEVICES_MAX);
+                return -1;
+            }
+            o->device_paths[o->ndevice_paths++] = arg;
+            break;
+        case 'p':
+            if (option_number(arg, 0, INT_MAX, 1, &v) < 0 || (v != SPI_PROTOCOL_V1 && v != SPI_PROTOCOL_V2))
+            {
+                fprintf(stderr, "Invalid protocol version: %s\n", arg);
+                return -1;
+            }
+            o->protocol = v;
+            break;
+        case 'F':
+            if (option_number(arg, 1, UINT32_MAX, 1, &v) < 0)
+            {
+                fprintf(stderr, "Invalid SPI speed: %s\n", arg);
+                return -1;
+            }
+            o->speed_hz = v;
+            break;
+        case 'C':
+            o->calibrate = 1;
+            break;
+        case 'N':
+            if (option_number(arg, 1, UINT_MAX, 1, &v) < 0)
+            {
+                fprintf(stderr, "Invalid benchmark iterations: %s\n", arg);
+                return -1;
+            }
+            o->bench.iterations = v;
+            break;
+        case 'K':
+            o->crc = 1;
+            break;
+        case 'R':
+            if (option_number(arg, 0, INT_MAX, 1, &v) < 0)
+            {
+                fprintf(stderr, "Invalid retry count: %s\n", arg);
+                return -1;
+            }
+            o->retries = v;
+            break;
+        case 'H':
+            if (option_number(arg, 0, OPTION_SECONDS_MAX, 0, &v) < 0)
+            {
+                fprintf(stderr, "Invalid wait: %s\n", arg);
+                return -1;
+            }
+            o->wait_ns = v * NSEC_PER_SEC;
+            break;
+        case 'k':
+            if (option_number(arg, 1, UINT32_MAX, 1, &v) < 0)
+            {
+                fprintf(stderr, "Invalid tick rate: %s\n", arg);
+                return -1;
+            }
+            o->tick_hz = v;
+            break;
+        case 'W':
+            if (option_number(arg, 1, 1000000, 0, &v) < 0)
+            {
+                fprintf(stderr, "Invalid shunt resistance: %s\n", arg);
+                return -1;
+            }
+            o->shunt_uohm = (uint32_t)lround(v * 1000);
+            break;
+        case 's':
+            if (option_number(arg, 0, SAMPLE_MAX_HZ, 0, &v) < 0 || v == 0)
+            {
+                fprintf(stderr, "Invalid sampling rate: %s\n", arg);
+                return -1;
+            }
+            o->sampler.hz = v;
+            break;
+        case 'n':
+            if (option_number(arg, 0, fmin(ULONG_MAX, OPTION_INTEGER_MAX), 1, &v) < 0)
+            {
+                fprintf(stderr, "Invalid sample count: %s\n", arg);
+                return -1;
+            }
+            o->sampler.count = v;
+            break;
+        case 'b':
+            if (option_number(arg, 1, SPI_BATCH_MAX, 1, &v) < 0)
+            {
+                fprintf(stderr, "Invalid batch size: %s\n", arg);
+                return -1;
+            }
+            o->sampler.batch = v;
+            break;
+        case 'e':
+            o->sampler.pipeline = 1;
+            break;
+        case 'j':
+            if (option_number(arg, 0, SAMPLE_MAX_HZ, 0, &v) < 0 || v == 0)
+            {
+                fprintf(stderr, "Invalid adaptive base rate: %s\n", arg);
+                return -1;
+            }
+            o->sampler.base_hz = v;
+            break;
+        case 'z':
+            if (option_number(arg, 0, 100, 0, &v) < 0 || v == 0)
+            {
+                fprintf(stderr, "Invalid deadband: %s\n", arg);
+                return -1;
+            }
+            o->sampler.deadband = v / 100;
+            break;
+        case 'Y':
+            if (option_number(arg, 1, 99, 1, &v) < 0)
+            {
+                fprintf(stderr, "Invalid real-time priority: %s\n", arg);
+                return -1;
+            }
+            o->sampler.rt_priority = v;
+            break;
+        case 'a':
+            if (options_cpus(&o->sampler, arg) < 0)
+            {
+                fprintf(stderr, "Invalid CPU list: %s\n", arg);
+                return -1;
+            }
+            break;
+        case 'm':
+            o->sampler.lock_memory = 1;
+            break;
+        case 'i':
+            if (!o->irqs_given)
+            {
+                o->sampler.nirqs = 0;
+                o->irqs_given = 1;
+            }
+            if (o->sampler.nirqs == SPI_DEVICES_MAX)
+            {
+                fprintf(stderr, "At most %d interrupt lines are supported\n", SPI_DEVICES_MAX);
+                return -1;
+            }
+            o->sampler.irqs[o->sampler.nirqs++] = arg;
+            break;
+        case 'r':
+            if (option_number(arg, 1, OPTION_RING_MAX, 1, &v) < 0)
+            {
+                fprintf(stderr, "Invalid ring capacity: %s\n", arg);
+                return -1;
+            }
+            o->ring_capacity = v;
+            break;
+        case 'o':
+            o->output_path = arg;
+            break;
+        case 'f':
+            o->output_format = output_format_parse(arg);
+            if (o->output_format < 0)
+            {
+                fprintf(stderr, "Invalid output format: %s\n", arg);
+                return -1;
+            }
+            break;
+        case 'c':
+            o->capture.prefix = arg;
+            break;
+        case 'S':
+            if (option_number(arg, 1, (double)(UINT64_MAX >> 20), 1, &v) < 0)
+            {
+                fprintf(stderr, "Invalid rotation size: %s\n", arg);
+                return -1;
+            }
+            o->capture.rotate_size = (uint64_t)v * 1024 * 1024;
+            break;
+        case 'T':
+            if (option_number(arg, 0, OPTION_SECONDS_MAX, 1, &v) < 0)
+            {
+                fprintf(stderr, "Invalid rotation time: %s\n", arg);
+                return -1;
+            }
+            o->capture.rotate_time_ns = (uint64_t)v * NSEC_PER_SEC;
+            break;
+        case 'A':
+            o->summary_path = arg;
+            break;
+        case 'I':
+            if (option_number(arg, 0, OPTION_SECONDS_MAX, 0, &v) < 0 || (uint64_t)(v * NSEC_PER_SEC) == 0)
+            {
+                fprintf(stderr, "Invalid statistics interval: %s\n", arg);
+                return -1;
+            }
+            o->summary_interval_ns = v * NSEC_PER_SEC;
+            break;
+        case 'U':
+            o->net.udp = arg;
+            break;
+        case 'O':
+            if (!o->nodes_given)
+            {
+                o->collector.nnodes = 0;
+                o->nodes_given = 1;
+            }
+            if (o->collector.nnodes == COLLECTOR_NODES_MAX)
+            {
+                fprintf(stderr, "At most %d nodes are supported\n", COLLECTOR_NODES_MAX);
+                return -1;
+            }
+            o->collector.nodes[o->collector.nnodes++] = arg;
+            break;
+        case 'w':
+            if (option_number(arg, 0, OPTION_SECONDS_MAX, 0, &v) < 0 || (uint64_t)(v * NSEC_PER_SEC) == 0)
+            {
+                fprintf(stderr, "Invalid rollup interval: %s\n", arg);
+                return -1;
+            }
+            o->collector.rollup_ns = v * NSEC_PER_SEC;
+            break;
+        case 'l':
+            if (option_number(arg, 0, OPTION_SECONDS_MAX * 1000, 0, &v) < 0)
+            {
+                fprintf(stderr, "Invalid lateness: %s\n", arg);
+                return -1;
+            }
+            o->collector.lateness_ns = v * NSEC_PER_MSEC;
+            break;
+        case 'L':
+            if (option_number(arg, 1, 65535, 1, &v) < 0)
+            {
+                fprintf(stderr, "Invalid TCP port: %s\n", arg);
+                return -1;
+            }
+            o->net.tcp_port = v;
+            break;
+        case 'M':
+            if (option_number(arg, 1, 65535, 1, &v) < 0)
+            {
+                fprintf(stderr, "Invalid metrics port: %s\n", arg);
+                return -1;
+            }
+            o->metrics_port = v;
+            break;
+        case 'Q':
+            o->control_path = arg;
+            break;
+        case 'u':
+            if (!o->rules_given)
+            {
+                o->nrules = 0;
+                o->rules_given = 1;
+            }
+            if (o->nrules == RULES_MAX)
+            {
+                fprintf(stderr, "At most %d rules are supported\n", RULES_MAX);
+                return -1;
+            }
+            if (rules_compile(arg, &o->rules[o->nrules]) < 0)
+            {
+                return -1;
+            }
+            o->nrules++;
+            break;
+        case 't':
+            o->trace_path = arg;
+            break;
+        case 'B':
+            o->daemon = 1;
+            break;
+        case 'P':
+            o->pidfile = arg;
+            break;
+        case 'G':
+            o->logfile = arg;
+            break;
+        case 'E':
+            o->config = arg;
+            break;
+        default:
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Apply the command line options
+ * @details --decode and --help are handled by main() before, and are
+ *              skipped here.
+ * 
+ * @param o Options
+ * @param argc Argument count
+ * @param argv Arguments
+ * @return int 0 on success, -1 on an invalid option
+ */
+static int options_parse(app_options *o, int argc, char **argv)
+{
+    int opt;
 
-    close(gs_spi_fd);
+    o->devices_given = 0;
+    o->irqs_given = 0;
+    o->rules_given = 0;
+    o->nodes_given = 0;
+    optind = 1;
+    while ((opt = getopt_long(argc, argv, gs_short_options, gs_long_options, NULL)) != -1)
+    {
+        if (opt == 'd' || opt == 'h')
+        {
+            continue;
+        }
+        if (option_apply(o, opt, optarg) < 0)
+        {
+            return -1;
+        }
+    }
 
     return 0;
 }
+
+/**
+ * @brief Check the sampling settings that would only fail once sampling starts
+ * 
+ * @param o Options
+ * @return int 0 on success, -1 if sampling could not start
+ */
+static int options_check(const app_options *o)
+{
+    if (o->sampler.hz == 0 || o->bench.iterations > 0 || o->collector.nnodes > 0)
+    {
+        return 0;
+    }
+
+    return sampler_check(&o->sampler);
+}
+
+/**
+ * @brief Load the options from the configuration file and the command line
+ * @details The command line is applied last, so it overrides the file. The
+ *              sampling settings are checked with sampler_check(), so they
+ *              are rejected before the service detaches or a reload
+ *              replaces the running ones.
+ * 
+ * @param o Options
+ * @param argc Argument count
+ * @param argv Arguments
+ * @param config_text Set to the configuration file text, which the string
+ *              options point into, or NULL
+ * @return int 0 on success, -1 on error
+ */
+static int options_load(app_options *o, int argc, char **argv, char **config_text)
+{
+    options_init(o);
+    *config_text = NULL;
+
+    /* The command line names the configuration file */
+    if (options_parse(o, argc, argv) < 0)
+    {
+        return -1;
+    }
+    if (o->config == NULL)
+    {
+        return options_check(o);
+    }
+
+    const char *config = o->config;
+    options_init(o);
+    o->devices_given = 0;
+    o->irqs_given = 0;
+    o->rules_given = 0;
+    o->nodes_given = 0;
+    if (config_read(config, gs_long_options, option_apply, o, config_text) < 0 || options_parse(o, argc, argv) < 0)
+    {
+        return -1;
+    }
+
+    return options_check(o);
+}
+
+/**
+ * @brief Close sinks that were opened but not started
+ * 
+ * @param sinks Sinks
+ * @param nsinks Number of sinks
+ */
+static void sinks_discard(sink *sinks, size_t nsinks)
+{
+    for (size_t i = 0; i < nsinks; i++)
+    {
+        if (sinks[i].ops->close != NULL)
+        {
+            sinks[i].ops->close(sinks[i].ctx);
+        }
+    }
+}
+
+/**
+ * @brief Open the sinks selected by the options
+ * @details Closes the sinks already opened when one of them fails.
+ * 
+ * @param o Options
+ * @param sinks Filled with the opened sinks
+ * @return int Number of sinks, -1 on error
+ */
+static int sinks_open(app_options *o, sink *sinks)
+{
+    size_t nsinks = 0;
+
+    /* Without another consumer, samples go to stdout unless told otherwise */
+    int exported = o->capture.prefix != NULL || o->summary_path != NULL
+        || o->net.udp != NULL || o->net.tcp_port != 0 || o->metrics_port != 0
+        || o->control_path != NULL;
+    const char *output_path = o->output_path;
+    if (output_path == NULL && !exported && !o->daemon)
+    {
+        output_path = "-";
+    }
+
+    if (output_path != NULL)
+    {
+        if (output_open(&sinks[nsinks], output_path, o->output_format, o->sampler.hz, o->sampler.base_hz > 0) < 0)
+        {
+            sinks_discard(sinks, nsinks);
+            return -1;
+        }
+        nsinks++;
+    }
+    if (o->capture.prefix != NULL)
+    {
+        o->capture.sample_rate = o->sampler.hz;
+        if (capture_open(&sinks[nsinks], &o->capture) < 0)
+        {
+            sinks_discard(sinks, nsinks);
+            return -1;
+        }
+        nsinks++;
+    }
+    if (o->summary_path != NULL)
+    {
+        if (summary_open(&sinks[nsinks], o->summary_path, o->summary_interval_ns) < 0)
+        {
+            sinks_discard(sinks, nsinks);
+            return -1;
+        }
+        nsinks++;
+    }
+    if (o->net.udp != NULL || o->net.tcp_port != 0)
+    {
+        o->net.sample_rate = o->sampler.hz;
+        if (net_open(&sinks[nsinks], &o->net) < 0)
+        {
+            sinks_discard(sinks, nsinks);
+            return -1;
+        }
+        nsinks++;
+    }
+    if (o->metrics_port != 0)
+    {
+        metrics_config metrics_cfg = { .port = o->metrics_port, .devices = gs_devices, .ndevices = gs_ndevices };
+
+        if (metrics_open(&sinks[nsinks], &metrics_cfg) < 0)
+        {
+            sinks_discard(sinks, nsinks);
+            return -1;
+        }
+        nsinks++;
+    }
+    if (o->control_path != NULL)
+    {
+        control_config control_cfg = { .path = o->control_path, .devices = gs_devices, .ndevices = gs_ndevices };
+
+        if (control_open(&sinks[nsinks], &control_cfg) < 0)
+        {
+            sinks_discard(sinks, nsinks);
+            return -1;
+        }
+        nsinks++;
+    }
+    if (o->nrules > 0)
+    {
+        rules_config rules_cfg = { .rules = o->rules, .nrules = o->nrules, .devices = gs_devices, .ndevices = gs_ndevices };
+
+        if (rules_open(&sinks[nsinks], &rules_cfg) < 0)
+        {
+            sinks_discard(sinks, nsinks);
+            return -1;
+        }
+        nsinks++;
+    }
+
+    return (int)nsinks;
+}
+
+/**
+ * @brief Size the arena of a sampling run
+ * @details A ring per sink and acquisition thread, which the ring capacity
+ *              scales, and ARENA_FIXED_SIZE for the buffers of the sinks.
+ *              Only what is allocated is ever backed by memory.
+ * 
+ * @param o Options
+ * @return size_t Arena size in bytes
+ */
+static size_t arena_size(const app_options *o)
+{
+    return ARENA_FIXED_SIZE + SINKS_MAX * sampler_threads(gs_devices, gs_ndevices) * ring_bytes(o->ring_capacity);
+}
+
+/**
+ * @brief Open and configure the devices
+ * @details On a reload with the same device list the devices stay open and
+ *              are only reconfigured, so a long-running service pays the open
+ *              and setup ioctls once. A new device list is opened and set up
+ *              in the spare set before the running devices are closed, so
+ *              when one of its devices is missing or rejects its speed the
+ *              running devices are kept.
+ * 
+ * @param o Options
+ * @param prev Options the devices were set up with, or NULL on the first call
+ * @return int 0 on success, -1 if a device could not be opened or configured,
+ *              or calibration failed on the devices now running
+ */
+static int devices_setup(const app_options *o, const app_options *prev)
+{
+    const char *default_path = SPI_DEVICE;
+    const char *const *paths = o->ndevice_paths > 0 ? o->device_paths : &default_path;
+    size_t npaths = o->ndevice_paths > 0 ? o->ndevice_paths : 1;
+    int reopen = prev == NULL || npaths != gs_ndevices;
+    spi_device *devs = gs_devices;
+    size_t ndevs = gs_ndevices;
+    int ret = 0;
+
+    for (size_t i = 0; !reopen && i < npaths; i++)
+    {
+        reopen = strcmp(paths[i], gs_devices[i].path) != 0;
+    }
+
+    if (reopen)
+    {
+        devs = gs_devices == gs_device_sets[0] ? gs_device_sets[1] : gs_device_sets[0];
+        for (ndevs = 0; ndevs < npaths; ndevs++)
+        {
+            if (spi_init(&devs[ndevs], paths[ndevs], ndevs, o->wait_ns) < 0)
+            {
+                ret = -1;
+                break;
+            }
+        }
+    }
+
+    for (size_t i = 0; ret == 0 && i < ndevs; i++)
+    {
+        spi_device *dev = &devs[i];
+        uint32_t speed_hz = o->speed_hz ? o->speed_hz : SPI_SPEED_HZ;
+
+        dev->protocol = o->protocol;
+        dev->crc = o->crc;
+        dev->retries = o->retries;
+        dev->tick_hz = o->tick_hz;
+        dev->shunt_uohm = o->shunt_uohm;
+
+        if (!o->calibrate && speed_hz != dev->speed_hz && spi_set_speed(dev, speed_hz) < 0)
+        {
+            ret = -1;
+        }
+    }
+
+    if (reopen)
+    {
+        /* Only a complete new set replaces the running one */
+        spi_device *closed = ret == 0 ? gs_devices : devs;
+        size_t nclosed = ret == 0 ? gs_ndevices : ndevs;
+
+        for (size_t i = 0; i < nclosed; i++)
+        {
+            spi_close(&closed[i]);
+        }
+        if (ret < 0)
+        {
+            return -1;
+        }
+        gs_devices = devs;
+        gs_ndevices = ndevs;
+        gs_menu_device = &gs_devices[0];
+    }
+    if (ret < 0)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; o->calibrate && (reopen || !prev->calibrate) && i < gs_ndevices; i++)
+    {
+        if (calibrate_speed(&gs_devices[i], o->speed_hz ? o->speed_hz : CALIBRATE_MAX_HZ, CALIBRATE_ROUNDS) < 0)
+        {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Go back to the settings that ran before a reload
+ * 
+ * @param o Options, set back to prev
+ * @param prev Settings before the reload
+ * @return int 0 on success, -1 if the devices could not be set up again
+ */
+static int options_revert(app_options *o, const app_options *prev)
+{
+    app_options failed = *o;
+
+    fprintf(stderr, "Invalid configuration, keeping the running one\n");
+    *o = *prev;
+    if (o->trace_path == NULL || failed.trace_path == NULL)
+    {
+        trace_arm(o->trace_path != NULL);
+    }
+
+    return devices_setup(o, &failed);
+}
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+int main(int argc, char **argv)
+{
+    app_options options, prev;
+    char *config_text, *prev_text = NULL;
+    int opt;
+
+    /* Actions and invalid options are handled before anything else */
+    while ((opt = getopt_long(argc, argv, gs_short_options, gs_long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'd':
+                if (archive_probe(optarg))
+                {
+                    return archive_decode_csv(optarg, stdout) < 0 ? 1 : 0;
+                }
+                return record_decode_csv(optarg, stdout) < 0 ? 1 : 0;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            case '?':
+                print_usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if (options_load(&options, argc, argv, &config_text) < 0)
+    {
+        exit(1);
+    }
+
+    if (options.daemon)
+    {
+        if (options.sampler.hz == 0 && options.collector.nnodes == 0)
+        {
+            fprintf(stderr, "Daemon mode needs a sampling rate\n");
+            exit(1);
+        }
+        if (daemon_lock(options.pidfile) < 0)
+        {
+            exit(1);
+        }
+    }
+
+    if (options.collector.nnodes > 0)
+    {
+        if (options.daemon && daemon_detach(options.logfile) < 0)
+        {
+            exit(1);
+        }
+        int ret = collect_run(&options);
+
+        free(config_text);
+        daemon_stop();
+        return ret < 0 ? 1 : 0;
+    }
+
+    trace_arm(options.trace_path != NULL);
+    int ret = devices_setup(&options, NULL);
+
+    /* Detach once the devices are set up, so the init script sees their errors */
+    if (gs_ndevices == 0 || (options.daemon && (ret < 0 || daemon_detach(options.logfile) < 0)))
+    {
+        daemon_stop();
+        exit(1);
+    }
+
+    if (options.bench.iterations > 0)
+    {
+        options.bench.max_hz = options.speed_hz ? options.speed_hz : BENCH_MAX_HZ;
+        options.bench.pipeline = options.sampler.pipeline;
+        for (size_t i = 0; i < gs_ndevices; i++)
+        {
+            if (bench_run(&gs_devices[i], &options.bench, stdout, i == 0) < 0)
+            {
+                ret = -1;
+            }
+        }
+        if (options.trace_path != NULL)
+        {
+            trace_dump(options.trace_path);
+        }
+    }
+
+    int reloaded = 0;                   /* prev and prev_text hold the settings before a reload */
+
+    while (options.sampler.hz > 0 && options.bench.iterations == 0)
+    {
+        sink sinks[SINKS_MAX] = {0};
+
+        if (arena_init(arena_size(&options)) < 0)
+        {
+            ret = -1;
+            break;
+        }
+        int nsinks = sinks_open(&options, sinks);
+
+        gs_reload = 0;
+        if (nsinks >= 0)
+        {
+            ret = sample_run(&options.sampler, sinks, nsinks, options.ring_capacity);
+        }
+        arena_release();
+        if (nsinks >= 0 && options.trace_path != NULL)
+        {
+            trace_dump(options.trace_path);
+        }
+
+        if ((nsinks < 0 || ret < 0) && reloaded)
+        {
+            /* The new settings failed to start, go back to the running ones */
+            ret = options_revert(&options, &prev);
+            free(config_text);
+            config_text = prev_text;
+            reloaded = 0;
+            continue;
+        }
+        if (nsinks < 0)
+        {
+            ret = -1;
+            break;
+        }
+        if (reloaded)
+        {
+            free(prev_text);
+            reloaded = 0;
+        }
+        if (!options.daemon || !gs_reload)
+        {
+            break;
+        }
+
+        /* Reload, keeping the running settings if the new ones are invalid */
+        fprintf(stderr, "Reloading the configuration\n");
+        prev = options;
+        prev_text = config_text;
+        if (options_load(&options, argc, argv, &config_text) < 0 || options.sampler.hz == 0)
+        {
+            fprintf(stderr, "Invalid configuration, keeping the running one\n");
+            free(config_text);
+            options = prev;
+            config_text = prev_text;
+            continue;
+        }
+        options.daemon = 1;
+        if (options.trace_path == NULL || prev.trace_path == NULL)
+        {
+            trace_arm(options.trace_path != NULL);
+        }
+        if (devices_setup(&options, &prev) < 0)
+        {
+            ret = options_revert(&options, &prev);
+            free(config_text);
+            config_text = prev_text;
+            continue;
+        }
+        reloaded = 1;
+    }
+
+    if (options.sampler.hz == 0 && !options.calibrate && !options.daemon && options.bench.iterations == 0)
+    {
+        menu_run();
+    }
+
+    for (size_t i = 0; i < gs_ndevices; i++)
+    {
+        spi_close(&gs_devices[i]);
+    }
+    free(config_text);
+    daemon_stop();
+
+    return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,195 @@
+/**
+ * @file    ina219.c
+ * @brief   INA219 register conversion
+ * @details The current and power resolutions follow from the calibration
+ *              and the shunt: current LSB = 0.04096 V / (cal * shunt), power
+ *              LSB = 20 * current LSB. They are computed once per reply as
+ *              fixed-point factors, so a batch is converted with integer
+ *              multiplications down to nanoamperes, nanowatts and
+ *              microvolts, and only the result is turned into floats. The
+ *              registers of a reply are gathered in a raw_block and
+ *              converted by block_convert().
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <string.h>
+#include <math.h>
+
+#include "ina219.h"
+#include "block.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define INA219_CAL_NA_UOHM 40960000000000ULL /* 0.04096 V as cal * shunt in uohm * current LSB in nA */
+#define INA219_CURRENT_Q16_MAX (1ULL << 40) /* Coarsest current resolution, about 16 mA */
+#define INA219_SHUNT_MIN_UOHM 1000  /* Smallest shunt the products are sized for */
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static uint16_t ina219_get16(const uint8_t *p);
+static void ina219_put16(uint8_t *p, uint16_t value);
+static long ina219_clamp(double value, long lo, long hi);
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Read a big endian register
+ * 
+ * @param p Register bytes
+ * @return uint16_t Register value
+ */
+static uint16_t ina219_get16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+/**
+ * @brief Write a big endian register
+ * 
+ * @param p Register bytes
+ * @param value Register value
+ */
+static void ina219_put16(uint8_t *p, uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+/**
+ * @brief Round a value to the range of a register
+ * 
+ * @param value Value in register units
+ * @param lo Lowest register value
+ * @param hi Highest register value
+ * @return long Register value
+ */
+static long ina219_clamp(double value, long lo, long hi)
+{
+    long v = lround(value);
+
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Compute the conversion factors of a calibration
+ * 
+ * @param s Conversion factors
+ * @param cal Calibration register
+ * @param shunt_uohm Shunt resistance in micro-ohms
+ * @return int 0 on success, -1 if the calibration does not fit the shunt
+ */
+int ina219_scale_init(ina219_scale *s, uint16_t cal, uint32_t shunt_uohm)
+{
+    uint64_t divisor = (uint64_t)cal * shunt_uohm;
+
+    if (cal == 0 || shunt_uohm < INA219_SHUNT_MIN_UOHM
+        || (INA219_CAL_NA_UOHM * INA219_Q16_ONE) / divisor > INA219_CURRENT_Q16_MAX)
+    {
+        return -1;
+    }
+
+    s->current_q16 = (INA219_CAL_NA_UOHM * INA219_Q16_ONE) / divisor;
+    s->power_q16 = s->current_q16 * INA219_POWER_LSB_RATIO;
+    s->shunt_uohm = shunt_uohm;
+
+    return 0;
+}
+
+/**
+ * @brief Compute the calibration register for a current resolution
+ * 
+ * @param current_lsb_na Current resolution in nanoamperes
+ * @param shunt_uohm Shunt resistance in micro-ohms
+ * @return uint16_t Calibration register
+ */
+uint16_t ina219_calibration(uint32_t current_lsb_na, uint32_t shunt_uohm)
+{
+    uint64_t cal = INA219_CAL_NA_UOHM / ((uint64_t)current_lsb_na * shunt_uohm);
+
+    return cal > 0xfffe ? 0xfffe : (uint16_t)cal;
+}
+
+/**
+ * @brief Convert a batch of raw samples into packed samples
+ * @details On a math overflow the current is taken from the shunt voltage
+ *              instead, and the power from that current and the bus voltage.
+ * 
+ * @param shunt_uohm Shunt resistance in micro-ohms
+ * @param raw Calibration register followed by the raw samples
+ * @param count Number of samples
+ * @param samples Filled with count packed samples of SPI_SAMPLE_LEN bytes
+ * @return int Number of samples, -1 if the count or the calibration is invalid
+ */
+int ina219_decode(uint32_t shunt_uohm, const uint8_t *raw, int count, uint8_t *samples)
+{
+    ina219_scale s;
+    raw_block regs;
+    sample_block blk;
+
+    if (count < 0 || count > BLOCK_LEN || ina219_scale_init(&s, ina219_get16(raw), shunt_uohm) < 0)
+    {
+        return -1;
+    }
+
+    raw += SPI_RAW_CAL_LEN;
+    regs.n = count;
+    for (int k = 0; k < count; k++, raw += SPI_RAW_SAMPLE_LEN)
+    {
+        regs.shunt[k] = (int16_t)ina219_get16(raw);
+        regs.bus[k] = ina219_get16(raw + 2);
+        regs.current[k] = (int16_t)ina219_get16(raw + 4);
+        regs.power[k] = ina219_get16(raw + 6);
+    }
+
+    block_convert(&regs, &s, &blk);
+
+    for (int k = 0; k < count; k++)
+    {
+        homeoffice_data data = {
+            .voltage = blk.voltage[k], .current = blk.current[k], .power = blk.power[k], .relay = blk.relay[k],
+        };
+
+        memcpy(samples + k * SPI_SAMPLE_LEN, &data, SPI_SAMPLE_LEN);
+    }
+
+    return count;
+}
+
+/**
+ * @brief Convert a reading into raw registers, as the device would read them
+ * @details Readings beyond the current or power range set the math overflow
+ *              flag, as the INA219 does.
+ * 
+ * @param s Conversion factors of the calibration in use
+ * @param data Reading
+ * @param raw Filled with SPI_RAW_SAMPLE_LEN bytes
+ */
+void ina219_encode(const ina219_scale *s, const homeoffice_data *data, uint8_t *raw)
+{
+    double current_lsb_na = (double)s->current_q16 / INA219_Q16_ONE;
+    double current_na = data->current * 1e9;
+    double current = current_na / current_lsb_na;
+    double power = data->power * 1e9 / (current_lsb_na * INA219_POWER_LSB_RATIO);
+    long bus = ina219_clamp(data->voltage * 1e6 / INA219_BUS_LSB_UV, 0, 0xffff >> INA219_BUS_SHIFT);
+    int ovf = fabs(current) > INT16_MAX || power > 0xffff;
+
+    ina219_put16(raw, ina219_clamp(current_na * s->shunt_uohm / 1e6 / INA219_SHUNT_LSB_NV, INT16_MIN, INT16_MAX));
+    ina219_put16(raw + 2, bus << INA219_BUS_SHIFT | INA219_BUS_CNVR
+        | (data->relay ? INA219_BUS_RELAY : 0) | (ovf ? INA219_BUS_OVF : 0));
+    ina219_put16(raw + 4, ina219_clamp(current, INT16_MIN, INT16_MAX));
+    ina219_put16(raw + 6, ina219_clamp(power, 0, 0xffff));
+}
@@ -0,0 +1,59 @@
+/**
+ * @file    ina219.h
+ * @brief   INA219 register conversion
+ * @details In raw register mode the device forwards the shunt, bus voltage,
+ *              current and power registers of its INA219 as read over I2C,
+ *              big endian, with the calibration register once per reply.
+ *              The firmware keeps the relay state in the reserved bit 2 of
+ *              the bus voltage register. The host converts them with the
+ *              shunt resistance, which the calibration was computed for.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef INA219_H
+#define INA219_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdint.h>
+
+#include "spi.h"
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define INA219_SHUNT_LSB_NV 10000   /* Shunt voltage resolution */
+#define INA219_BUS_LSB_UV 4000      /* Bus voltage resolution */
+#define INA219_BUS_SHIFT 3          /* Bus voltage bits above the flags */
+#define INA219_BUS_OVF 0x0001       /* Math overflow: current and power are invalid */
+#define INA219_BUS_CNVR 0x0002      /* Conversion ready */
+#define INA219_BUS_RELAY 0x0004     /* Reserved bit set by the firmware while the relay is on */
+#define INA219_POWER_LSB_RATIO 20   /* Power resolution in current resolutions */
+#define INA219_SHUNT_DEFAULT_UOHM 100000 /* Shunt of the device boards */
+#define INA219_Q16_ONE 65536        /* 1.0 in the fixed-point factors */
+#define INA219_Q16_SHIFT 16         /* log2 of INA219_Q16_ONE */
+
+/* *************************
+ * PUBLIC TYPES DEFINITION *
+ * *************************/
+
+/* Conversion factors of one calibration, in 2^-16 units */
+typedef struct ina219_scale{
+    uint64_t current_q16;           /* Current resolution in 2^-16 nA */
+    uint64_t power_q16;             /* Power resolution in 2^-16 nW */
+    uint32_t shunt_uohm;
+} ina219_scale;
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+int ina219_scale_init(ina219_scale *s, uint16_t cal, uint32_t shunt_uohm);
+uint16_t ina219_calibration(uint32_t current_lsb_na, uint32_t shunt_uohm);
+int ina219_decode(uint32_t shunt_uohm, const uint8_t *raw, int count, uint8_t *samples);
+void ina219_encode(const ina219_scale *s, const homeoffice_data *data, uint8_t *raw);
+
+#endif /* INA219_H */
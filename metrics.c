@@ -0,0 +1,566 @@
+/**
+ * @file    metrics.c
+ * @brief   Prometheus metrics endpoint
+ * @details The sink thread keeps the last sample and the energy of every
+ *              device and renders the whole response into one of two buffers
+ *              every METRICS_RENDER_NS, then publishes it. The HTTP thread
+ *              pins the published buffer with a reader count while sending it,
+ *              and the renderer skips a turn rather than overwrite a pinned
+ *              buffer, so neither side ever waits for the other.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include "metrics.h"
+#include "sampler.h"
+#include "stats.h"
+#include "timeutil.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define METRICS_BUFFER_SIZE (64 * 1024) /* Rendered response size limit */
+#define METRICS_RENDER_NS (250 * NSEC_PER_MSEC) /* Response refresh interval */
+#define METRICS_POLL_MS 200         /* Stop flag check interval of the HTTP thread */
+#define METRICS_TIMEOUT_S 1         /* Socket timeout of a scrape */
+#define METRICS_REQUEST_MAX 1024    /* Request bytes read */
+#define METRICS_HEADER_MAX 256      /* Response header length */
+#define METRICS_LISTEN_BACKLOG 8    /* Pending HTTP connections */
+
+/* **************************
+ * PRIVATE TYPES DEFINITION *
+ * **************************/
+
+/* Rendered response */
+typedef struct metrics_buffer{
+    char data[METRICS_BUFFER_SIZE];
+    size_t len;
+    atomic_int readers;             /* HTTP threads sending the buffer */
+} metrics_buffer;
+
+/* Metrics sink context */
+typedef struct metrics_ctx{
+    metrics_config cfg;
+
+    /* Sink thread state */
+    homeoffice_data last[SPI_DEVICES_MAX];
+    stats_energy energy[SPI_DEVICES_MAX];
+    int seen[SPI_DEVICES_MAX];
+    uint64_t next_render_ns;
+
+    /* Published response */
+    metrics_buffer buffers[2];
+    atomic_int current;
+
+    /* HTTP server */
+    int listen_fd;
+    pthread_t thread;
+    atomic_int stop;
+} metrics_ctx;
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static void metrics_printf(metrics_buffer *b, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void metrics_family(metrics_buffer *b, const char *name, const char *type, const char *help);
+static void metrics_device_counter(metrics_ctx *m, metrics_buffer *b, const char *name,
+    const char *help, size_t offset);
+static void metrics_render(metrics_ctx *m);
+static void metrics_tick(metrics_ctx *m);
+static int metrics_send_all(int fd, struct iovec *iov, int iovcnt);
+static void metrics_serve(metrics_ctx *m, int fd);
+static void *metrics_http_thread(void *arg);
+static void metrics_write(void *ctx, const sample_record *recs, size_t n);
+static void metrics_flush(void *ctx);
+static void metrics_close(void *ctx);
+
+/* *************************************
+ * PRIVATE GLOBAL VARIABLES DEFINITION *
+ * *************************************/
+
+static const sink_ops gs_metrics_ops = {
+    .write = metrics_write,
+    .flush = metrics_flush,
+    .close = metrics_close,
+};
+
+static const char gs_metrics_not_found[] =
+    "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Append formatted text to a response buffer
+ * @details Output past the end of the buffer is dropped.
+ * 
+ * @param b Response buffer
+ * @param fmt printf format
+ */
+static void metrics_printf(metrics_buffer *b, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (b->len >= METRICS_BUFFER_SIZE - 1)
+    {
+        return;
+    }
+
+    va_start(ap, fmt);
+    n = vsnprintf(b->data + b->len, METRICS_BUFFER_SIZE - b->len, fmt, ap);
+    va_end(ap);
+
+    if (n > 0)
+    {
+        b->len += n;
+        if (b->len > METRICS_BUFFER_SIZE - 1)
+        {
+            b->len = METRICS_BUFFER_SIZE - 1;
+        }
+    }
+}
+
+/**
+ * @brief Append the HELP and TYPE lines of a metric family
+ * 
+ * @param b Response buffer
+ * @param name Metric name
+ * @param type Metric type
+ * @param help Description
+ */
+static void metrics_family(metrics_buffer *b, const char *name, const char *type, const char *help)
+{
+    metrics_printf(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * @brief Append a per-device counter taken from the link statistics
+ * 
+ * @param m Metrics context
+ * @param b Response buffer
+ * @param name Metric name
+ * @param help Description
+ * @param offset Offset of the counter in spi_stats
+ */
+static void metrics_device_counter(metrics_ctx *m, metrics_buffer *b, const char *name,
+    const char *help, size_t offset)
+{
+    metrics_family(b, name, "counter", help);
+    for (size_t d = 0; d < m->cfg.ndevices; d++)
+    {
+        _Atomic uint64_t *counter = (_Atomic uint64_t *)((char *)&m->cfg.devices[d].stats + offset);
+
+        metrics_printf(b, "%s{device=\"%s\"} %llu\n", name, m->cfg.devices[d].path,
+            (unsigned long long)atomic_load_explicit(counter, memory_order_relaxed));
+    }
+}
+
+/**
+ * @brief Render the response into the unpublished buffer and publish it
+ * @details Skipped when the HTTP thread is still sending that buffer from an
+ *              earlier turn.
+ * 
+ * @param m Metrics context
+ */
+static void metrics_render(metrics_ctx *m)
+{
+    metrics_buffer *b = &m->buffers[!atomic_load(&m->current)];
+    sampler_stats ss;
+
+    if (atomic_load(&b->readers) != 0)
+    {
+        return;
+    }
+    b->len = 0;
+
+    static const struct {
+        const char *name;
+        const char *help;
+        int field;
+    } gauges[] = {
+        { "homeoffice_voltage_volts", "Bus voltage of the last sample.", 0 },
+        { "homeoffice_current_amperes", "Current of the last sample.", 1 },
+        { "homeoffice_power_watts", "Power of the last sample.", 2 },
+        { "homeoffice_relay_state", "Relay state of the last sample, 1 when on.", 3 },
+    };
+    for (size_t g = 0; g < sizeof(gauges) / sizeof(gauges[0]); g++)
+    {
+        metrics_family(b, gauges[g].name, "gauge", gauges[g].help);
+        for (size_t d = 0; d < m->cfg.ndevices; d++)
+        {
+            const homeoffice_data *data = &m->last[d];
+            double value = gauges[g].field == 0 ? data->voltage
+                : gauges[g].field == 1 ? data->current
+                : gauges[g].field == 2 ? data->power : data->relay;
+
+            if (m->seen[d])
+            {
+                metrics_printf(b, "%s{device=\"%s\"} %.6g\n", gauges[g].name, m->cfg.devices[d].path, value);
+            }
+        }
+    }
+
+    metrics_family(b, "homeoffice_energy_watt_hours_total", "counter", "Energy consumed since startup.");
+    for (size_t d = 0; d < m->cfg.ndevices; d++)
+    {
+        metrics_printf(b, "homeoffice_energy_watt_hours_total{device=\"%s\"} %.9g\n",
+            m->cfg.devices[d].path, stats_energy_wh(&m->energy[d]));
+    }
+
+    metrics_device_counter(m, b, "homeoffice_spi_transfers_total", "SPI request attempts.",
+        offsetof(spi_stats, transfers));
+    metrics_device_counter(m, b, "homeoffice_spi_retries_total", "SPI request attempts after a failure.",
+        offsetof(spi_stats, retries));
+    metrics_device_counter(m, b, "homeoffice_spi_ioctl_errors_total", "Failed SPI_IOC_MESSAGE calls.",
+        offsetof(spi_stats, ioctl_errors));
+    metrics_device_counter(m, b, "homeoffice_spi_echo_errors_total", "Replies not echoing the command.",
+        offsetof(spi_stats, echo_errors));
+    metrics_device_counter(m, b, "homeoffice_spi_crc_errors_total", "Replies with a bad CRC.",
+        offsetof(spi_stats, crc_errors));
+    metrics_device_counter(m, b, "homeoffice_spi_failures_total", "SPI requests given up after all retries.",
+        offsetof(spi_stats, failures));
+
+    metrics_family(b, "homeoffice_spi_transfer_seconds", "histogram", "Latency of SPI request attempts.");
+    for (size_t d = 0; d < m->cfg.ndevices; d++)
+    {
+        const spi_stats *st = &m->cfg.devices[d].stats;
+        const char *path = m->cfg.devices[d].path;
+        uint64_t cumulative = 0;
+
+        for (unsigned int k = 0; k < SPI_LATENCY_BUCKETS; k++)
+        {
+            cumulative += atomic_load_explicit(&st->latency[k], memory_order_relaxed);
+            if (k < SPI_LATENCY_BUCKETS - 1)
+            {
+                metrics_printf(b, "homeoffice_spi_transfer_seconds_bucket{device=\"%s\",le=\"%g\"} %llu\n",
+                    path, spi_latency_bound_us(k) / 1e6, (unsigned long long)cumulative);
+            }
+            else
+            {
+                metrics_printf(b, "homeoffice_spi_transfer_seconds_bucket{device=\"%s\",le=\"+Inf\"} %llu\n",
+                    path, (unsigned long long)cumulative);
+            }
+        }
+        metrics_printf(b, "homeoffice_spi_transfer_seconds_sum{device=\"%s\"} %.9g\n", path,
+            (double)atomic_load_explicit(&st->latency_ns, memory_order_relaxed) / NSEC_PER_SEC);
+        metrics_printf(b, "homeoffice_spi_transfer_seconds_count{device=\"%s\"} %llu\n", path,
+            (unsigned long long)cumulative);
+    }
+
+    sampler_get_stats(&ss);
+    metrics_family(b, "homeoffice_samples_total", "counter", "Samples taken.");
+    metrics_printf(b, "homeoffice_samples_total %llu\n", (unsigned long long)ss.samples);
+    metrics_family(b, "homeoffice_overruns_total", "counter", "Sample periods missed.");
+    metrics_printf(b, "homeoffice_overruns_total %llu\n", (unsigned long long)ss.overruns);
+    metrics_family(b, "homeoffice_read_errors_total", "counter", "Reads that failed after all retries.");
+    metrics_printf(b, "homeoffice_read_errors_total %llu\n", (unsigned long long)ss.errors);
+    metrics_family(b, "homeoffice_interrupt_reads_total", "counter", "Reads triggered by a GPIO interrupt line.");
+    metrics_printf(b, "homeoffice_interrupt_reads_total %llu\n", (unsigned long long)ss.interrupts);
+    metrics_family(b, "homeoffice_interrupt_errors_total", "counter", "GPIO interrupt lines dropped after an error.");
+    metrics_printf(b, "homeoffice_interrupt_errors_total %llu\n", (unsigned long long)ss.irq_errors);
+    metrics_family(b, "homeoffice_max_late_seconds", "gauge", "Worst sample deadline miss.");
+    metrics_printf(b, "homeoffice_max_late_seconds %.9g\n", (double)ss.max_late_ns / NSEC_PER_SEC);
+
+    uint64_t wakes = 0;
+    metrics_family(b, "homeoffice_wakeup_latency_seconds", "histogram",
+        "Delay from a sample deadline to the acquisition thread running.");
+    for (unsigned int k = 0; k < SAMPLER_WAKE_BUCKETS; k++)
+    {
+        wakes += ss.wake[k];
+        if (k < SAMPLER_WAKE_BUCKETS - 1)
+        {
+            metrics_printf(b, "homeoffice_wakeup_latency_seconds_bucket{le=\"%g\"} %llu\n",
+                sampler_wake_bound_us(k) / 1e6, (unsigned long long)wakes);
+        }
+        else
+        {
+            metrics_printf(b, "homeoffice_wakeup_latency_seconds_bucket{le=\"+Inf\"} %llu\n",
+                (unsigned long long)wakes);
+        }
+    }
+    metrics_printf(b, "homeoffice_wakeup_latency_seconds_sum %.9g\n", (double)ss.wake_ns / NSEC_PER_SEC);
+    metrics_printf(b, "homeoffice_wakeup_latency_seconds_count %llu\n", (unsigned long long)wakes);
+
+    atomic_store(&m->current, b == &m->buffers[1]);
+}
+
+/**
+ * @brief Render the response when it is due
+ * 
+ * @param m Metrics context
+ */
+static void metrics_tick(metrics_ctx *m)
+{
+    uint64_t now_ns = time_now_ns(CLOCK_MONOTONIC);
+
+    if (now_ns >= m->next_render_ns)
+    {
+        metrics_render(m);
+        m->next_render_ns = now_ns + METRICS_RENDER_NS;
+    }
+}
+
+/**
+ * @brief Send a gathered buffer completely
+ * 
+ * @param fd Socket
+ * @param iov Buffers, consumed as they are sent
+ * @param iovcnt Number of buffers
+ * @return int 0 on success, -1 on error or timeout
+ */
+static int metrics_send_all(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Answer one HTTP request
+ * 
+ * @param m Metrics context
+ * @param fd Client socket
+ */
+static void metrics_serve(metrics_ctx *m, int fd)
+{
+    char request[METRICS_REQUEST_MAX];
+    char header[METRICS_HEADER_MAX];
+    ssize_t n = recv(fd, request, sizeof(request) - 1, 0);
+
+    if (n <= 0)
+    {
+        return;
+    }
+    request[n] = '\0';
+
+    if (strncmp(request, "GET /metrics", 12) != 0 || (request[12] != ' ' && request[12] != '?'))
+    {
+        struct iovec iov = { .iov_base = (void *)gs_metrics_not_found, .iov_len = strlen(gs_metrics_not_found) };
+        metrics_send_all(fd, &iov, 1);
+        return;
+    }
+
+    /* Pin the published buffer, retrying if it was replaced meanwhile */
+    metrics_buffer *b;
+    for (;;)
+    {
+        int current = atomic_load(&m->current);
+
+        b = &m->buffers[current];
+        atomic_fetch_add(&b->readers, 1);
+        if (atomic_load(&m->current) == current)
+        {
+            break;
+        }
+        atomic_fetch_sub(&b->readers, 1);
+    }
+
+    int len = snprintf(header, sizeof(header),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n\r\n", b->len);
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = len },
+        { .iov_base = b->data, .iov_len = b->len },
+    };
+    metrics_send_all(fd, iov, 2);
+
+    atomic_fetch_sub(&b->readers, 1);
+}
+
+/**
+ * @brief HTTP server thread
+ * @details Scrapes are served one at a time, each bounded by
+ *              METRICS_TIMEOUT_S, which is plenty for a few scrapers.
+ * 
+ * @param arg Metrics context
+ * @return void* NULL
+ */
+static void *metrics_http_thread(void *arg)
+{
+    metrics_ctx *m = arg;
+    struct pollfd pfd = { .fd = m->listen_fd, .events = POLLIN };
+    struct timeval timeout = { .tv_sec = METRICS_TIMEOUT_S };
+
+    while (!atomic_load(&m->stop))
+    {
+        if (poll(&pfd, 1, METRICS_POLL_MS) <= 0)
+        {
+            continue;
+        }
+
+        int fd = accept4(m->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        metrics_serve(m, fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Keep the last sample and the energy of every device
+ * 
+ * @param ctx Metrics context
+ * @param recs Samples
+ * @param n Number of samples
+ */
+static void metrics_write(void *ctx, const sample_record *recs, size_t n)
+{
+    metrics_ctx *m = ctx;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        uint8_t d = recs[i].device;
+
+        if (d < SPI_DEVICES_MAX)
+        {
+            m->last[d] = recs[i].data;
+            m->seen[d] = 1;
+            stats_energy_update(&m->energy[d], recs[i].timestamp_ns, recs[i].data.power);
+        }
+    }
+
+    metrics_tick(m);
+}
+
+/**
+ * @brief Refresh the response while the stream is idle
+ * 
+ * @param ctx Metrics context
+ */
+static void metrics_flush(void *ctx)
+{
+    metrics_tick(ctx);
+}
+
+/**
+ * @brief Stop the HTTP server
+ * 
+ * @param ctx Metrics context
+ */
+static void metrics_close(void *ctx)
+{
+    metrics_ctx *m = ctx;
+
+    atomic_store(&m->stop, 1);
+    pthread_join(m->thread, NULL);
+    close(m->listen_fd);
+    free(m);
+}
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Open a metrics endpoint sink
+ * @details The HTTP server starts right away, serving a response rendered
+ *              before the first sample.
+ * 
+ * @param s Sink to set up
+ * @param cfg Configuration
+ * @return int 0 on success, -1 on error
+ */
+int metrics_open(sink *s, const metrics_config *cfg)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(cfg->port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    int one = 1;
+
+    metrics_ctx *m = calloc(1, sizeof(metrics_ctx));
+    if (m == NULL)
+    {
+        return -1;
+    }
+    m->cfg = *cfg;
+
+    m->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m->listen_fd < 0)
+    {
+        perror("Error opening metrics socket");
+        free(m);
+        return -1;
+    }
+    setsockopt(m->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(m->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(m->listen_fd, METRICS_LISTEN_BACKLOG) < 0)
+    {
+        perror("Error listening on the metrics port");
+        close(m->listen_fd);
+        free(m);
+        return -1;
+    }
+
+    metrics_render(m);
+
+    int err = pthread_create(&m->thread, NULL, metrics_http_thread, m);
+    if (err != 0)
+    {
+        fprintf(stderr, "Error starting metrics thread: %s\n", strerror(err));
+        close(m->listen_fd);
+        free(m);
+        return -1;
+    }
+
+    s->name = "metrics";
+    s->ops = &gs_metrics_ops;
+    s->ctx = m;
+
+    return 0;
+}
@@ -0,0 +1,45 @@
+/**
+ * @file    metrics.h
+ * @brief   Prometheus metrics endpoint
+ * @details Serves the latest readings of every device and the acquisition
+ *              health counters on HTTP /metrics, in the Prometheus text
+ *              exposition format. The response is rendered by the sink thread
+ *              and only copied out by the HTTP thread, so scrapes never cause
+ *              SPI traffic and never touch the sampler.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include "sink.h"
+#include "spi.h"
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define METRICS_PORT_DEFAULT 9110   /* Default HTTP port */
+
+/* *************************
+ * PUBLIC TYPES DEFINITION *
+ * *************************/
+
+/* Metrics endpoint configuration */
+typedef struct metrics_config{
+    int port;                       /* HTTP listening port */
+    spi_device *devices;            /* Sampled devices, for their link statistics */
+    size_t ndevices;
+} metrics_config;
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+int metrics_open(sink *s, const metrics_config *cfg);
+
+#endif /* METRICS_H */
@@ -0,0 +1,590 @@
+/**
+ * @file    net.c
+ * @brief   Network export sink
+ * @details Samples are encoded into a batch of records with a single encoder,
+ *              so the batch is one contiguous delta-encoded stream. The batch
+ *              is sent when it is full or when its oldest sample has waited
+ *              NET_COALESCE_NS: over UDP as datagrams of NET_UDP_RECORDS
+ *              records, each behind its own header, in one sendmmsg() call;
+ *              over TCP as one gathered send per client. A TCP client starts
+ *              with a header rebased on the next batch, so every client
+ *              receives a valid capture stream. Clients are accepted and reaped
+ *              by polling an epoll set from the sink thread, which never blocks
+ *              on the network: unsent bytes are kept per client in a backlog
+ *              buffer from a pool set up at open, and a client that falls
+ *              NET_CLIENT_BACKLOG bytes behind, or finds the pool empty, is
+ *              disconnected.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "net.h"
+#include "record.h"
+#include "arena.h"
+#include "timeutil.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define NET_BATCH_RECORDS 512       /* Records encoded per batch */
+#define NET_UDP_RECORDS 64          /* Records per datagram, fits a 1500 byte MTU */
+#define NET_UDP_DATAGRAMS (NET_BATCH_RECORDS / NET_UDP_RECORDS) /* Datagrams per batch */
+#define NET_COALESCE_NS (20 * NSEC_PER_MSEC) /* Longest a sample waits for its batch */
+#define NET_CLIENT_BACKLOG (256 * 1024) /* Unsent bytes after which a client is dropped */
+#define NET_BACKLOG_BUFFERS 4       /* Clients that may lag behind at once */
+#define NET_LISTEN_BACKLOG 8        /* Pending TCP connections */
+#define NET_EPOLL_EVENTS 16         /* Events handled per poll */
+#define NET_ADDR_MAX 64             /* UDP destination string length */
+
+/* **************************
+ * PRIVATE TYPES DEFINITION *
+ * **************************/
+
+/* TCP client */
+typedef struct net_client{
+    int fd;
+    uint8_t *pending;               /* Backlog buffer of the bytes not accepted by the socket yet */
+    size_t pending_len;
+} net_client;
+
+/* Network sink context */
+typedef struct net_ctx{
+    double sample_rate;
+
+    /* Current batch */
+    record_encoder enc;
+    record_entry batch[NET_BATCH_RECORDS];
+    size_t n;
+    uint64_t first_ns;              /* Time of the oldest sample in the batch */
+    uint64_t base_ns[NET_UDP_DATAGRAMS]; /* Encoder time base at the start of each datagram */
+
+    /* UDP */
+    int udp_fd;
+    struct sockaddr_in udp_addr;
+    record_header udp_headers[NET_UDP_DATAGRAMS];
+    struct iovec udp_iov[NET_UDP_DATAGRAMS][2];
+    struct mmsghdr udp_msgs[NET_UDP_DATAGRAMS];
+    unsigned long long udp_errors;
+
+    /* TCP */
+    int listen_fd;
+    int epoll_fd;
+    net_client clients[NET_CLIENTS_MAX];
+    size_t nclients;
+    arena_pool backlog;             /* NET_CLIENT_BACKLOG byte buffers */
+} net_ctx;
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static uint64_t net_base_ns(net_ctx *net);
+static int net_udp_open(net_ctx *net, const net_config *cfg);
+static int net_tcp_open(net_ctx *net, int port);
+static void net_client_add(net_ctx *net, int fd);
+static void net_client_remove(net_ctx *net, size_t i);
+static int net_client_send(net_ctx *net, net_client *c, const void *data, size_t len);
+static void net_poll(net_ctx *net);
+static void net_send(net_ctx *net);
+static void net_write(void *ctx, const sample_record *recs, size_t n);
+static void net_flush(void *ctx);
+static void net_close(void *ctx);
+
+/* *************************************
+ * PRIVATE GLOBAL VARIABLES DEFINITION *
+ * *************************************/
+
+static const sink_ops gs_net_ops = {
+    .write = net_write,
+    .flush = net_flush,
+    .close = net_close,
+};
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Get the time base of the next encoded record
+ * 
+ * @param net Network context
+ * @return uint64_t Time base, as stored in a record header
+ */
+static uint64_t net_base_ns(net_ctx *net)
+{
+    return net->enc.last_us * NSEC_PER_USEC;
+}
+
+/**
+ * @brief Open the UDP socket and prepare the datagram descriptors
+ * 
+ * @param net Network context
+ * @param cfg Configuration
+ * @return int 0 on success, -1 on error
+ */
+static int net_udp_open(net_ctx *net, const net_config *cfg)
+{
+    char addr[NET_ADDR_MAX];
+    char *port;
+
+    snprintf(addr, sizeof(addr), "%s", cfg->udp);
+    port = strrchr(addr, ':');
+    if (port == NULL)
+    {
+        fprintf(stderr, "Invalid UDP destination: %s\n", cfg->udp);
+        return -1;
+    }
+    *port++ = '\0';
+
+    net->udp_addr.sin_family = AF_INET;
+    net->udp_addr.sin_port = htons(atoi(port));
+    if (inet_pton(AF_INET, addr, &net->udp_addr.sin_addr) != 1 || net->udp_addr.sin_port == 0)
+    {
+        fprintf(stderr, "Invalid UDP destination: %s\n", cfg->udp);
+        return -1;
+    }
+
+    net->udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (net->udp_fd < 0)
+    {
+        perror("Error opening UDP socket");
+        return -1;
+    }
+
+    if (IN_MULTICAST(ntohl(net->udp_addr.sin_addr.s_addr))
+        && setsockopt(net->udp_fd, IPPROTO_IP, IP_MULTICAST_TTL, &cfg->udp_ttl, sizeof(cfg->udp_ttl)) < 0)
+    {
+        perror("Error setting the multicast TTL");
+        close(net->udp_fd);
+        return -1;
+    }
+
+    for (int i = 0; i < NET_UDP_DATAGRAMS; i++)
+    {
+        net->udp_iov[i][0].iov_base = &net->udp_headers[i];
+        net->udp_iov[i][0].iov_len = sizeof(record_header);
+        net->udp_iov[i][1].iov_base = &net->batch[i * NET_UDP_RECORDS];
+
+        net->udp_msgs[i].msg_hdr.msg_name = &net->udp_addr;
+        net->udp_msgs[i].msg_hdr.msg_namelen = sizeof(net->udp_addr);
+        net->udp_msgs[i].msg_hdr.msg_iov = net->udp_iov[i];
+        net->udp_msgs[i].msg_hdr.msg_iovlen = 2;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Open the TCP listening socket and the epoll set
+ * 
+ * @param net Network context
+ * @param port Listening port
+ * @return int 0 on success, -1 on error
+ */
+static int net_tcp_open(net_ctx *net, int port)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    struct epoll_event ev = { .events = EPOLLIN };
+    int one = 1;
+
+    net->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (net->listen_fd < 0)
+    {
+        perror("Error opening TCP socket");
+        return -1;
+    }
+
+    setsockopt(net->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(net->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(net->listen_fd, NET_LISTEN_BACKLOG) < 0)
+    {
+        perror("Error listening on the TCP port");
+        close(net->listen_fd);
+        return -1;
+    }
+
+    net->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    ev.data.fd = net->listen_fd;
+    if (net->epoll_fd < 0 || epoll_ctl(net->epoll_fd, EPOLL_CTL_ADD, net->listen_fd, &ev) < 0)
+    {
+        perror("Error setting up epoll");
+        if (net->epoll_fd >= 0)
+        {
+            close(net->epoll_fd);
+        }
+        close(net->listen_fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Add an accepted TCP client
+ * @details The client gets a capture header whose time base is the one of
+ *              the next batch, so it decodes the stream from there on.
+ * 
+ * @param net Network context
+ * @param fd Client socket
+ */
+static void net_client_add(net_ctx *net, int fd)
+{
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.fd = fd };
+    record_encoder enc;
+    record_header hdr;
+    net_client *c;
+
+    if (net->nclients == NET_CLIENTS_MAX || epoll_ctl(net->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        close(fd);
+        return;
+    }
+
+    c = &net->clients[net->nclients++];
+    c->fd = fd;
+    c->pending = NULL;
+    c->pending_len = 0;
+
+    record_header_init(&hdr, net->sample_rate, net->n > 0 ? net->base_ns[0] : net_base_ns(net), &enc);
+    if (net_client_send(net, c, &hdr, sizeof(hdr)) < 0)
+    {
+        net_client_remove(net, net->nclients - 1);
+    }
+}
+
+/**
+ * @brief Disconnect a TCP client
+ * 
+ * @param net Network context
+ * @param i Index of the client
+ */
+static void net_client_remove(net_ctx *net, size_t i)
+{
+    net_client *c = &net->clients[i];
+
+    close(c->fd);
+    if (c->pending != NULL)
+    {
+        arena_pool_put(&net->backlog, c->pending);
+    }
+    net->clients[i] = net->clients[--net->nclients];
+}
+
+/**
+ * @brief Send the pending bytes of a TCP client followed by new data
+ * @details Whatever the socket does not take is kept in the backlog buffer
+ *              of the client, to be sent first next time. The buffer is taken
+ *              from the pool when the client first lags and given back once
+ *              it has caught up.
+ * 
+ * @param net Network context
+ * @param c Client
+ * @param data New data
+ * @param len Length of the new data
+ * @return int 0 on success, -1 if the client must be disconnected
+ */
+static int net_client_send(net_ctx *net, net_client *c, const void *data, size_t len)
+{
+    struct iovec iov[2] = {
+        { .iov_base = c->pending, .iov_len = c->pending_len },
+        { .iov_base = (void *)data, .iov_len = len },
+    };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+    size_t total = c->pending_len + len;
+    ssize_t sent = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    if (sent < 0)
+    {
+        if (errno != EAGAIN && errno != EINTR)
+        {
+            return -1;
+        }
+        sent = 0;
+    }
+    if ((size_t)sent == total)
+    {
+        if (c->pending != NULL)
+        {
+            arena_pool_put(&net->backlog, c->pending);
+            c->pending = NULL;
+        }
+        c->pending_len = 0;
+        return 0;
+    }
+    if (total - sent > NET_CLIENT_BACKLOG)
+    {
+        return -1;
+    }
+    if (c->pending == NULL)
+    {
+        c->pending = arena_pool_get(&net->backlog);
+        if (c->pending == NULL)
+        {
+            return -1;
+        }
+    }
+
+    /* Keep the unsent end of the backlog, then the unsent end of the data */
+    if ((size_t)sent < c->pending_len)
+    {
+        memmove(c->pending, c->pending + sent, c->pending_len - sent);
+        memcpy(c->pending + c->pending_len - sent, data, len);
+    }
+    else
+    {
+        memcpy(c->pending, (const uint8_t *)data + (sent - c->pending_len), total - sent);
+    }
+    c->pending_len = total - sent;
+
+    return 0;
+}
+
+/**
+ * @brief Accept new TCP clients and reap disconnected ones
+ * 
+ * @param net Network context
+ */
+static void net_poll(net_ctx *net)
+{
+    struct epoll_event events[NET_EPOLL_EVENTS];
+    int n = epoll_wait(net->epoll_fd, events, NET_EPOLL_EVENTS, 0);
+
+    for (int e = 0; e < n; e++)
+    {
+        int fd = events[e].data.fd;
+
+        if (fd == net->listen_fd)
+        {
+            int client;
+
+            while ((client = accept4(net->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+            {
+                net_client_add(net, client);
+            }
+            continue;
+        }
+
+        for (size_t i = 0; i < net->nclients; i++)
+        {
+            if (net->clients[i].fd != fd)
+            {
+                continue;
+            }
+
+            /* Clients only listen, anything they send is discarded */
+            char discard[256];
+            ssize_t len = read(fd, discard, sizeof(discard));
+
+            if ((events[e].events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) || len == 0
+                || (len < 0 && errno != EAGAIN && errno != EINTR))
+            {
+                net_client_remove(net, i);
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Send the current batch to every destination
+ * 
+ * @param net Network context
+ */
+static void net_send(net_ctx *net)
+{
+    if (net->listen_fd >= 0)
+    {
+        net_poll(net);
+    }
+
+    if (net->n == 0)
+    {
+        return;
+    }
+
+    if (net->udp_fd >= 0)
+    {
+        unsigned int datagrams = (net->n + NET_UDP_RECORDS - 1) / NET_UDP_RECORDS;
+
+        for (unsigned int i = 0; i < datagrams; i++)
+        {
+            size_t first = i * NET_UDP_RECORDS;
+            size_t count = net->n - first < NET_UDP_RECORDS ? net->n - first : NET_UDP_RECORDS;
+            record_encoder enc;
+
+            record_header_init(&net->udp_headers[i], net->sample_rate, net->base_ns[i], &enc);
+            net->udp_headers[i].count = count;
+            net->udp_iov[i][1].iov_len = count * sizeof(record_entry);
+        }
+
+        if (sendmmsg(net->udp_fd, net->udp_msgs, datagrams, 0) != (int)datagrams)
+        {
+            net->udp_errors++;
+        }
+    }
+
+    for (size_t i = 0; i < net->nclients; )
+    {
+        if (net_client_send(net, &net->clients[i], net->batch, net->n * sizeof(record_entry)) < 0)
+        {
+            net_client_remove(net, i);
+            continue;
+        }
+        i++;
+    }
+
+    net->n = 0;
+}
+
+/**
+ * @brief Encode samples into the batch, sending it when full
+ * 
+ * @param ctx Network context
+ * @param recs Samples
+ * @param n Number of samples
+ */
+static void net_write(void *ctx, const sample_record *recs, size_t n)
+{
+    net_ctx *net = ctx;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (net->n == 0)
+        {
+            net->first_ns = recs[i].timestamp_ns;
+        }
+        if (net->n % NET_UDP_RECORDS == 0)
+        {
+            net->base_ns[net->n / NET_UDP_RECORDS] = net_base_ns(net);
+        }
+
+        record_encode(&net->enc, &recs[i], &net->batch[net->n++]);
+        if (net->n == NET_BATCH_RECORDS)
+        {
+            net_send(net);
+        }
+    }
+}
+
+/**
+ * @brief Send the batch once its oldest sample has waited long enough
+ * 
+ * @param ctx Network context
+ */
+static void net_flush(void *ctx)
+{
+    net_ctx *net = ctx;
+
+    if (net->n > 0 && time_now_ns(CLOCK_MONOTONIC) - net->first_ns >= NET_COALESCE_NS)
+    {
+        net_send(net);
+    }
+    else if (net->listen_fd >= 0)
+    {
+        net_poll(net);
+    }
+}
+
+/**
+ * @brief Send the last batch and close the sockets
+ * 
+ * @param ctx Network context
+ */
+static void net_close(void *ctx)
+{
+    net_ctx *net = ctx;
+
+    net_send(net);
+
+    if (net->udp_fd >= 0)
+    {
+        if (net->udp_errors > 0)
+        {
+            fprintf(stderr, "UDP: %llu failed sends\n", net->udp_errors);
+        }
+        close(net->udp_fd);
+    }
+    if (net->listen_fd >= 0)
+    {
+        while (net->nclients > 0)
+        {
+            net_client_remove(net, 0);
+        }
+        close(net->epoll_fd);
+        close(net->listen_fd);
+    }
+
+    free(net);
+}
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Open a network export sink
+ * 
+ * @param s Sink to set up
+ * @param cfg Configuration
+ * @return int 0 on success, -1 on error
+ */
+int net_open(sink *s, const net_config *cfg)
+{
+    record_header hdr;
+
+    net_ctx *net = calloc(1, sizeof(net_ctx));
+    if (net == NULL)
+    {
+        return -1;
+    }
+
+    net->sample_rate = cfg->sample_rate;
+    net->udp_fd = -1;
+    net->listen_fd = -1;
+    net->epoll_fd = -1;
+
+    /* Start the delta stream at the current time */
+    record_header_init(&hdr, cfg->sample_rate, time_now_ns(CLOCK_MONOTONIC), &net->enc);
+
+    if (cfg->udp != NULL && net_udp_open(net, cfg) < 0)
+    {
+        free(net);
+        return -1;
+    }
+    if (cfg->tcp_port != 0 && (arena_pool_init(&net->backlog, NET_CLIENT_BACKLOG, NET_BACKLOG_BUFFERS) < 0
+        || net_tcp_open(net, cfg->tcp_port) < 0))
+    {
+        if (net->udp_fd >= 0)
+        {
+            close(net->udp_fd);
+        }
+        free(net);
+        return -1;
+    }
+
+    s->name = "network";
+    s->ops = &gs_net_ops;
+    s->ctx = net;
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+/**
+ * @file    net.h
+ * @brief   Network export sink
+ * @details Publishes the sample stream as binary capture records (see
+ *              record.h), both as batched UDP datagrams, typically to a
+ *              multicast group for dashboards, and to any number of TCP
+ *              clients for collectors. Samples are encoded once per batch and
+ *              the same bytes are sent to every destination.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef NET_H
+#define NET_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include "sink.h"
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define NET_UDP_TTL_DEFAULT 1       /* Default multicast TTL */
+#define NET_CLIENTS_MAX 32          /* Maximum TCP clients */
+
+/* *************************
+ * PUBLIC TYPES DEFINITION *
+ * *************************/
+
+/* Network export configuration */
+typedef struct net_config{
+    const char *udp;                /* UDP destination "<address>:<port>", or NULL */
+    int udp_ttl;                    /* Multicast TTL */
+    int tcp_port;                   /* TCP listening port, 0 for none */
+    double sample_rate;             /* Nominal sampling rate, stored in the headers */
+} net_config;
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+int net_open(sink *s, const net_config *cfg);
+
+#endif /* NET_H */
@@ -0,0 +1,417 @@
+/**
+ * @file    output.c
+ * @brief   Sample output sink
+ * @details CSV output formats samples with the time relative to the first
+ *              sample of the stream. Binary output encodes fixed-size records
+ *              into a large buffer that is handed to write() only when full,
+ *              so the file sees few, large writes. Archive output goes through
+ *              the same buffer one compressed block at a time.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "output.h"
+#include "record.h"
+#include "archive.h"
+#include "arena.h"
+#include "timeutil.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024) /* Output buffer size */
+
+/* **************************
+ * PRIVATE TYPES DEFINITION *
+ * **************************/
+
+/* Output sink context */
+typedef struct output_ctx{
+    int format;
+    int started;
+    double sample_rate;
+    int adaptive;                   /* CSV lines end with the decimated flag */
+    uint64_t start_ns;
+
+    /* CSV output */
+    FILE *fp;
+
+    /* Binary output */
+    int fd;
+    record_encoder enc;
+    size_t used;
+
+    /* Archive output */
+    archive_writer arc;
+
+    char *buffer;
+} output_ctx;
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static int output_write_all(int fd, const void *buf, size_t len);
+static void output_put(output_ctx *out, const void *data, size_t len);
+static void output_archive_header(output_ctx *out);
+static void output_archive_block(output_ctx *out, const void *block, size_t len);
+static void output_write(void *ctx, const sample_record *recs, size_t n);
+static void output_flush(void *ctx);
+static void output_close(void *ctx);
+
+/* *************************************
+ * PRIVATE GLOBAL VARIABLES DEFINITION *
+ * *************************************/
+
+static const sink_ops gs_output_ops = {
+    .write = output_write,
+    .flush = output_flush,
+    .close = output_close,
+};
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Write a whole buffer to a file descriptor
+ * 
+ * @param fd File descriptor
+ * @param buf Data
+ * @param len Length of the data
+ * @return int 0 on success, -1 on error
+ */
+static int output_write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("Error writing output");
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Append data to the binary output buffer, writing it out when full
+ * @details Data larger than the buffer, such as a long archive index, is
+ *              written directly.
+ * 
+ * @param out Output context
+ * @param data Data
+ * @param len Length of the data
+ */
+static void output_put(output_ctx *out, const void *data, size_t len)
+{
+    if (out->used + len > OUTPUT_BUFFER_SIZE)
+    {
+        output_write_all(out->fd, out->buffer, out->used);
+        out->used = 0;
+    }
+    if (len > OUTPUT_BUFFER_SIZE)
+    {
+        output_write_all(out->fd, data, len);
+        return;
+    }
+
+    memcpy(out->buffer + out->used, data, len);
+    out->used += len;
+}
+
+/**
+ * @brief Write the archive header
+ * 
+ * @param out Output context
+ */
+static void output_archive_header(output_ctx *out)
+{
+    archive_header hdr;
+
+    archive_header_init(&hdr, out->sample_rate, out->start_ns);
+    output_put(out, &hdr, sizeof(hdr));
+}
+
+/**
+ * @brief Write an archive block, and the index segment it fills
+ * 
+ * @param out Output context
+ * @param block Block, or NULL if none was completed
+ * @param len Length of the block
+ */
+static void output_archive_block(output_ctx *out, const void *block, size_t len)
+{
+    if (block == NULL)
+    {
+        return;
+    }
+
+    output_put(out, block, len);
+    block = archive_segment_full(&out->arc, &len);
+    if (block != NULL)
+    {
+        output_put(out, block, len);
+    }
+}
+
+/**
+ * @brief Write samples in the configured format
+ * 
+ * @param ctx Output context
+ * @param recs Samples
+ * @param n Number of samples
+ */
+static void output_write(void *ctx, const sample_record *recs, size_t n)
+{
+    output_ctx *out = ctx;
+
+    if (!out->started)
+    {
+        out->start_ns = recs[0].timestamp_ns;
+        out->started = 1;
+
+        if (out->format == OUTPUT_FORMAT_BINARY)
+        {
+            record_header hdr;
+
+            record_header_init(&hdr, out->sample_rate, out->start_ns, &out->enc);
+            output_put(out, &hdr, sizeof(hdr));
+        }
+        else if (out->format == OUTPUT_FORMAT_ARCHIVE)
+        {
+            output_archive_header(out);
+        }
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (out->format == OUTPUT_FORMAT_BINARY)
+        {
+            record_entry entry;
+
+            record_encode(&out->enc, &recs[i], &entry);
+            output_put(out, &entry, sizeof(entry));
+        }
+        else if (out->format == OUTPUT_FORMAT_ARCHIVE)
+        {
+            size_t len;
+            const void *block = archive_add(&out->arc, &recs[i], &len);
+
+            output_archive_block(out, block, len);
+        }
+        else
+        {
+            fprintf(out->fp, "%.6f,%d,%.4f,%.6f,%.6f,%d",
+                (double)(int64_t)(recs[i].timestamp_ns - out->start_ns) / NSEC_PER_SEC,
+                recs[i].device,
+                recs[i].data.voltage,
+                recs[i].data.current,
+                recs[i].data.power,
+                recs[i].data.relay);
+            if (out->adaptive)
+            {
+                fprintf(out->fp, ",%d", recs[i].flags & SAMPLE_FLAG_DECIMATED ? 1 : 0);
+            }
+            fputc('\n', out->fp);
+        }
+    }
+}
+
+/**
+ * @brief Flush buffered output
+ * @details Binary and archive output are only flushed once the buffer is
+ *              full, to keep writes large; CSV output is flushed whenever the ring is empty.
+ * 
+ * @param ctx Output context
+ */
+static void output_flush(void *ctx)
+{
+    output_ctx *out = ctx;
+
+    if (out->format == OUTPUT_FORMAT_CSV)
+    {
+        fflush(out->fp);
+    }
+}
+
+/**
+ * @brief Close the output
+ * 
+ * @param ctx Output context
+ */
+static void output_close(void *ctx)
+{
+    output_ctx *out = ctx;
+
+    if (out->format == OUTPUT_FORMAT_BINARY)
+    {
+        if (!out->started)
+        {
+            record_header hdr;
+
+            record_header_init(&hdr, out->sample_rate, 0, &out->enc);
+            output_put(out, &hdr, sizeof(hdr));
+        }
+        output_write_all(out->fd, out->buffer, out->used);
+        if (out->fd != STDOUT_FILENO)
+        {
+            close(out->fd);
+        }
+    }
+    else if (out->format == OUTPUT_FORMAT_ARCHIVE)
+    {
+        size_t len;
+        const void *data;
+
+        if (!out->started)
+        {
+            output_archive_header(out);
+        }
+        for (int d = 0; d < SPI_DEVICES_MAX; d++)
+        {
+            data = archive_finish_block(&out->arc, d, &len);
+            output_archive_block(out, data, len);
+        }
+        data = archive_index(&out->arc, &len);
+        output_put(out, data, len);
+        output_write_all(out->fd, out->buffer, out->used);
+        if (out->fd != STDOUT_FILENO)
+        {
+            close(out->fd);
+        }
+    }
+    else
+    {
+        fflush(out->fp);
+        if (out->fp == stdout)
+        {
+            /* The buffer stays attached to stdout until exit */
+            free(out);
+            return;
+        }
+        fclose(out->fp);
+        free(out->buffer);
+    }
+
+    free(out);
+}
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Parse an output format name
+ * 
+ * @param name "csv", "binary" or "archive"
+ * @return int OUTPUT_FORMAT_*, or -1 if unknown
+ */
+int output_format_parse(const char *name)
+{
+    if (strcmp(name, "csv") == 0)
+    {
+        return OUTPUT_FORMAT_CSV;
+    }
+    if (strcmp(name, "binary") == 0)
+    {
+        return OUTPUT_FORMAT_BINARY;
+    }
+    if (strcmp(name, "archive") == 0)
+    {
+        return OUTPUT_FORMAT_ARCHIVE;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Open an output sink
+ * 
+ * @param s Sink to set up
+ * @param path Output file, or "-" for stdout
+ * @param format OUTPUT_FORMAT_*
+ * @param sample_rate Nominal sampling rate, stored in the binary and
+ *              archive headers
+ * @param adaptive Whether the sampling rate is adaptive, which adds a
+ *              decimated column to CSV output; binary records always carry it
+ * @return int 0 on success, -1 on error
+ */
+int output_open(sink *s, const char *path, int format, double sample_rate, int adaptive)
+{
+    output_ctx *out = calloc(1, sizeof(output_ctx));
+    if (out == NULL)
+    {
+        return -1;
+    }
+
+    out->format = format;
+    out->sample_rate = sample_rate;
+    out->adaptive = adaptive;
+
+    int to_stdout = strcmp(path, "-") == 0;
+    if (format == OUTPUT_FORMAT_BINARY || format == OUTPUT_FORMAT_ARCHIVE)
+    {
+        out->buffer = arena_alloc(OUTPUT_BUFFER_SIZE);
+        if (out->buffer == NULL
+            || (format == OUTPUT_FORMAT_ARCHIVE && archive_writer_init(&out->arc, sizeof(archive_header)) < 0))
+        {
+            free(out);
+            return -1;
+        }
+        out->fd = to_stdout ? STDOUT_FILENO : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out->fd < 0)
+        {
+            perror("Error opening output file");
+            free(out);
+            return -1;
+        }
+    }
+    else
+    {
+        /* stdio may keep the buffer past the run, so it stays on the heap */
+        out->buffer = malloc(OUTPUT_BUFFER_SIZE);
+        if (out->buffer == NULL)
+        {
+            free(out);
+            return -1;
+        }
+        out->fp = to_stdout ? stdout : fopen(path, "w");
+        if (out->fp == NULL)
+        {
+            perror("Error opening output file");
+            free(out->buffer);
+            free(out);
+            return -1;
+        }
+        setvbuf(out->fp, out->buffer, _IOFBF, OUTPUT_BUFFER_SIZE);
+        fprintf(out->fp, "time_s,device,voltage_v,current_a,power_w,relay%s\n", adaptive ? ",decimated" : "");
+    }
+
+    s->name = "output";
+    s->ops = &gs_output_ops;
+    s->ctx = out;
+
+    return 0;
+}
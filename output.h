@@ -0,0 +1,33 @@
+/**
+ * @file    output.h
+ * @brief   Sample output sink
+ * @details Writes the sample stream to a file or to stdout, either as CSV
+ *              text, as binary capture records or as a compressed archive.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include "sink.h"
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define OUTPUT_FORMAT_CSV 0         /* One CSV line per sample */
+#define OUTPUT_FORMAT_BINARY 1      /* Binary capture, see record.h */
+#define OUTPUT_FORMAT_ARCHIVE 2     /* Compressed archive, see archive.h */
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+int output_format_parse(const char *name);
+int output_open(sink *s, const char *path, int format, double sample_rate, int adaptive);
+
+#endif /* OUTPUT_H */
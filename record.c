@@ -0,0 +1,213 @@
+/**
+ * @file    record.c
+ * @brief   Binary sample record format
+ * @details Encodes samples into binary capture records, reads them back and
+ *              converts binary captures to CSV.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "record.h"
+#include "timeutil.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define RECORD_DECODE_BATCH 4096    /* Records read from the file at once */
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Fill a binary capture header and reset the encoder
+ * 
+ * @param hdr Header
+ * @param sample_rate Nominal sampling rate in Hz
+ * @param start_ns CLOCK_MONOTONIC time base of the capture
+ * @param enc Encoder to reset
+ */
+void record_header_init(record_header *hdr, double sample_rate, uint64_t start_ns, record_encoder *enc)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, RECORD_MAGIC, sizeof(hdr->magic));
+    hdr->version = RECORD_VERSION;
+    hdr->record_size = sizeof(record_entry);
+    hdr->sample_rate = sample_rate;
+    hdr->start_ns = start_ns;
+    hdr->realtime_offset_ns = time_realtime_offset_ns();
+
+    enc->last_us = start_ns / NSEC_PER_USEC;
+}
+
+/**
+ * @brief Encode a sample as a binary record
+ * @details The delta is taken between timestamps truncated to microseconds,
+ *              so the rounding error does not accumulate along the capture.
+ * 
+ * @param enc Encoder
+ * @param rec Sample
+ * @param entry Encoded record
+ */
+void record_encode(record_encoder *enc, const sample_record *rec, record_entry *entry)
+{
+    uint64_t now_us = rec->timestamp_ns / NSEC_PER_USEC;
+
+    entry->delta_us = (int32_t)(now_us - enc->last_us);
+    entry->voltage = rec->data.voltage;
+    entry->current = rec->data.current;
+    entry->power = rec->data.power;
+    entry->flags = (rec->data.relay ? RECORD_FLAG_RELAY : 0)
+        | (rec->flags & SAMPLE_FLAG_DECIMATED ? RECORD_FLAG_DECIMATED : 0);
+    entry->device = rec->device;
+
+    enc->last_us = now_us;
+}
+
+/**
+ * @brief Open a binary capture and read its header
+ * @details Headers before version 3 have no wall clock offset, which is left
+ *              at 0.
+ * 
+ * @param path Binary capture file
+ * @param hdr Filled with the header
+ * @return FILE* Capture positioned at its first record, or NULL on error
+ */
+FILE *record_open(const char *path, record_header *hdr)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        perror("Error opening capture file");
+        return NULL;
+    }
+
+    /* Headers before version 3 end at the wall clock offset */
+    memset(hdr, 0, sizeof(*hdr));
+    if (fread(hdr, offsetof(record_header, realtime_offset_ns), 1, fp) != 1
+        || memcmp(hdr->magic, RECORD_MAGIC, sizeof(hdr->magic)) != 0)
+    {
+        fprintf(stderr, "%s: not a binary capture\n", path);
+        fclose(fp);
+        return NULL;
+    }
+
+    if (!(hdr->version == RECORD_VERSION && hdr->record_size == sizeof(record_entry))
+        && !(hdr->version == RECORD_VERSION_V2 && hdr->record_size == sizeof(record_entry))
+        && !(hdr->version == RECORD_VERSION_V1 && hdr->record_size == sizeof(record_entry_v1)))
+    {
+        fprintf(stderr, "%s: unsupported capture version %u\n", path, hdr->version);
+        fclose(fp);
+        return NULL;
+    }
+    if (hdr->version == RECORD_VERSION && fread(&hdr->realtime_offset_ns, sizeof(hdr->realtime_offset_ns), 1, fp) != 1)
+    {
+        fprintf(stderr, "%s: truncated capture header\n", path);
+        fclose(fp);
+        return NULL;
+    }
+
+    return fp;
+}
+
+/**
+ * @brief Decode a record read from a binary capture
+ * @details Version 1 records, which have no device field, are decoded as
+ *              coming from device 0.
+ * 
+ * @param hdr Header of the capture
+ * @param raw Record as stored, hdr->record_size bytes
+ * @param entry Decoded record
+ */
+void record_entry_read(const record_header *hdr, const uint8_t *raw, record_entry *entry)
+{
+    if (hdr->version == RECORD_VERSION_V1)
+    {
+        record_entry_v1 v1;
+
+        memcpy(&v1, raw, sizeof(v1));
+        entry->delta_us = (int32_t)v1.delta_us;
+        entry->voltage = v1.voltage;
+        entry->current = v1.current;
+        entry->power = v1.power;
+        entry->flags = v1.flags;
+        entry->device = 0;
+    }
+    else
+    {
+        memcpy(entry, raw, sizeof(*entry));
+    }
+}
+
+/**
+ * @brief Convert a binary capture to CSV
+ * @details Version 1 captures, which have no device field, are decoded as
+ *              coming from device 0. Captures from version 3 get a decimated
+ *              column and a last column with the wall clock time of each
+ *              record.
+ * 
+ * @param path Binary capture file
+ * @param out CSV output
+ * @return int 0 on success, -1 on error
+ */
+int record_decode_csv(const char *path, FILE *out)
+{
+    static uint8_t buffer[RECORD_DECODE_BATCH * sizeof(record_entry)];
+    record_header hdr;
+    record_entry entry;
+    int64_t time_us = 0;
+    uint64_t remaining;
+    size_t n;
+
+    FILE *fp = record_open(path, &hdr);
+    if (fp == NULL)
+    {
+        return -1;
+    }
+
+    int realtime = hdr.version == RECORD_VERSION;
+
+    fprintf(out, "time_s,device,voltage_v,current_a,power_w,relay%s\n", realtime ? ",decimated,realtime_s" : "");
+
+    remaining = hdr.count != 0 ? hdr.count : UINT64_MAX;
+    while (remaining > 0
+        && (n = fread(buffer, hdr.record_size,
+            remaining < RECORD_DECODE_BATCH ? remaining : RECORD_DECODE_BATCH, fp)) > 0)
+    {
+        remaining -= n;
+        for (size_t i = 0; i < n; i++)
+        {
+            record_entry_read(&hdr, buffer + i * hdr.record_size, &entry);
+            time_us += entry.delta_us;
+            fprintf(out, "%.6f,%d,%.4f,%.6f,%.6f,%d",
+                (double)time_us / 1000000,
+                entry.device,
+                entry.voltage,
+                entry.current,
+                entry.power,
+                entry.flags & RECORD_FLAG_RELAY ? 1 : 0);
+            if (realtime)
+            {
+                fprintf(out, ",%d", entry.flags & RECORD_FLAG_DECIMATED ? 1 : 0);
+
+                /* Split in whole seconds and a remainder to keep the microseconds */
+                int64_t wall_us = (int64_t)(hdr.start_ns / NSEC_PER_USEC) + time_us
+                    + hdr.realtime_offset_ns / (int64_t)NSEC_PER_USEC;
+                fprintf(out, ",%lld.%06lld", (long long)(wall_us / 1000000), (long long)(wall_us % 1000000));
+            }
+            fputc('\n', out);
+        }
+    }
+
+    fclose(fp);
+
+    return 0;
+}
@@ -0,0 +1,92 @@
+/**
+ * @file    record.h
+ * @brief   Binary sample record format
+ * @details A binary capture is a record_header followed by fixed-size
+ *              record_entry structures, all in host (little endian) byte order.
+ *              Timestamps are stored as microsecond deltas from the previous
+ *              record, the first one relative to the header start time. The
+ *              delta is signed because records of devices polled by different
+ *              threads may interleave slightly out of order. When
+ *              the header holds a record count, anything past those records
+ *              (e.g. unused preallocated space) is ignored. From version 3
+ *              the header also holds the offset of the wall clock, so
+ *              captures of several nodes can be merged on CLOCK_REALTIME.
+ *              Samples taken at the base rate of adaptive sampling are
+ *              flagged, so the rate changes can be found in the capture.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef RECORD_H
+#define RECORD_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "ring.h"
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define RECORD_MAGIC "HOFB"         /* Binary capture magic */
+#define RECORD_VERSION 3            /* Binary capture format version */
+#define RECORD_VERSION_V2 2         /* Header without the wall clock offset, still decoded */
+#define RECORD_VERSION_V1 1         /* Single device records, still decoded */
+
+#define RECORD_FLAG_RELAY 0x01      /* Relay was on */
+#define RECORD_FLAG_DECIMATED 0x02  /* Taken at the adaptive base rate */
+
+/* *************************
+ * PUBLIC TYPES DEFINITION *
+ * *************************/
+
+/* Binary capture header */
+typedef struct record_header{
+    char magic[4];                  /* RECORD_MAGIC */
+    uint16_t version;               /* RECORD_VERSION */
+    uint16_t record_size;           /* sizeof(record_entry) */
+    float sample_rate;              /* Nominal sampling rate in Hz */
+    uint32_t count;                 /* Number of records, 0 if unknown */
+    uint64_t start_ns;              /* CLOCK_MONOTONIC time base */
+    int64_t realtime_offset_ns;     /* CLOCK_REALTIME minus CLOCK_MONOTONIC */
+}__attribute__((__packed__)) record_header;
+
+/* Binary capture record */
+typedef struct record_entry{
+    int32_t delta_us;               /* Time since the previous record */
+    float voltage;
+    float current;
+    float power;
+    uint8_t flags;                  /* RECORD_FLAG_* */
+    uint8_t device;                 /* Index of the device in the device list */
+}__attribute__((__packed__)) record_entry;
+
+/* Binary capture record, version 1 */
+typedef struct record_entry_v1{
+    uint32_t delta_us;
+    float voltage;
+    float current;
+    float power;
+    uint8_t flags;
+}__attribute__((__packed__)) record_entry_v1;
+
+/* Record encoder state */
+typedef struct record_encoder{
+    uint64_t last_us;               /* Timestamp of the previous record */
+} record_encoder;
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+void record_header_init(record_header *hdr, double sample_rate, uint64_t start_ns, record_encoder *enc);
+void record_encode(record_encoder *enc, const sample_record *rec, record_entry *entry);
+FILE *record_open(const char *path, record_header *hdr);
+void record_entry_read(const record_header *hdr, const uint8_t *raw, record_entry *entry);
+int record_decode_csv(const char *path, FILE *out);
+
+#endif /* RECORD_H */
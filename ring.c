@@ -0,0 +1,178 @@
+/**
+ * @file    ring.c
+ * @brief   Single-producer/single-consumer sample ring
+ * @details The head index is only written by the producer and the tail index
+ *              only by the consumer. Each side keeps a cached copy of the other
+ *              side's index, so the shared cache line is only touched when the
+ *              ring looks full (producer) or empty (consumer).
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+#include "arena.h"
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Get the memory a ring takes
+ * 
+ * @param capacity Minimum number of records
+ * @return size_t Size of the slots, the capacity rounded up to a power of two
+ */
+size_t ring_bytes(size_t capacity)
+{
+    size_t size = 1;
+
+    while (size < capacity)
+    {
+        size <<= 1;
+    }
+
+    return size * sizeof(sample_record);
+}
+
+/**
+ * @brief Allocate a ring
+ * @details The capacity is rounded up to a power of two. The slots come from
+ *              the arena, faulted in before sampling starts.
+ * 
+ * @param r Ring
+ * @param capacity Minimum number of records
+ * @return int 0 on success, -1 on error
+ */
+int ring_init(ring *r, size_t capacity)
+{
+    size_t bytes = ring_bytes(capacity);
+
+    memset(r, 0, sizeof(*r));
+    r->slots = arena_alloc(bytes);
+    if (r->slots == NULL)
+    {
+        fprintf(stderr, "Error allocating ring of %zu records\n", bytes / sizeof(sample_record));
+        return -1;
+    }
+
+    r->mask = bytes / sizeof(sample_record) - 1;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->drops, 0);
+
+    return 0;
+}
+
+/**
+ * @brief Release a ring
+ * @details The slots go back with the arena.
+ * 
+ * @param r Ring
+ */
+void ring_free(ring *r)
+{
+    r->slots = NULL;
+}
+
+/**
+ * @brief Get the ring capacity
+ * 
+ * @param r Ring
+ * @return size_t Number of records the ring holds
+ */
+size_t ring_capacity(const ring *r)
+{
+    return r->mask + 1;
+}
+
+/**
+ * @brief Reserve the next free slot (producer)
+ * @details The slot is published with ring_commit(). When the ring is full
+ *              the drop counter is incremented and NULL is returned.
+ * 
+ * @param r Ring
+ * @return sample_record* Free slot, or NULL if the ring is full
+ */
+sample_record *ring_reserve(ring *r)
+{
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    if (head - r->tail_cache > r->mask)
+    {
+        r->tail_cache = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (head - r->tail_cache > r->mask)
+        {
+            atomic_fetch_add_explicit(&r->drops, 1, memory_order_relaxed);
+            return NULL;
+        }
+    }
+
+    return &r->slots[head & r->mask];
+}
+
+/**
+ * @brief Publish the slot returned by ring_reserve() (producer)
+ * 
+ * @param r Ring
+ */
+void ring_commit(ring *r)
+{
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+/**
+ * @brief Take up to max records out of the ring (consumer)
+ * 
+ * @param r Ring
+ * @param out Destination array
+ * @param max Size of the destination array
+ * @return size_t Number of records copied
+ */
+size_t ring_pop(ring *r, sample_record *out, size_t max)
+{
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    if (r->head_cache == tail)
+    {
+        r->head_cache = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (r->head_cache == tail)
+        {
+            return 0;
+        }
+    }
+
+    size_t n = r->head_cache - tail;
+    if (n > max)
+    {
+        n = max;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        out[i] = r->slots[(tail + i) & r->mask];
+    }
+
+    atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+
+    return n;
+}
+
+/**
+ * @brief Get the number of records dropped because the ring was full
+ * 
+ * @param r Ring
+ * @return uint64_t Dropped records
+ */
+uint64_t ring_drops(ring *r)
+{
+    return atomic_load_explicit(&r->drops, memory_order_relaxed);
+}
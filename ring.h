@@ -0,0 +1,71 @@
+/**
+ * @file    ring.h
+ * @brief   Single-producer/single-consumer sample ring
+ * @details Lock-free ring of timestamped samples between the acquisition
+ *              thread and one consumer thread. The producer never blocks:
+ *              when the ring is full the sample is dropped and counted.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef RING_H
+#define RING_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "spi.h"
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define RING_CACHE_LINE 64          /* Cache line size used to separate indices */
+
+#define SAMPLE_FLAG_DECIMATED 0x01  /* Taken at the adaptive base rate */
+
+/* *************************
+ * PUBLIC TYPES DEFINITION *
+ * *************************/
+
+/* Timestamped homeoffice sample */
+typedef struct sample_record{
+    uint64_t timestamp_ns;          /* CLOCK_MONOTONIC acquisition time */
+    homeoffice_data data;
+    uint8_t device;                 /* Index of the device in the device list */
+    uint8_t flags;                  /* SAMPLE_FLAG_* */
+} sample_record;
+
+/* SPSC ring of sample records */
+typedef struct ring{
+    sample_record *slots;
+    size_t mask;
+
+    /* Producer side */
+    _Alignas(RING_CACHE_LINE) atomic_size_t head;
+    size_t tail_cache;
+    _Atomic uint64_t drops;
+
+    /* Consumer side */
+    _Alignas(RING_CACHE_LINE) atomic_size_t tail;
+    size_t head_cache;
+} ring;
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+size_t ring_bytes(size_t capacity);
+int ring_init(ring *r, size_t capacity);
+void ring_free(ring *r);
+size_t ring_capacity(const ring *r);
+sample_record *ring_reserve(ring *r);
+void ring_commit(ring *r);
+size_t ring_pop(ring *r, sample_record *out, size_t max);
+uint64_t ring_drops(ring *r);
+
+#endif /* RING_H */
@@ -0,0 +1,465 @@
+/**
+ * @file    rules.c
+ * @brief   Threshold rules
+ * @details A rule reads
+ * 
+ *              <voltage|current|power> <op> <value>[unit] [for <time>] -> relay <on|off>
+ * 
+ *              with op one of >, >=, < and <=, the unit V, A or W with an
+ *              optional m or k prefix, and the time in us, ms, s or min. The
+ *              hold time is measured on the sample clock, from the first
+ *              sample that meets the predicate; the action is taken once, and
+ *              again only after a sample that does not meet it. A relay
+ *              command that fails is retried on later samples, at most every
+ *              RULES_RETRY_NS of sample time, until it goes through. Checking a
+ *              sample costs one comparison per rule and never allocates, and
+ *              a relay command takes the device lock for one SPI request,
+ *              between two sampler reads.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "rules.h"
+#include "timeutil.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define RULES_WORD_MAX 16           /* Longest keyword or unit */
+#define RULES_RETRY_NS (100 * NSEC_PER_MSEC) /* Sample time between retries of a failed action */
+
+/* **************************
+ * PRIVATE TYPES DEFINITION *
+ * **************************/
+
+/* Quantity a rule compares */
+typedef struct rules_quantity{
+    const char *name;
+    size_t offset;
+    char unit;
+} rules_quantity;
+
+/* Unit of a hold time */
+typedef struct rules_time_unit{
+    const char *name;
+    uint64_t ns;
+} rules_time_unit;
+
+/* Evaluation state of one rule on one device */
+typedef struct rules_state{
+    uint64_t since_ns;              /* First sample of the current match */
+    int active;                     /* The last sample met the predicate */
+    int fired;                      /* The action was taken for the current match */
+    uint64_t retry_ns;              /* Sample time of the next attempt after a failed action */
+    int failed;                     /* The action failed for the current match */
+} rules_state;
+
+/* Rules sink context */
+typedef struct rules_ctx{
+    rules_config cfg;
+    rule rules[RULES_MAX];
+    rules_state state[SPI_DEVICES_MAX][RULES_MAX];
+    unsigned long failures;         /* Failed relay commands */
+} rules_ctx;
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static void rules_skip(const char **p);
+static size_t rules_word(const char **p, char *word);
+static int rules_literal(const char **p, const char *lit);
+static int rules_fire(rules_ctx *ctx, const rule *r, uint8_t device, int quiet);
+static void rules_write(void *ctx, const sample_record *recs, size_t n);
+static void rules_close(void *ctx);
+
+/* *************************************
+ * PRIVATE GLOBAL VARIABLES DEFINITION *
+ * *************************************/
+
+static const sink_ops gs_rules_ops = {
+    .write = rules_write,
+    .flush = NULL,
+    .close = rules_close,
+};
+
+static const rules_quantity gs_rules_quantities[] = {
+    { "voltage", offsetof(homeoffice_data, voltage), 'V' },
+    { "current", offsetof(homeoffice_data, current), 'A' },
+    { "power", offsetof(homeoffice_data, power), 'W' },
+};
+
+static const rules_time_unit gs_rules_time_units[] = {
+    { "us", NSEC_PER_USEC },
+    { "ms", NSEC_PER_MSEC },
+    { "s", NSEC_PER_SEC },
+    { "min", 60 * NSEC_PER_SEC },
+};
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Skip blanks
+ * 
+ * @param p Parse position
+ */
+static void rules_skip(const char **p)
+{
+    while (isspace((unsigned char)**p))
+    {
+        (*p)++;
+    }
+}
+
+/**
+ * @brief Read a word of letters
+ * 
+ * @param p Parse position, moved past the word
+ * @param word Filled with the word, RULES_WORD_MAX bytes
+ * @return size_t Length of the word, 0 if there is none or it is too long
+ */
+static size_t rules_word(const char **p, char *word)
+{
+    size_t len = 0;
+
+    while (isalpha((unsigned char)(*p)[len]))
+    {
+        len++;
+    }
+    if (len >= RULES_WORD_MAX)
+    {
+        return 0;
+    }
+    memcpy(word, *p, len);
+    word[len] = '\0';
+    *p += len;
+
+    return len;
+}
+
+/**
+ * @brief Consume a literal
+ * 
+ * @param p Parse position, moved past the literal if it is there
+ * @param lit Literal
+ * @return int 1 if the literal was consumed, 0 otherwise
+ */
+static int rules_literal(const char **p, const char *lit)
+{
+    size_t len = strlen(lit);
+
+    if (strncasecmp(*p, lit, len) != 0)
+    {
+        return 0;
+    }
+    *p += len;
+
+    return 1;
+}
+
+/**
+ * @brief Take the action of a rule on a device
+ * 
+ * @param ctx Rules context
+ * @param r Rule
+ * @param device Index of the device
+ * @param quiet Do not log a failure, it was logged by an earlier attempt
+ * @return int 0 on success, -1 if the relay command failed
+ */
+static int rules_fire(rules_ctx *ctx, const rule *r, uint8_t device, int quiet)
+{
+    uint8_t relay;
+
+    if (device >= ctx->cfg.ndevices)
+    {
+        return 0;
+    }
+    if (spi_command(&ctx->cfg.devices[device], r->cmd, &relay, sizeof(relay)) < 0)
+    {
+        ctx->failures++;
+        if (!quiet)
+        {
+            fprintf(stderr, "Rule \"%s\" on %s: SPI request failed, retrying\n", r->text, ctx->cfg.devices[device].path);
+        }
+        return -1;
+    }
+    fprintf(stderr, "Rule \"%s\" on %s: relay %s\n", r->text, ctx->cfg.devices[device].path, relay ? "on" : "off");
+
+    return 0;
+}
+
+/**
+ * @brief Check every rule against a batch of samples
+ * 
+ * @param ctx Rules context
+ * @param recs Samples
+ * @param n Number of samples
+ */
+static void rules_write(void *ctx, const sample_record *recs, size_t n)
+{
+    rules_ctx *rc = ctx;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        const sample_record *rec = &recs[i];
+
+        if (rec->device >= SPI_DEVICES_MAX)
+        {
+            continue;
+        }
+        for (size_t k = 0; k < rc->cfg.nrules; k++)
+        {
+            const rule *r = &rc->rules[k];
+            rules_state *st = &rc->state[rec->device][k];
+            float value;
+            int match;
+
+            memcpy(&value, (const char *)&rec->data + r->offset, sizeof(value));
+            match = r->op == RULE_OP_GT ? value > r->threshold
+                : r->op == RULE_OP_GE ? value >= r->threshold
+                : r->op == RULE_OP_LT ? value < r->threshold
+                : value <= r->threshold;
+
+            if (!match)
+            {
+                st->active = 0;
+                st->fired = 0;
+                st->failed = 0;
+                continue;
+            }
+            if (!st->active)
+            {
+                st->active = 1;
+                st->since_ns = rec->timestamp_ns;
+            }
+            if (!st->fired && rec->timestamp_ns - st->since_ns >= r->hold_ns &&
+                (!st->failed || rec->timestamp_ns >= st->retry_ns))
+            {
+                if (rules_fire(rc, r, rec->device, st->failed) == 0)
+                {
+                    st->fired = 1;
+                }
+                else
+                {
+                    st->failed = 1;
+                    st->retry_ns = rec->timestamp_ns + RULES_RETRY_NS;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Release the rules sink
+ * 
+ * @param ctx Rules context
+ */
+static void rules_close(void *ctx)
+{
+    rules_ctx *rc = ctx;
+
+    if (rc->failures > 0)
+    {
+        fprintf(stderr, "Rules: %lu failed relay commands\n", rc->failures);
+    }
+    free(ctx);
+}
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Compile a rule
+ * 
+ * @param text Rule, kept referenced by the compiled rule
+ * @param r Filled with the compiled rule
+ * @return int 0 on success, -1 on a syntax error
+ */
+int rules_compile(const char *text, rule *r)
+{
+    const rules_quantity *q = NULL;
+    const char *p = text;
+    char word[RULES_WORD_MAX];
+    double scale = 1;
+    char *end;
+
+    memset(r, 0, sizeof(rule));
+    r->text = text;
+
+    rules_skip(&p);
+    if (rules_word(&p, word) > 0)
+    {
+        for (size_t i = 0; i < sizeof(gs_rules_quantities) / sizeof(gs_rules_quantities[0]); i++)
+        {
+            if (strcasecmp(word, gs_rules_quantities[i].name) == 0)
+            {
+                q = &gs_rules_quantities[i];
+            }
+        }
+    }
+    if (q == NULL)
+    {
+        fprintf(stderr, "Rule \"%s\": expected voltage, current or power\n", text);
+        return -1;
+    }
+    r->offset = q->offset;
+
+    rules_skip(&p);
+    if (rules_literal(&p, ">="))
+    {
+        r->op = RULE_OP_GE;
+    }
+    else if (rules_literal(&p, "<="))
+    {
+        r->op = RULE_OP_LE;
+    }
+    else if (rules_literal(&p, ">"))
+    {
+        r->op = RULE_OP_GT;
+    }
+    else if (rules_literal(&p, "<"))
+    {
+        r->op = RULE_OP_LT;
+    }
+    else
+    {
+        fprintf(stderr, "Rule \"%s\": expected >, >=, < or <=\n", text);
+        return -1;
+    }
+
+    rules_skip(&p);
+    double threshold = strtod(p, &end);
+    if (end == p || !isfinite(threshold))
+    {
+        fprintf(stderr, "Rule \"%s\": expected a threshold\n", text);
+        return -1;
+    }
+    p = end;
+    if (rules_word(&p, word) > 0)
+    {
+        size_t len = strlen(word);
+
+        if (len == 2 && word[0] == 'm')
+        {
+            scale = 1e-3;
+        }
+        else if (len == 2 && word[0] == 'k')
+        {
+            scale = 1e3;
+        }
+        if ((len != 1 && scale == 1) || toupper((unsigned char)word[len - 1]) != q->unit)
+        {
+            fprintf(stderr, "Rule \"%s\": expected a threshold in %c\n", text, q->unit);
+            return -1;
+        }
+    }
+    r->threshold = threshold * scale;
+
+    rules_skip(&p);
+    if (rules_literal(&p, "for"))
+    {
+        const rules_time_unit *u = NULL;
+
+        rules_skip(&p);
+        double hold = strtod(p, &end);
+        int has_hold = end != p;
+
+        p = end;
+        if (has_hold && rules_word(&p, word) > 0)
+        {
+            for (size_t i = 0; i < sizeof(gs_rules_time_units) / sizeof(gs_rules_time_units[0]); i++)
+            {
+                if (strcasecmp(word, gs_rules_time_units[i].name) == 0)
+                {
+                    u = &gs_rules_time_units[i];
+                }
+            }
+        }
+        /* The hold in nanoseconds must fit in hold_ns */
+        if (u == NULL || !isfinite(hold) || !(hold >= 0) || !(hold * u->ns < (double)UINT64_MAX))
+        {
+            fprintf(stderr, "Rule \"%s\": expected a time in us, ms, s or min\n", text);
+            return -1;
+        }
+        r->hold_ns = hold * u->ns;
+        rules_skip(&p);
+    }
+
+    if (!rules_literal(&p, "->"))
+    {
+        fprintf(stderr, "Rule \"%s\": expected ->\n", text);
+        return -1;
+    }
+    rules_skip(&p);
+    if (rules_word(&p, word) == 0 || strcasecmp(word, "relay") != 0)
+    {
+        fprintf(stderr, "Rule \"%s\": expected relay\n", text);
+        return -1;
+    }
+    rules_skip(&p);
+    if (rules_word(&p, word) > 0 && strcasecmp(word, "on") == 0)
+    {
+        r->cmd = CMD_SET_RELAY_ON;
+    }
+    else if (strcasecmp(word, "off") == 0)
+    {
+        r->cmd = CMD_SET_RELAY_OFF;
+    }
+    else
+    {
+        fprintf(stderr, "Rule \"%s\": expected on or off\n", text);
+        return -1;
+    }
+    rules_skip(&p);
+    if (*p != '\0')
+    {
+        fprintf(stderr, "Rule \"%s\": unexpected \"%s\"\n", text, p);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Open a rules sink
+ * 
+ * @param s Sink to set up
+ * @param cfg Configuration, the rules are copied
+ * @return int 0 on success, -1 on error
+ */
+int rules_open(sink *s, const rules_config *cfg)
+{
+    if (cfg->nrules > RULES_MAX)
+    {
+        fprintf(stderr, "At most %d rules are supported\n", RULES_MAX);
+        return -1;
+    }
+
+    rules_ctx *ctx = calloc(1, sizeof(rules_ctx));
+    if (ctx == NULL)
+    {
+        return -1;
+    }
+    ctx->cfg = *cfg;
+    memcpy(ctx->rules, cfg->rules, cfg->nrules * sizeof(rule));
+
+    s->name = "rules";
+    s->ops = &gs_rules_ops;
+    s->ctx = ctx;
+
+    return 0;
+}
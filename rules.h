@@ -0,0 +1,64 @@
+/**
+ * @file    rules.h
+ * @brief   Threshold rules
+ * @details Rules such as "power > 5W for 200ms -> relay off" are compiled
+ *              once into flat predicates and checked on every sample of every
+ *              device by a sink, which switches the relay of the device when a
+ *              predicate has held for the given time.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef RULES_H
+#define RULES_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "sink.h"
+#include "spi.h"
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define RULES_MAX 16                /* Maximum rules */
+
+#define RULE_OP_GT 0                /* value > threshold */
+#define RULE_OP_GE 1                /* value >= threshold */
+#define RULE_OP_LT 2                /* value < threshold */
+#define RULE_OP_LE 3                /* value <= threshold */
+
+/* *************************
+ * PUBLIC TYPES DEFINITION *
+ * *************************/
+
+/* Compiled rule */
+typedef struct rule{
+    size_t offset;                  /* Offset of the float compared in homeoffice_data */
+    int op;                         /* RULE_OP_* */
+    float threshold;
+    uint64_t hold_ns;               /* Time the predicate must hold before the action */
+    uint8_t cmd;                    /* Command sent to the device */
+    const char *text;               /* Source of the rule */
+} rule;
+
+/* Rules sink configuration */
+typedef struct rules_config{
+    const rule *rules;
+    size_t nrules;
+    spi_device *devices;            /* Sampled devices, addressed by index */
+    size_t ndevices;
+} rules_config;
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+int rules_compile(const char *text, rule *r);
+int rules_open(sink *s, const rules_config *cfg);
+
+#endif /* RULES_H */
@@ -0,0 +1,1162 @@
+/**
+ * @file    sampler.c
+ * @brief   Continuous sample acquisition
+ * @details Each acquisition thread sleeps until absolute deadlines on
+ *              CLOCK_MONOTONIC that are advanced by exactly one slot per
+ *              cycle, so the cadence does not drift with the time spent in the
+ *              SPI transfer. It never formats or writes anything itself: each
+ *              sample is timestamped and pushed into the sink rings. For real
+ *              time operation the threads are created with their policy and
+ *              CPU set already applied, on a small stack that they fault in
+ *              before the first deadline, so that with the memory locked the
+ *              sampling loop takes no page faults. In adaptive mode a bus
+ *              runs at the base rate while the readings of its devices stay
+ *              within a deadband of their last reference, and at the full rate
+ *              for SAMPLER_FAST_HOLD_NS after a step or a relay toggle. With
+ *              pipelining, every device gets an SPI worker thread with the
+ *              real-time priority of the acquisition threads. The workers
+ *              are pinned to the CPUs of the list left over by the
+ *              acquisition threads, or left unpinned when there are none,
+ *              rather than sharing the CPU of their acquisition thread, see
+ *              sampler_worker_cpu(). Each read submits the next request
+ *              before decoding the previous reply.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "sampler.h"
+#include "spi.h"
+#include "timeutil.h"
+#include "clocksync.h"
+#include "gpio.h"
+#include "trace.h"
+#include "arena.h"
+#include "ina219.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define SAMPLER_STACK_SIZE (256 * 1024) /* Stack of an acquisition thread */
+#define SAMPLER_STACK_PREFAULT (64 * 1024) /* Stack faulted in before sampling */
+#define SAMPLER_PAGE_SIZE 4096      /* Prefault stride */
+
+#ifndef MCL_ONFAULT
+#define MCL_ONFAULT 4               /* Lock pages as they are faulted in, from Linux 4.4 */
+#endif
+
+#define SAMPLER_FAST_HOLD_NS NSEC_PER_SEC /* Full rate kept after the last change */
+#define SAMPLER_DEADBAND_FLOOR 1e-3 /* Absolute change ignored around zero readings */
+
+/* **************************
+ * PRIVATE TYPES DEFINITION *
+ * **************************/
+
+/* Acquisition thread of one SPI bus */
+typedef struct sampler_bus{
+    int bus;                        /* SPI controller number */
+    spi_device *devices[SPI_DEVICES_MAX];
+    clocksync clocks[SPI_DEVICES_MAX]; /* Tick correlation of devices with dev->tick_hz */
+    size_t ndevices;
+    struct pollfd irqs[SPI_DEVICES_MAX]; /* Interrupt lines of the devices that have one */
+    size_t irq_pos[SPI_DEVICES_MAX]; /* Position in the bus of the device of each line */
+    size_t nirqs;
+    uint8_t pending_flags[SPI_DEVICES_MAX]; /* SAMPLE_FLAG_* of the request in flight of pipelined devices */
+    uint8_t decoded[SPI_BATCH_MAX * SPI_SAMPLE_LEN]; /* Packed samples converted from a raw reply */
+    homeoffice_data ref[SPI_DEVICES_MAX]; /* Readings the deadband is centered on */
+    int has_ref[SPI_DEVICES_MAX];
+    uint64_t changed_ns;            /* Last step or relay toggle on the bus */
+    size_t ring;                    /* Index of the sink rings fed by the thread */
+    const sampler_config *cfg;
+    sink *sinks;
+    size_t nsinks;
+    pthread_t thread;
+    uint64_t samples;               /* Samples taken by the thread */
+} sampler_bus;
+
+/* Acquisition statistics of all threads, readable while sampling */
+typedef struct sampler_live{
+    _Atomic uint64_t samples;
+    _Atomic uint64_t overruns;
+    _Atomic uint64_t max_late_ns;
+    _Atomic uint64_t errors;
+    _Atomic uint64_t interrupts;
+    _Atomic uint64_t irq_errors;
+    _Atomic uint64_t rate_changes;
+    _Atomic uint64_t wake[SAMPLER_WAKE_BUCKETS];
+    _Atomic uint64_t wake_ns;
+    _Atomic uint64_t max_wake_ns;
+} sampler_live;
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static size_t sampler_group(spi_device *devices, size_t ndevices, sampler_bus *buses);
+static uint64_t sampler_timestamp(sampler_bus *ctx, size_t pos, int batch, const spi_slot *slot);
+static void sampler_publish(sampler_bus *ctx, uint8_t device, const uint8_t *samples,
+    size_t count, uint64_t timestamp_ns, uint64_t interval_ns, uint8_t flags);
+static int sampler_changed(sampler_bus *ctx, size_t pos, const uint8_t *wire);
+static void sampler_max(_Atomic uint64_t *max, uint64_t value);
+static void sampler_wake(uint64_t wake_ns);
+static void sampler_prefault_stack();
+static void sampler_count(sampler_bus *ctx, int count);
+static uint8_t sampler_cmd(const spi_device *dev, unsigned int batch);
+static int sampler_decode(sampler_bus *ctx, const spi_device *dev, const uint8_t **samples, int count);
+static int sampler_read(sampler_bus *ctx, size_t pos, unsigned int batch, uint64_t interval_ns, uint8_t flags);
+static int sampler_read_pipelined(sampler_bus *ctx, size_t pos, unsigned int batch, uint64_t interval_ns,
+    uint8_t flags, int submit);
+static int sampler_wait_irq(sampler_bus *ctx, uint64_t deadline_ns);
+static int sampler_irq_open(sampler_bus *ctx, const sampler_config *cfg);
+static void sampler_irq_drop(sampler_bus *ctx, size_t line);
+static void sampler_irq_close(sampler_bus *ctx);
+static int sampler_attr(const sampler_config *cfg, int cpu, pthread_attr_t *attr);
+static int sampler_worker_cpu(const sampler_config *cfg, size_t nbuses, size_t worker);
+static void sampler_start_error(int err);
+static int sampler_check_rates(const sampler_config *cfg);
+static void *sampler_probe(void *arg);
+static void *sampler_thread(void *arg);
+
+/* *************************************
+ * PRIVATE GLOBAL VARIABLES DEFINITION *
+ * *************************************/
+
+static atomic_int gs_sampler_stop; /* Set to stop the acquisition threads */
+static sampler_live gs_sampler_live; /* Statistics of the current run */
+
+/* Upper bounds of the wake-up latency histogram buckets, in microseconds */
+static const uint32_t gs_sampler_wake_us[SAMPLER_WAKE_BUCKETS - 1] = {
+    2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000
+};
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Group the devices by SPI bus, in order of first appearance
+ * 
+ * @param devices Devices
+ * @param ndevices Number of devices
+ * @param buses Filled with one entry per bus, may be NULL to only count
+ * @return size_t Number of buses
+ */
+static size_t sampler_group(spi_device *devices, size_t ndevices, sampler_bus *buses)
+{
+    int seen[SPI_DEVICES_MAX];
+    size_t nbuses = 0;
+
+    for (size_t i = 0; i < ndevices; i++)
+    {
+        size_t b;
+
+        for (b = 0; b < nbuses && seen[b] != devices[i].bus; b++);
+        if (b == nbuses)
+        {
+            seen[nbuses++] = devices[i].bus;
+            if (buses != NULL)
+            {
+                memset(&buses[b], 0, sizeof(sampler_bus));
+                buses[b].bus = devices[i].bus;
+                buses[b].ring = b;
+            }
+        }
+        if (buses != NULL)
+        {
+            if (devices[i].tick_hz)
+            {
+                clocksync_init(&buses[b].clocks[buses[b].ndevices], devices[i].tick_hz, SPI_TICK_MASK);
+            }
+            buses[b].devices[buses[b].ndevices++] = &devices[i];
+        }
+    }
+
+    return nbuses;
+}
+
+/**
+ * @brief Get the acquisition time of the last reply of a device
+ * @details The device takes the sample somewhere inside the transfer, so
+ *              the middle of its bracket is the best host estimate, off by at
+ *              most half the bracket. Batch replies of a device with a tick
+ *              counter are stamped through its clock model instead, which
+ *              filters out the jitter of the brackets.
+ * 
+ * @param ctx Bus context
+ * @param pos Position of the device in the bus
+ * @param batch Whether the reply is a batch
+ * @param slot Pipelined reply, NULL for the last direct reply of the device
+ * @return uint64_t CLOCK_MONOTONIC time of the newest sample
+ */
+static uint64_t sampler_timestamp(sampler_bus *ctx, size_t pos, int batch, const spi_slot *slot)
+{
+    spi_device *dev = ctx->devices[pos];
+    uint64_t start_ns = slot != NULL ? slot->xfer_start_ns : dev->xfer_start_ns;
+    uint64_t end_ns = slot != NULL ? slot->xfer_end_ns : dev->xfer_end_ns;
+
+    if (batch && dev->tick_hz)
+    {
+        uint64_t tick = clocksync_add(&ctx->clocks[pos], slot != NULL ? spi_slot_tick(slot) : spi_reply_tick(dev),
+            start_ns, end_ns);
+
+        return clocksync_host_ns(&ctx->clocks[pos], tick);
+    }
+
+    return start_ns + (end_ns - start_ns) / 2;
+}
+
+/**
+ * @brief Decode reply samples straight from the receive frame into every sink ring
+ * @details Batches are returned oldest first and the last sample is taken
+ *              at the acquisition time, so the earlier ones are stamped one
+ *              sample interval apart back from it.
+ * 
+ * @param ctx Bus context
+ * @param device Index of the device
+ * @param samples Packed samples in the reply frame
+ * @param count Number of samples
+ * @param timestamp_ns Acquisition time of the batch
+ * @param interval_ns Sample interval
+ * @param flags SAMPLE_FLAG_* of the samples
+ */
+static void sampler_publish(sampler_bus *ctx, uint8_t device, const uint8_t *samples,
+    size_t count, uint64_t timestamp_ns, uint64_t interval_ns, uint8_t flags)
+{
+    for (size_t k = 0; k < count; k++)
+    {
+        const uint8_t *wire = samples + k * SPI_SAMPLE_LEN;
+        uint64_t ts = timestamp_ns - (count - 1 - k) * interval_ns;
+
+        for (size_t i = 0; i < ctx->nsinks; i++)
+        {
+            ring *r = &ctx->sinks[i].rings[ctx->ring];
+            sample_record *slot = ring_reserve(r);
+            if (slot != NULL)
+            {
+                slot->timestamp_ns = ts;
+                memcpy(&slot->data, wire, SPI_SAMPLE_LEN);
+                slot->device = device;
+                slot->flags = flags;
+                ring_commit(r);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Check a reading against the deadband of its device
+ * @details The reference moves only on a change, so a slow drift is caught
+ *              once it adds up to the deadband.
+ * 
+ * @param ctx Bus context
+ * @param pos Position of the device in the bus
+ * @param wire Packed sample
+ * @return int 1 on a step or a relay toggle, 0 otherwise
+ */
+static int sampler_changed(sampler_bus *ctx, size_t pos, const uint8_t *wire)
+{
+    homeoffice_data *ref = &ctx->ref[pos];
+    homeoffice_data data;
+    double band = ctx->cfg->deadband;
+
+    memcpy(&data, wire, SPI_SAMPLE_LEN);
+    if (ctx->has_ref[pos] && data.relay == ref->relay
+        && fabs(data.voltage - ref->voltage) <= band * fabs(ref->voltage) + SAMPLER_DEADBAND_FLOOR
+        && fabs(data.current - ref->current) <= band * fabs(ref->current) + SAMPLER_DEADBAND_FLOOR
+        && fabs(data.power - ref->power) <= band * fabs(ref->power) + SAMPLER_DEADBAND_FLOOR)
+    {
+        return 0;
+    }
+
+    *ref = data;
+    ctx->has_ref[pos] = 1;
+
+    return 1;
+}
+
+/**
+ * @brief Raise a shared maximum
+ * 
+ * @param max Maximum, updated by several threads
+ * @param value New value
+ */
+static void sampler_max(_Atomic uint64_t *max, uint64_t value)
+{
+    uint64_t cur = atomic_load_explicit(max, memory_order_relaxed);
+
+    while (value > cur && !atomic_compare_exchange_weak_explicit(max,
+        &cur, value, memory_order_relaxed, memory_order_relaxed));
+}
+
+/**
+ * @brief Account the latency of a wake-up
+ * 
+ * @param wake_ns Time from the deadline to the thread running again
+ */
+static void sampler_wake(uint64_t wake_ns)
+{
+    unsigned int bucket = 0;
+
+    while (bucket < SAMPLER_WAKE_BUCKETS - 1 && wake_ns > gs_sampler_wake_us[bucket] * NSEC_PER_USEC)
+    {
+        bucket++;
+    }
+
+    atomic_fetch_add_explicit(&gs_sampler_live.wake[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&gs_sampler_live.wake_ns, wake_ns, memory_order_relaxed);
+    sampler_max(&gs_sampler_live.max_wake_ns, wake_ns);
+}
+
+/**
+ * @brief Fault in the top of the calling thread stack
+ * @details Touches one byte per page of a frame below the caller, so the
+ *              sampling loop does not take the first-touch faults.
+ * 
+ */
+static __attribute__((noinline)) void sampler_prefault_stack()
+{
+    volatile uint8_t stack[SAMPLER_STACK_PREFAULT];
+
+    for (size_t i = 0; i < sizeof(stack); i += SAMPLER_PAGE_SIZE)
+    {
+        stack[i] = 0;
+    }
+}
+
+/**
+ * @brief Set up the attributes of an acquisition or pipeline thread
+ * 
+ * @param cfg Sampler configuration
+ * @param cpu CPU to pin the thread to, -1 to leave it unpinned
+ * @param attr Initialized attributes to set up
+ * @return int 0 on success, an error number otherwise
+ */
+static int sampler_attr(const sampler_config *cfg, int cpu, pthread_attr_t *attr)
+{
+    int err = pthread_attr_setstacksize(attr, SAMPLER_STACK_SIZE);
+
+    if (err == 0 && cfg->rt_priority > 0)
+    {
+        struct sched_param param = { .sched_priority = cfg->rt_priority };
+
+        err = pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+        if (err == 0)
+        {
+            err = pthread_attr_setschedpolicy(attr, SCHED_FIFO);
+        }
+        if (err == 0)
+        {
+            err = pthread_attr_setschedparam(attr, &param);
+        }
+    }
+    if (err == 0 && cpu >= 0)
+    {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        err = pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+    }
+
+    return err;
+}
+
+/**
+ * @brief Choose the CPU of a pipeline worker
+ * @details A worker pinned next to its acquisition thread would take turns
+ *              with it on one CPU, and spi-bcm2835 busy-polls short
+ *              transfers, so little of the transfer would overlap the
+ *              decoding. Workers take the CPUs of cfg->cpus left over by the
+ *              acquisition threads in turn, and are left unpinned when there
+ *              are none, at the cost of being scheduled on the housekeeping
+ *              CPUs.
+ * 
+ * @param cfg Sampler configuration
+ * @param nbuses Number of acquisition threads
+ * @param worker Index of the worker
+ * @return int CPU, -1 to leave the worker unpinned
+ */
+static int sampler_worker_cpu(const sampler_config *cfg, size_t nbuses, size_t worker)
+{
+    if (cfg->ncpus <= nbuses)
+    {
+        return -1;
+    }
+
+    return cfg->cpus[nbuses + worker % (cfg->ncpus - nbuses)];
+}
+
+/**
+ * @brief Report a thread that could not be started
+ * 
+ * @param err Error number of pthread_create()
+ */
+static void sampler_start_error(int err)
+{
+    fprintf(stderr, "Error starting acquisition thread: %s%s\n", strerror(err),
+        err == EPERM ? " (SCHED_FIFO needs root or CAP_SYS_NICE)" : "");
+}
+
+/**
+ * @brief Check the sampling rates of a configuration
+ * 
+ * @param cfg Sampler configuration
+ * @return int 0 if they are consistent, -1 otherwise
+ */
+static int sampler_check_rates(const sampler_config *cfg)
+{
+    if (cfg->base_hz > 0 && cfg->batch > 1)
+    {
+        fprintf(stderr, "Adaptive sampling reads one sample per transfer, without --batch\n");
+        return -1;
+    }
+    if (cfg->base_hz >= cfg->hz)
+    {
+        fprintf(stderr, "The adaptive base rate must be below the sampling rate\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Body of the threads sampler_check() starts
+ * 
+ * @param arg Unused
+ * @return void* arg
+ */
+static void *sampler_probe(void *arg)
+{
+    return arg;
+}
+
+/**
+ * @brief Account the outcome of a read
+ * 
+ * @param ctx Bus context
+ * @param count Number of samples, -1 if the read failed
+ */
+static void sampler_count(sampler_bus *ctx, int count)
+{
+    if (count >= 0)
+    {
+        ctx->samples += count;
+        atomic_fetch_add_explicit(&gs_sampler_live.samples, count, memory_order_relaxed);
+    }
+    else
+    {
+        atomic_fetch_add_explicit(&gs_sampler_live.errors, 1, memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Get the read command of a device
+ * 
+ * @param dev SPI device
+ * @param batch Samples per read
+ * @return uint8_t Batch or single read command, raw in raw register mode
+ */
+static uint8_t sampler_cmd(const spi_device *dev, unsigned int batch)
+{
+    if (dev->shunt_uohm != 0)
+    {
+        return batch > 1 ? CMD_READ_BATCH_RAW : CMD_READ_RAW;
+    }
+
+    return batch > 1 ? CMD_READ_BATCH : CMD_READ_ALL;
+}
+
+/**
+ * @brief Convert the raw samples of a reply in raw register mode
+ * 
+ * @param ctx Bus context
+ * @param dev SPI device
+ * @param samples Reply payload, set to the packed samples
+ * @param count Number of samples of the reply, -1 if the read failed
+ * @return int Number of samples, -1 if the read failed or the reply is invalid
+ */
+static int sampler_decode(sampler_bus *ctx, const spi_device *dev, const uint8_t **samples, int count)
+{
+    if (dev->shunt_uohm == 0 || count < 0)
+    {
+        return count;
+    }
+
+    count = ina219_decode(dev->shunt_uohm, *samples, count, ctx->decoded);
+    *samples = ctx->decoded;
+
+    return count;
+}
+
+/**
+ * @brief Read a device and publish its samples
+ * 
+ * @param ctx Bus context
+ * @param pos Position of the device in the bus
+ * @param batch Samples per read, 1 for a single read
+ * @param interval_ns Sample interval
+ * @param flags SAMPLE_FLAG_* of the samples
+ * @return int Number of samples, -1 if the read failed after all retries
+ */
+static int sampler_read(sampler_bus *ctx, size_t pos, unsigned int batch, uint64_t interval_ns, uint8_t flags)
+{
+    spi_device *dev = ctx->devices[pos];
+    const uint8_t *samples;
+    int count;
+
+    if (dev->pipeline != NULL)
+    {
+        return sampler_read_pipelined(ctx, pos, batch, interval_ns, flags, 1);
+    }
+
+    /* Held until the samples are decoded out of the receive frame */
+    pthread_mutex_lock(&dev->lock);
+    if (batch > 1)
+    {
+        count = spi_read_batch(dev, sampler_cmd(dev, batch), batch, &samples);
+    }
+    else
+    {
+        samples = spi_query(dev, sampler_cmd(dev, batch));
+        count = samples != NULL ? 1 : -1;
+    }
+    count = sampler_decode(ctx, dev, &samples, count);
+
+    if (count >= 0)
+    {
+        TRACE_BEGIN("sampler_publish", count);
+        sampler_publish(ctx, dev->index, samples, count, sampler_timestamp(ctx, pos, batch > 1, NULL), interval_ns, flags);
+        TRACE_END("sampler_publish", count);
+        if (ctx->cfg->base_hz > 0 && count > 0 && sampler_changed(ctx, pos, samples + (count - 1) * SPI_SAMPLE_LEN))
+        {
+            ctx->changed_ns = dev->xfer_end_ns;
+        }
+    }
+    pthread_mutex_unlock(&dev->lock);
+    sampler_count(ctx, count);
+
+    return count;
+}
+
+/**
+ * @brief Read a pipelined device and publish the samples of its previous read
+ * @details The next request is submitted before the previous reply is
+ *              decoded, so the decoding overlaps the transfer. Samples reach
+ *              the sinks one read of the device later than without
+ *              pipelining, stamped from the bracket of their own transfer.
+ *              The reply is in a slot of the pipeline, so the device lock is
+ *              not needed to decode it.
+ * 
+ * @param ctx Bus context
+ * @param pos Position of the device in the bus
+ * @param batch Samples per read, 1 for a single read
+ * @param interval_ns Sample interval
+ * @param flags SAMPLE_FLAG_* of the submitted read
+ * @param submit Submit the next request, 0 to only drain the last one
+ * @return int Number of samples published, -1 if the previous read failed
+ */
+static int sampler_read_pipelined(sampler_bus *ctx, size_t pos, unsigned int batch, uint64_t interval_ns,
+    uint8_t flags, int submit)
+{
+    spi_device *dev = ctx->devices[pos];
+    const spi_slot *slot = spi_complete(dev);
+    uint8_t slot_flags = ctx->pending_flags[pos];
+    const uint8_t *samples;
+    int count;
+
+    if (submit)
+    {
+        spi_submit(dev, sampler_cmd(dev, batch), batch > 1 ? batch : 0);
+        ctx->pending_flags[pos] = flags;
+    }
+    if (slot == NULL)
+    {
+        return 0;
+    }
+
+    count = sampler_decode(ctx, dev, &samples, spi_slot_samples(slot, &samples));
+    if (count >= 0)
+    {
+        TRACE_BEGIN("sampler_publish", count);
+        sampler_publish(ctx, dev->index, samples, count, sampler_timestamp(ctx, pos, batch > 1, slot),
+            interval_ns, slot_flags);
+        TRACE_END("sampler_publish", count);
+        if (ctx->cfg->base_hz > 0 && count > 0 && sampler_changed(ctx, pos, samples + (count - 1) * SPI_SAMPLE_LEN))
+        {
+            ctx->changed_ns = slot->xfer_end_ns;
+        }
+    }
+    sampler_count(ctx, count);
+
+    return count;
+}
+
+/**
+ * @brief Wait for a deadline or an edge on an interrupt line of the bus
+ * @details ppoll() takes a relative timeout, which the kernel rounds up, so
+ *              the deadline is never reported early; with the timer slack of
+ *              a real time thread it is as precise as clock_nanosleep().
+ *              A line reporting an error or hang-up instead of an edge would
+ *              wake every call at once, so it is dropped; the bus falls back
+ *              to clock_nanosleep() once it has no line left.
+ * 
+ * @param ctx Bus context
+ * @param deadline_ns CLOCK_MONOTONIC deadline
+ * @return int Position of a device whose line fired, -1 otherwise
+ */
+static int sampler_wait_irq(sampler_bus *ctx, uint64_t deadline_ns)
+{
+    uint64_t now_ns = time_now_ns(CLOCK_MONOTONIC);
+    struct timespec timeout;
+
+    ns_to_timespec(deadline_ns > now_ns ? deadline_ns - now_ns : 0, &timeout);
+    if (ppoll(ctx->irqs, ctx->nirqs, &timeout, NULL) <= 0)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < ctx->nirqs; i++)
+    {
+        if (ctx->irqs[i].revents & (POLLERR | POLLHUP | POLLNVAL | POLLPRI))
+        {
+            atomic_fetch_add_explicit(&gs_sampler_live.irq_errors, 1, memory_order_relaxed);
+            sampler_irq_drop(ctx, i--);
+            continue;
+        }
+        if (ctx->irqs[i].revents & POLLIN)
+        {
+            gpio_irq_drain(ctx->irqs[i].fd);
+            return ctx->irq_pos[i];
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Request the interrupt lines of the devices of a bus
+ * 
+ * @param ctx Bus context
+ * @param cfg Sampler configuration
+ * @return int 0 on success, -1 on error
+ */
+static int sampler_irq_open(sampler_bus *ctx, const sampler_config *cfg)
+{
+    for (size_t pos = 0; pos < ctx->ndevices; pos++)
+    {
+        size_t index = ctx->devices[pos]->index;
+        int fd;
+
+        if (index >= cfg->nirqs)
+        {
+            continue;
+        }
+        fd = gpio_irq_open(cfg->irqs[index]);
+        if (fd < 0)
+        {
+            sampler_irq_close(ctx);
+            return -1;
+        }
+        ctx->irqs[ctx->nirqs].fd = fd;
+        ctx->irqs[ctx->nirqs].events = POLLIN;
+        ctx->irq_pos[ctx->nirqs++] = pos;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Release an interrupt line of a bus that failed
+ * 
+ * @param ctx Bus context
+ * @param line Line, the last one takes its place
+ */
+static void sampler_irq_drop(sampler_bus *ctx, size_t line)
+{
+    close(ctx->irqs[line].fd);
+    ctx->nirqs--;
+    ctx->irqs[line] = ctx->irqs[ctx->nirqs];
+    ctx->irq_pos[line] = ctx->irq_pos[ctx->nirqs];
+}
+
+/**
+ * @brief Release the interrupt lines of a bus
+ * 
+ * @param ctx Bus context
+ */
+static void sampler_irq_close(sampler_bus *ctx)
+{
+    while (ctx->nirqs > 0)
+    {
+        close(ctx->irqs[--ctx->nirqs].fd);
+    }
+}
+
+/**
+ * @brief Acquisition thread of one SPI bus
+ * @details The devices of the bus are interleaved: each sample period is
+ *              split into one slot per device, and every slot reads the next
+ *              device in turn, so transfers are spread evenly over the period.
+ *              When a slot finishes after its successor's deadline, the missed
+ *              slots are counted as overruns and skipped, keeping the schedule
+ *              phase-locked to the start time. In batch mode each slot drains
+ *              up to cfg->batch samples buffered by the device, so the period
+ *              is cfg->batch sample intervals. A read that fails after all
+ *              retries produces no sample and is counted as an error. Every
+ *              wake-up is timed against its deadline. An edge on the interrupt
+ *              line of a device reads it at once, between two slots, without
+ *              moving the schedule, and counts as a change for the adaptive
+ *              rate. The rate is switched between slots; samples taken at
+ *              the base rate carry SAMPLE_FLAG_DECIMATED.
+ * 
+ * @param arg Bus context
+ * @return void* NULL
+ */
+static void *sampler_thread(void *arg)
+{
+    sampler_bus *ctx = arg;
+    unsigned int batch = ctx->cfg->batch > 1 ? ctx->cfg->batch : 1;
+    uint64_t interval_ns = (uint64_t)(NSEC_PER_SEC / ctx->cfg->hz);
+    uint64_t fast_slot_ns = interval_ns * batch / ctx->ndevices;
+    uint64_t base_slot_ns = ctx->cfg->base_hz > 0 ? (uint64_t)(NSEC_PER_SEC / ctx->cfg->base_hz) / ctx->ndevices : fast_slot_ns;
+    uint64_t slot_ns = fast_slot_ns;
+    int fast = 1;
+    uint64_t target = ctx->cfg->count * ctx->ndevices;
+    uint64_t next_ns = time_now_ns(CLOCK_MONOTONIC);
+    uint64_t slot = 0;
+    struct timespec deadline;
+
+    trace_thread("sampler");
+    sampler_prefault_stack();
+    arena_guard(1);
+
+    while (!atomic_load_explicit(&gs_sampler_stop, memory_order_relaxed)
+        && (target == 0 || ctx->samples < target))
+    {
+        if (ctx->nirqs > 0)
+        {
+            int pos = sampler_wait_irq(ctx, next_ns);
+
+            if (pos >= 0)
+            {
+                atomic_fetch_add_explicit(&gs_sampler_live.interrupts, 1, memory_order_relaxed);
+                TRACE_INSTANT("sampler_irq", pos);
+                ctx->changed_ns = time_now_ns(CLOCK_MONOTONIC);
+                sampler_read(ctx, pos, batch, interval_ns, fast ? 0 : SAMPLE_FLAG_DECIMATED);
+                continue;
+            }
+            if (time_now_ns(CLOCK_MONOTONIC) < next_ns)
+            {
+                continue;
+            }
+        }
+        else
+        {
+            ns_to_timespec(next_ns, &deadline);
+            if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+            {
+                continue;
+            }
+        }
+        uint64_t woke_ns = time_now_ns(CLOCK_MONOTONIC);
+        sampler_wake(woke_ns > next_ns ? woke_ns - next_ns : 0);
+        TRACE_INSTANT("sampler_wake", woke_ns > next_ns ? woke_ns - next_ns : 0);
+
+        sampler_read(ctx, slot % ctx->ndevices, batch, interval_ns, fast ? 0 : SAMPLE_FLAG_DECIMATED);
+
+        next_ns += slot_ns;
+        slot++;
+
+        uint64_t now_ns = time_now_ns(CLOCK_MONOTONIC);
+        if (now_ns > next_ns)
+        {
+            uint64_t late_ns = now_ns - next_ns;
+            uint64_t missed = late_ns / slot_ns + 1;
+
+            sampler_max(&gs_sampler_live.max_late_ns, late_ns);
+            atomic_fetch_add_explicit(&gs_sampler_live.overruns, missed, memory_order_relaxed);
+            next_ns += missed * slot_ns;
+            slot += missed;
+        }
+
+        int want_fast = ctx->cfg->base_hz == 0 || now_ns - ctx->changed_ns < SAMPLER_FAST_HOLD_NS;
+        if (want_fast != fast)
+        {
+            uint64_t new_slot_ns = want_fast ? fast_slot_ns : base_slot_ns;
+
+            /* The next slot follows the previous one at the new rate, a step right away */
+            next_ns = next_ns - slot_ns + new_slot_ns;
+            if (want_fast && next_ns < now_ns)
+            {
+                next_ns = now_ns;
+            }
+            slot_ns = new_slot_ns;
+            fast = want_fast;
+            atomic_fetch_add_explicit(&gs_sampler_live.rate_changes, 1, memory_order_relaxed);
+            TRACE_INSTANT("sampler_rate", fast);
+        }
+    }
+
+    /* The last reads of pipelined devices are still in flight */
+    for (size_t pos = 0; pos < ctx->ndevices; pos++)
+    {
+        if (ctx->devices[pos]->pipeline != NULL && (target == 0 || ctx->samples < target))
+        {
+            sampler_read_pipelined(ctx, pos, batch, interval_ns, 0, 0);
+        }
+    }
+
+    return NULL;
+}
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Count the acquisition threads needed for a set of devices
+ * @details One thread is used per SPI bus. Sinks must be started with this
+ *              many producers.
+ * 
+ * @param devices Devices
+ * @param ndevices Number of devices
+ * @return size_t Number of acquisition threads
+ */
+size_t sampler_threads(spi_device *devices, size_t ndevices)
+{
+    return sampler_group(devices, ndevices, NULL);
+}
+
+/**
+ * @brief Check that a configuration can be run
+ * @details Catches ahead of time what sampler_run() would only fail on when
+ *              starting, so a service can reject a configuration before it
+ *              detaches or gives up the running one on a reload. A thread is
+ *              started with the policy of the acquisition threads on each of
+ *              cfg->cpus, and the memory lock and the interrupt lines are
+ *              taken and released again.
+ * 
+ * @param cfg Sampler configuration
+ * @return int 0 if the configuration can run, -1 otherwise
+ */
+int sampler_check(const sampler_config *cfg)
+{
+    if (sampler_check_rates(cfg) < 0)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; (cfg->rt_priority > 0 || cfg->ncpus > 0) && i < (cfg->ncpus > 0 ? cfg->ncpus : 1); i++)
+    {
+        pthread_attr_t attr;
+        pthread_t thread;
+
+        pthread_attr_init(&attr);
+        int err = sampler_attr(cfg, cfg->ncpus > 0 ? cfg->cpus[i] : -1, &attr);
+        if (err == 0)
+        {
+            err = pthread_create(&thread, &attr, sampler_probe, NULL);
+        }
+        pthread_attr_destroy(&attr);
+        if (err != 0)
+        {
+            sampler_start_error(err);
+            return -1;
+        }
+        pthread_join(thread, NULL);
+    }
+
+    if (cfg->lock_memory)
+    {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) < 0)
+        {
+            perror("Error locking memory");
+            return -1;
+        }
+        munlockall();
+    }
+
+    for (size_t i = 0; i < cfg->nirqs; i++)
+    {
+        int fd = gpio_irq_open(cfg->irqs[i]);
+
+        if (fd < 0)
+        {
+            return -1;
+        }
+        close(fd);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Run the acquisition threads until stopped or the sample count is reached
+ * @details Devices on the same bus share one thread and are interleaved,
+ *              devices on different buses are polled in parallel. The sinks
+ *              must already be started. They are left running so the caller
+ *              can drain and stop them. With cfg->lock_memory the process
+ *              memory is locked for the duration of the run. The interrupt
+ *              lines in cfg->irqs are requested for the run only. Adaptive
+ *              sampling needs one sample per transfer, as the device buffer
+ *              of batch mode fills at the device rate.
+ * 
+ * @param cfg Sampler configuration
+ * @param devices Initialized devices
+ * @param ndevices Number of devices
+ * @param sinks Sinks fed with the samples
+ * @param nsinks Number of sinks
+ * @param stats Filled with the acquisition statistics of all threads
+ * @return int 0 on success, -1 on error
+ */
+int sampler_run(const sampler_config *cfg, spi_device *devices, size_t ndevices,
+    sink *sinks, size_t nsinks, sampler_stats *stats)
+{
+    sampler_bus buses[SPI_DEVICES_MAX];
+    size_t nbuses = sampler_group(devices, ndevices, buses);
+    size_t started;
+    size_t workers = 0;
+    int ret = 0;
+
+    if (sampler_check_rates(cfg) < 0)
+    {
+        return -1;
+    }
+
+    atomic_store(&gs_sampler_stop, 0);
+    atomic_store(&gs_sampler_live.samples, 0);
+    atomic_store(&gs_sampler_live.overruns, 0);
+    atomic_store(&gs_sampler_live.max_late_ns, 0);
+    atomic_store(&gs_sampler_live.errors, 0);
+    atomic_store(&gs_sampler_live.interrupts, 0);
+    atomic_store(&gs_sampler_live.irq_errors, 0);
+    atomic_store(&gs_sampler_live.rate_changes, 0);
+    for (unsigned int k = 0; k < SAMPLER_WAKE_BUCKETS; k++)
+    {
+        atomic_store(&gs_sampler_live.wake[k], 0);
+    }
+    atomic_store(&gs_sampler_live.wake_ns, 0);
+    atomic_store(&gs_sampler_live.max_wake_ns, 0);
+
+    /* Pages already mapped are locked as they are touched, before sampling
+       for the rings, the device frames and the thread stacks */
+    if (cfg->lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) < 0)
+    {
+        perror("Error locking memory");
+        return -1;
+    }
+
+    for (size_t b = 0; b < nbuses; b++)
+    {
+        if (sampler_irq_open(&buses[b], cfg) < 0)
+        {
+            while (b-- > 0)
+            {
+                sampler_irq_close(&buses[b]);
+            }
+            if (cfg->lock_memory)
+            {
+                munlockall();
+            }
+            return -1;
+        }
+    }
+
+    for (started = 0; started < nbuses; started++)
+    {
+        pthread_attr_t attr;
+
+        buses[started].cfg = cfg;
+        buses[started].sinks = sinks;
+        buses[started].nsinks = nsinks;
+
+        int err = 0;
+        for (size_t i = 0; err == 0 && cfg->pipeline && i < buses[started].ndevices; i++)
+        {
+            pthread_attr_init(&attr);
+            err = sampler_attr(cfg, sampler_worker_cpu(cfg, nbuses, workers++), &attr);
+            if (err == 0)
+            {
+                err = spi_pipeline_start(buses[started].devices[i], &attr);
+            }
+            pthread_attr_destroy(&attr);
+        }
+
+        pthread_attr_init(&attr);
+        if (err == 0)
+        {
+            err = sampler_attr(cfg, cfg->ncpus > 0 ? cfg->cpus[started % cfg->ncpus] : -1, &attr);
+        }
+        if (err == 0)
+        {
+            err = pthread_create(&buses[started].thread, &attr, sampler_thread, &buses[started]);
+        }
+        pthread_attr_destroy(&attr);
+        if (err != 0)
+        {
+            sampler_start_error(err);
+            sampler_stop();
+            ret = -1;
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < started; i++)
+    {
+        pthread_join(buses[i].thread, NULL);
+    }
+    for (size_t i = 0; i < ndevices; i++)
+    {
+        spi_pipeline_stop(&devices[i]);
+    }
+    for (size_t i = 0; i < nbuses; i++)
+    {
+        sampler_irq_close(&buses[i]);
+    }
+    sampler_get_stats(stats);
+
+    if (cfg->lock_memory)
+    {
+        munlockall();
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Get the acquisition statistics of the current or last run
+ * @details May be called from any thread while sampling.
+ * 
+ * @param stats Filled with the statistics of all acquisition threads
+ */
+void sampler_get_stats(sampler_stats *stats)
+{
+    stats->samples = atomic_load_explicit(&gs_sampler_live.samples, memory_order_relaxed);
+    stats->overruns = atomic_load_explicit(&gs_sampler_live.overruns, memory_order_relaxed);
+    stats->max_late_ns = atomic_load_explicit(&gs_sampler_live.max_late_ns, memory_order_relaxed);
+    stats->errors = atomic_load_explicit(&gs_sampler_live.errors, memory_order_relaxed);
+    stats->interrupts = atomic_load_explicit(&gs_sampler_live.interrupts, memory_order_relaxed);
+    stats->irq_errors = atomic_load_explicit(&gs_sampler_live.irq_errors, memory_order_relaxed);
+    stats->rate_changes = atomic_load_explicit(&gs_sampler_live.rate_changes, memory_order_relaxed);
+    for (unsigned int k = 0; k < SAMPLER_WAKE_BUCKETS; k++)
+    {
+        stats->wake[k] = atomic_load_explicit(&gs_sampler_live.wake[k], memory_order_relaxed);
+    }
+    stats->wake_ns = atomic_load_explicit(&gs_sampler_live.wake_ns, memory_order_relaxed);
+    stats->max_wake_ns = atomic_load_explicit(&gs_sampler_live.max_wake_ns, memory_order_relaxed);
+}
+
+/**
+ * @brief Get the upper bound of a wake-up latency histogram bucket
+ * 
+ * @param bucket Bucket, below SAMPLER_WAKE_BUCKETS - 1
+ * @return uint32_t Upper bound in microseconds
+ */
+uint32_t sampler_wake_bound_us(unsigned int bucket)
+{
+    return gs_sampler_wake_us[bucket];
+}
+
+/**
+ * @brief Print the acquisition statistics
+ * @details Wake-up latency percentiles are given as the upper bound of the
+ *              histogram bucket they fall in.
+ * 
+ * @param stats Acquisition statistics
+ * @param fp Output stream
+ */
+void sampler_print_stats(const sampler_stats *stats, FILE *fp)
+{
+    static const struct {
+        const char *name;
+        double q;
+    } percentiles[] = { { "p50", 0.5 }, { "p99", 0.99 }, { "p99.9", 0.999 } };
+    uint64_t wakes = 0;
+
+    fprintf(fp, "Samples: %llu, overruns: %llu, max late: %.3f ms, read errors: %llu\n",
+        (unsigned long long)stats->samples, (unsigned long long)stats->overruns,
+        (double)stats->max_late_ns / NSEC_PER_MSEC, (unsigned long long)stats->errors);
+    if (stats->interrupts > 0)
+    {
+        fprintf(fp, "Interrupt reads: %llu\n", (unsigned long long)stats->interrupts);
+    }
+    if (stats->irq_errors > 0)
+    {
+        fprintf(fp, "Interrupt lines dropped on error: %llu\n", (unsigned long long)stats->irq_errors);
+    }
+    if (stats->rate_changes > 0)
+    {
+        fprintf(fp, "Adaptive rate changes: %llu\n", (unsigned long long)stats->rate_changes);
+    }
+
+    for (unsigned int k = 0; k < SAMPLER_WAKE_BUCKETS; k++)
+    {
+        wakes += stats->wake[k];
+    }
+    if (wakes == 0)
+    {
+        return;
+    }
+
+    fprintf(fp, "Wake-up latency: mean %.1f us, max %.1f us",
+        (double)stats->wake_ns / wakes / NSEC_PER_USEC, (double)stats->max_wake_ns / NSEC_PER_USEC);
+    for (size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++)
+    {
+        uint64_t rank = (uint64_t)(percentiles[p].q * wakes);
+        uint64_t cumulative = 0;
+        unsigned int k = 0;
+
+        while (k < SAMPLER_WAKE_BUCKETS - 1 && (cumulative += stats->wake[k]) <= rank)
+        {
+            k++;
+        }
+        if (k < SAMPLER_WAKE_BUCKETS - 1)
+        {
+            fprintf(fp, ", %s <= %u us", percentiles[p].name, gs_sampler_wake_us[k]);
+        }
+        else
+        {
+            fprintf(fp, ", %s > %u us", percentiles[p].name, gs_sampler_wake_us[k - 1]);
+        }
+    }
+    fprintf(fp, "\n");
+
+    fprintf(fp, "Wake-up histogram:");
+    for (unsigned int k = 0; k < SAMPLER_WAKE_BUCKETS; k++)
+    {
+        if (k < SAMPLER_WAKE_BUCKETS - 1)
+        {
+            fprintf(fp, " <=%uus %llu", gs_sampler_wake_us[k], (unsigned long long)stats->wake[k]);
+        }
+        else
+        {
+            fprintf(fp, " >%uus %llu", gs_sampler_wake_us[k - 1], (unsigned long long)stats->wake[k]);
+        }
+    }
+    fprintf(fp, "\n");
+}
+
+/**
+ * @brief Ask the acquisition threads to stop (async-signal-safe)
+ * 
+ */
+void sampler_stop()
+{
+    atomic_store(&gs_sampler_stop, 1);
+}
@@ -0,0 +1,81 @@
+/**
+ * @file    sampler.h
+ * @brief   Continuous sample acquisition
+ * @details Real-time acquisition threads, one per SPI bus, that read the
+ *              homeoffice devices at a fixed rate and push the timestamped
+ *              samples to the sinks. The threads can run under SCHED_FIFO,
+ *              pinned to chosen CPUs, with the process memory locked, and
+ *              record how late they wake up for each sample slot.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "spi.h"
+#include "sink.h"
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define SAMPLE_MAX_HZ 100000        /* Highest accepted sampling rate */
+#define SAMPLER_WAKE_BUCKETS 12     /* Wake-up latency histogram buckets, the last one unbounded */
+#define SAMPLER_DEADBAND_DEFAULT 0.01 /* Default relative change that raises the adaptive rate */
+
+/* *************************
+ * PUBLIC TYPES DEFINITION *
+ * *************************/
+
+/* Sampler configuration */
+typedef struct sampler_config{
+    double hz;                      /* Sampling rate */
+    double base_hz;                 /* Rate while the readings are steady, 0 to always sample at hz */
+    double deadband;                /* Relative change of a reading that switches to hz */
+    unsigned long count;            /* Samples to take per device, 0 to run until stopped */
+    unsigned int batch;             /* Samples per CMD_READ_BATCH, 1 for CMD_READ_ALL */
+    int rt_priority;                /* SCHED_FIFO priority of the threads, 0 for the default policy */
+    int cpus[SPI_DEVICES_MAX];      /* CPUs the threads are pinned to, one each in turn */
+    size_t ncpus;                   /* 0 to leave the threads unpinned */
+    int lock_memory;                /* Lock the process memory while sampling */
+    const char *irqs[SPI_DEVICES_MAX]; /* Interrupt line of each device in order, see gpio_irq_open() */
+    size_t nirqs;                   /* 0 to only read on schedule */
+    int pipeline;                   /* Overlap each transfer with decoding the previous one, see spi_submit() */
+} sampler_config;
+
+/* Sampler statistics */
+typedef struct sampler_stats{
+    uint64_t samples;               /* Samples taken */
+    uint64_t overruns;              /* Sample periods missed */
+    uint64_t max_late_ns;           /* Worst deadline miss */
+    uint64_t errors;                /* Reads that failed after all retries */
+    uint64_t interrupts;            /* Reads triggered by an interrupt line */
+    uint64_t irq_errors;            /* Interrupt lines dropped after an error */
+    uint64_t rate_changes;          /* Switches between the adaptive rates */
+    uint64_t wake[SAMPLER_WAKE_BUCKETS]; /* Wake-ups per latency bucket */
+    uint64_t wake_ns;               /* Sum of the wake-up latencies */
+    uint64_t max_wake_ns;           /* Worst wake-up latency */
+} sampler_stats;
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+size_t sampler_threads(spi_device *devices, size_t ndevices);
+int sampler_check(const sampler_config *cfg);
+int sampler_run(const sampler_config *cfg, spi_device *devices, size_t ndevices,
+    sink *sinks, size_t nsinks, sampler_stats *stats);
+void sampler_get_stats(sampler_stats *stats);
+uint32_t sampler_wake_bound_us(unsigned int bucket);
+void sampler_print_stats(const sampler_stats *stats, FILE *fp);
+void sampler_stop();
+
+#endif /* SAMPLER_H */
@@ -0,0 +1,808 @@
+/**
+ * @file    simdev.c
+ * @brief   Emulated homeoffice devices
+ * @details An emulated device latches the command frame and builds the reply
+ *              frame the firmware would send, echoed command, CRC and tick
+ *              included. Its conversions go into a FIFO at their time on the
+ *              device clock, which starts with the first transfer and runs at
+ *              a scale of the host clock; with a scale of 0 every batch read
+ *              comes back full. A device path holds the options after the
+ *              prefix, separated by commas:
+ * 
+ *              sim:rate=<hz>,voltage=<v>,load=<a>,shunt=<mohm>,scale=<x>,errors=<p>,seed=<n>
+ *              replay:<capture>,shunt=<mohm>,scale=<x>,errors=<p>,seed=<n>
+ * 
+ *              The simulated INA219 reads a bus voltage that sags with the
+ *              load, a load that steps between levels every few seconds while
+ *              the relay is on, and noise on both, quantized to the register
+ *              resolution. A replayed capture is played from the records of
+ *              the device with the same index, or from all of them if there
+ *              are none, and loops at its end; relay commands are answered
+ *              but the relay state comes from the capture. A failed transfer
+ *              is an ioctl error, a wrong echo or a corrupted payload byte,
+ *              which only the CRC check can catch. Raw reads get the
+ *              registers of each reading, with the calibration of the current
+ *              resolution on the shunt option.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "simdev.h"
+#include "record.h"
+#include "timeutil.h"
+#include "ina219.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define SIMDEV_BUS_LSB_V 0.004      /* INA219 bus voltage resolution */
+#define SIMDEV_CURRENT_LSB_A 0.0001 /* Current resolution, 3.2 A full scale */
+#define SIMDEV_POWER_LSB_W 0.002    /* Power resolution, 20 current LSBs */
+#define SIMDEV_SOURCE_OHM 0.05      /* Supply resistance the bus voltage sags across */
+#define SIMDEV_VOLTAGE_NOISE_V 0.002 /* Bus voltage noise, standard deviation */
+#define SIMDEV_RIPPLE 0.005         /* Relative load noise, standard deviation */
+#define SIMDEV_OFFSET_NOISE_A 0.0002 /* Shunt offset noise, standard deviation */
+#define SIMDEV_STEP_MIN 0.2         /* Load step range, relative to the load option */
+#define SIMDEV_STEP_MAX 1.8
+#define SIMDEV_STEP_S 3.0           /* Mean time between load steps */
+#define SIMDEV_REPLAY_STEP_NS NSEC_PER_MSEC /* Record spacing of captures without a time span */
+#define SIMDEV_REPLAY_CHUNK 4096    /* Records the replay buffer grows by at first */
+#define SIMDEV_ARG_MAX 512          /* Longest device path argument */
+
+#define SIMDEV_FAULT_NONE 0
+#define SIMDEV_FAULT_IOCTL 1        /* The transfer fails */
+#define SIMDEV_FAULT_ECHO 2         /* The reply echoes another command */
+#define SIMDEV_FAULT_DATA 3         /* A payload byte is corrupted after the CRC */
+
+/* **************************
+ * PRIVATE TYPES DEFINITION *
+ * **************************/
+
+/* Record of a replayed capture */
+typedef struct simdev_record{
+    int64_t time_us;                /* Time in the capture */
+    uint64_t time_ns;               /* Device time in the first pass */
+    uint8_t wire[SPI_SAMPLE_LEN];   /* Packed sample */
+    uint8_t device;
+} simdev_record;
+
+/* Emulated device */
+typedef struct simdev{
+    /* Options */
+    double rate;                    /* Conversions per second of device time */
+    double scale;                   /* Device time per host time, 0 to fill every batch */
+    double errors;                  /* Share of failed transfers */
+    double voltage;                 /* Nominal bus voltage */
+    double load;                    /* Mean load current with the relay on */
+    uint32_t shunt_uohm;            /* Shunt the calibration register is computed for */
+    uint64_t rng;                   /* xorshift64* state */
+
+    /* Conversion source */
+    uint64_t (*time_ns)(const struct simdev *sd, uint64_t k); /* Device time of conversion k */
+    void (*sample)(struct simdev *sd, uint64_t k, uint8_t *wire);
+    uint64_t next;                  /* Next conversion */
+    uint64_t start_ns;              /* Host time of device time 0, 0 before the first transfer */
+
+    /* Simulated load */
+    double level;                   /* Load current of the current step */
+    uint64_t step_k;                /* Conversion of the next load step */
+
+    /* Replayed capture */
+    simdev_record *records;
+    size_t nrecords;
+    uint64_t span_ns;               /* Device time of one pass through the capture */
+
+    /* Device state */
+    ina219_scale ina219;            /* Conversion of the calibration register */
+    uint16_t cal;                   /* Calibration register */
+    uint8_t fifo[SIMDEV_FIFO_MAX][SPI_SAMPLE_LEN];
+    size_t head;                    /* Oldest conversion in the FIFO */
+    size_t count;
+    uint8_t last[SPI_SAMPLE_LEN];   /* Latest conversion */
+    uint8_t relay;
+    uint8_t cmd;                    /* Latched from the last command frame */
+    uint8_t arg;
+} simdev;
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static double simdev_uniform(simdev *sd);
+static double simdev_noise(simdev *sd, double sigma);
+static float simdev_quantize(double value, double lsb);
+static uint64_t simdev_sim_time(const simdev *sd, uint64_t k);
+static void simdev_sim_sample(simdev *sd, uint64_t k, uint8_t *wire);
+static uint64_t simdev_replay_time(const simdev *sd, uint64_t k);
+static void simdev_replay_sample(simdev *sd, uint64_t k, uint8_t *wire);
+static void simdev_convert(simdev *sd);
+static void simdev_fill(simdev *sd, size_t want);
+static uint8_t *simdev_raw(const simdev *sd, uint8_t *p, const uint8_t *wire);
+static void simdev_batch(spi_device *dev, simdev *sd, uint8_t *rx, size_t len);
+static void simdev_reply(spi_device *dev, simdev *sd, uint8_t *rx, size_t len);
+static int simdev_fault(simdev *sd);
+static int simdev_arg(const spi_device *dev, const char *arg, char *buf);
+static simdev *simdev_new(spi_device *dev, char *opts);
+static int simdev_replay_load(simdev *sd, const char *path, int device);
+static int simdev_sim_open(spi_device *dev, const char *arg, uint64_t wait_ns);
+static int simdev_replay_open(spi_device *dev, const char *arg, uint64_t wait_ns);
+static int simdev_set_speed(spi_device *dev, uint32_t speed_hz);
+static int simdev_message(spi_device *dev, struct spi_ioc_transfer *xfer, unsigned int n);
+static void simdev_close(spi_device *dev);
+
+/* ************************************
+ * PUBLIC GLOBAL VARIABLES DEFINITION *
+ * ************************************/
+
+const transport_ops g_simdev_sim_ops = {
+    SIMDEV_SIM_PREFIX, simdev_sim_open, NULL, simdev_set_speed, simdev_message, simdev_close,
+};
+
+const transport_ops g_simdev_replay_ops = {
+    SIMDEV_REPLAY_PREFIX, simdev_replay_open, NULL, simdev_set_speed, simdev_message, simdev_close,
+};
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Draw a uniform random number
+ * 
+ * @param sd Emulated device
+ * @return double Number in [0, 1)
+ */
+static double simdev_uniform(simdev *sd)
+{
+    sd->rng ^= sd->rng >> 12;
+    sd->rng ^= sd->rng << 25;
+    sd->rng ^= sd->rng >> 27;
+
+    return (double)((sd->rng * 0x2545f4914f6cdd1dULL) >> 11) / (double)(1ULL << 53);
+}
+
+/**
+ * @brief Draw zero-mean noise
+ * @details Sum of four uniform draws, close enough to a normal distribution
+ *              for sensor noise.
+ * 
+ * @param sd Emulated device
+ * @param sigma Standard deviation
+ * @return double Noise
+ */
+static double simdev_noise(simdev *sd, double sigma)
+{
+    double sum = simdev_uniform(sd) + simdev_uniform(sd) + simdev_uniform(sd) + simdev_uniform(sd);
+
+    return (sum - 2.0) * sqrt(3.0) * sigma;
+}
+
+/**
+ * @brief Round a reading to the resolution of its register
+ * 
+ * @param value Reading
+ * @param lsb Register resolution
+ * @return float Rounded reading
+ */
+static float simdev_quantize(double value, double lsb)
+{
+    return (float)(lround(value / lsb) * lsb);
+}
+
+/**
+ * @brief Get the device time of a simulated conversion
+ * 
+ * @param sd Emulated device
+ * @param k Conversion
+ * @return uint64_t Device time
+ */
+static uint64_t simdev_sim_time(const simdev *sd, uint64_t k)
+{
+    return (uint64_t)((double)k * NSEC_PER_SEC / sd->rate);
+}
+
+/**
+ * @brief Simulate a conversion of the INA219
+ * 
+ * @param sd Emulated device
+ * @param k Conversion, in increasing order
+ * @param wire Filled with the packed sample
+ */
+static void simdev_sim_sample(simdev *sd, uint64_t k, uint8_t *wire)
+{
+    homeoffice_data data;
+
+    if (k >= sd->step_k)
+    {
+        sd->level = sd->load * (SIMDEV_STEP_MIN + (SIMDEV_STEP_MAX - SIMDEV_STEP_MIN) * simdev_uniform(sd));
+        sd->step_k = k + (uint64_t)(sd->rate * SIMDEV_STEP_S * (0.5 + simdev_uniform(sd))) + 1;
+    }
+
+    double current = (sd->relay ? sd->level * (1.0 + simdev_noise(sd, SIMDEV_RIPPLE)) : 0.0)
+        + simdev_noise(sd, SIMDEV_OFFSET_NOISE_A);
+    double voltage = sd->voltage - SIMDEV_SOURCE_OHM * current + simdev_noise(sd, SIMDEV_VOLTAGE_NOISE_V);
+
+    data.voltage = simdev_quantize(voltage, SIMDEV_BUS_LSB_V);
+    data.current = simdev_quantize(current, SIMDEV_CURRENT_LSB_A);
+    data.power = simdev_quantize(fabs((double)data.voltage * data.current), SIMDEV_POWER_LSB_W);
+    data.relay = sd->relay;
+    memcpy(wire, &data, SPI_SAMPLE_LEN);
+}
+
+/**
+ * @brief Get the device time of a replayed record
+ * 
+ * @param sd Emulated device
+ * @param k Record, counted across the passes through the capture
+ * @return uint64_t Device time
+ */
+static uint64_t simdev_replay_time(const simdev *sd, uint64_t k)
+{
+    return k / sd->nrecords * sd->span_ns + sd->records[k % sd->nrecords].time_ns;
+}
+
+/**
+ * @brief Replay a record
+ * 
+ * @param sd Emulated device
+ * @param k Record, counted across the passes through the capture
+ * @param wire Filled with the packed sample
+ */
+static void simdev_replay_sample(simdev *sd, uint64_t k, uint8_t *wire)
+{
+    memcpy(wire, sd->records[k % sd->nrecords].wire, SPI_SAMPLE_LEN);
+    sd->relay = wire[SPI_SAMPLE_LEN - 1];
+}
+
+/**
+ * @brief Take the next conversion into the FIFO
+ * @details A full FIFO drops its oldest conversion, like the firmware.
+ * 
+ * @param sd Emulated device
+ */
+static void simdev_convert(simdev *sd)
+{
+    sd->sample(sd, sd->next++, sd->last);
+
+    if (sd->count == SIMDEV_FIFO_MAX)
+    {
+        sd->head = (sd->head + 1) % SIMDEV_FIFO_MAX;
+        sd->count--;
+    }
+    memcpy(sd->fifo[(sd->head + sd->count) % SIMDEV_FIFO_MAX], sd->last, SPI_SAMPLE_LEN);
+    sd->count++;
+}
+
+/**
+ * @brief Take the conversions due on the device clock
+ * 
+ * @param sd Emulated device
+ * @param want Conversions to have in the FIFO when the device is not paced
+ */
+static void simdev_fill(simdev *sd, size_t want)
+{
+    if (sd->scale <= 0)
+    {
+        while (sd->count < want)
+        {
+            simdev_convert(sd);
+        }
+        return;
+    }
+
+    uint64_t now_ns = time_now_ns(CLOCK_MONOTONIC);
+    if (sd->start_ns == 0)
+    {
+        sd->start_ns = now_ns;
+    }
+
+    uint64_t device_ns = (uint64_t)((double)(now_ns - sd->start_ns) * sd->scale);
+    while (sd->time_ns(sd, sd->next) <= device_ns)
+    {
+        simdev_convert(sd);
+    }
+}
+
+/**
+ * @brief Write the raw registers of a conversion
+ * 
+ * @param sd Emulated device
+ * @param p Reply frame position
+ * @param wire Packed sample
+ * @return uint8_t* Position after the registers
+ */
+static uint8_t *simdev_raw(const simdev *sd, uint8_t *p, const uint8_t *wire)
+{
+    homeoffice_data data;
+
+    memcpy(&data, wire, SPI_SAMPLE_LEN);
+    ina219_encode(&sd->ina219, &data, p);
+
+    return p + SPI_RAW_SAMPLE_LEN;
+}
+
+/**
+ * @brief Build the reply of a batch read from the FIFO
+ * 
+ * @param dev SPI device
+ * @param sd Emulated device
+ * @param rx Reply frame
+ * @param len Length of the reply frame
+ */
+static void simdev_batch(spi_device *dev, simdev *sd, uint8_t *rx, size_t len)
+{
+    int raw = sd->cmd == CMD_READ_BATCH_RAW;
+    size_t sample_len = raw ? SPI_RAW_SAMPLE_LEN : SPI_SAMPLE_LEN;
+    size_t empty_len = raw ? SPI_RAW_BATCH_FRAME_LEN(0) : SPI_BATCH_FRAME_LEN(0);
+    size_t tick_len = dev->tick_hz && len >= empty_len + sd->arg * sample_len + SPI_TICK_LEN ? SPI_TICK_LEN : 0;
+    size_t room = len >= empty_len + tick_len ? (len - empty_len - tick_len) / sample_len : 0;
+    size_t want = sd->arg < room ? sd->arg : room;
+    uint8_t *p = &rx[SPI_BATCH_DATA_OFFSET];
+
+    simdev_fill(sd, want);
+    size_t count = sd->count < want ? sd->count : want;
+    rx[SPI_BATCH_DATA_OFFSET - 1] = count;
+    if (raw)
+    {
+        *p++ = sd->cal >> 8;
+        *p++ = sd->cal;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        if (raw)
+        {
+            p = simdev_raw(sd, p, sd->fifo[sd->head]);
+        }
+        else
+        {
+            memcpy(p, sd->fifo[sd->head], SPI_SAMPLE_LEN);
+            p += SPI_SAMPLE_LEN;
+        }
+        sd->head = (sd->head + 1) % SIMDEV_FIFO_MAX;
+        sd->count--;
+    }
+
+    if (tick_len > 0)
+    {
+        uint64_t now_ns = time_now_ns(CLOCK_MONOTONIC);
+        uint64_t tick = now_ns / NSEC_PER_SEC * dev->tick_hz + now_ns % NSEC_PER_SEC * dev->tick_hz / NSEC_PER_SEC;
+
+        p = &rx[len - SPI_CRC_LEN - SPI_TICK_LEN];
+        p[0] = tick;
+        p[1] = tick >> 8;
+        p[2] = tick >> 16;
+    }
+}
+
+/**
+ * @brief Build the reply frame of the latched command
+ * 
+ * @param dev SPI device
+ * @param sd Emulated device
+ * @param rx Reply frame
+ * @param len Length of the reply frame
+ */
+static void simdev_reply(spi_device *dev, simdev *sd, uint8_t *rx, size_t len)
+{
+    uint8_t *payload = &rx[SPI_DATA_OFFSET];
+
+    memset(rx, 0, len);
+    rx[2] = sd->cmd;
+
+    switch (sd->cmd)
+    {
+    case CMD_READ_VOLTAGE:
+    case CMD_READ_CURRENT:
+    case CMD_READ_POWER:
+        simdev_fill(sd, 1);
+        memcpy(payload, &sd->last[(sd->cmd - CMD_READ_VOLTAGE) * sizeof(float)], sizeof(float));
+        break;
+    case CMD_READ_ALL:
+        simdev_fill(sd, 1);
+        memcpy(payload, sd->last, SPI_SAMPLE_LEN);
+        break;
+    case CMD_SET_RELAY_ON:
+    case CMD_SET_RELAY_OFF:
+        sd->relay = sd->cmd == CMD_SET_RELAY_ON;
+        payload[0] = sd->relay;
+        break;
+    case CMD_READ_RELAY:
+        payload[0] = sd->relay;
+        break;
+    case CMD_READ_RAW:
+        simdev_fill(sd, 1);
+        payload[0] = sd->cal >> 8;
+        payload[1] = sd->cal;
+        simdev_raw(sd, &payload[SPI_RAW_CAL_LEN], sd->last);
+        break;
+    case CMD_READ_BATCH:
+    case CMD_READ_BATCH_RAW:
+        simdev_batch(dev, sd, rx, len);
+        break;
+    default:
+        break;
+    }
+
+    rx[len - 1] = spi_crc8(&rx[2], len - 3);
+}
+
+/**
+ * @brief Draw the fault of a transfer
+ * 
+ * @param sd Emulated device
+ * @return int SIMDEV_FAULT_*
+ */
+static int simdev_fault(simdev *sd)
+{
+    if (sd->errors <= 0 || simdev_uniform(sd) >= sd->errors)
+    {
+        return SIMDEV_FAULT_NONE;
+    }
+
+    return SIMDEV_FAULT_IOCTL + (int)(simdev_uniform(sd) * 3);
+}
+
+/**
+ * @brief Copy the path argument of an emulated device to be parsed
+ * 
+ * @param dev SPI device
+ * @param arg Path argument
+ * @param buf Buffer of SIMDEV_ARG_MAX bytes
+ * @return int 0 on success, -1 if the argument is too long
+ */
+static int simdev_arg(const spi_device *dev, const char *arg, char *buf)
+{
+    if (snprintf(buf, SIMDEV_ARG_MAX, "%s", arg) >= SIMDEV_ARG_MAX)
+    {
+        fprintf(stderr, "%s: emulated device path too long\n", dev->path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Create an emulated device from its options
+ * 
+ * @param dev SPI device
+ * @param opts Options, modified while parsed
+ * @return simdev* Emulated device, or NULL on error
+ */
+static simdev *simdev_new(spi_device *dev, char *opts)
+{
+    simdev *sd = calloc(1, sizeof(simdev));
+    char *save;
+
+    if (sd == NULL)
+    {
+        perror("Error allocating emulated device");
+        return NULL;
+    }
+
+    sd->rate = SIMDEV_RATE_DEFAULT;
+    sd->scale = 1;
+    sd->voltage = SIMDEV_VOLTAGE_DEFAULT;
+    sd->load = SIMDEV_LOAD_DEFAULT;
+    sd->shunt_uohm = INA219_SHUNT_DEFAULT_UOHM;
+    sd->rng = dev->index + 1;
+    sd->relay = 1;
+
+    for (char *opt = strtok_r(opts, ",", &save); opt != NULL; opt = strtok_r(NULL, ",", &save))
+    {
+        char *value = strchr(opt, '=');
+        char *end = NULL;
+        double v = -1;
+        int valid = 1;
+
+        if (value != NULL)
+        {
+            *value++ = '\0';
+            v = strtod(value, &end);
+            valid = end != value && *end == '\0' && v >= 0;
+        }
+
+        if (valid && strcmp(opt, "rate") == 0 && v > 0)
+        {
+            sd->rate = v;
+        }
+        else if (valid && strcmp(opt, "scale") == 0)
+        {
+            sd->scale = v;
+        }
+        else if (valid && strcmp(opt, "errors") == 0 && v <= 1)
+        {
+            sd->errors = v;
+        }
+        else if (valid && strcmp(opt, "seed") == 0)
+        {
+            sd->rng = (uint64_t)v + 1;
+        }
+        else if (valid && strcmp(opt, "voltage") == 0)
+        {
+            sd->voltage = v;
+        }
+        else if (valid && strcmp(opt, "load") == 0)
+        {
+            sd->load = v;
+        }
+        else if (valid && strcmp(opt, "shunt") == 0 && v >= 1 && v <= 1000000)
+        {
+            sd->shunt_uohm = (uint32_t)lround(v * 1000);
+        }
+        else
+        {
+            fprintf(stderr, "%s: invalid emulated device option: %s%s%s\n", dev->path, opt,
+                value != NULL ? "=" : "", value != NULL ? value : "");
+            free(sd);
+            return NULL;
+        }
+    }
+
+    sd->cal = ina219_calibration((uint32_t)lround(SIMDEV_CURRENT_LSB_A * 1e9), sd->shunt_uohm);
+    if (ina219_scale_init(&sd->ina219, sd->cal, sd->shunt_uohm) < 0)
+    {
+        fprintf(stderr, "%s: no calibration for a %.1f mA current resolution on this shunt\n", dev->path,
+            SIMDEV_CURRENT_LSB_A * 1000);
+        free(sd);
+        return NULL;
+    }
+
+    return sd;
+}
+
+/**
+ * @brief Load the records of a capture to replay
+ * 
+ * @param sd Emulated device
+ * @param path Binary capture file
+ * @param device Index of the device to replay
+ * @return int 0 on success, -1 on error
+ */
+static int simdev_replay_load(simdev *sd, const char *path, int device)
+{
+    uint8_t raw[sizeof(record_entry)];
+    record_header hdr;
+    record_entry entry;
+    size_t capacity = 0;
+    size_t own = 0;
+    int64_t time_us = 0;
+
+    FILE *fp = record_open(path, &hdr);
+    if (fp == NULL)
+    {
+        return -1;
+    }
+
+    for (uint64_t remaining = hdr.count != 0 ? hdr.count : UINT64_MAX;
+        remaining > 0 && fread(raw, hdr.record_size, 1, fp) == 1; remaining--)
+    {
+        if (sd->nrecords == capacity)
+        {
+            size_t grown = capacity ? capacity * 2 : SIMDEV_REPLAY_CHUNK;
+            simdev_record *records = realloc(sd->records, grown * sizeof(simdev_record));
+            if (records == NULL)
+            {
+                perror("Error allocating replayed capture");
+                fclose(fp);
+                return -1;
+            }
+            sd->records = records;
+            capacity = grown;
+        }
+
+        simdev_record *r = &sd->records[sd->nrecords++];
+        homeoffice_data data;
+
+        record_entry_read(&hdr, raw, &entry);
+        time_us += entry.delta_us;
+        data.voltage = entry.voltage;
+        data.current = entry.current;
+        data.power = entry.power;
+        data.relay = entry.flags & RECORD_FLAG_RELAY ? 1 : 0;
+        memcpy(r->wire, &data, SPI_SAMPLE_LEN);
+        r->time_us = time_us;
+        r->device = entry.device;
+        own += entry.device == device;
+    }
+    fclose(fp);
+
+    /* Keep the records of the device, if the capture has any */
+    if (own > 0)
+    {
+        size_t kept = 0;
+
+        for (size_t i = 0; i < sd->nrecords; i++)
+        {
+            if (sd->records[i].device == device)
+            {
+                sd->records[kept++] = sd->records[i];
+            }
+        }
+        sd->nrecords = kept;
+    }
+    if (sd->nrecords == 0)
+    {
+        fprintf(stderr, "%s: no records to replay\n", path);
+        return -1;
+    }
+
+    /* Records slightly out of order are played at the time of the one before */
+    int64_t last_us = sd->records[0].time_us;
+    for (size_t i = 0; i < sd->nrecords; i++)
+    {
+        last_us = sd->records[i].time_us > last_us ? sd->records[i].time_us : last_us;
+        sd->records[i].time_ns = (uint64_t)(last_us - sd->records[0].time_us) * NSEC_PER_USEC;
+    }
+
+    uint64_t last_ns = sd->records[sd->nrecords - 1].time_ns;
+    sd->span_ns = last_ns + (sd->nrecords > 1 && last_ns > 0 ? last_ns / (sd->nrecords - 1) : SIMDEV_REPLAY_STEP_NS);
+
+    return 0;
+}
+
+/**
+ * @brief Open a simulated device
+ * 
+ * @param dev SPI device
+ * @param arg Options
+ * @param wait_ns Unused, an emulated device is always there
+ * @return int 0 on success, -1 on error
+ */
+static int simdev_sim_open(spi_device *dev, const char *arg, uint64_t wait_ns)
+{
+    char opts[SIMDEV_ARG_MAX];
+
+    (void)wait_ns;
+
+    if (simdev_arg(dev, arg, opts) < 0)
+    {
+        return -1;
+    }
+
+    simdev *sd = simdev_new(dev, opts);
+    if (sd == NULL)
+    {
+        return -1;
+    }
+
+    sd->time_ns = simdev_sim_time;
+    sd->sample = simdev_sim_sample;
+    dev->transport_ctx = sd;
+
+    return 0;
+}
+
+/**
+ * @brief Open a replayed capture
+ * 
+ * @param dev SPI device
+ * @param arg Capture file, followed by the options
+ * @param wait_ns Unused, the capture is read at once
+ * @return int 0 on success, -1 on error
+ */
+static int simdev_replay_open(spi_device *dev, const char *arg, uint64_t wait_ns)
+{
+    char opts[SIMDEV_ARG_MAX];
+
+    (void)wait_ns;
+
+    if (simdev_arg(dev, arg, opts) < 0)
+    {
+        return -1;
+    }
+
+    /* The capture file name ends at the first option */
+    char *options = opts + strcspn(opts, ",");
+    if (*options != '\0')
+    {
+        *options++ = '\0';
+    }
+
+    simdev *sd = simdev_new(dev, options);
+    if (sd == NULL)
+    {
+        return -1;
+    }
+    if (simdev_replay_load(sd, opts, dev->index) < 0)
+    {
+        free(sd->records);
+        free(sd);
+        return -1;
+    }
+
+    sd->time_ns = simdev_replay_time;
+    sd->sample = simdev_replay_sample;
+    dev->transport_ctx = sd;
+
+    return 0;
+}
+
+/**
+ * @brief Set the SPI clock of an emulated device, which takes any
+ * 
+ * @param dev SPI device
+ * @param speed_hz SPI clock in Hz
+ * @return int 0
+ */
+static int simdev_set_speed(spi_device *dev, uint32_t speed_hz)
+{
+    (void)dev;
+    (void)speed_hz;
+
+    return 0;
+}
+
+/**
+ * @brief Exchange a message with an emulated device
+ * @details A transfer with a receive buffer gets the reply to the command
+ *              latched from the last command frame, as with the firmware both
+ *              in one message and in two.
+ * 
+ * @param dev SPI device
+ * @param xfer Transfers of the message
+ * @param n Number of transfers
+ * @return int Bytes transferred, -1 with errno set on an injected failure
+ */
+static int simdev_message(spi_device *dev, struct spi_ioc_transfer *xfer, unsigned int n)
+{
+    simdev *sd = dev->transport_ctx;
+    int fault = simdev_fault(sd);
+    int bytes = 0;
+
+    if (fault == SIMDEV_FAULT_IOCTL)
+    {
+        errno = EIO;
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < n; i++)
+    {
+        const uint8_t *tx = (const uint8_t *)(uintptr_t)xfer[i].tx_buf;
+        uint8_t *rx = (uint8_t *)(uintptr_t)xfer[i].rx_buf;
+
+        if (rx != NULL)
+        {
+            simdev_reply(dev, sd, rx, xfer[i].len);
+            if (fault == SIMDEV_FAULT_ECHO)
+            {
+                rx[2] ^= 0x80;
+            }
+            else if (fault == SIMDEV_FAULT_DATA)
+            {
+                rx[SPI_DATA_OFFSET] ^= 0x01;
+            }
+        }
+        else if (tx != NULL)
+        {
+            sd->cmd = tx[0];
+            sd->arg = tx[1];
+        }
+        bytes += xfer[i].len;
+    }
+
+    return bytes;
+}
+
+/**
+ * @brief Close an emulated device
+ * 
+ * @param dev SPI device
+ */
+static void simdev_close(spi_device *dev)
+{
+    simdev *sd = dev->transport_ctx;
+
+    free(sd->records);
+    free(sd);
+    dev->transport_ctx = NULL;
+}
@@ -0,0 +1,39 @@
+/**
+ * @file    simdev.h
+ * @brief   Emulated homeoffice devices
+ * @details Transports that answer the SPI protocol in-process, so the client
+ *              can be run and load-tested without boards attached. A "sim:"
+ *              device generates INA219 readings, a "replay:" device plays a
+ *              binary capture back. Both fill a device FIFO at a scale of the
+ *              host clock and can fail a share of their transfers.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef SIMDEV_H
+#define SIMDEV_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include "transport.h"
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define SIMDEV_SIM_PREFIX "sim:"    /* Path prefix of simulated devices */
+#define SIMDEV_REPLAY_PREFIX "replay:" /* Path prefix of replayed captures */
+#define SIMDEV_FIFO_MAX 256         /* Samples buffered by an emulated device */
+#define SIMDEV_RATE_DEFAULT 1000    /* Default conversions per second of a simulated device */
+#define SIMDEV_VOLTAGE_DEFAULT 5.0  /* Default bus voltage of a simulated device in V */
+#define SIMDEV_LOAD_DEFAULT 0.5     /* Default load current of a simulated device in A */
+
+/* *************************************
+ * PUBLIC GLOBAL VARIABLES DECLARATION *
+ * *************************************/
+
+extern const transport_ops g_simdev_sim_ops; /* Transport of "sim:" devices */
+extern const transport_ops g_simdev_replay_ops; /* Transport of "replay:" devices */
+
+#endif /* SIMDEV_H */
@@ -0,0 +1,181 @@
+/**
+ * @file    sink.c
+ * @brief   Sample consumers
+ * @details Runs each sink in its own thread, draining its rings in batches and
+ *              flushing whenever they all run empty.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "sink.h"
+#include "trace.h"
+#include "arena.h"
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static void *sink_thread(void *arg);
+static void sink_free_rings(sink *s);
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Sink consumer thread
+ * @details The stop flag is read before the rings are polled, so once it is
+ *              seen and the rings are empty every sample pushed before the stop
+ *              request has been written.
+ * 
+ * @param arg Sink
+ * @return void* NULL
+ */
+static void *sink_thread(void *arg)
+{
+    sink *s = arg;
+    sample_record batch[SINK_BATCH];
+    struct timespec idle = { .tv_sec = 0, .tv_nsec = SINK_IDLE_NS };
+
+    trace_thread(s->name);
+    arena_guard(1);
+
+    for (;;)
+    {
+        int stop = atomic_load(&s->stop);
+        size_t total = 0;
+
+        for (size_t i = 0; i < s->nrings; i++)
+        {
+            size_t n = ring_pop(&s->rings[i], batch, SINK_BATCH);
+
+            if (n > 0)
+            {
+                TRACE_BEGIN("sink_write", n);
+                s->ops->write(s->ctx, batch, n);
+                TRACE_END("sink_write", n);
+                total += n;
+            }
+        }
+
+        if (total > 0)
+        {
+            continue;
+        }
+
+        if (s->ops->flush != NULL)
+        {
+            TRACE_BEGIN("sink_flush", 0);
+            s->ops->flush(s->ctx);
+            TRACE_END("sink_flush", 0);
+        }
+
+        if (stop)
+        {
+            break;
+        }
+
+        nanosleep(&idle, NULL);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Release the sink rings
+ * 
+ * @param s Sink
+ */
+static void sink_free_rings(sink *s)
+{
+    for (size_t i = 0; i < s->nrings; i++)
+    {
+        ring_free(&s->rings[i]);
+    }
+    s->nrings = 0;
+}
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Allocate the sink rings and start its thread
+ * 
+ * @param s Sink, with name, ops and ctx already set
+ * @param capacity Ring capacity in records
+ * @param producers Number of acquisition threads feeding the sink
+ * @return int 0 on success, -1 on error
+ */
+int sink_start(sink *s, size_t capacity, size_t producers)
+{
+    if (producers > SINK_PRODUCERS_MAX)
+    {
+        fprintf(stderr, "Too many producers for %s sink\n", s->name);
+        return -1;
+    }
+
+    for (s->nrings = 0; s->nrings < producers; s->nrings++)
+    {
+        if (ring_init(&s->rings[s->nrings], capacity) < 0)
+        {
+            sink_free_rings(s);
+            return -1;
+        }
+    }
+
+    atomic_init(&s->stop, 0);
+
+    int err = pthread_create(&s->thread, NULL, sink_thread, s);
+    if (err != 0)
+    {
+        fprintf(stderr, "Error starting %s sink: %s\n", s->name, strerror(err));
+        sink_free_rings(s);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Drain the sink, stop its thread and close it
+ * 
+ * @param s Sink
+ */
+void sink_stop(sink *s)
+{
+    atomic_store(&s->stop, 1);
+    pthread_join(s->thread, NULL);
+
+    if (s->ops->close != NULL)
+    {
+        s->ops->close(s->ctx);
+    }
+
+    sink_free_rings(s);
+}
+
+/**
+ * @brief Get the number of samples the sink dropped
+ * 
+ * @param s Sink
+ * @return uint64_t Samples dropped over all rings
+ */
+uint64_t sink_drops(sink *s)
+{
+    uint64_t drops = 0;
+
+    for (size_t i = 0; i < s->nrings; i++)
+    {
+        drops += ring_drops(&s->rings[i]);
+    }
+
+    return drops;
+}
@@ -0,0 +1,61 @@
+/**
+ * @file    sink.h
+ * @brief   Sample consumers
+ * @details A sink is a consumer thread fed by one SPSC ring per acquisition
+ *              thread. The acquisition threads only ever push into the rings,
+ *              so a slow sink drops samples instead of delaying the SPI cadence.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef SINK_H
+#define SINK_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "ring.h"
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define SINK_RING_DEFAULT 4096      /* Default ring capacity in records */
+#define SINK_BATCH 256              /* Records taken from the ring at once */
+#define SINK_IDLE_NS 1000000        /* Sleep when the rings are empty */
+#define SINK_PRODUCERS_MAX SPI_DEVICES_MAX /* Maximum acquisition threads per sink */
+
+/* *************************
+ * PUBLIC TYPES DEFINITION *
+ * *************************/
+
+/* Sink operations, write and flush called from the sink thread, close from sink_stop() after it exits */
+typedef struct sink_ops{
+    void (*write)(void *ctx, const sample_record *recs, size_t n);
+    void (*flush)(void *ctx);
+    void (*close)(void *ctx);
+} sink_ops;
+
+/* Sample consumer */
+typedef struct sink{
+    const char *name;
+    const sink_ops *ops;
+    void *ctx;
+    ring rings[SINK_PRODUCERS_MAX]; /* One ring per acquisition thread */
+    size_t nrings;
+    pthread_t thread;
+    atomic_int stop;
+} sink;
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+int sink_start(sink *s, size_t capacity, size_t producers);
+void sink_stop(sink *s);
+uint64_t sink_drops(sink *s);
+
+#endif /* SINK_H */
@@ -0,0 +1,856 @@
+/**
+ * @file    spi.c
+ * @brief   Homeoffice device SPI link
+ * @details Opens and configures the spidev device and exchanges command and
+ *              reply frames with the homeoffice device, either as two separate
+ *              transfers (protocol version 1) or as a single SPI message
+ *              (protocol version 2). A pipelined device hands its requests
+ *              to a worker thread, which takes the device lock for each
+ *              transfer like any other caller and leaves the reply in a slot
+ *              of its own, so direct requests from other threads still fit in
+ *              between.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <linux/spi/spidev.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#include "spi.h"
+#include "timeutil.h"
+#include "trace.h"
+#include "arena.h"
+#include "transport.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define SPI_TURNAROUND_US 50        /* Delay between command and reply frames */
+#define SPI_CRC_POLY 0x07           /* CRC-8 polynomial (x^8 + x^2 + x + 1) */
+#define SPI_REOPEN_MIN_NS (1 * NSEC_PER_MSEC)  /* First wait after a failed reopen */
+#define SPI_REOPEN_MAX_NS (64 * NSEC_PER_MSEC) /* Longest wait between reopens, keeps resuming under 100 ms */
+
+/* Count an event in the device statistics (single writer per device) */
+#define SPI_STAT_INC(dev, field) \
+    atomic_store_explicit(&(dev)->stats.field, \
+        atomic_load_explicit(&(dev)->stats.field, memory_order_relaxed) + 1, memory_order_relaxed)
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static void spi_prepare(spi_device *dev);
+static void spi_failed(spi_device *dev);
+static int spi_recover(spi_device *dev);
+static int spi_write(spi_device *dev);
+static int spi_read(spi_device *dev);
+static int spi_exchange(spi_device *dev);
+static int spi_check(spi_device *dev, const uint8_t *rx, uint8_t cmd, size_t frame_len);
+static void spi_latency_add(spi_device *dev, uint64_t latency_ns);
+static int spi_request(spi_device *dev, uint8_t cmd, uint8_t arg, size_t frame_len, uint8_t *rx);
+static void *spi_worker(void *arg);
+
+/* *************************************
+ * PRIVATE GLOBAL VARIABLES DEFINITION *
+ * *************************************/
+
+static const uint8_t gs_spi_idle[SPI_FRAME_MAX]; /* All-zero frame clocked out while reading */
+
+/* Upper bounds of the latency histogram buckets, in microseconds */
+static const uint32_t gs_spi_latency_us[SPI_LATENCY_BUCKETS - 1] = {
+    50, 100, 200, 500, 1000, 2000, 5000, 10000
+};
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Build the transfer descriptors of a device
+ * @details The command segment points at the device command frame and the
+ *              reply segment at its receive frame, so a request only has to set
+ *              the command bytes and the reply length before the ioctl. Chip
+ *              select is released between the segments, and the bus is held
+ *              idle for SPI_TURNAROUND_US so the device can prepare its reply.
+ * 
+ * @param dev SPI device
+ */
+static void spi_prepare(spi_device *dev)
+{
+    memset(dev->xfer, 0, sizeof(dev->xfer));
+
+    dev->xfer[0].tx_buf = (unsigned long)dev->tx;
+    dev->xfer[0].len = SPI_FRAME_LEN;
+    dev->xfer[0].speed_hz = dev->speed_hz;
+    dev->xfer[0].bits_per_word = SPI_BITS_PER_WORD;
+    dev->xfer[0].delay_usecs = SPI_TURNAROUND_US;
+    dev->xfer[0].cs_change = 1;
+
+    dev->xfer[1].tx_buf = (unsigned long)gs_spi_idle;
+    dev->xfer[1].rx_buf = (unsigned long)dev->rx;
+    dev->xfer[1].len = SPI_FRAME_LEN;
+    dev->xfer[1].speed_hz = dev->speed_hz;
+    dev->xfer[1].bits_per_word = SPI_BITS_PER_WORD;
+}
+
+/**
+ * @brief Account a failed transfer
+ * @details Errors telling that the device is gone, as when its driver is
+ *              unbound or its module reloaded, mark it lost if the transport
+ *              can reopen it.
+ * 
+ * @param dev SPI device
+ */
+static void spi_failed(spi_device *dev)
+{
+    int err = errno;
+
+    SPI_STAT_INC(dev, ioctl_errors);
+    if (!dev->lost && dev->transport->reopen != NULL &&
+        (err == ENODEV || err == ENXIO || err == ESHUTDOWN || err == EBADF))
+    {
+        dev->lost = 1;
+        dev->reopen_ns = 0;
+        dev->reopen_backoff_ns = SPI_REOPEN_MIN_NS;
+    }
+}
+
+/**
+ * @brief Reopen a lost device
+ * @details Attempts are spaced by an exponential backoff, capped so the
+ *              device is back in use soon after it reappears, and a request
+ *              made in between fails at once instead of blocking the
+ *              sampling loop. The clock is set again on the new descriptor.
+ * 
+ * @param dev SPI device
+ * @return int 0 once the device is back, -1 otherwise
+ */
+static int spi_recover(spi_device *dev)
+{
+    uint64_t now_ns = time_now_ns(CLOCK_MONOTONIC);
+
+    if (now_ns < dev->reopen_ns)
+    {
+        return -1;
+    }
+
+    if (dev->transport->reopen(dev) < 0 || dev->transport->set_speed(dev, dev->speed_hz) < 0)
+    {
+        dev->reopen_ns = now_ns + dev->reopen_backoff_ns;
+        dev->reopen_backoff_ns = dev->reopen_backoff_ns * 2 < SPI_REOPEN_MAX_NS ?
+            dev->reopen_backoff_ns * 2 : SPI_REOPEN_MAX_NS;
+        return -1;
+    }
+
+    dev->lost = 0;
+    SPI_STAT_INC(dev, reopens);
+    return 0;
+}
+
+/**
+ * @brief SPI write the command frame
+ * @details The command segment is sent on its own, so it must release chip
+ *              select when done, unlike in a combined message.
+ * 
+ * @param dev SPI device
+ * @return int 0 on success, -1 on error
+ */
+static int spi_write(spi_device *dev)
+{
+    int ret;
+
+    dev->xfer[0].cs_change = 0;
+    TRACE_BEGIN("spi_ioctl_write", dev->xfer[0].len);
+    ret = dev->transport->message(dev, &dev->xfer[0], 1);
+    TRACE_END("spi_ioctl_write", ret);
+    if (ret < 0)
+    {
+        spi_failed(dev);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief SPI read the reply frame
+ * 
+ * @param dev SPI device
+ * @return int 0 on success, -1 on error
+ */
+static int spi_read(spi_device *dev)
+{
+    int ret;
+
+    TRACE_BEGIN("spi_ioctl_read", dev->xfer[1].len);
+    ret = dev->transport->message(dev, &dev->xfer[1], 1);
+    TRACE_END("spi_ioctl_read", ret);
+    if (ret < 0)
+    {
+        spi_failed(dev);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief SPI send the command and read its reply in a single SPI message
+ * @details Both segments are queued in one SPI_IOC_MESSAGE, so the pair
+ *              costs a single ioctl.
+ * 
+ * @param dev SPI device
+ * @return int 0 on success, -1 on error
+ */
+static int spi_exchange(spi_device *dev)
+{
+    int ret;
+
+    dev->xfer[0].cs_change = 1;
+    TRACE_BEGIN("spi_ioctl", dev->xfer[0].len + dev->xfer[1].len);
+    ret = dev->transport->message(dev, dev->xfer, 2);
+    TRACE_END("spi_ioctl", ret);
+    if (ret < 0)
+    {
+        spi_failed(dev);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Check the reply frame
+ * @details The reply must echo the command code at byte 2. With CRC checking
+ *              enabled, the last byte of the frame must hold the CRC-8 of the
+ *              bytes from the echoed command up to it.
+ * 
+ * @param dev SPI device
+ * @param rx Reply frame
+ * @param cmd Command code
+ * @param frame_len Length of the frame
+ * @return int 0 if the frame is valid, -1 otherwise
+ */
+static int spi_check(spi_device *dev, const uint8_t *rx, uint8_t cmd, size_t frame_len)
+{
+    if (rx[2] != cmd)
+    {
+        SPI_STAT_INC(dev, echo_errors);
+        return -1;
+    }
+
+    if (dev->crc && spi_crc8(&rx[2], frame_len - 3) != rx[frame_len - 1])
+    {
+        SPI_STAT_INC(dev, crc_errors);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Account the latency of a request attempt
+ * 
+ * @param dev SPI device
+ * @param latency_ns Time from the start of the attempt to its checked reply
+ */
+static void spi_latency_add(spi_device *dev, uint64_t latency_ns)
+{
+    unsigned int bucket = 0;
+
+    while (bucket < SPI_LATENCY_BUCKETS - 1 && latency_ns > gs_spi_latency_us[bucket] * NSEC_PER_USEC)
+    {
+        bucket++;
+    }
+
+    SPI_STAT_INC(dev, latency[bucket]);
+    atomic_store_explicit(&dev->stats.latency_ns,
+        atomic_load_explicit(&dev->stats.latency_ns, memory_order_relaxed) + latency_ns, memory_order_relaxed);
+}
+
+/**
+ * @brief SPI send a command and read a valid reply into a receive frame
+ * @details Uses the two-phase write/read sequence for protocol version 1 and
+ *              the combined single-message exchange otherwise. A failed
+ *              transfer or an invalid reply is retried up to dev->retries
+ *              times before giving up. A lost device is reopened first, see
+ *              spi_recover(). The clock is read right before and
+ *              after the transfer, and the bracket of the valid reply is kept
+ *              in dev->xfer_start_ns and dev->xfer_end_ns.
+ * 
+ * @param dev SPI device
+ * @param cmd Command code
+ * @param arg Command argument
+ * @param frame_len Length of the reply frame
+ * @param rx Receive frame, dev->rx or a pipeline slot
+ * @return int 0 on success, -1 if every attempt failed
+ */
+static int spi_request(spi_device *dev, uint8_t cmd, uint8_t arg, size_t frame_len, uint8_t *rx)
+{
+    TRACE_BEGIN("spi_request", cmd);
+    dev->tx[0] = cmd;
+    dev->tx[1] = arg;
+    dev->xfer[1].rx_buf = (unsigned long)rx;
+    dev->xfer[1].len = frame_len;
+
+    for (unsigned int attempt = 0; attempt <= dev->retries; attempt++)
+    {
+        uint64_t start_ns;
+        uint64_t end_ns;
+        int ret;
+
+        if (dev->lost && spi_recover(dev) < 0)
+        {
+            break;
+        }
+
+        if (attempt > 0)
+        {
+            SPI_STAT_INC(dev, retries);
+        }
+        SPI_STAT_INC(dev, transfers);
+
+        start_ns = time_now_ns(CLOCK_MONOTONIC);
+        if (dev->protocol == SPI_PROTOCOL_V1)
+        {
+            ret = spi_write(dev);
+            if (ret == 0)
+            {
+                ret = spi_read(dev);
+            }
+        }
+        else
+        {
+            ret = spi_exchange(dev);
+        }
+        end_ns = time_now_ns(CLOCK_MONOTONIC);
+
+        ret = ret == 0 ? spi_check(dev, rx, cmd, frame_len) : ret;
+        spi_latency_add(dev, time_now_ns(CLOCK_MONOTONIC) - start_ns);
+        if (ret == 0)
+        {
+            dev->xfer_start_ns = start_ns;
+            dev->xfer_end_ns = end_ns;
+            TRACE_END("spi_request", attempt);
+            return 0;
+        }
+    }
+
+    SPI_STAT_INC(dev, failures);
+    TRACE_END("spi_request", dev->retries + 1);
+    return -1;
+}
+
+/**
+ * @brief Worker thread of a pipelined device
+ * @details Runs the submitted requests in order, alternating between the
+ *              slots as the caller does.
+ * 
+ * @param arg SPI device
+ * @return void* NULL
+ */
+static void *spi_worker(void *arg)
+{
+    spi_device *dev = arg;
+    spi_pipeline *p = dev->pipeline;
+    unsigned int next = 0;
+
+    trace_thread("spi_worker");
+    arena_guard(1);
+
+    for (;;)
+    {
+        while (sem_wait(&p->submitted) < 0 && errno == EINTR)
+        {
+        }
+        if (atomic_load(&p->stop))
+        {
+            break;
+        }
+
+        spi_slot *slot = &p->slots[next];
+        next = (next + 1) % SPI_PIPELINE_DEPTH;
+
+        pthread_mutex_lock(&dev->lock);
+        slot->ret = spi_request(dev, slot->cmd, slot->arg, slot->frame_len, slot->rx);
+        slot->xfer_start_ns = dev->xfer_start_ns;
+        slot->xfer_end_ns = dev->xfer_end_ns;
+        pthread_mutex_unlock(&dev->lock);
+
+        sem_post(&p->completed);
+    }
+
+    return NULL;
+}
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Get the SPI command string
+ * 
+ * @param cmd SPI Command
+ * @return char* 
+ */
+char *spi_cmd_str(uint8_t cmd)
+{
+    switch (cmd)
+    {
+    case CMD_READ_POWER:
+        return "READ POWER";
+    case CMD_READ_CURRENT:
+        return "READ CURRENT";
+    case CMD_READ_VOLTAGE:
+        return "READ VOLTAGE";
+    case CMD_READ_RELAY:
+        return "READ RELAY";
+    case CMD_READ_ALL:
+        return "READ ALL";
+    case CMD_SET_RELAY_ON:
+        return "SET RELAY ON";
+    case CMD_SET_RELAY_OFF:
+        return "SET RELAY OFF";
+    case CMD_READ_BATCH:
+        return "READ BATCH";
+    case CMD_READ_RAW:
+        return "READ RAW";
+    case CMD_READ_BATCH_RAW:
+        return "READ BATCH RAW";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+/**
+ * @brief Compute the CRC-8 of a buffer
+ * @details CRC-8 with polynomial 0x07 and a zero initial value (SMBus PEC),
+ *              computed bitwise since frames are short.
+ * 
+ * @param data Buffer
+ * @param len Length of the buffer
+ * @return uint8_t CRC
+ */
+uint8_t spi_crc8(const uint8_t *data, size_t len)
+{
+    uint8_t crc = 0;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x80) ? (crc << 1) ^ SPI_CRC_POLY : crc << 1;
+        }
+    }
+
+    return crc;
+}
+
+/**
+ * @brief Initialize SPI communication with a device
+ * @details The bus and chip select numbers are taken from a spidevB.C device
+ *              name; devices with other names are each given a bus of their
+ *              own. The protocol version, CRC checking and retries take their
+ *              defaults and can be changed afterwards. The path also selects
+ *              the transport, so emulated devices are opened the same way.
+ *              A device that fails to initialize is left closed, so the
+ *              caller can keep running its other devices.
+ * 
+ * @param dev SPI device
+ * @param path Device path, see transport_find()
+ * @param index Position of the device in the device list
+ * @param wait_ns Longest wait for a spidev node to appear, 0 to fail at once
+ * @return int 0 on success, -1 on error
+ */
+int spi_init(spi_device *dev, const char *path, int index, uint64_t wait_ns)
+{
+    const char *name = strrchr(path, '/');
+
+    memset(dev, 0, sizeof(*dev));
+    snprintf(dev->path, sizeof(dev->path), "%s", path);
+    dev->index = index;
+    dev->protocol = SPI_PROTOCOL_DEFAULT;
+    dev->retries = SPI_RETRIES_DEFAULT;
+    if (sscanf(name != NULL ? name + 1 : path, "spidev%d.%d", &dev->bus, &dev->cs) != 2)
+    {
+        dev->bus = SPI_BUS_UNKNOWN + index;
+        dev->cs = 0;
+    }
+
+    spi_prepare(dev);
+    pthread_mutex_init(&dev->lock, NULL);
+
+    const char *arg;
+    dev->fd = -1;
+    dev->transport = transport_find(path, &arg);
+    if (dev->transport->open(dev, arg, wait_ns) < 0)
+    {
+        dev->transport = NULL;
+        pthread_mutex_destroy(&dev->lock);
+        return -1;
+    }
+    if (spi_set_speed(dev, SPI_SPEED_HZ) < 0)
+    {
+        spi_close(dev);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Set the SPI clock of a device
+ * 
+ * @param dev SPI device
+ * @param speed_hz SPI clock in Hz
+ * @return int 0 on success, -1 on error
+ */
+int spi_set_speed(spi_device *dev, uint32_t speed_hz)
+{
+    if (dev->transport->set_speed(dev, speed_hz) < 0)
+    {
+        perror("Error setting SPI speed");
+        return -1;
+    }
+
+    dev->speed_hz = speed_hz;
+    dev->xfer[0].speed_hz = speed_hz;
+    dev->xfer[1].speed_hz = speed_hz;
+
+    return 0;
+}
+
+/**
+ * @brief Close SPI communication with a device
+ * 
+ * @param dev SPI device
+ */
+void spi_close(spi_device *dev)
+{
+    if (dev->transport != NULL)
+    {
+        dev->transport->close(dev);
+        dev->transport = NULL;
+        pthread_mutex_destroy(&dev->lock);
+    }
+}
+
+/**
+ * @brief SPI send a command and get its reply payload
+ * @details The payload is decoded in place by the caller: the returned
+ *              pointer is into the device receive frame and stays valid until
+ *              the next request on the device. When other threads share the
+ *              device, the caller holds dev->lock until it is done with it.
+ * 
+ * @param dev SPI device
+ * @param cmd SPI Command
+ * @return const uint8_t* Reply payload, or NULL if no valid reply was received
+ */
+const uint8_t *spi_query(spi_device *dev, uint8_t cmd)
+{
+    if (spi_request(dev, cmd, 0, SPI_FRAME_LEN, dev->rx) < 0)
+    {
+        return NULL;
+    }
+
+    return &dev->rx[SPI_DATA_OFFSET];
+}
+
+/**
+ * @brief SPI send a command and read its reply
+ * @details Safe to call while other threads use the device.
+ * 
+ * @param dev SPI device
+ * @param cmd SPI Command
+ * @param rx_buf Receive buffer
+ * @param len Length of the buffer
+ * @return int 0 on success, -1 if no valid reply was received
+ */
+int spi_command(spi_device *dev, uint8_t cmd, void *rx_buf, size_t len)
+{
+    pthread_mutex_lock(&dev->lock);
+
+    const uint8_t *payload = spi_query(dev, cmd);
+    if (payload != NULL)
+    {
+        memcpy(rx_buf, payload, len);
+    }
+
+    pthread_mutex_unlock(&dev->lock);
+
+    return payload != NULL ? 0 : -1;
+}
+
+/**
+ * @brief Get the length of the reply frame of a command
+ * 
+ * @param dev SPI device
+ * @param cmd Command code
+ * @param arg Command argument, the number of samples of a batch read
+ * @return size_t Frame length
+ */
+size_t spi_frame_len(const spi_device *dev, uint8_t cmd, uint8_t arg)
+{
+    if (cmd == CMD_READ_BATCH)
+    {
+        return SPI_BATCH_FRAME_LEN(arg) + (dev->tick_hz ? SPI_TICK_LEN : 0);
+    }
+    if (cmd == CMD_READ_BATCH_RAW)
+    {
+        return SPI_RAW_BATCH_FRAME_LEN(arg) + (dev->tick_hz ? SPI_TICK_LEN : 0);
+    }
+
+    return SPI_FRAME_LEN;
+}
+
+/**
+ * @brief SPI read a batch of buffered samples
+ * @details The device answers CMD_READ_BATCH with the number of samples it
+ *              returns at byte SPI_BATCH_DATA_OFFSET - 1, followed by that many
+ *              packed samples of SPI_SAMPLE_LEN bytes taken from its FIFO,
+ *              oldest first, and the CRC byte at the end of the frame. The
+ *              samples are left in the device receive frame for the caller to
+ *              decode in place, until the next request on the device. As with
+ *              spi_query(), the caller holds dev->lock if the device is shared.
+ *              With dev->tick_hz set, the frame is SPI_TICK_LEN bytes longer
+ *              and carries the tick of the newest sample. CMD_READ_BATCH_RAW
+ *              replies have the calibration register and raw samples in place
+ *              of the packed samples, see ina219_decode().
+ * 
+ * @param dev SPI device
+ * @param cmd CMD_READ_BATCH or CMD_READ_BATCH_RAW
+ * @param max Maximum number of samples to read, up to SPI_BATCH_MAX
+ * @param samples Set to the first packed sample, or to the calibration register
+ *              of a raw reply
+ * @return int Number of samples, -1 on error
+ */
+int spi_read_batch(spi_device *dev, uint8_t cmd, uint8_t max, const uint8_t **samples)
+{
+    if (spi_request(dev, cmd, max, spi_frame_len(dev, cmd, max), dev->rx) < 0)
+    {
+        return -1;
+    }
+
+    uint8_t count = dev->rx[SPI_BATCH_DATA_OFFSET - 1];
+    *samples = &dev->rx[SPI_BATCH_DATA_OFFSET];
+
+    return count < max ? count : max;
+}
+
+/**
+ * @brief Get the device tick counter of the last valid reply
+ * @details Devices with a tick counter, see dev->tick_hz, put its 24 low
+ *              bits in little endian order right before the CRC byte of every
+ *              batch reply, taken when they read the newest sample.
+ * 
+ * @param dev SPI device
+ * @return uint32_t Tick counter, modulo SPI_TICK_MASK + 1
+ */
+uint32_t spi_reply_tick(const spi_device *dev)
+{
+    const uint8_t *tick = &dev->rx[dev->xfer[1].len - SPI_CRC_LEN - SPI_TICK_LEN];
+
+    return tick[0] | (uint32_t)tick[1] << 8 | (uint32_t)tick[2] << 16;
+}
+
+/**
+ * @brief Start the worker thread of a device
+ * @details The pipeline lives until spi_pipeline_stop(); the device keeps
+ *              serving direct requests meanwhile.
+ * 
+ * @param dev SPI device
+ * @param attr Attributes of the worker thread, NULL for the defaults
+ * @return int 0 on success, an error number otherwise, as pthread_create()
+ */
+int spi_pipeline_start(spi_device *dev, const pthread_attr_t *attr)
+{
+    spi_pipeline *p = calloc(1, sizeof(spi_pipeline));
+    if (p == NULL)
+    {
+        return ENOMEM;
+    }
+
+    sem_init(&p->submitted, 0, 0);
+    sem_init(&p->completed, 0, 0);
+    atomic_init(&p->stop, 0);
+    dev->pipeline = p;
+
+    int err = pthread_create(&p->thread, attr, spi_worker, dev);
+    if (err != 0)
+    {
+        dev->pipeline = NULL;
+        sem_destroy(&p->submitted);
+        sem_destroy(&p->completed);
+        free(p);
+    }
+
+    return err;
+}
+
+/**
+ * @brief Stop the worker thread of a device
+ * @details A request still in flight is completed and its reply dropped.
+ * 
+ * @param dev SPI device
+ */
+void spi_pipeline_stop(spi_device *dev)
+{
+    spi_pipeline *p = dev->pipeline;
+
+    if (p == NULL)
+    {
+        return;
+    }
+
+    spi_complete(dev);
+    atomic_store(&p->stop, 1);
+    sem_post(&p->submitted);
+    pthread_join(p->thread, NULL);
+
+    sem_destroy(&p->submitted);
+    sem_destroy(&p->completed);
+    dev->pipeline = NULL;
+    free(p);
+}
+
+/**
+ * @brief Hand a request to the worker of a pipelined device
+ * @details Returns right away. Only one request is in flight at a time: its
+ *              reply must be taken with spi_complete() before the next
+ *              submission. Meanwhile the caller is free to decode the reply
+ *              before it, which is in the other slot.
+ * 
+ * @param dev Pipelined SPI device
+ * @param cmd SPI Command
+ * @param arg Command argument, the number of samples of CMD_READ_BATCH
+ * @return int 0 on success, -1 if a request is already in flight
+ */
+int spi_submit(spi_device *dev, uint8_t cmd, uint8_t arg)
+{
+    spi_pipeline *p = dev->pipeline;
+
+    if (p->in_flight)
+    {
+        return -1;
+    }
+
+    spi_slot *slot = &p->slots[p->next];
+    slot->cmd = cmd;
+    slot->arg = arg;
+    slot->frame_len = spi_frame_len(dev, cmd, arg);
+    p->next = (p->next + 1) % SPI_PIPELINE_DEPTH;
+    p->in_flight = 1;
+    sem_post(&p->submitted);
+
+    return 0;
+}
+
+/**
+ * @brief Wait for the reply of the request in flight
+ * 
+ * @param dev Pipelined SPI device
+ * @return const spi_slot* Request and reply, valid until the next call, or
+ *              NULL if no request is in flight
+ */
+const spi_slot *spi_complete(spi_device *dev)
+{
+    spi_pipeline *p = dev->pipeline;
+
+    if (!p->in_flight)
+    {
+        return NULL;
+    }
+
+    TRACE_BEGIN("spi_complete", 0);
+    while (sem_wait(&p->completed) < 0 && errno == EINTR)
+    {
+    }
+    TRACE_END("spi_complete", 0);
+
+    const spi_slot *slot = &p->slots[p->done];
+    p->done = (p->done + 1) % SPI_PIPELINE_DEPTH;
+    p->in_flight = 0;
+
+    return slot;
+}
+
+/**
+ * @brief Get the packed samples of a pipelined reply
+ * @details CMD_READ_ALL and CMD_READ_RAW replies hold one sample, batch
+ *              replies the count given by the device, see spi_read_batch().
+ * 
+ * @param slot Completed request
+ * @param samples Set to the first packed sample, or to the calibration register
+ *              of a raw reply
+ * @return int Number of samples, -1 if the request failed
+ */
+int spi_slot_samples(const spi_slot *slot, const uint8_t **samples)
+{
+    if (slot->ret < 0)
+    {
+        return -1;
+    }
+    if (slot->cmd != CMD_READ_BATCH && slot->cmd != CMD_READ_BATCH_RAW)
+    {
+        *samples = &slot->rx[SPI_DATA_OFFSET];
+        return 1;
+    }
+
+    uint8_t count = slot->rx[SPI_BATCH_DATA_OFFSET - 1];
+    *samples = &slot->rx[SPI_BATCH_DATA_OFFSET];
+
+    return count < slot->arg ? count : slot->arg;
+}
+
+/**
+ * @brief Get the device tick counter of a pipelined batch reply
+ * 
+ * @param slot Completed request of a device with dev->tick_hz set
+ * @return uint32_t Tick counter, modulo SPI_TICK_MASK + 1
+ */
+uint32_t spi_slot_tick(const spi_slot *slot)
+{
+    const uint8_t *tick = &slot->rx[slot->frame_len - SPI_CRC_LEN - SPI_TICK_LEN];
+
+    return tick[0] | (uint32_t)tick[1] << 8 | (uint32_t)tick[2] << 16;
+}
+
+/**
+ * @brief Get the upper bound of a latency histogram bucket
+ * 
+ * @param bucket Bucket, below SPI_LATENCY_BUCKETS - 1
+ * @return uint32_t Upper bound in microseconds
+ */
+uint32_t spi_latency_bound_us(unsigned int bucket)
+{
+    return gs_spi_latency_us[bucket];
+}
+
+/**
+ * @brief Print the link statistics of a device
+ * 
+ * @param dev SPI device
+ * @param fp Output stream
+ */
+void spi_print_stats(spi_device *dev, FILE *fp)
+{
+    fprintf(fp, "%s: transfers %llu, retries %llu, ioctl errors %llu, echo errors %llu, crc errors %llu, failures %llu, reopens %llu\n",
+        dev->path,
+        (unsigned long long)atomic_load(&dev->stats.transfers),
+        (unsigned long long)atomic_load(&dev->stats.retries),
+        (unsigned long long)atomic_load(&dev->stats.ioctl_errors),
+        (unsigned long long)atomic_load(&dev->stats.echo_errors),
+        (unsigned long long)atomic_load(&dev->stats.crc_errors),
+        (unsigned long long)atomic_load(&dev->stats.failures),
+        (unsigned long long)atomic_load(&dev->stats.reopens));
+}
@@ -0,0 +1,189 @@
+/**
+ * @file    spi.h
+ * @brief   Homeoffice device SPI link
+ * @details SPI commands and reply layout of the homeoffice device, and the
+ *              functions that exchange them over spidev or an emulated device
+ *              (see transport.h). Each device has its own context, so several
+ *              devices can be polled by one process. A device that goes
+ *              away while sampling is reopened as soon as it is back.
+ *              A device can also be pipelined: a worker thread runs one
+ *              request while the caller decodes the reply of the previous
+ *              one from the other frame of a ping-pong pair.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef SPI_H
+#define SPI_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <linux/spi/spidev.h>
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define SPI_PROTOCOL_V1 1           /* Command and reply in two separate transfers */
+#define SPI_PROTOCOL_V2 2           /* Command and reply in a single SPI message */
+#define SPI_PROTOCOL_DEFAULT SPI_PROTOCOL_V2
+
+#define SPI_DEVICE "/dev/spidev0.0" /* Default SPI device path */
+#define SPI_DEVICES_MAX 16          /* Maximum number of devices polled at once */
+#define SPI_PATH_MAX 64             /* SPI device path length */
+#define SPI_BUS_UNKNOWN 1000        /* First bus number given to non-spidev names */
+#define SPI_SPEED_HZ 100000         /* Default SPI speed in Hz */
+#define SPI_MODE SPI_MODE_0         /* SPI communication mode */
+#define SPI_BITS_PER_WORD 8         /* SPI bits per word */
+#define SPI_RETRIES_DEFAULT 2       /* Default retries of a failed request */
+#define SPI_WAIT_DEFAULT_S 10       /* Default wait for a device node to appear */
+#define SPI_LATENCY_BUCKETS 9       /* Latency histogram buckets, the last one unbounded */
+
+#define CMD_READ_VOLTAGE 0x01       /* SPI Read Voltage command */
+#define CMD_READ_CURRENT 0x02       /* SPI Read Current command */
+#define CMD_READ_POWER 0x03         /* SPI Read Power command */
+#define CMD_READ_RELAY 0x04         /* SPI Read Relay command */
+#define CMD_READ_ALL 0x05           /* SPI Read All command */
+#define CMD_SET_RELAY_ON 0x06       /* SPI Set Relay On command */
+#define CMD_SET_RELAY_OFF 0x07      /* SPI Set Relay Off command */
+#define CMD_READ_BATCH 0x08         /* SPI Read Batch command */
+#define CMD_READ_RAW 0x09           /* SPI Read Raw INA219 registers command */
+#define CMD_READ_BATCH_RAW 0x0A     /* SPI Read Batch of raw INA219 registers command */
+
+#define SPI_FRAME_LEN 20            /* Command frame and single reply frame length */
+#define SPI_DATA_OFFSET 3           /* First payload byte in a reply frame */
+#define SPI_FRAME_ALIGN 64          /* Alignment of the device frames */
+#define SPI_SAMPLE_LEN 13           /* Packed sample on the wire: voltage, current, power, relay */
+#define SPI_BATCH_MAX 64            /* Maximum samples per CMD_READ_BATCH */
+#define SPI_BATCH_DATA_OFFSET 4     /* First sample in a batch reply frame */
+#define SPI_CRC_LEN 1               /* CRC-8 trailer at the end of every reply frame */
+#define SPI_TICK_LEN 3              /* Optional device tick counter before the CRC */
+#define SPI_TICK_MASK 0xffffff      /* Tick counter wrap-around */
+#define SPI_BATCH_FRAME_LEN(n) (SPI_BATCH_DATA_OFFSET + (n) * SPI_SAMPLE_LEN + SPI_CRC_LEN)
+#define SPI_RAW_SAMPLE_LEN 8        /* Raw sample on the wire: shunt, bus, current and power registers */
+#define SPI_RAW_CAL_LEN 2           /* Calibration register ahead of the raw samples */
+#define SPI_RAW_BATCH_FRAME_LEN(n) (SPI_BATCH_DATA_OFFSET + SPI_RAW_CAL_LEN + (n) * SPI_RAW_SAMPLE_LEN + SPI_CRC_LEN)
+#define SPI_FRAME_MAX (SPI_BATCH_FRAME_LEN(SPI_BATCH_MAX) + SPI_TICK_LEN) /* Largest reply frame */
+#define SPI_PIPELINE_DEPTH 2        /* Reply frames of a pipelined device: one in flight, one decoded */
+
+/* *************************
+ * PUBLIC TYPES DEFINITION *
+ * *************************/
+
+/* Homeoffice device struct data */
+typedef struct homeoffice_data{
+    float voltage;
+    float current;
+    float power;
+    uint8_t relay;
+}__attribute__((__packed__)) __attribute__((aligned(4))) homeoffice_data;
+
+/* SPI link statistics */
+typedef struct spi_stats{
+    _Atomic uint64_t transfers;     /* Request attempts */
+    _Atomic uint64_t retries;       /* Attempts after a failure */
+    _Atomic uint64_t ioctl_errors;  /* Failed SPI_IOC_MESSAGE calls */
+    _Atomic uint64_t echo_errors;   /* Replies not echoing the command */
+    _Atomic uint64_t crc_errors;    /* Replies with a bad CRC */
+    _Atomic uint64_t failures;      /* Requests given up after all retries */
+    _Atomic uint64_t reopens;       /* Reopens of a device that went away */
+    _Atomic uint64_t latency[SPI_LATENCY_BUCKETS]; /* Attempts per latency bucket */
+    _Atomic uint64_t latency_ns;    /* Total attempt latency */
+} spi_stats;
+
+/* Request of a pipelined device and its reply */
+typedef struct spi_slot{
+    uint8_t cmd;
+    uint8_t arg;
+    size_t frame_len;
+    int ret;                        /* 0 on a valid reply, -1 if every attempt failed */
+    uint64_t xfer_start_ns;         /* Transfer bracket of the valid reply */
+    uint64_t xfer_end_ns;
+    _Alignas(SPI_FRAME_ALIGN) uint8_t rx[SPI_FRAME_MAX];
+} spi_slot;
+
+/* Worker thread of a pipelined device */
+typedef struct spi_pipeline{
+    pthread_t thread;
+    sem_t submitted;                /* Posted by the caller for each request */
+    sem_t completed;                /* Posted by the worker for each reply */
+    atomic_int stop;
+    spi_slot slots[SPI_PIPELINE_DEPTH];
+    unsigned int next;              /* Slot of the next request (caller) */
+    unsigned int done;              /* Slot of the next reply (caller) */
+    int in_flight;                  /* A request was submitted and not completed (caller) */
+} spi_pipeline;
+
+struct transport_ops;               /* See transport.h */
+
+/* SPI device context */
+typedef struct spi_device{
+    char path[SPI_PATH_MAX];        /* Device path, see transport_find() */
+    int fd;                         /* SPI file descriptor of spidev devices */
+    int index;                      /* Position in the device list */
+    int bus;                        /* SPI controller number */
+    int cs;                         /* Chip select number */
+    int protocol;                   /* SPI_PROTOCOL_* */
+    uint32_t speed_hz;              /* SPI clock */
+    int crc;                        /* Check the CRC-8 of reply frames */
+    unsigned int retries;           /* Retries of a failed request */
+    uint32_t tick_hz;               /* Rate of the device tick counter in the replies, 0 if absent */
+    uint32_t shunt_uohm;            /* Shunt resistance in raw register mode, 0 for float replies */
+    spi_stats stats;
+
+    /* Set while the device is gone, see spi_recover() */
+    int lost;
+    uint64_t reopen_ns;             /* CLOCK_MONOTONIC time of the next reopen attempt */
+    uint64_t reopen_backoff_ns;     /* Wait after a failed reopen attempt */
+
+    /* CLOCK_MONOTONIC times bracketing the transfer of the last valid reply */
+    uint64_t xfer_start_ns;
+    uint64_t xfer_end_ns;
+
+    /* Serializes requests from several threads, see spi_query() */
+    pthread_mutex_t lock;
+
+    /* Transport carrying the messages, set by spi_init() */
+    const struct transport_ops *transport;
+    void *transport_ctx;            /* State of the transport */
+
+    /* Set while the device is pipelined, see spi_submit() */
+    spi_pipeline *pipeline;
+
+    /* Transfer path, set up once by spi_init() */
+    struct spi_ioc_transfer xfer[2]; /* Command and reply segments */
+    _Alignas(SPI_FRAME_ALIGN) uint8_t tx[SPI_FRAME_LEN];
+    _Alignas(SPI_FRAME_ALIGN) uint8_t rx[SPI_FRAME_MAX];
+} spi_device;
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+char *spi_cmd_str(uint8_t cmd);
+uint8_t spi_crc8(const uint8_t *data, size_t len);
+int spi_init(spi_device *dev, const char *path, int index, uint64_t wait_ns);
+void spi_close(spi_device *dev);
+int spi_set_speed(spi_device *dev, uint32_t speed_hz);
+const uint8_t *spi_query(spi_device *dev, uint8_t cmd);
+int spi_command(spi_device *dev, uint8_t cmd, void *rx_buf, size_t len);
+size_t spi_frame_len(const spi_device *dev, uint8_t cmd, uint8_t arg);
+int spi_read_batch(spi_device *dev, uint8_t cmd, uint8_t max, const uint8_t **samples);
+uint32_t spi_reply_tick(const spi_device *dev);
+int spi_pipeline_start(spi_device *dev, const pthread_attr_t *attr);
+void spi_pipeline_stop(spi_device *dev);
+int spi_submit(spi_device *dev, uint8_t cmd, uint8_t arg);
+const spi_slot *spi_complete(spi_device *dev);
+int spi_slot_samples(const spi_slot *slot, const uint8_t **samples);
+uint32_t spi_slot_tick(const spi_slot *slot);
+uint32_t spi_latency_bound_us(unsigned int bucket);
+void spi_print_stats(spi_device *dev, FILE *fp);
+
+#endif /* SPI_H */
@@ -0,0 +1,382 @@
+/**
+ * @file    stats.c
+ * @brief   Streaming statistics
+ * @details A sample updates the current bucket of every window with Welford's
+ *              algorithm. A bucket is reused, and cleared, once the window has
+ *              moved past it. Summaries merge the live buckets with the
+ *              pairwise form of the same update, which keeps the variance
+ *              stable without storing the samples.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <string.h>
+#include <math.h>
+
+#include "stats.h"
+#include "timeutil.h"
+#include "block.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define STATS_SEC_PER_HOUR 3600.0   /* Seconds per hour */
+#define STATS_POWER_UW_MAX 1000000000LL /* Largest power integrated, 1 kW */
+#define STATS_FJ_PER_UJ 1000000000LL /* Femtojoules per microjoule */
+
+/* **************************
+ * PRIVATE TYPES DEFINITION *
+ * **************************/
+
+/* Window layout */
+typedef struct stats_layout{
+    const char *name;
+    uint64_t bucket_ns;
+    unsigned int nbuckets;
+} stats_layout;
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static void stats_moments_add(stats_moments *m, double x);
+static void stats_moments_merge(stats_moments *m, const stats_moments *other);
+static stats_bucket *stats_bucket_get(stats_window *win, uint64_t timestamp_ns);
+
+/* *************************************
+ * PRIVATE GLOBAL VARIABLES DEFINITION *
+ * *************************************/
+
+static const stats_layout gs_stats_layouts[STATS_WINDOWS] = {
+    [STATS_WINDOW_1S] = { "1s", 100 * NSEC_PER_MSEC, 10 },
+    [STATS_WINDOW_1MIN] = { "1min", NSEC_PER_SEC, 60 },
+    [STATS_WINDOW_15MIN] = { "15min", 15 * NSEC_PER_SEC, 60 },
+};
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Add a value to running moments
+ * 
+ * @param m Moments
+ * @param x Value
+ */
+static void stats_moments_add(stats_moments *m, double x)
+{
+    if (m->n == 0)
+    {
+        m->min = x;
+        m->max = x;
+    }
+    else
+    {
+        if (x < m->min)
+        {
+            m->min = x;
+        }
+        if (x > m->max)
+        {
+            m->max = x;
+        }
+    }
+
+    m->n++;
+    double delta = x - m->mean;
+    m->mean += delta / m->n;
+    m->m2 += delta * (x - m->mean);
+}
+
+/**
+ * @brief Merge running moments into others
+ * 
+ * @param m Moments merged into
+ * @param other Moments to merge
+ */
+static void stats_moments_merge(stats_moments *m, const stats_moments *other)
+{
+    if (other->n == 0)
+    {
+        return;
+    }
+    if (m->n == 0)
+    {
+        *m = *other;
+        return;
+    }
+
+    double n = m->n + other->n;
+    double delta = other->mean - m->mean;
+
+    m->mean += delta * other->n / n;
+    m->m2 += other->m2 + delta * delta * m->n * other->n / n;
+    m->n += other->n;
+    if (other->min < m->min)
+    {
+        m->min = other->min;
+    }
+    if (other->max > m->max)
+    {
+        m->max = other->max;
+    }
+}
+
+/**
+ * @brief Get the bucket of a window that holds a sample time
+ * @details A bucket left over from an earlier turn of the ring is cleared
+ *              and reused.
+ * 
+ * @param win Window
+ * @param timestamp_ns Sample time
+ * @return stats_bucket* Bucket, or NULL if the sample is older than the window
+ */
+static stats_bucket *stats_bucket_get(stats_window *win, uint64_t timestamp_ns)
+{
+    uint64_t epoch = timestamp_ns / win->bucket_ns + 1;
+    stats_bucket *b = &win->buckets[epoch % win->nbuckets];
+
+    if (b->epoch != epoch)
+    {
+        if (b->epoch > epoch)
+        {
+            return NULL;
+        }
+        memset(b, 0, sizeof(stats_bucket));
+        b->epoch = epoch;
+    }
+
+    return b;
+}
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Initialize the statistics of a device
+ * 
+ * @param st Statistics
+ */
+void stats_init(stats_engine *st)
+{
+    memset(st, 0, sizeof(stats_engine));
+
+    for (int w = 0; w < STATS_WINDOWS; w++)
+    {
+        st->windows[w].bucket_ns = gs_stats_layouts[w].bucket_ns;
+        st->windows[w].nbuckets = gs_stats_layouts[w].nbuckets;
+    }
+}
+
+/**
+ * @brief Add a sample to the statistics
+ * @details Energy is integrated with the trapezoidal rule between
+ *              consecutive samples; a sample older than the previous one only
+ *              updates the windows.
+ * 
+ * @param st Statistics
+ * @param timestamp_ns CLOCK_MONOTONIC acquisition time
+ * @param data Sample
+ */
+void stats_update(stats_engine *st, uint64_t timestamp_ns, const homeoffice_data *data)
+{
+    double values[STATS_CHANNELS] = {
+        [STATS_CHANNEL_VOLTAGE] = data->voltage,
+        [STATS_CHANNEL_CURRENT] = data->current,
+        [STATS_CHANNEL_POWER] = data->power,
+    };
+
+    for (int w = 0; w < STATS_WINDOWS; w++)
+    {
+        stats_bucket *b = stats_bucket_get(&st->windows[w], timestamp_ns);
+
+        if (b == NULL)
+        {
+            continue;
+        }
+        for (int c = 0; c < STATS_CHANNELS; c++)
+        {
+            stats_moments_add(&b->ch[c], values[c]);
+        }
+    }
+
+    stats_energy_update(&st->energy, timestamp_ns, data->power);
+}
+
+/**
+ * @brief Add a block of samples to the statistics
+ * @details The block is split into runs of samples that share a bucket of
+ *              the finest window. The buckets of the other windows are whole
+ *              multiples of it, so each run is reduced once per channel and
+ *              merged into one bucket of every window.
+ * 
+ * @param st Statistics
+ * @param blk Samples of the device, oldest first
+ */
+void stats_update_block(stats_engine *st, const sample_block *blk)
+{
+    const float *channels[STATS_CHANNELS] = {
+        [STATS_CHANNEL_VOLTAGE] = blk->voltage,
+        [STATS_CHANNEL_CURRENT] = blk->current,
+        [STATS_CHANNEL_POWER] = blk->power,
+    };
+    uint64_t bucket_ns = st->windows[STATS_WINDOW_1S].bucket_ns;
+    size_t start = 0;
+
+    while (start < blk->n)
+    {
+        uint64_t epoch = blk->timestamp_ns[start] / bucket_ns;
+        size_t end = start + 1;
+        stats_moments m[STATS_CHANNELS];
+
+        while (end < blk->n && blk->timestamp_ns[end] / bucket_ns == epoch)
+        {
+            end++;
+        }
+
+        for (int c = 0; c < STATS_CHANNELS; c++)
+        {
+            const float *x = &channels[c][start];
+            size_t n = end - start;
+            block_reduction r;
+
+            block_reduce(x, n, x[0], &r);
+            m[c].n = n;
+            m[c].mean = x[0] + (double)r.sum / n;
+            m[c].m2 = fmax(0, r.sumsq - (double)r.sum * r.sum / n);
+            m[c].min = r.min;
+            m[c].max = r.max;
+        }
+
+        for (int w = 0; w < STATS_WINDOWS; w++)
+        {
+            stats_bucket *b = stats_bucket_get(&st->windows[w], blk->timestamp_ns[start]);
+
+            if (b == NULL)
+            {
+                continue;
+            }
+            for (int c = 0; c < STATS_CHANNELS; c++)
+            {
+                stats_moments_merge(&b->ch[c], &m[c]);
+            }
+        }
+
+        start = end;
+    }
+
+    for (size_t i = 0; i < blk->n; i++)
+    {
+        stats_energy_update(&st->energy, blk->timestamp_ns[i], blk->power[i]);
+    }
+}
+
+/**
+ * @brief Summarize a window
+ * @details The window covers the bucket holding now_ns and the ones before
+ *              it, so its span lies between nbuckets - 1 and nbuckets buckets.
+ * 
+ * @param st Statistics
+ * @param window STATS_WINDOW_*
+ * @param now_ns End of the window, on the sample clock
+ * @param out Summary of each channel
+ */
+void stats_window_get(const stats_engine *st, int window, uint64_t now_ns, stats_summary out[STATS_CHANNELS])
+{
+    const stats_window *win = &st->windows[window];
+    uint64_t last = now_ns / win->bucket_ns + 1;
+    stats_moments total[STATS_CHANNELS] = {0};
+
+    for (unsigned int i = 0; i < win->nbuckets; i++)
+    {
+        const stats_bucket *b = &win->buckets[i];
+
+        if (b->epoch == 0 || b->epoch > last || b->epoch + win->nbuckets <= last)
+        {
+            continue;
+        }
+        for (int c = 0; c < STATS_CHANNELS; c++)
+        {
+            stats_moments_merge(&total[c], &b->ch[c]);
+        }
+    }
+
+    for (int c = 0; c < STATS_CHANNELS; c++)
+    {
+        out[c].n = total[c].n;
+        out[c].min = total[c].min;
+        out[c].max = total[c].max;
+        out[c].mean = total[c].mean;
+        out[c].rms = total[c].n ? sqrt(total[c].m2 / total[c].n + total[c].mean * total[c].mean) : 0;
+    }
+}
+
+/**
+ * @brief Get the name of a window
+ * 
+ * @param window STATS_WINDOW_*
+ * @return const char* Name of the window
+ */
+const char *stats_window_str(int window)
+{
+    return gs_stats_layouts[window].name;
+}
+
+/**
+ * @brief Integrate power up to a sample
+ * @details Trapezoidal rule between consecutive samples; a sample older than
+ *              the previous one is ignored. Power is taken in whole
+ *              microwatts, which every INA219 power resolution is a multiple
+ *              of, and each step is added exactly: whole seconds of the step
+ *              in microjoules, the rest in femtojoules carried over at each
+ *              microjoule.
+ * 
+ * @param e Energy integrator, zeroed before the first sample
+ * @param timestamp_ns Sample time
+ * @param power Sample power
+ */
+void stats_energy_update(stats_energy *e, uint64_t timestamp_ns, double power)
+{
+    int64_t uw = 0;
+
+    if (e->started && timestamp_ns <= e->last_ns)
+    {
+        return;
+    }
+    if (isfinite(power))
+    {
+        double clamped = fmin(fmax(power * 1e6, -STATS_POWER_UW_MAX), STATS_POWER_UW_MAX);
+        uw = llround(clamped);
+    }
+    if (e->started)
+    {
+        uint64_t dt_ns = timestamp_ns - e->last_ns;
+        int64_t sum_uw = e->last_uw + uw;
+
+        e->uj2 += sum_uw * (int64_t)(dt_ns / NSEC_PER_SEC);
+        e->fj2 += sum_uw * (int64_t)(dt_ns % NSEC_PER_SEC);
+        e->uj2 += e->fj2 / STATS_FJ_PER_UJ;
+        e->fj2 %= STATS_FJ_PER_UJ;
+    }
+    e->last_ns = timestamp_ns;
+    e->last_uw = uw;
+    e->started = 1;
+}
+
+/**
+ * @brief Get the energy of an integrator
+ * 
+ * @param e Energy integrator
+ * @return double Energy since the first sample, in Wh
+ */
+double stats_energy_wh(const stats_energy *e)
+{
+    double uj = ((double)e->uj2 + (double)e->fj2 / STATS_FJ_PER_UJ) / 2;
+
+    return uj / 1e6 / STATS_SEC_PER_HOUR;
+}
@@ -0,0 +1,103 @@
+/**
+ * @file    stats.h
+ * @brief   Streaming statistics
+ * @details Incremental aggregation of the sample stream of one device:
+ *              rolling windows of min, max, mean and RMS for voltage, current
+ *              and power, and the energy consumed since startup. Each window
+ *              is a ring of time buckets holding Welford moments, so a sample
+ *              costs a constant amount of work and a summary merges at most
+ *              STATS_BUCKETS_MAX buckets.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdint.h>
+
+#include "spi.h"
+#include "block.h"
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define STATS_CHANNEL_VOLTAGE 0     /* Voltage channel */
+#define STATS_CHANNEL_CURRENT 1     /* Current channel */
+#define STATS_CHANNEL_POWER 2       /* Power channel */
+#define STATS_CHANNELS 3            /* Number of channels */
+
+#define STATS_WINDOW_1S 0           /* 1 second window */
+#define STATS_WINDOW_1MIN 1         /* 1 minute window */
+#define STATS_WINDOW_15MIN 2        /* 15 minute window */
+#define STATS_WINDOWS 3             /* Number of windows */
+
+#define STATS_BUCKETS_MAX 60        /* Maximum buckets per window */
+
+/* *************************
+ * PUBLIC TYPES DEFINITION *
+ * *************************/
+
+/* Running moments of one channel */
+typedef struct stats_moments{
+    uint64_t n;
+    double mean;
+    double m2;                      /* Sum of squared deviations from the mean */
+    double min;
+    double max;
+} stats_moments;
+
+/* Moments of the samples that fall in one time bucket */
+typedef struct stats_bucket{
+    uint64_t epoch;                 /* Bucket number since the clock origin plus one, 0 if empty */
+    stats_moments ch[STATS_CHANNELS];
+} stats_bucket;
+
+/* Rolling window */
+typedef struct stats_window{
+    uint64_t bucket_ns;
+    unsigned int nbuckets;
+    stats_bucket buckets[STATS_BUCKETS_MAX];
+} stats_window;
+
+/* Summary of one channel over a window */
+typedef struct stats_summary{
+    uint64_t n;
+    double min;
+    double max;
+    double mean;
+    double rms;
+} stats_summary;
+
+/* Energy integrator, in integers so that long runs do not drift */
+typedef struct stats_energy{
+    int64_t uj2;                    /* Twice the energy since the first sample, in uJ */
+    int64_t fj2;                    /* Twice the remainder below 1 uJ, in fJ */
+    int64_t last_uw;                /* Power of the last sample, in uW */
+    uint64_t last_ns;
+    int started;
+} stats_energy;
+
+/* Statistics of one device */
+typedef struct stats_engine{
+    stats_window windows[STATS_WINDOWS];
+    stats_energy energy;
+} stats_engine;
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+void stats_init(stats_engine *st);
+void stats_update(stats_engine *st, uint64_t timestamp_ns, const homeoffice_data *data);
+void stats_update_block(stats_engine *st, const sample_block *blk);
+void stats_window_get(const stats_engine *st, int window, uint64_t now_ns, stats_summary out[STATS_CHANNELS]);
+const char *stats_window_str(int window);
+void stats_energy_update(stats_energy *e, uint64_t timestamp_ns, double power);
+double stats_energy_wh(const stats_energy *e);
+
+#endif /* STATS_H */
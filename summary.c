@@ -0,0 +1,240 @@
+/**
+ * @file    summary.c
+ * @brief   Statistics summary sink
+ * @details Runs of consecutive samples of one device are gathered into a
+ *              block and aggregated with the block kernels. Reports are driven
+ *              by the sample clock: when a sample crosses a report boundary,
+ *              every device seen so far gets one line per window ending at
+ *              that boundary. A last report is written when the sink is closed.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "summary.h"
+#include "stats.h"
+#include "block.h"
+
+/* **************************
+ * PRIVATE TYPES DEFINITION *
+ * **************************/
+
+/* Summary sink context */
+typedef struct summary_ctx{
+    FILE *fp;
+    uint64_t interval_ns;
+    uint64_t start_ns;
+    uint64_t next_ns;               /* Next report boundary */
+    uint64_t last_ns;               /* Latest sample time */
+    int started;
+    int seen[SPI_DEVICES_MAX];
+    stats_engine stats[SPI_DEVICES_MAX];
+    sample_block block;             /* Samples not aggregated yet */
+} summary_ctx;
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static void summary_aggregate(summary_ctx *sum);
+static void summary_report(summary_ctx *sum, uint64_t now_ns);
+static void summary_write(void *ctx, const sample_record *recs, size_t n);
+static void summary_flush(void *ctx);
+static void summary_close(void *ctx);
+
+/* *************************************
+ * PRIVATE GLOBAL VARIABLES DEFINITION *
+ * *************************************/
+
+static const sink_ops gs_summary_ops = {
+    .write = summary_write,
+    .flush = summary_flush,
+    .close = summary_close,
+};
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Aggregate the pending block of samples
+ * 
+ * @param sum Summary context
+ */
+static void summary_aggregate(summary_ctx *sum)
+{
+    if (sum->block.n > 0)
+    {
+        stats_update_block(&sum->stats[sum->block.device], &sum->block);
+        sum->block.n = 0;
+    }
+}
+
+/**
+ * @brief Write the summary of every device seen so far
+ * 
+ * @param sum Summary context
+ * @param now_ns End of the windows, on the sample clock
+ */
+static void summary_report(summary_ctx *sum, uint64_t now_ns)
+{
+    stats_summary s[STATS_CHANNELS];
+
+    summary_aggregate(sum);
+    for (int d = 0; d < SPI_DEVICES_MAX; d++)
+    {
+        if (!sum->seen[d])
+        {
+            continue;
+        }
+        for (int w = 0; w < STATS_WINDOWS; w++)
+        {
+            stats_window_get(&sum->stats[d], w, now_ns, s);
+            fprintf(sum->fp, "%.6f,%d,%s,%llu", (double)(now_ns - sum->start_ns) / NSEC_PER_SEC,
+                d, stats_window_str(w), (unsigned long long)s[STATS_CHANNEL_VOLTAGE].n);
+            for (int c = 0; c < STATS_CHANNELS; c++)
+            {
+                fprintf(sum->fp, ",%.6f,%.6f,%.6f,%.6f", s[c].min, s[c].max, s[c].mean, s[c].rms);
+            }
+            fprintf(sum->fp, ",%.6f\n", stats_energy_wh(&sum->stats[d].energy));
+        }
+    }
+}
+
+/**
+ * @brief Aggregate samples, reporting at each boundary they cross
+ * 
+ * @param ctx Summary context
+ * @param recs Samples
+ * @param n Number of samples
+ */
+static void summary_write(void *ctx, const sample_record *recs, size_t n)
+{
+    summary_ctx *sum = ctx;
+
+    if (!sum->started)
+    {
+        sum->start_ns = recs[0].timestamp_ns;
+        sum->next_ns = sum->start_ns + sum->interval_ns;
+        sum->started = 1;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t t = recs[i].timestamp_ns;
+
+        if (t >= sum->next_ns)
+        {
+            summary_report(sum, sum->next_ns - 1);
+
+            /* Skip the boundaries of a gap in the stream */
+            sum->next_ns += (t - sum->next_ns) / sum->interval_ns * sum->interval_ns + sum->interval_ns;
+        }
+
+        if (recs[i].device < SPI_DEVICES_MAX)
+        {
+            sample_block *blk = &sum->block;
+
+            if (blk->n == BLOCK_LEN || (blk->n > 0 && (blk->device != recs[i].device
+                || t < blk->timestamp_ns[blk->n - 1])))
+            {
+                summary_aggregate(sum);
+            }
+            sum->seen[recs[i].device] = 1;
+            block_append(blk, &recs[i]);
+        }
+        if (t > sum->last_ns)
+        {
+            sum->last_ns = t;
+        }
+    }
+}
+
+/**
+ * @brief Flush the written summaries
+ * 
+ * @param ctx Summary context
+ */
+static void summary_flush(void *ctx)
+{
+    summary_ctx *sum = ctx;
+
+    summary_aggregate(sum);
+    fflush(sum->fp);
+}
+
+/**
+ * @brief Write the last report and close the summary
+ * 
+ * @param ctx Summary context
+ */
+static void summary_close(void *ctx)
+{
+    summary_ctx *sum = ctx;
+
+    if (sum->started)
+    {
+        summary_report(sum, sum->last_ns);
+    }
+
+    if (sum->fp == stdout)
+    {
+        fflush(sum->fp);
+    }
+    else
+    {
+        fclose(sum->fp);
+    }
+    free(sum);
+}
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Open a statistics summary sink
+ * 
+ * @param s Sink to set up
+ * @param path Output file, or "-" for stdout
+ * @param interval_ns Report interval
+ * @return int 0 on success, -1 on error
+ */
+int summary_open(sink *s, const char *path, uint64_t interval_ns)
+{
+    summary_ctx *sum = calloc(1, sizeof(summary_ctx));
+    if (sum == NULL)
+    {
+        return -1;
+    }
+
+    sum->fp = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (sum->fp == NULL)
+    {
+        perror("Error opening summary file");
+        free(sum);
+        return -1;
+    }
+    sum->interval_ns = interval_ns;
+    for (int d = 0; d < SPI_DEVICES_MAX; d++)
+    {
+        stats_init(&sum->stats[d]);
+    }
+
+    fprintf(sum->fp, "time_s,device,window,samples");
+    fprintf(sum->fp, ",voltage_min,voltage_max,voltage_mean,voltage_rms");
+    fprintf(sum->fp, ",current_min,current_max,current_mean,current_rms");
+    fprintf(sum->fp, ",power_min,power_max,power_mean,power_rms,energy_wh\n");
+
+    s->name = "summary";
+    s->ops = &gs_summary_ops;
+    s->ctx = sum;
+
+    return 0;
+}
@@ -0,0 +1,34 @@
+/**
+ * @file    summary.h
+ * @brief   Statistics summary sink
+ * @details Aggregates the sample stream of every device and writes periodic
+ *              CSV summaries of the rolling windows and the energy consumed,
+ *              instead of the raw samples.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef SUMMARY_H
+#define SUMMARY_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdint.h>
+
+#include "sink.h"
+#include "timeutil.h"
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define SUMMARY_INTERVAL_DEFAULT NSEC_PER_SEC /* Default report interval in ns */
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+int summary_open(sink *s, const char *path, uint64_t interval_ns);
+
+#endif /* SUMMARY_H */
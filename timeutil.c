@@ -0,0 +1,113 @@
+/**
+ * @file    timeutil.c
+ * @brief   Time helpers
+ * @details Conversions between struct timespec and nanosecond counts, and
+ *              the offset of the wall clock from the monotonic clock.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdatomic.h>
+
+#include "timeutil.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define TIME_OFFSET_ROUNDS 3        /* Brackets tried per offset measurement */
+#define TIME_OFFSET_REFRESH_NS NSEC_PER_SEC /* Lifetime of a measured offset */
+
+/* *************************************
+ * PRIVATE GLOBAL VARIABLES DEFINITION *
+ * *************************************/
+
+static _Atomic int64_t gs_time_offset_ns; /* Last measured CLOCK_REALTIME offset */
+static _Atomic uint64_t gs_time_offset_expiry_ns; /* CLOCK_MONOTONIC time it is re-measured */
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Convert a timespec to nanoseconds
+ * 
+ * @param ts Time value
+ * @return uint64_t Time in nanoseconds
+ */
+uint64_t timespec_to_ns(const struct timespec *ts)
+{
+    return (uint64_t)ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+/**
+ * @brief Convert nanoseconds to a timespec
+ * 
+ * @param ns Time in nanoseconds
+ * @param ts Time value
+ */
+void ns_to_timespec(uint64_t ns, struct timespec *ts)
+{
+    ts->tv_sec = ns / NSEC_PER_SEC;
+    ts->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+/**
+ * @brief Read a clock in nanoseconds
+ * 
+ * @param clock Clock identifier (e.g. CLOCK_MONOTONIC)
+ * @return uint64_t Current time in nanoseconds
+ */
+uint64_t time_now_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return timespec_to_ns(&ts);
+}
+
+/**
+ * @brief Get the offset of CLOCK_REALTIME from CLOCK_MONOTONIC
+ * @details Adding the offset to a CLOCK_MONOTONIC time gives the wall clock
+ *              time, as kept by NTP or by PTP through phc2sys. Both clocks
+ *              are slewed alike, so the offset only moves when the wall clock
+ *              is stepped. It is measured as the narrowest of a few
+ *              monotonic brackets around a wall clock read, and re-measured
+ *              at most every TIME_OFFSET_REFRESH_NS. Safe to call from any
+ *              thread.
+ * 
+ * @return int64_t CLOCK_REALTIME minus CLOCK_MONOTONIC in nanoseconds
+ */
+int64_t time_realtime_offset_ns()
+{
+    uint64_t now_ns = time_now_ns(CLOCK_MONOTONIC);
+
+    if (now_ns < atomic_load_explicit(&gs_time_offset_expiry_ns, memory_order_acquire))
+    {
+        return atomic_load_explicit(&gs_time_offset_ns, memory_order_relaxed);
+    }
+
+    uint64_t best_width = UINT64_MAX;
+    int64_t offset = 0;
+
+    for (int i = 0; i < TIME_OFFSET_ROUNDS; i++)
+    {
+        uint64_t before = time_now_ns(CLOCK_MONOTONIC);
+        uint64_t wall = time_now_ns(CLOCK_REALTIME);
+        uint64_t after = time_now_ns(CLOCK_MONOTONIC);
+
+        if (after - before < best_width)
+        {
+            best_width = after - before;
+            offset = (int64_t)(wall - (before + (after - before) / 2));
+        }
+    }
+
+    atomic_store_explicit(&gs_time_offset_ns, offset, memory_order_relaxed);
+    atomic_store_explicit(&gs_time_offset_expiry_ns, now_ns + TIME_OFFSET_REFRESH_NS, memory_order_release);
+
+    return offset;
+}
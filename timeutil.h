@@ -0,0 +1,35 @@
+/**
+ * @file    timeutil.h
+ * @brief   Time helpers
+ * @details Conversions between struct timespec and nanosecond counts.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef TIMEUTIL_H
+#define TIMEUTIL_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdint.h>
+#include <time.h>
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define NSEC_PER_SEC 1000000000ULL  /* Nanoseconds per second */
+#define NSEC_PER_MSEC 1000000ULL    /* Nanoseconds per millisecond */
+#define NSEC_PER_USEC 1000ULL       /* Nanoseconds per microsecond */
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+uint64_t timespec_to_ns(const struct timespec *ts);
+void ns_to_timespec(uint64_t ns, struct timespec *ts);
+uint64_t time_now_ns(clockid_t clock);
+int64_t time_realtime_offset_ns();
+
+#endif /* TIMEUTIL_H */
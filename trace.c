@@ -0,0 +1,288 @@
+/**
+ * @file    trace.c
+ * @brief   Hot-path tracepoints
+ * @details A thread gets its ring when it is named or on its first event,
+ *              so threads are only registered, and memory only allocated,
+ *              while tracing. Each ring
+ *              has a single writer and keeps the last TRACE_RING_EVENTS events
+ *              of its thread. A dump writes every ring and releases them; the
+ *              rings of threads still running are then replaced on their next
+ *              event, which they detect by a generation number. Tracing can
+ *              only be switched on while armed with a trace file, so rings
+ *              are never allocated without a dump to release them.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "arena.h"
+#include "timeutil.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define TRACE_NAME_LEN 16           /* Thread name length */
+
+/* **************************
+ * PRIVATE TYPES DEFINITION *
+ * **************************/
+
+/* Recorded event */
+typedef struct trace_event{
+    uint64_t ts_ns;                 /* CLOCK_MONOTONIC_RAW time */
+    const char *name;               /* Static tracepoint name */
+    uint64_t arg;
+    char phase;                     /* TRACE_PHASE_* */
+} trace_event;
+
+/* Events of one thread */
+typedef struct trace_ring{
+    char name[TRACE_NAME_LEN];
+    pid_t tid;
+    atomic_ullong head;             /* Events recorded, written by the owner only */
+    trace_event events[TRACE_RING_EVENTS];
+} trace_ring;
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static trace_ring *trace_ring_get();
+static void trace_dump_ring(FILE *fp, pid_t pid, const trace_ring *r, int *first);
+static void trace_release();
+
+/* ************************************
+ * PUBLIC GLOBAL VARIABLES DEFINITION *
+ * ************************************/
+
+atomic_int g_trace_enabled;
+
+/* *************************************
+ * PRIVATE GLOBAL VARIABLES DEFINITION *
+ * *************************************/
+
+static pthread_mutex_t gs_trace_lock = PTHREAD_MUTEX_INITIALIZER; /* Guards the registry */
+static trace_ring *gs_trace_rings[TRACE_THREADS_MAX]; /* Registered rings */
+static size_t gs_trace_nrings;
+static atomic_uint gs_trace_generation; /* Bumped when the rings are released */
+static atomic_int gs_trace_armed;   /* A trace file is set, see trace_arm() */
+
+static __thread trace_ring *gs_trace_ring; /* Ring of the calling thread */
+static __thread unsigned int gs_trace_ring_generation;
+static __thread const char *gs_trace_thread_name;
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Get the ring of the calling thread, registering it if needed
+ * 
+ * @return trace_ring* Ring, or NULL if there is no room for another thread
+ */
+static trace_ring *trace_ring_get()
+{
+    unsigned int generation = atomic_load_explicit(&gs_trace_generation, memory_order_acquire);
+
+    if (gs_trace_ring != NULL && gs_trace_ring_generation == generation)
+    {
+        return gs_trace_ring;
+    }
+
+    gs_trace_ring = NULL;
+    pthread_mutex_lock(&gs_trace_lock);
+    if (gs_trace_nrings < TRACE_THREADS_MAX)
+    {
+        /* Tracing switched on mid-run allocates on the hot path, on purpose */
+        int guard = arena_guard(0);
+        trace_ring *r = calloc(1, sizeof(trace_ring));
+
+        arena_guard(guard);
+
+        if (r != NULL)
+        {
+            snprintf(r->name, sizeof(r->name), "%s", gs_trace_thread_name != NULL ? gs_trace_thread_name : "thread");
+            r->tid = syscall(SYS_gettid);
+            gs_trace_rings[gs_trace_nrings++] = r;
+            gs_trace_ring = r;
+            gs_trace_ring_generation = atomic_load(&gs_trace_generation);
+        }
+    }
+    pthread_mutex_unlock(&gs_trace_lock);
+
+    return gs_trace_ring;
+}
+
+/**
+ * @brief Write the events of a ring, oldest first
+ * 
+ * @param fp Output stream
+ * @param pid Process ID
+ * @param r Ring
+ * @param first Cleared after the first event is written
+ */
+static void trace_dump_ring(FILE *fp, pid_t pid, const trace_ring *r, int *first)
+{
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint64_t start = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+
+    fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+        *first ? "" : ",\n", pid, r->tid, r->name);
+    *first = 0;
+
+    for (uint64_t i = start; i < head; i++)
+    {
+        const trace_event *e = &r->events[i & (TRACE_RING_EVENTS - 1)];
+
+        fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d%s,\"args\":{\"arg\":%llu}}",
+            e->name, e->phase, (double)e->ts_ns / NSEC_PER_USEC, pid, r->tid,
+            e->phase == TRACE_PHASE_INSTANT ? ",\"s\":\"t\"" : "", (unsigned long long)e->arg);
+    }
+}
+
+/**
+ * @brief Release the rings of every thread, with the registry lock held
+ */
+static void trace_release()
+{
+    atomic_fetch_add_explicit(&gs_trace_generation, 1, memory_order_release);
+    for (size_t i = 0; i < gs_trace_nrings; i++)
+    {
+        free(gs_trace_rings[i]);
+    }
+    gs_trace_nrings = 0;
+}
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Name the calling thread in the traces
+ * @details Registers the thread when tracing is on, so its first event does
+ *              not allocate; costs nothing otherwise.
+ * 
+ * @param name Thread name, kept by reference
+ */
+void trace_thread(const char *name)
+{
+    gs_trace_thread_name = name;
+    if (atomic_load_explicit(&g_trace_enabled, memory_order_relaxed))
+    {
+        trace_ring_get();
+    }
+}
+
+/**
+ * @brief Record an event in the ring of the calling thread
+ * @details Called through TRACE(), which checks that tracing is on.
+ * 
+ * @param name Tracepoint name, a string literal
+ * @param phase TRACE_PHASE_*
+ * @param arg Event argument
+ */
+void trace_record(const char *name, char phase, uint64_t arg)
+{
+    trace_ring *r = trace_ring_get();
+
+    if (r == NULL)
+    {
+        return;
+    }
+
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    trace_event *e = &r->events[head & (TRACE_RING_EVENTS - 1)];
+
+    e->ts_ns = time_now_ns(CLOCK_MONOTONIC_RAW);
+    e->name = name;
+    e->arg = arg;
+    e->phase = phase;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+/**
+ * @brief Arm tracing for a run with a trace file, and switch it on or off
+ * 
+ * @param armed Non-zero if the run dumps the rings to a trace file
+ */
+void trace_arm(int armed)
+{
+    atomic_store_explicit(&gs_trace_armed, armed != 0, memory_order_relaxed);
+    atomic_store_explicit(&g_trace_enabled, armed != 0, memory_order_relaxed);
+}
+
+/**
+ * @brief Switch tracing on or off (async-signal-safe)
+ * 
+ * @param on Non-zero to trace
+ * @return int 0 on success, -1 if tracing is not armed
+ */
+int trace_set(int on)
+{
+    if (on && !atomic_load_explicit(&gs_trace_armed, memory_order_relaxed))
+    {
+        return -1;
+    }
+    atomic_store_explicit(&g_trace_enabled, on != 0, memory_order_relaxed);
+
+    return 0;
+}
+
+/**
+ * @brief Write the recorded events as a Chrome trace and release the rings
+ * @details Must only be called while no other thread records events,
+ *              typically once the acquisition and sink threads have stopped.
+ *              The rings are released even if the file cannot be written.
+ * 
+ * @param path Output file
+ * @return int 0 on success, -1 on error
+ */
+int trace_dump(const char *path)
+{
+    pid_t pid = getpid();
+    int first = 1;
+    int ret = 0;
+
+    pthread_mutex_lock(&gs_trace_lock);
+
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        perror("Error opening trace file");
+        trace_release();
+        pthread_mutex_unlock(&gs_trace_lock);
+        return -1;
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (size_t i = 0; i < gs_trace_nrings; i++)
+    {
+        trace_dump_ring(fp, pid, gs_trace_rings[i], &first);
+    }
+    fprintf(fp, "\n]}\n");
+
+    trace_release();
+
+    pthread_mutex_unlock(&gs_trace_lock);
+
+    if (fclose(fp) != 0)
+    {
+        perror("Error writing trace file");
+        ret = -1;
+    }
+
+    return ret;
+}
@@ -0,0 +1,62 @@
+/**
+ * @file    trace.h
+ * @brief   Hot-path tracepoints
+ * @details Tracepoints record CLOCK_MONOTONIC_RAW timestamps into a ring of
+ *              the calling thread, and cost one relaxed load when tracing is
+ *              off. Tracing is switched at runtime and the rings are dumped in
+ *              the Chrome trace event format, viewable in chrome://tracing or
+ *              Perfetto.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* ****************
+ * PUBLIC DEFINES *
+ * ****************/
+
+#define TRACE_THREADS_MAX 32        /* Traced threads between two dumps */
+#define TRACE_RING_EVENTS 65536     /* Events kept per thread, a power of two */
+
+#define TRACE_PHASE_BEGIN 'B'       /* Start of a span */
+#define TRACE_PHASE_END 'E'         /* End of a span */
+#define TRACE_PHASE_INSTANT 'i'     /* Point event */
+
+/* Record an event when tracing is on */
+#define TRACE(name, phase, arg) \
+    do { \
+        if (__builtin_expect(atomic_load_explicit(&g_trace_enabled, memory_order_relaxed), 0)) \
+        { \
+            trace_record(name, phase, arg); \
+        } \
+    } while (0)
+
+#define TRACE_BEGIN(name, arg) TRACE(name, TRACE_PHASE_BEGIN, arg)
+#define TRACE_END(name, arg) TRACE(name, TRACE_PHASE_END, arg)
+#define TRACE_INSTANT(name, arg) TRACE(name, TRACE_PHASE_INSTANT, arg)
+
+/* *************************************
+ * PUBLIC GLOBAL VARIABLES DECLARATION *
+ * *************************************/
+
+extern atomic_int g_trace_enabled;  /* Set while tracing, read by TRACE() */
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+void trace_thread(const char *name);
+void trace_record(const char *name, char phase, uint64_t arg);
+void trace_arm(int armed);
+int trace_set(int on);
+int trace_dump(const char *path);
+
+#endif /* TRACE_H */
@@ -0,0 +1,355 @@
+/**
+ * @file    transport.c
+ * @brief   SPI transports
+ * @details The spidev transport, which sends each message with a single
+ *              SPI_IOC_MESSAGE ioctl, and the lookup of the transport of a
+ *              device path. A spidev node that is not there yet, because its
+ *              modules are still loading, is waited for with inotify, and
+ *              the mode, word size and clock are only written when the
+ *              driver does not already hold them.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+
+#include "transport.h"
+#include "simdev.h"
+#include "timeutil.h"
+
+/* *****************
+ * PRIVATE DEFINES *
+ * *****************/
+
+#define SPIDEV_BACKOFF_MIN_NS (1 * NSEC_PER_MSEC)  /* First wait after a transient open error */
+#define SPIDEV_BACKOFF_MAX_NS (64 * NSEC_PER_MSEC) /* Longest wait between open attempts */
+
+/* *********************************
+ * PROTOTYPES OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+static int spidev_setup8(int fd, unsigned long rd, unsigned long wr, uint8_t value);
+static int spidev_try_open(spi_device *dev, const char *path, const char **step);
+static int spidev_transient(int err);
+static void spidev_wait_node(const char *path, uint64_t timeout_ns);
+static void spidev_sleep(uint64_t ns);
+static int spidev_open(spi_device *dev, const char *arg, uint64_t wait_ns);
+static int spidev_reopen(spi_device *dev);
+static int spidev_set_speed(spi_device *dev, uint32_t speed_hz);
+static int spidev_message(spi_device *dev, struct spi_ioc_transfer *xfer, unsigned int n);
+static void spidev_close(spi_device *dev);
+
+/* *************************************
+ * PRIVATE GLOBAL VARIABLES DEFINITION *
+ * *************************************/
+
+static const transport_ops gs_transport_spidev = {
+    NULL, spidev_open, spidev_reopen, spidev_set_speed, spidev_message, spidev_close,
+};
+
+/* Transports with a path prefix */
+static const transport_ops *const gs_transports[] = {
+    &g_simdev_sim_ops,
+    &g_simdev_replay_ops,
+};
+
+/* *********************************
+ * DEFINITION OF PRIVATE FUNCTIONS *
+ * *********************************/
+
+/**
+ * @brief Set an 8-bit spidev setting unless the driver already holds it
+ * 
+ * @param fd spidev file descriptor
+ * @param rd SPI_IOC_RD_* request of the setting
+ * @param wr SPI_IOC_WR_* request of the setting
+ * @param value Wanted value
+ * @return int 0 on success, -1 on error with errno set
+ */
+static int spidev_setup8(int fd, unsigned long rd, unsigned long wr, uint8_t value)
+{
+    uint8_t current;
+
+    if (ioctl(fd, rd, &current) == 0 && current == value)
+    {
+        return 0;
+    }
+
+    return ioctl(fd, wr, &value) < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Open a spidev device and set its mode and word size, silently
+ * 
+ * @param dev SPI device
+ * @param path spidev device path
+ * @param step Set to the failed step on error
+ * @return int 0 on success, -1 on error with errno set
+ */
+static int spidev_try_open(spi_device *dev, const char *path, const char **step)
+{
+    int err;
+
+    dev->fd = open(path, O_RDWR | O_CLOEXEC);
+    if (dev->fd < 0)
+    {
+        *step = "Error opening SPI device";
+        return -1;
+    }
+
+    if (spidev_setup8(dev->fd, SPI_IOC_RD_MODE, SPI_IOC_WR_MODE, SPI_MODE) < 0)
+    {
+        *step = "Error setting SPI mode";
+    }
+    else if (spidev_setup8(dev->fd, SPI_IOC_RD_BITS_PER_WORD, SPI_IOC_WR_BITS_PER_WORD, SPI_BITS_PER_WORD) < 0)
+    {
+        *step = "Error setting SPI bits per word";
+    }
+    else
+    {
+        return 0;
+    }
+
+    err = errno;
+    spidev_close(dev);
+    errno = err;
+    return -1;
+}
+
+/**
+ * @brief Tell whether an open error may go away by itself
+ * @details The node is missing or not yet usable while the controller and
+ *              spidev modules are loading or udev is still setting it up.
+ * 
+ * @param err errno of the failed step
+ * @return int 1 if worth retrying, 0 otherwise
+ */
+static int spidev_transient(int err)
+{
+    return err == ENOENT || err == ENODEV || err == ENXIO || err == EBUSY || err == EAGAIN ||
+        err == EINTR || err == EIO || err == ESHUTDOWN || err == EACCES;
+}
+
+/**
+ * @brief Wait for a device node to be created or changed
+ * @details Watches the directory of the node, so the wait ends as soon as
+ *              the node appears rather than at the next poll. The node is
+ *              checked again once the watch is set, in case it appeared in
+ *              between. Falls back to a short sleep if the directory cannot
+ *              be watched.
+ * 
+ * @param path Device node path
+ * @param timeout_ns Longest wait
+ */
+static void spidev_wait_node(const char *path, uint64_t timeout_ns)
+{
+    const char *slash = strrchr(path, '/');
+    char dir[SPI_PATH_MAX];
+    int fd;
+
+    if (slash == NULL)
+    {
+        snprintf(dir, sizeof(dir), ".");
+    }
+    else if (slash == path)
+    {
+        snprintf(dir, sizeof(dir), "/");
+    }
+    else
+    {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    }
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dir, IN_CREATE | IN_ATTRIB | IN_MOVED_TO) < 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        spidev_sleep(timeout_ns < SPIDEV_BACKOFF_MAX_NS ? timeout_ns : SPIDEV_BACKOFF_MAX_NS);
+        return;
+    }
+
+    if (access(path, F_OK) != 0)
+    {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        uint64_t timeout_ms = (timeout_ns + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+
+        poll(&pfd, 1, timeout_ms < INT_MAX ? (int)timeout_ms : INT_MAX);
+    }
+
+    close(fd);
+}
+
+/**
+ * @brief Sleep on CLOCK_MONOTONIC
+ * 
+ * @param ns Sleep time
+ */
+static void spidev_sleep(uint64_t ns)
+{
+    struct timespec ts;
+
+    ns_to_timespec(ns, &ts);
+    clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+}
+
+/**
+ * @brief Open a spidev device
+ * @details A missing node is waited for with inotify and other transient
+ *              errors are retried with an exponential backoff, until the
+ *              node can be opened or wait_ns has passed.
+ * 
+ * @param dev SPI device
+ * @param arg spidev device path
+ * @param wait_ns Longest wait for the device, 0 to fail at once
+ * @return int 0 on success, -1 on error
+ */
+static int spidev_open(spi_device *dev, const char *arg, uint64_t wait_ns)
+{
+    uint64_t start_ns = time_now_ns(CLOCK_MONOTONIC);
+    uint64_t backoff_ns = SPIDEV_BACKOFF_MIN_NS;
+    int waited = 0;
+    const char *step;
+
+    while (spidev_try_open(dev, arg, &step) < 0)
+    {
+        int err = errno;
+        uint64_t elapsed_ns = time_now_ns(CLOCK_MONOTONIC) - start_ns;
+
+        if (!spidev_transient(err) || elapsed_ns >= wait_ns)
+        {
+            fprintf(stderr, "%s: ", arg);
+            errno = err;
+            perror(step);
+            return -1;
+        }
+
+        if (!waited)
+        {
+            fprintf(stderr, "%s: %s, waiting up to %.1f s\n", arg, strerror(err), (double)wait_ns / NSEC_PER_SEC);
+            waited = 1;
+        }
+
+        if (err == ENOENT)
+        {
+            spidev_wait_node(arg, wait_ns - elapsed_ns);
+        }
+        else
+        {
+            spidev_sleep(backoff_ns < wait_ns - elapsed_ns ? backoff_ns : wait_ns - elapsed_ns);
+            backoff_ns = backoff_ns * 2 < SPIDEV_BACKOFF_MAX_NS ? backoff_ns * 2 : SPIDEV_BACKOFF_MAX_NS;
+        }
+    }
+
+    if (waited)
+    {
+        fprintf(stderr, "%s: ready after %.3f s\n", arg, (double)(time_now_ns(CLOCK_MONOTONIC) - start_ns) / NSEC_PER_SEC);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Reopen a spidev device that went away
+ * @details Called on the sampling path, so a single silent attempt is made.
+ * 
+ * @param dev SPI device
+ * @return int 0 on success, -1 on error with errno set
+ */
+static int spidev_reopen(spi_device *dev)
+{
+    const char *step;
+
+    if (dev->fd >= 0)
+    {
+        spidev_close(dev);
+    }
+
+    return spidev_try_open(dev, dev->path, &step);
+}
+
+/**
+ * @brief Set the SPI clock of a spidev device
+ * @details Skips the write when the driver already runs at that clock.
+ * 
+ * @param dev SPI device
+ * @param speed_hz SPI clock in Hz
+ * @return int 0 on success, -1 on error with errno set
+ */
+static int spidev_set_speed(spi_device *dev, uint32_t speed_hz)
+{
+    uint32_t current;
+
+    if (ioctl(dev->fd, SPI_IOC_RD_MAX_SPEED_HZ, &current) == 0 && current == speed_hz)
+    {
+        return 0;
+    }
+
+    return ioctl(dev->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz) < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Send a message on a spidev device
+ * 
+ * @param dev SPI device
+ * @param xfer Transfers of the message
+ * @param n Number of transfers
+ * @return int Negative on error
+ */
+static int spidev_message(spi_device *dev, struct spi_ioc_transfer *xfer, unsigned int n)
+{
+    return ioctl(dev->fd, SPI_IOC_MESSAGE(n), xfer);
+}
+
+/**
+ * @brief Close a spidev device
+ * 
+ * @param dev SPI device
+ */
+static void spidev_close(spi_device *dev)
+{
+    close(dev->fd);
+    dev->fd = -1;
+}
+
+/* ********************************
+ * DEFINITION OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+/**
+ * @brief Get the transport of a device path
+ * 
+ * @param path Device path
+ * @param arg Set to the argument of the transport, the path without its prefix
+ * @return const transport_ops* Transport
+ */
+const transport_ops *transport_find(const char *path, const char **arg)
+{
+    for (size_t i = 0; i < sizeof(gs_transports) / sizeof(gs_transports[0]); i++)
+    {
+        size_t len = strlen(gs_transports[i]->prefix);
+
+        if (strncmp(path, gs_transports[i]->prefix, len) == 0)
+        {
+            *arg = path + len;
+            return gs_transports[i];
+        }
+    }
+
+    *arg = path;
+    return &gs_transport_spidev;
+}
@@ -0,0 +1,43 @@
+/**
+ * @file    transport.h
+ * @brief   SPI transports
+ * @details A transport carries the SPI messages of a device. The device path
+ *              selects it: "sim:" and "replay:" paths get the emulated
+ *              devices of simdev.h, any other path is opened as a spidev
+ *              character device.
+ * @author  Klaus Becker (doklauss@gmail.com)
+*/
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+/* ****************
+ * INCLUDED FILES *
+ * ****************/
+
+#include <stdint.h>
+#include <linux/spi/spidev.h>
+
+#include "spi.h"
+
+/* *************************
+ * PUBLIC TYPES DEFINITION *
+ * *************************/
+
+/* Transport operations, called with the device lock held when it is shared */
+typedef struct transport_ops{
+    const char *prefix;             /* Path prefix selecting the transport, NULL for the default */
+    int (*open)(spi_device *dev, const char *arg, uint64_t wait_ns); /* Waits up to wait_ns for the device to appear */
+    int (*reopen)(spi_device *dev);  /* Reopens a device that went away, NULL if it cannot */
+    int (*set_speed)(spi_device *dev, uint32_t speed_hz);
+    int (*message)(spi_device *dev, struct spi_ioc_transfer *xfer, unsigned int n);
+    void (*close)(spi_device *dev);
+} transport_ops;
+
+/* ********************************
+ * PROTOTYPES OF PUBLIC FUNCTIONS *
+ * ********************************/
+
+const transport_ops *transport_find(const char *path, const char **arg);
+
+#endif /* TRANSPORT_H */